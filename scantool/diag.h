@@ -100,6 +100,12 @@ typedef struct sigaction_t {
 typedef uint8_t target_type, source_type, databyte_type, command_type;
 typedef uint16_t flag_type;
 
+/*
+ * Timestamps : CLOCK_MONOTONIC time in ns, see diag_os_getns().
+ * Unaffected by clock steps; only differences are meaningful.
+ */
+typedef uint64_t tstamp_type;
+
 /*
  * IOCTLs
  *
@@ -138,6 +144,10 @@ typedef uint16_t flag_type;
  * which cause data to be transmitted to layer 1
  *
  * The receiver of the message *must* copy the data if it wants it !!!
+ * ... or take a reference with diag_msg_retain(), which shares the
+ * payload without copying. A retained message has its own header (data,
+ * len, src etc. can be changed freely, it can go on another list) but
+ * the payload bytes themselves must then be treated as read only.
  */
 struct diag_msg
 {
@@ -153,20 +163,73 @@ struct diag_msg
 	uint8_t	len;		/* calculated data length */
 	uint8_t	*data;		/* The data */
 
-	struct timeval	 rxtime;	/* Processed time */
+	tstamp_type	 rxtime;	/* Time the 1st byte was received, if known, else processed time */
 	struct diag_msg	*next;		/* For lists of messages */
 
-	uint8_t	mcnt;		/* Number of elements on this list */
-
 	uint8_t	*idata;		/* For free() of data later */
+	struct diag_msg	*iowner;	/* Message whose payload we share, or NULL */
+	unsigned int	irefs;	/* Headers using our payload, incl. ourselves */
 	uint8_t	iflags;		/* Internal flags */
 	#define	DIAG_MSG_IFLAG_MALLOC	1	/* We malloced; we Free */
+	#define	DIAG_MSG_IFLAG_INLINE	2	/* idata is ibuf, nothing to free */
+	uint8_t	iclass;		/* Pool size class of idata */
+	#define	DIAG_MSG_ICLASS_HEAP	0xff	/* idata not pooled */
+
+	/* Short frames (nearly all OBD/KWP ones) are stored here */
+	#define	DIAG_MSG_INLINE	16
+	uint8_t	ibuf[DIAG_MSG_INLINE];
 };
 
 struct diag_msg	*diag_allocmsg(size_t datalen);	/* Alloc a new message */
 struct diag_msg	*diag_dupmsg(struct diag_msg *);	/* Duplicate a message */
 struct diag_msg	*diag_dupsinglemsg(struct diag_msg *); /* same, but just the 1st bit */
 void diag_freemsg(struct diag_msg *);	/* Free a msg that we dup'ed */
+struct diag_msg	*diag_msg_retain(struct diag_msg *);	/* Share a single msg */
+void diag_msg_release(struct diag_msg *);	/* Drop a list of msgs */
+
+/*
+ * A list of messages, linked through ->next as before, that knows its
+ * tail and length so appending doesn't walk the list. head is the plain
+ * message chain handed to callbacks etc; don't relink it behind the
+ * list's back, use these.
+ */
+struct diag_msglist
+{
+	struct diag_msg	*head;
+	struct diag_msg	*tail;
+	unsigned int	cnt;
+};
+
+void diag_msglist_append(struct diag_msglist *, struct diag_msg *);	/* Add msg (and its chain) at the end */
+void diag_msglist_insert(struct diag_msglist *, struct diag_msg *prev,
+	struct diag_msg *);	/* Add a single msg after prev, or first if NULL */
+struct diag_msg	*diag_msglist_pop(struct diag_msglist *);	/* Unlink the first msg */
+struct diag_msg	*diag_msglist_take(struct diag_msglist *);	/* Unlink them all */
+void diag_msglist_free(struct diag_msglist *);	/* Release them all */
+void diag_msgpool_stats(FILE *fp);	/* Print allocator counters */
+
+/*
+ * Receive buffer arena. Connections borrow a buffer while a frame is
+ * being assembled and give it back once it has been turned into a
+ * message, so idle connections hold no receive storage. All buffers
+ * of an arena have the same size, the largest asked for so far. Not
+ * locked: the owner must serialise access. The L2 link's arena is only
+ * used by whoever holds the link (diag_l2_link_enter()), which the L2
+ * and L3 receive paths and the timer callbacks all do; the diag lock
+ * alone isn't enough, as it is let go of during waits.
+ */
+struct diag_rxarena
+{
+	void	*free;		/* Idle buffers, linked through their 1st word */
+	size_t	bufsize;	/* Size of each buffer */
+	unsigned int	nfree;	/* Buffers on the free list */
+	unsigned int	nused;	/* Buffers lent out */
+	unsigned int	peak;	/* Most buffers lent out at once */
+};
+
+uint8_t	*diag_rxarena_get(struct diag_rxarena *, size_t size, size_t *got);	/* Borrow >= size bytes */
+void diag_rxarena_put(struct diag_rxarena *, uint8_t *buf, size_t size);	/* Return a buffer of size bytes */
+void diag_rxarena_free(struct diag_rxarena *);	/* Free the idle buffers */
 
 /*
  * General functions
@@ -191,9 +254,40 @@ int diag_iflseterr(const char *name, const int line, const int code);
 
 /*
  * diag_geterr returns the last error and clears it.
+ * The latched error is per thread, so sessions running on other
+ * threads don't see (or clear) each other's errors.
  */
 int diag_geterr(void);
 
+/*
+ * Error history: each thread also keeps a ring of its last
+ * DIAG_ERR_HISTORY errors, with where they were set. Errors of failed
+ * queued requests (diag_l2_submit()) are passed to the thread that reaps
+ * them; keepalive errors go to a background ring shared by all.
+ * Routine errors (timeouts, incomplete data) are only recorded, not
+ * logged to stderr, unless debugging is on for the layer they come from.
+ */
+#define DIAG_ERR_HISTORY	16
+
+#define DIAG_ERRLAYER_OTHER	-1	/* Not in L0..L3, e.g. diag_general */
+
+struct diag_errent {
+	int code;
+	int layer;		/* 0..3, or DIAG_ERRLAYER_OTHER */
+	const char *name;	/* Source file (a string literal) */
+	int line;
+	tstamp_type tstamp;	/* diag_os_getns() when it was set */
+};
+
+/* Copy up to "max" entries, newest first; returns the number copied */
+int diag_errhistory(struct diag_errent *out, int max);
+void diag_errhistory_clear(void);
+void diag_errhistory_print(FILE *fp);
+/* Latch and record an error passed on from another thread */
+void diag_errhistory_add(const struct diag_errent *e);
+/* Also record this thread's errors in the shared background ring */
+void diag_err_background(void);
+
 /*
  * Textual description of error.
  */
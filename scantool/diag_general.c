@@ -28,21 +28,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "diag.h"
 #include "diag_err.h"
 #include "diag_dtc.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
+#include "diag_l3.h"
+#include "diag_tty.h"
 
 CVSID("$Id: diag_general.c,v 1.7 2011/06/02 23:54:24 fenugrec Exp $");
 
 static int diag_initialized;
+/* Sessions on other threads may be starting up at the same time */
+static pthread_mutex_t diag_init_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int diag_init_once(void);
 
 int diag_init(void)	//returns 0 if normal exit
 {
 	int rv;
 
+	pthread_mutex_lock(&diag_init_mtx);
+	rv = diag_init_once();
+	pthread_mutex_unlock(&diag_init_mtx);
+
+	return rv;
+}
+
+static int diag_init_once(void)
+{
+	int rv;
+
 	if (diag_initialized)
 		return 0;
 	diag_initialized = 1;
@@ -70,6 +88,133 @@ int diag_init(void)	//returns 0 if normal exit
 }
 
 
+/*
+ * Message pool.
+ *
+ * Every frame received by an L2 framer used to cost a calloc() for the
+ * header and one for the data, plus the matching free()s. Payloads of up
+ * to DIAG_MSG_INLINE bytes are now stored inside the header (ibuf), and
+ * headers and larger payloads are recycled through free lists; payloads
+ * are rounded up to a few size classes, larger ones still come from the
+ * heap. Once the lists are warm, allocating and freeing messages does
+ * no malloc at all.
+ *
+ * The lists are per thread (the timer thread allocates too), so they
+ * need no locking. A message freed by another thread than the one that
+ * allocated it just lands on the freeing thread's list. Each list is
+ * capped at DIAG_MSGPOOL_MAX entries, the rest is given back to the heap.
+ * A thread's lists are given back too when it exits (the L2 request
+ * threads come and go with their links), through a pthread key
+ * destructor set up the first time the thread keeps an entry.
+ */
+#ifdef __GNUC__
+#define DIAG_MSGPOOL_TLS	__thread
+#define DIAG_MSGPOOL_COUNT(c)	__atomic_add_fetch(&(c), 1, __ATOMIC_RELAXED)
+#define DIAG_MSGPOOL_MAX	64
+#else
+/* No thread local storage: don't cache, only count */
+#define DIAG_MSGPOOL_TLS
+#define DIAG_MSGPOOL_COUNT(c)	((c)++)
+#define DIAG_MSGPOOL_MAX	0
+#endif
+
+#define DIAG_MSGPOOL_CLASSES	2
+static const size_t diag_msgpool_size[DIAG_MSGPOOL_CLASSES] = { 64, 256 };
+
+struct diag_msgpool_list {
+	void *head;		/* Free entries, linked through their 1st word */
+	unsigned int cnt;
+};
+
+static DIAG_MSGPOOL_TLS struct diag_msgpool_list diag_msgpool_hdr;
+static DIAG_MSGPOOL_TLS struct diag_msgpool_list diag_msgpool_data[DIAG_MSGPOOL_CLASSES];
+static DIAG_MSGPOOL_TLS int diag_msgpool_armed;	/* Drained at thread exit */
+
+static pthread_key_t diag_msgpool_key;
+static pthread_once_t diag_msgpool_once = PTHREAD_ONCE_INIT;
+
+static struct {
+	unsigned long allocs;	/* diag_allocmsg() calls */
+	unsigned long inlined;	/* ... with the payload in ibuf */
+	unsigned long retains;	/* diag_msg_retain() calls */
+	unsigned long frees;	/* messages released by diag_freemsg() */
+	unsigned long mallocs;	/* headers or payloads taken from the heap */
+	unsigned long heapfrees;	/* ... and given back */
+} diag_msgpool_cnt;
+
+static void *
+diag_msgpool_get(struct diag_msgpool_list *fl, size_t size)
+{
+	void *p = fl->head;
+
+	if (p) {
+		fl->head = *(void **)p;
+		fl->cnt--;
+		return p;
+	}
+	if (diag_malloc(&p, size))
+		return NULL;
+	DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.mallocs);
+	return p;
+}
+
+static void
+diag_msgpool_drain(struct diag_msgpool_list *fl)
+{
+	void *p;
+
+	while ((p = fl->head) != NULL) {
+		fl->head = *(void **)p;
+		free(p);
+		DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.heapfrees);
+	}
+	fl->cnt = 0;
+}
+
+/* Key destructor : the thread is exiting, give its lists back */
+#ifdef WIN32
+static void
+diag_msgpool_exit(void *unused)
+#else
+static void
+diag_msgpool_exit(void *unused __attribute__((unused)))
+#endif
+{
+	unsigned int i;
+
+	diag_msgpool_drain(&diag_msgpool_hdr);
+	for (i = 0; i < DIAG_MSGPOOL_CLASSES; i++)
+		diag_msgpool_drain(&diag_msgpool_data[i]);
+	diag_msgpool_armed = 0;
+}
+
+static void
+diag_msgpool_keyinit(void)
+{
+	if (pthread_key_create(&diag_msgpool_key, diag_msgpool_exit))
+		fprintf(stderr, FLFMT "msgpool: no thread exit hook, "
+			"free lists of exiting threads will leak\n", FL);
+}
+
+static void
+diag_msgpool_put(struct diag_msgpool_list *fl, void *p)
+{
+	if (fl->cnt >= DIAG_MSGPOOL_MAX) {
+		free(p);
+		DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.heapfrees);
+		return;
+	}
+	if (!diag_msgpool_armed) {
+		/* 1st entry kept by this thread */
+		(void) pthread_once(&diag_msgpool_once, diag_msgpool_keyinit);
+		(void) pthread_setspecific(diag_msgpool_key, &diag_msgpool_armed);
+		diag_msgpool_armed = 1;
+	}
+	*(void **)p = fl->head;
+	fl->head = p;
+	fl->cnt++;
+}
+
 /*
  * Message handling
  */
@@ -77,24 +222,46 @@ struct diag_msg *
 diag_allocmsg(size_t datalen)
 {
 	struct diag_msg *newmsg;
+	uint8_t class;
 
-	if (diag_calloc(&newmsg, 1))
+	newmsg = diag_msgpool_get(&diag_msgpool_hdr, sizeof(struct diag_msg));
+	if (newmsg == NULL)
 		return 0;
+	memset(newmsg, 0, sizeof(struct diag_msg));
 
 	newmsg->iflags |= DIAG_MSG_IFLAG_MALLOC;
+	newmsg->iclass = DIAG_MSG_ICLASS_HEAP;
+	newmsg->irefs = 1;
 
-	if (datalen)
+	if (datalen <= DIAG_MSG_INLINE)
+	{
+		newmsg->iflags |= DIAG_MSG_IFLAG_INLINE;
+		newmsg->data = datalen ? newmsg->ibuf : NULL;
+		DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.inlined);
+	}
+	else
 	{
-		if (diag_calloc(&newmsg->data, datalen))
+		for (class = 0; class < DIAG_MSGPOOL_CLASSES; class++) {
+			if (datalen <= diag_msgpool_size[class])
+				break;
+		}
+		if (class < DIAG_MSGPOOL_CLASSES) {
+			newmsg->data = diag_msgpool_get(&diag_msgpool_data[class],
+				diag_msgpool_size[class]);
+			newmsg->iclass = class;
+		} else if (diag_malloc(&newmsg->data, datalen) == 0) {
+			DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.mallocs);
+		}
+		if (newmsg->data == NULL)
 		{
-			free(newmsg);
+			diag_msgpool_put(&diag_msgpool_hdr, newmsg);
 			return 0;
 		}
+		memset(newmsg->data, 0, datalen);
 	}
-	else
-		newmsg->data = NULL;
 
 	newmsg->idata = newmsg->data;	/* Keep tab as users change newmsg->data */
+	DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.allocs);
 
 	return newmsg;
 }
@@ -173,23 +340,95 @@ diag_dupsinglemsg(struct diag_msg *msg)
 	newmsg->src = msg->src;
 	newmsg->len = msg->len;
 	newmsg->rxtime = msg->rxtime;
-	newmsg->iflags = msg->iflags;
+	/* not iflags, see diag_dupmsg() */
 	/* Dup data */
 	memcpy(newmsg->data, msg->data, msg->len);
 
 	return newmsg;
 }
 
-/* Free a msg that we dup'd */
+/*
+ * Message sharing.
+ *
+ * diag_msg_retain() gives a new header that points at the payload of
+ * msg instead of copying it; the header whose storage holds the payload
+ * (the owner) counts how many headers use it, and is only recycled when
+ * the last one is released. Sharing a shared message shares its owner.
+ * This is used wherever a received frame used to be duplicated only to
+ * be split or put on another list.
+ *
+ * Reference counts are not atomic, so all the headers sharing a payload
+ * must stay with one thread at a time. Received messages are handled
+ * by whoever holds their link (diag_l2_link_enter(), which orders the
+ * keepalive timer and the session threads), and the request queue
+ * hands a response chain over whole, under its lock (see diag_l2_reap()).
+ * Holding the diag lock is not enough: it is let go of while waiting for
+ * the ECU.
+ */
+struct diag_msg *
+diag_msg_retain(struct diag_msg *msg)
+{
+	struct diag_msg *newmsg, *owner;
+
+	/* Not ours (e.g. on the stack): can't outlive it, so copy */
+	if ( (msg->iflags & DIAG_MSG_IFLAG_MALLOC) == 0 )
+		return diag_dupsinglemsg(msg);
+
+	owner = msg->iowner ? msg->iowner : msg;
+
+	newmsg = diag_msgpool_get(&diag_msgpool_hdr, sizeof(struct diag_msg));
+	if (newmsg == NULL)
+		return 0;
+	memset(newmsg, 0, sizeof(struct diag_msg));
+
+	newmsg->fmt = msg->fmt;
+	newmsg->type = msg->type;
+	newmsg->dest = msg->dest;
+	newmsg->src = msg->src;
+	newmsg->len = msg->len;
+	newmsg->data = msg->data;
+	newmsg->rxtime = msg->rxtime;
+	newmsg->iflags = DIAG_MSG_IFLAG_MALLOC;
+	newmsg->iowner = owner;
+	newmsg->irefs = 1;
+	owner->irefs++;
+	DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.retains);
+
+	return newmsg;
+}
+
+/* Drop one reference on an owner, recycle it with the last one. */
+static void
+diag_msg_unref(struct diag_msg *msg)
+{
+	if (--msg->irefs)
+		return;
+
+	if ((msg->iflags & DIAG_MSG_IFLAG_INLINE) == 0 && msg->idata) {
+		if (msg->iclass < DIAG_MSGPOOL_CLASSES) {
+			diag_msgpool_put(&diag_msgpool_data[msg->iclass],
+				msg->idata);
+		} else {
+			free(msg->idata);
+			DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.heapfrees);
+		}
+	}
+	diag_msgpool_put(&diag_msgpool_hdr, msg);
+}
+
+/*
+ * Release a list of messages from diag_allocmsg(), diag_dupmsg() or
+ * diag_msg_retain(). Payloads still shared by other headers stay.
+ */
 void
-diag_freemsg(struct diag_msg *msg)
+diag_msg_release(struct diag_msg *msg)
 {
 	struct diag_msg *nextmsg;
 
 	if ( (msg->iflags & DIAG_MSG_IFLAG_MALLOC) == 0 )
 	{
 		fprintf(stderr,
-			FLFMT "diag_freemsg called for non diag_allocmsg()'d message %p\n",
+			FLFMT "diag_msg_release called for non diag_allocmsg()'d message %p\n",
 			FL, msg);
 		return;
 	}
@@ -198,14 +437,181 @@ diag_freemsg(struct diag_msg *msg)
 	{
 		nextmsg = msg->next;
 
-		if (msg->idata)
-			free(msg->idata);
-		free(msg);
+		if (msg->iowner) {
+			diag_msg_unref(msg->iowner);
+			diag_msgpool_put(&diag_msgpool_hdr, msg);
+		} else {
+			diag_msg_unref(msg);
+		}
+		DIAG_MSGPOOL_COUNT(diag_msgpool_cnt.frees);
 		msg = nextmsg;
 	}
 	return;
 }
 
+/* Free a msg that we dup'd; same as diag_msg_release() */
+void
+diag_freemsg(struct diag_msg *msg)
+{
+	diag_msg_release(msg);
+}
+
+/*
+ * Message lists
+ */
+void
+diag_msglist_append(struct diag_msglist *ml, struct diag_msg *msg)
+{
+	if (msg == NULL)
+		return;
+
+	if (ml->tail)
+		ml->tail->next = msg;
+	else
+		ml->head = msg;
+
+	/* msg may already be a chain: only that part is walked */
+	ml->cnt++;
+	while (msg->next) {
+		msg = msg->next;
+		ml->cnt++;
+	}
+	ml->tail = msg;
+}
+
+void
+diag_msglist_insert(struct diag_msglist *ml, struct diag_msg *prev,
+	struct diag_msg *msg)
+{
+	if (prev == NULL) {
+		msg->next = ml->head;
+		ml->head = msg;
+	} else {
+		msg->next = prev->next;
+		prev->next = msg;
+	}
+	if (msg->next == NULL)
+		ml->tail = msg;
+	ml->cnt++;
+}
+
+struct diag_msg *
+diag_msglist_pop(struct diag_msglist *ml)
+{
+	struct diag_msg *msg = ml->head;
+
+	if (msg == NULL)
+		return NULL;
+
+	ml->head = msg->next;
+	if (ml->head == NULL)
+		ml->tail = NULL;
+	ml->cnt--;
+	msg->next = NULL;
+	return msg;
+}
+
+struct diag_msg *
+diag_msglist_take(struct diag_msglist *ml)
+{
+	struct diag_msg *msg = ml->head;
+
+	ml->head = ml->tail = NULL;
+	ml->cnt = 0;
+	return msg;
+}
+
+void
+diag_msglist_free(struct diag_msglist *ml)
+{
+	struct diag_msg *msg = diag_msglist_take(ml);
+
+	if (msg)
+		diag_msg_release(msg);
+}
+
+/*
+ * Print the message allocator counters. "malloc() calls" should stop
+ * increasing once the pool is warm (e.g. during "monitor").
+ */
+void
+diag_msgpool_stats(FILE *fp)
+{
+	unsigned long allocs = diag_msgpool_cnt.allocs;
+	unsigned long retains = diag_msgpool_cnt.retains;
+	unsigned long frees = diag_msgpool_cnt.frees;
+
+	fprintf(fp, "Messages: %lu allocated (%lu inline), %lu shared, %lu freed, %lu in use\n",
+		allocs, diag_msgpool_cnt.inlined, retains, frees,
+		allocs + retains - frees);
+	fprintf(fp, "Message heap: %lu malloc() calls, %lu free() calls, "
+		"%u headers cached (this thread)\n",
+		diag_msgpool_cnt.mallocs, diag_msgpool_cnt.heapfrees,
+		diag_msgpool_hdr.cnt);
+}
+
+/*
+ * Receive buffer arenas
+ */
+#define DIAG_RXARENA_MAXFREE	8	/* Idle buffers kept per arena */
+
+uint8_t *
+diag_rxarena_get(struct diag_rxarena *a, size_t size, size_t *got)
+{
+	void *p;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	if (size > a->bufsize) {
+		/* Bigger frames than before; idle buffers are too small */
+		diag_rxarena_free(a);
+		a->bufsize = size;
+	}
+
+	p = a->free;
+	if (p) {
+		a->free = *(void **)p;
+		a->nfree--;
+	} else if (diag_malloc(&p, a->bufsize)) {
+		return NULL;
+	}
+
+	if (++a->nused > a->peak)
+		a->peak = a->nused;
+	*got = a->bufsize;
+	return p;
+}
+
+void
+diag_rxarena_put(struct diag_rxarena *a, uint8_t *buf, size_t size)
+{
+	if (buf == NULL)
+		return;
+
+	a->nused--;
+	if (size != a->bufsize || a->nfree >= DIAG_RXARENA_MAXFREE) {
+		/* Left over from before the arena grew, or enough spares */
+		free(buf);
+		return;
+	}
+	*(void **)buf = a->free;
+	a->free = buf;
+	a->nfree++;
+}
+
+void
+diag_rxarena_free(struct diag_rxarena *a)
+{
+	void *p;
+
+	while ((p = a->free) != NULL) {
+		a->free = *(void **)p;
+		free(p);
+	}
+	a->nfree = 0;
+}
+
 void
 diag_data_dump(FILE *out, const void *data, size_t len)
 {
@@ -225,8 +631,31 @@ void smartcat(char *p1, const size_t s1, const char *p2 )
  * Error code latching.
  * "diag_seterr" returns NULL so you can call it from a function
  * that returns a NULL pointer on error.
+ *
+ * The latched code and the history ring are per thread: each session
+ * runs its links from its own thread. Setting an error takes no lock
+ * and, for routine errors, does no I/O. Errors from the helper threads
+ * are passed on : a link's request thread hands a failed request's
+ * error to the submitter (see diag_l2_reap()), and errors in the timer
+ * thread (keepalives) also go to a shared "background" ring, which
+ * diag_errhistory_print() shows too.
  */
-static int latchedCode;
+#ifdef __GNUC__
+#define DIAG_ERR_TLS	__thread
+#else
+#define DIAG_ERR_TLS
+#endif
+
+struct diag_errstate {
+	int latched;		/* Returned and cleared by diag_geterr() */
+	unsigned int next;	/* Ring write index, counts up */
+	struct diag_errent ring[DIAG_ERR_HISTORY];
+};
+
+static DIAG_ERR_TLS struct diag_errstate diag_errstate;
+static DIAG_ERR_TLS int diag_err_isbg;	/* See diag_err_background() */
+static struct diag_errstate diag_errbg;
+static pthread_mutex_t diag_errbg_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static const struct {
 	const int code;
@@ -259,43 +688,190 @@ static const struct {
 const char *
 diag_errlookup(const int code) {
 	unsigned i;
-	static char ill_str[30];		//...
+	static DIAG_ERR_TLS char ill_str[40];
 	for (i = 0; i < ARRAY_SIZE(edesc); i++)
 		if (edesc[i].code == code)
 			return edesc[i].desc;
 
-	sprintf(ill_str,"Illegal error code: 0x%.2X\n",code);
+	snprintf(ill_str, sizeof(ill_str), "Illegal error code: 0x%.2X", code);
 	return ill_str;
 }
 
-void *
-diag_pflseterr(const char *name, const int line, const int code) {
+/*
+ * Guess the layer from the source file name; __FILE__ may include a path.
+ */
+static int
+diag_errlayer(const char *name) {
+	const char *p = strrchr(name, '/');
+
+	if (p)
+		name = p + 1;
+	if (strncmp(name, "diag_l", 6) == 0 && name[6] >= '0' && name[6] <= '3')
+		return name[6] - '0';
+	if (strncmp(name, "diag_tty", 8) == 0)
+		return 0;
+	return DIAG_ERRLAYER_OTHER;
+}
+
+static int
+diag_errlayer_debug(int layer) {
+	switch (layer) {
+	case 0:
+		return diag_l0_debug;
+	case 1:
+		return diag_l1_debug;
+	case 2:
+		return diag_l2_debug;
+	case 3:
+		return diag_l3_debug;
+	default:
+		return 0;
+	}
+}
+
+static void
+diag_errstate_add(struct diag_errstate *es, const struct diag_errent *e) {
+	es->ring[es->next++ % DIAG_ERR_HISTORY] = *e;
+}
+
+static void
+diag_flseterr(const char *name, const int line, const int code) {
+	struct diag_errstate *es = &diag_errstate;
+	struct diag_errent e;
+
+	e.code = code;
+	e.layer = diag_errlayer(name);
+	e.name = name;
+	e.line = line;
+	e.tstamp = diag_os_getns();
+	diag_errstate_add(es, &e);
+
+	if (es->latched == 0)
+		es->latched = code;
+
+	if (diag_err_isbg) {
+		pthread_mutex_lock(&diag_errbg_mtx);
+		diag_errstate_add(&diag_errbg, &e);
+		pthread_mutex_unlock(&diag_errbg_mtx);
+	}
+
+	/* Timeouts etc. are part of normal polling; only log them if asked */
+	switch (code) {
+	case DIAG_ERR_TIMEOUT:
+	case DIAG_ERR_INCDATA:
+		if (diag_errlayer_debug(e.layer) == 0)
+			return;
+		break;
+	default:
+		break;
+	}
 	fprintf(stderr, "%s:%d: %s.\n", name, line, diag_errlookup(code));
-	if (latchedCode == 0)
-		latchedCode = code;
+}
 
+void *
+diag_pflseterr(const char *name, const int line, const int code) {
+	diag_flseterr(name, line, code);
 	return (void *)0;
 }
 
 int
 diag_iflseterr(const char *name, const int line, const int code) {
-	fprintf(stderr, "%s:%d: %s.\n", name, line, diag_errlookup(code));
-	if (latchedCode == 0)
-		latchedCode = code;
-
+	diag_flseterr(name, line, code);
 	return code;
 }
 
+/*
+ * Record an error that happened on another thread, on this thread's
+ * behalf; it was logged (or not) there already.
+ */
+void
+diag_errhistory_add(const struct diag_errent *e) {
+	diag_errstate_add(&diag_errstate, e);
+	if (diag_errstate.latched == 0)
+		diag_errstate.latched = e->code;
+}
+
+/*
+ * This thread works for nobody in particular (e.g. the timer thread) :
+ * nobody reads its errors, so also keep them where all can see them.
+ */
+void
+diag_err_background(void) {
+	diag_err_isbg = 1;
+}
+
 /*
  * Return and clear the error.
  */
 int
 diag_geterr(void) {
-	int oldCode = latchedCode;
-	latchedCode = 0;
+	int oldCode = diag_errstate.latched;
+	diag_errstate.latched = 0;
 	return oldCode;
 }
 
+static int
+diag_errstate_copy(const struct diag_errstate *es, struct diag_errent *out, int max) {
+	unsigned int n;
+	int i;
+
+	n = (es->next < DIAG_ERR_HISTORY) ? es->next : DIAG_ERR_HISTORY;
+	for (i = 0; i < max && (unsigned int)i < n; i++)
+		out[i] = es->ring[(es->next - 1 - i) % DIAG_ERR_HISTORY];
+
+	return i;
+}
+
+int
+diag_errhistory(struct diag_errent *out, int max) {
+	return diag_errstate_copy(&diag_errstate, out, max);
+}
+
+void
+diag_errhistory_clear(void) {
+	diag_errstate.next = 0;
+	pthread_mutex_lock(&diag_errbg_mtx);
+	diag_errbg.next = 0;
+	pthread_mutex_unlock(&diag_errbg_mtx);
+}
+
+static void
+diag_errstate_print(FILE *fp, const char *what, const struct diag_errent *hist,
+	int n, unsigned int total) {
+	tstamp_type now = diag_os_getns();
+	int i;
+
+	fprintf(fp, "Last %d errors %s (%u since cleared), newest first:\n",
+		n, what, total);
+	for (i = 0; i < n; i++) {
+		char lname[4] = "-";
+
+		if (hist[i].layer != DIAG_ERRLAYER_OTHER)
+			snprintf(lname, sizeof(lname), "L%d", hist[i].layer);
+		fprintf(fp, "  %8lu ms ago  %-3s %s:%d: %s\n",
+			(unsigned long)((now - hist[i].tstamp) / 1000000),
+			lname, hist[i].name, hist[i].line,
+			diag_errlookup(hist[i].code));
+	}
+}
+
+void
+diag_errhistory_print(FILE *fp) {
+	struct diag_errent hist[DIAG_ERR_HISTORY];
+	unsigned int total;
+	int n;
+
+	n = diag_errhistory(hist, DIAG_ERR_HISTORY);
+	diag_errstate_print(fp, "on this thread", hist, n, diag_errstate.next);
+
+	pthread_mutex_lock(&diag_errbg_mtx);
+	n = diag_errstate_copy(&diag_errbg, hist, DIAG_ERR_HISTORY);
+	total = diag_errbg.next;
+	pthread_mutex_unlock(&diag_errbg_mtx);
+	if (n)
+		diag_errstate_print(fp, "in the background (keepalives)", hist, n, total);
+}
+
 /* Memory allocation */
 
 int diag_flcalloc(const char *name, const int line,
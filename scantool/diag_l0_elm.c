@@ -503,6 +503,9 @@ void *data, size_t len, int timeout)
 	if (diag_l0_debug & DIAG_DEBUG_READ)
 		fprintf(stderr, FLFMT "Expecting %d bytes from ELM, %d ms timeout\n", FL, (int) len, timeout);
 
+	if (len > sizeof(rxbuf) - 1)
+		len = sizeof(rxbuf) - 1;	//keep room for the NUL
+
 	while ( (xferd = diag_tty_read(dl0d, &rxbuf, len, timeout)) <= 0) {
 		if (xferd == DIAG_ERR_TIMEOUT) {
 			return diag_iseterr(DIAG_ERR_TIMEOUT);
@@ -525,20 +528,24 @@ void *data, size_t len, int timeout)
 	
 	//Here, rxbuf contains the string received from ELM. Parse it to get hex digits
 	char *rptr, *bp;
-	char rbyte;
+	unsigned int rbyte;
+	rxbuf[xferd]=0;		//strtok needs a terminated string
 	xferd=0;
 	rptr=rxbuf+strspn(rxbuf, " \n\r");	//skip all leading spaces and linefeeds
 	while ((bp=strtok(rptr, " >\n\r")) !=NULL) {
 		//process token delimited by spaces or prompt character
 		//this is very sketchy and deserves to be tested more...
-		sscanf(bp, "%02x", &rbyte);
-		((char *)data)[xferd]=rbyte;
+		rptr=NULL;
+		if (sscanf(bp, "%02x", &rbyte) != 1)
+			continue;	//not a hex byte ("NO DATA", "OK"...)
+		((char *)data)[xferd]=(char) rbyte;
 		xferd++;
 		if (xferd==len)
 			break;	
 		//printf("%s\t0x%02x\n", bp, i);
-		rptr=NULL;
 	}
+	if (xferd == 0)		//only "NO DATA" or similar
+		return diag_iseterr(DIAG_ERR_TIMEOUT);
 	return xferd;
 }
 
@@ -642,6 +642,7 @@ diag_l0_sim_recv(struct diag_l0_device *dl0d,
 		memcpy(data, resp_p->data, xferd);
 		// Free the present response in the list (and walk to the next one).
 		sim_last_ecu_responses = sim_free_ecu_response(&sim_last_ecu_responses);
+		dl0d->rxstamp = diag_os_getns();
 	} else {
 		// Nothing to receive, simulate timeout on return.
 		xferd = 0;
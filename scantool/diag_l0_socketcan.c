@@ -0,0 +1,510 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag, Layer 0, Linux SocketCAN raw socket interface
+ *
+ * The subinterface is the network interface name ("can0", "vcan0", ...);
+ * the bitrate is set up outside of freediag, with "ip link set can0 type
+ * can bitrate 500000".
+ *
+ * Frames are passed to/from L1 one at a time in the DIAG_L1_CAN format
+ * (see diag_l1.h). The kernel only hands us frames in the OBD response
+ * ranges (CAN_RAW_FILTER); they are read in batches with recvmmsg() and
+ * each carries the kernel receive time from SO_TIMESTAMPING, converted to
+ * the diag_os_getns() clock.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE	/* recvmmsg() */
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "diag.h"
+#include "diag_os.h"
+#include "diag_err.h"
+#include "diag_tty.h"
+#include "diag_l1.h"
+
+CVSID("$Id$");
+
+extern const struct diag_l0 diag_l0_socketcan;
+
+#if defined(__linux__)
+
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#define SCAN_RXBATCH	16	/* Frames per recvmmsg() */
+
+struct diag_l0_socketcan_device
+{
+	int protocol;
+	int tstamping;		/* SO_TIMESTAMPING accepted */
+
+	/* Frames read ahead by the last recvmmsg() */
+	struct can_frame frame[SCAN_RXBATCH];
+	tstamp_type stamp[SCAN_RXBATCH];
+	int head;
+	int count;
+};
+
+/* OBD response identifiers, ISO 15765-4 */
+static const struct can_filter diag_l0_socketcan_filters[] = {
+	/* 11 bit, 0x7E8 - 0x7EF */
+	{ 0x7E8, (CAN_SFF_MASK & ~0x07) | CAN_EFF_FLAG | CAN_RTR_FLAG },
+	/* 29 bit, 0x18DAxxxx physical responses */
+	{ 0x18DA0000 | CAN_EFF_FLAG,
+		0x1FFF0000 | CAN_EFF_FLAG | CAN_RTR_FLAG },
+};
+
+static int diag_l0_socketcan_initdone;
+
+static int
+diag_l0_socketcan_init(void)
+{
+	if (diag_l0_socketcan_initdone)
+		return 0;
+	diag_l0_socketcan_initdone = 1;
+
+	return 0;
+}
+
+static int
+diag_l0_socketcan_close(struct diag_l0_device **pdl0d)
+{
+	if (pdl0d && *pdl0d) {
+		struct diag_l0_device *dl0d = *pdl0d;
+		struct diag_l0_socketcan_device *dev =
+			(struct diag_l0_socketcan_device *)diag_l0_dl0_handle(dl0d);
+
+		if (diag_l0_debug & DIAG_DEBUG_CLOSE)
+			fprintf(stderr, FLFMT "link %p closing\n", FL, dl0d);
+
+		if (dl0d->fd != -1)
+			close(dl0d->fd);
+		if (dev)
+			free(dev);
+		if (dl0d->name)
+			free(dl0d->name);
+		free(dl0d);
+		*pdl0d = NULL;
+	}
+
+	return 0;
+}
+
+static struct diag_l0_device *
+diag_l0_socketcan_open(const char *subinterface, int iProtocol)
+{
+	int rv;
+	int fd;
+	struct diag_l0_device *dl0d;
+	struct diag_l0_socketcan_device *dev;
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int tsflags;
+
+	if (diag_l0_debug & DIAG_DEBUG_OPEN)
+		fprintf(stderr, FLFMT "open subinterface %s protocol %d\n",
+			FL, subinterface, iProtocol);
+
+	diag_l0_socketcan_init();
+
+	if (strlen(subinterface) >= sizeof(ifr.ifr_name)) {
+		fprintf(stderr, FLFMT "Bad CAN interface name \"%s\"\n",
+			FL, subinterface);
+		return (struct diag_l0_device *)diag_pseterr(DIAG_ERR_BADIFADAPTER);
+	}
+
+	if (rv=diag_calloc(&dl0d, 1))
+		return (struct diag_l0_device *)diag_pseterr(rv);
+	dl0d->fd = -1;
+	dl0d->dl0 = &diag_l0_socketcan;
+#if defined(__linux__) && (TRY_POSIX == 0)
+	dl0d->timerfd = -1;
+#endif
+
+	if (rv=diag_calloc(&dev, 1)) {
+		diag_l0_socketcan_close(&dl0d);
+		return (struct diag_l0_device *)diag_pseterr(rv);
+	}
+	dev->protocol = iProtocol;
+	dl0d->dl0_handle = dev;
+
+	if (rv=diag_calloc(&dl0d->name, strlen(subinterface)+1)) {
+		diag_l0_socketcan_close(&dl0d);
+		return (struct diag_l0_device *)diag_pseterr(rv);
+	}
+	strcpy(dl0d->name, subinterface);
+
+	fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (fd < 0) {
+		fprintf(stderr, FLFMT "Can't open CAN socket: %s\n",
+			FL, strerror(errno));
+		diag_l0_socketcan_close(&dl0d);
+		return (struct diag_l0_device *)diag_pseterr(DIAG_ERR_BADIFADAPTER);
+	}
+	dl0d->fd = fd;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, subinterface);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, FLFMT "No CAN interface \"%s\": %s\n",
+			FL, subinterface, strerror(errno));
+		diag_l0_socketcan_close(&dl0d);
+		return (struct diag_l0_device *)diag_pseterr(DIAG_ERR_BADIFADAPTER);
+	}
+
+	/* Filter before bind so no foreign traffic gets queued */
+	if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+			diag_l0_socketcan_filters,
+			sizeof(diag_l0_socketcan_filters)) < 0) {
+		fprintf(stderr, FLFMT "Can't set CAN filters: %s\n",
+			FL, strerror(errno));
+		diag_l0_socketcan_close(&dl0d);
+		return (struct diag_l0_device *)diag_pseterr(DIAG_ERR_GENERAL);
+	}
+
+	/*
+	 * Software stamps only : hardware ones are in the adapter's own
+	 * clock, which has nothing to do with the system clocks.
+	 */
+	tsflags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING,
+			&tsflags, sizeof(tsflags)) == 0) {
+		dev->tstamping = 1;
+	} else if (diag_l0_debug & DIAG_DEBUG_OPEN) {
+		/* Not fatal, we'll stamp frames as we read them */
+		fprintf(stderr, FLFMT "no SO_TIMESTAMPING: %s\n",
+			FL, strerror(errno));
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, FLFMT "Can't bind to \"%s\": %s\n",
+			FL, subinterface, strerror(errno));
+		diag_l0_socketcan_close(&dl0d);
+		return (struct diag_l0_device *)diag_pseterr(DIAG_ERR_BADIFADAPTER);
+	}
+
+	if (diag_l0_debug & DIAG_DEBUG_OPEN)
+		fprintf(stderr, FLFMT "%s is ifindex %d, fd %d\n",
+			FL, subinterface, ifr.ifr_ifindex, fd);
+
+	return dl0d;
+}
+
+/* Nothing to wake up on CAN */
+static int
+diag_l0_socketcan_initbus(struct diag_l0_device *dl0d __attribute__((unused)),
+	struct diag_l1_initbus_args *in __attribute__((unused)))
+{
+	return 0;
+}
+
+static int
+diag_l0_socketcan_send(struct diag_l0_device *dl0d,
+	const char *subinterface __attribute__((unused)),
+	const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	struct can_frame frame;
+	uint32_t id;
+	ssize_t rv;
+
+	if (len < DIAG_L1_CAN_IDLEN || len > DIAG_L1_CAN_MAXFRAME)
+		return diag_iseterr(DIAG_ERR_BADLEN);
+
+	id = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+
+	memset(&frame, 0, sizeof(frame));
+	if (id & DIAG_L1_CAN_EFF)
+		frame.can_id = (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	else
+		frame.can_id = id & CAN_SFF_MASK;
+	frame.can_dlc = (uint8_t)(len - DIAG_L1_CAN_IDLEN);
+	memcpy(frame.data, &p[DIAG_L1_CAN_IDLEN], frame.can_dlc);
+
+	if (diag_l0_debug & DIAG_DEBUG_WRITE) {
+		fprintf(stderr, FLFMT "device link %p send 0x%lx [%d]",
+			FL, dl0d, (unsigned long)frame.can_id, frame.can_dlc);
+		diag_data_dump(stderr, frame.data, frame.can_dlc);
+		fprintf(stderr, "\n");
+	}
+
+	while ((rv = write(dl0d->fd, &frame, sizeof(frame))) < 0) {
+		struct pollfd pfd;
+
+		if (errno == EINTR)
+			continue;
+		if (errno != ENOBUFS && errno != EAGAIN) {
+			fprintf(stderr, FLFMT "CAN write error: %s\n",
+				FL, strerror(errno));
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+		/* Controller queue full, give it one frame time or so */
+		pfd.fd = dl0d->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 10) < 0 && errno != EINTR)
+			return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	if (rv != (ssize_t)sizeof(frame))
+		return diag_iseterr(DIAG_ERR_GENERAL);
+
+	/* No byte wire time on CAN : the frame is out when write() returns */
+	dl0d->txqueued = diag_os_getns();
+	dl0d->txstamp = dl0d->txqueued;
+
+	return 0;
+}
+
+/*
+ * Receive time of a frame. SO_TIMESTAMPING gives CLOCK_REALTIME,
+ * rebase it onto the monotonic clock used everywhere else. Without a
+ * kernel stamp, the frame is stamped now.
+ */
+static tstamp_type
+diag_l0_socketcan_stamp(struct msghdr *mh, int64_t realoff)
+{
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		struct timespec ts[3];
+
+		if (cm->cmsg_level != SOL_SOCKET ||
+				cm->cmsg_type != SO_TIMESTAMPING)
+			continue;
+		/* ts[0] is the kernel stamp, ts[1] and ts[2] hardware ones */
+		memcpy(ts, CMSG_DATA(cm), sizeof(ts));
+		if (ts[0].tv_sec == 0 && ts[0].tv_nsec == 0)
+			break;
+		return (tstamp_type)((int64_t)ts[0].tv_sec * 1000000000LL +
+			ts[0].tv_nsec + realoff);
+	}
+
+	return diag_os_getns();
+}
+
+/* Read whatever is queued, up to SCAN_RXBATCH frames, in one call */
+static int
+diag_l0_socketcan_fill(struct diag_l0_device *dl0d,
+	struct diag_l0_socketcan_device *dev)
+{
+	struct mmsghdr mm[SCAN_RXBATCH];
+	struct iovec iov[SCAN_RXBATCH];
+	union {		/* Aligned for CMSG_FIRSTHDR() */
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(struct timespec))];
+	} ctrl[SCAN_RXBATCH];
+	struct timespec real, mono;
+	int64_t realoff;
+	int i, n;
+
+	memset(mm, 0, sizeof(mm));
+	for (i = 0; i < SCAN_RXBATCH; i++) {
+		iov[i].iov_base = &dev->frame[i];
+		iov[i].iov_len = sizeof(dev->frame[i]);
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+		if (dev->tstamping) {
+			mm[i].msg_hdr.msg_control = ctrl[i].buf;
+			mm[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+		}
+	}
+
+	do {
+		n = recvmmsg(dl0d->fd, mm, SCAN_RXBATCH, MSG_DONTWAIT, NULL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		fprintf(stderr, FLFMT "CAN read error: %s\n",
+			FL, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	realoff = ((int64_t)mono.tv_sec - real.tv_sec) * 1000000000LL +
+		(mono.tv_nsec - real.tv_nsec);
+
+	dev->head = 0;
+	dev->count = 0;
+	for (i = 0; i < n; i++) {
+		if (mm[i].msg_len != sizeof(struct can_frame))
+			continue;
+		if (dev->count != i)
+			dev->frame[dev->count] = dev->frame[i];
+		if (dev->tstamping)
+			dev->stamp[dev->count] =
+				diag_l0_socketcan_stamp(&mm[i].msg_hdr, realoff);
+		else
+			dev->stamp[dev->count] = diag_os_getns();
+		dev->count++;
+	}
+
+	return dev->count;
+}
+
+static int
+diag_l0_socketcan_recv(struct diag_l0_device *dl0d,
+	const char *subinterface __attribute__((unused)),
+	void *data, size_t len, int timeout)
+{
+	struct diag_l0_socketcan_device *dev;
+	struct can_frame *frame;
+	uint8_t *p = (uint8_t *)data;
+	uint32_t id;
+	size_t dlc;
+	tstamp_type deadline, now;
+	int rv, tout;
+
+	dev = (struct diag_l0_socketcan_device *)diag_l0_dl0_handle(dl0d);
+
+	if (len < DIAG_L1_CAN_IDLEN)
+		return diag_iseterr(DIAG_ERR_BADLEN);
+
+	/*
+	 * Wait on an absolute deadline : a wake-up that brings no frame
+	 * (filtered out, or short) doesn't start the timeout over.
+	 */
+	deadline = diag_os_getns() + (tstamp_type) timeout * 1000000;
+	while (dev->count == 0) {
+		struct pollfd pfd;
+
+		tout = timeout;
+		if (timeout > 0) {
+			now = diag_os_getns();
+			tout = 0;
+			if (deadline > now)
+				tout = (int) ((deadline - now + 999999) / 1000000);
+		}
+		pfd.fd = dl0d->fd;
+		pfd.events = POLLIN;
+		rv = poll(&pfd, 1, tout);
+		if (rv == 0)
+			return DIAG_ERR_TIMEOUT;
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+		rv = diag_l0_socketcan_fill(dl0d, dev);
+		if (rv < 0)
+			return rv;
+	}
+
+	frame = &dev->frame[dev->head];
+	dl0d->rxstamp = dev->stamp[dev->head];
+	dev->head++;
+	dev->count--;
+
+	if (frame->can_id & CAN_EFF_FLAG)
+		id = (frame->can_id & CAN_EFF_MASK) | DIAG_L1_CAN_EFF;
+	else
+		id = frame->can_id & CAN_SFF_MASK;
+	p[0] = (uint8_t)(id >> 24);
+	p[1] = (uint8_t)(id >> 16);
+	p[2] = (uint8_t)(id >> 8);
+	p[3] = (uint8_t)id;
+
+	dlc = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+	if (dlc > len - DIAG_L1_CAN_IDLEN)
+		dlc = len - DIAG_L1_CAN_IDLEN;
+	memcpy(&p[DIAG_L1_CAN_IDLEN], frame->data, dlc);
+
+	if (diag_l0_debug & DIAG_DEBUG_READ) {
+		fprintf(stderr, FLFMT "device link %p recv 0x%lx [%d]",
+			FL, dl0d, (unsigned long)frame->can_id, (int)dlc);
+		diag_data_dump(stderr, frame->data, dlc);
+		fprintf(stderr, "\n");
+	}
+
+	return (int)(DIAG_L1_CAN_IDLEN + dlc);
+}
+
+/* The bitrate belongs to the network interface, not to us */
+static int
+diag_l0_socketcan_setspeed(struct diag_l0_device *dl0d,
+	const struct diag_serial_settings *pss)
+{
+	if (diag_l0_debug & DIAG_DEBUG_IOCTL)
+		fprintf(stderr, FLFMT "%s: speed %d ignored, set it with "
+			"\"ip link\"\n", FL, dl0d->name, pss->speed);
+
+	return 0;
+}
+
+static int
+diag_l0_socketcan_getflags(struct diag_l0_device *dl0d __attribute__((unused)))
+{
+	/* The controller does framing and CRC */
+	return DIAG_L1_DOESL2FRAME | DIAG_L1_DOESL2CKSUM |
+		DIAG_L1_STRIPSL2CKSUM;
+}
+
+const struct diag_l0 diag_l0_socketcan = {
+	"Linux SocketCAN interface",
+	"SOCKETCAN",
+	DIAG_L1_CAN,
+	diag_l0_socketcan_init,
+	diag_l0_socketcan_open,
+	diag_l0_socketcan_close,
+	diag_l0_socketcan_initbus,
+	diag_l0_socketcan_send,
+	diag_l0_socketcan_recv,
+	diag_l0_socketcan_setspeed,
+	diag_l0_socketcan_getflags
+};
+
+#endif /* __linux__ */
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+	extern int diag_l0_socketcan_add(void);
+#if defined(__cplusplus)
+}
+#endif
+
+/* SocketCAN only exists on Linux, elsewhere there is nothing to add */
+int
+diag_l0_socketcan_add(void)
+{
+#if defined(__linux__)
+	return diag_l1_add_l0dev(&diag_l0_socketcan);
+#else
+	return 0;
+#endif
+}
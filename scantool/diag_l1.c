@@ -43,6 +43,9 @@
 #include "diag_tty.h"
 #include "diag_l1.h"
 
+/* Slack allowed for the echo beyond the wire time of the frame, in ms */
+#define DIAG_L1_ECHO_TIMEOUT	100
+
 CVSID("$Id: diag_l1.c,v 1.6 2011/06/06 02:13:05 fenugrec Exp $");
 
 int diag_l0_debug;
@@ -50,6 +53,8 @@ int diag_l1_debug;
 
 static int diag_l1_saferead(struct diag_l0_device *dl0d,
 char *buf, size_t bufsiz, int timeout);
+static int diag_l1_echocheck(struct diag_l0_device *dl0d, const uint8_t *data,
+	size_t sent, size_t *echoed, int timeout);
 
 /*
  * Linked list of supported L0 devices.
@@ -200,47 +205,154 @@ diag_l1_send(struct diag_l0_device *dl0d, const char *subinterface, const void *
 		rv = (dl0->diag_l0_send)(dl0d, subinterface, data, len);
 	} else {
 		const uint8_t *dp = (const uint8_t *)data;
+		struct diag_l1_txstats *ts = &dl0d->txstats;
+		tstamp_type t0, period, deadline, now;
+		size_t i, echoed = 0;
+
+		period = dl0d->byte_ns + (tstamp_type) p4 * 1000000;
+		t0 = diag_os_getns();
+		now = t0;
 
-		/* Send each byte */
-		while (len--) {
-			rv = (dl0->diag_l0_send)(dl0d, subinterface, dp, 1);
+		if (p4 == 0) {
+			/*
+			 * Half duplex without inter byte gap : stream the
+			 * whole frame, the echo is checked below.
+			 */
+			rv = (dl0->diag_l0_send)(dl0d, subinterface, data, len);
+			i = len;
+		} else for (i = 0; i < len; i++) {
+			/*
+			 * Send each byte. Byte i is scheduled at an absolute
+			 * deadline t0 + i * (wire time + P4), so that sleep
+			 * overshoot and echo latency do not accumulate over
+			 * the message as they would with a relative sleep
+			 * after every byte.
+			 */
+			if (i > 0) {
+				deadline = t0 + i * period;
+				diag_os_sleepuntil(deadline);
+				now = diag_os_getns();
+				if (now - deadline > ts->maxlate_ns)
+					ts->maxlate_ns = (unsigned long) (now - deadline);
+			}
+
+			rv = (dl0->diag_l0_send)(dl0d, subinterface, &dp[i], 1);
 			if (rv != 0)
 				break;
 
 			/*
-			 * If half duplex, read back the echo, if
-			 * the echo is wrong then this is an error
-			 * i.e something wrote on the diag bus whilst
-			 * we were writing
+			 * Consume whatever echo has already come back, without
+			 * waiting, so that a collision aborts the frame early.
 			 */
 			if (l0flags & DIAG_L1_HALFDUPLEX) {
-				uint8_t c;
-
-				c = *dp - 1; /* set it with wrong val */
-				if (diag_l1_saferead(dl0d, &c, 1, 1000) < 0)
-					rv=DIAG_ERR_GENERAL;
+				rv = diag_l1_echocheck(dl0d, dp, i + 1, &echoed, 0);
+				if (rv == DIAG_ERR_TIMEOUT)
+					rv = 0;
+				if (rv != 0)
 					break;
+			}
+		}
 
-				if (c != *dp) {
-					if (c == *dp - 1)
-						fprintf(stderr,"Half duplex interface not echoing!\n");
-					else
-						fprintf(stderr,"Bus Error: got 0x%x expected 0x%x\n",
-							c&0xff, *dp & 0xff);
-					rv = DIAG_ERR_BUSERROR;
-					break;
-				}
+		/*
+		 * If half duplex, collect the rest of the echo. If the echo
+		 * is wrong then this is an error i.e something wrote on the
+		 * diag bus whilst we were writing.
+		 */
+		if ((rv == 0) && (l0flags & DIAG_L1_HALFDUPLEX)) {
+			int timeout = (int) ((len - echoed) * dl0d->byte_ns / 1000000)
+				+ DIAG_L1_ECHO_TIMEOUT;
+
+			while ((rv == 0) && (echoed < len))
+				rv = diag_l1_echocheck(dl0d, dp, len, &echoed, timeout);
+
+			if (rv == DIAG_ERR_TIMEOUT) {
+				if (echoed == 0)
+					fprintf(stderr,"Half duplex interface not echoing!\n");
+				else
+					fprintf(stderr,"Echo lost after byte %u of %u\n",
+						(unsigned int) echoed, (unsigned int) len);
+				rv = DIAG_ERR_BUSERROR;
 			}
-			dp++;
+		}
 
-			if (p4)	/* Inter byte gap */
-				diag_os_millisleep(p4);
+		if ((p4 != 0) && (rv == 0) && (len > 1)) {
+			ts->frames++;
+			ts->requested_ns += (len - 1) * period;
+			ts->achieved_ns += now - t0;
 		}
+
+		if (diag_l1_debug & DIAG_DEBUG_TIMER)
+			fprintf(stderr, FLFMT "sent %u bytes, period %luus, took %luus\n",
+				FL, (unsigned int) len, (unsigned long) (period / 1000),
+				(unsigned long) ((diag_os_getns() - t0) / 1000));
 	}
 
 	return rv;
 }
 
+/*
+ * Half duplex echo cancellation.
+ * Read back up to "sent" - *echoed bytes of echo, waiting at most "timeout"
+ * ms, and compare them to what was sent. *echoed is the count of echo bytes
+ * verified so far and is updated. We never read past "sent" so the
+ * ECU response is left in the device.
+ *
+ * Returns 0 if some echo was consumed and matched, DIAG_ERR_TIMEOUT if
+ * nothing came back in time, or DIAG_ERR_BUSERROR on a collision, reporting
+ * the position of the first corrupted byte.
+ */
+static int
+diag_l1_echocheck(struct diag_l0_device *dl0d, const uint8_t *data,
+	size_t sent, size_t *echoed, int timeout)
+{
+	uint8_t echo[MAXRBUF];
+	size_t want, i;
+	int got;
+
+	want = sent - *echoed;
+	if (want > sizeof(echo))
+		want = sizeof(echo);
+	if (want == 0)
+		return 0;
+
+	got = diag_l1_saferead(dl0d, (char *) echo, want, timeout);
+	if (got == 0)
+		return DIAG_ERR_TIMEOUT;
+	if (got < 0)
+		return got;
+
+	for (i = 0; i < (size_t) got; i++) {
+		if (echo[i] != data[*echoed + i]) {
+			fprintf(stderr,"Bus Error at byte %u of %u: got 0x%x expected 0x%x\n",
+				(unsigned int) (*echoed + i), (unsigned int) sent,
+				echo[i], data[*echoed + i]);
+			*echoed += i;
+			return diag_iseterr(DIAG_ERR_BUSERROR);
+		}
+	}
+	*echoed += got;
+
+	/* The echo is back : these bytes are out */
+	dl0d->txstamp = dl0d->rxstamp;
+	return 0;
+}
+
+/*
+ * Print the transmit pacing statistics of a device
+ */
+void
+diag_l1_print_txstats(struct diag_l0_device *dl0d, FILE *fp)
+{
+	const struct diag_l1_txstats *ts = &dl0d->txstats;
+
+	fprintf(fp, "TX pacing: %lu messages", ts->frames);
+	if (ts->frames)
+		fprintf(fp, ", requested %llu us, achieved %llu us, worst byte %lu us late",
+			ts->requested_ns / 1000, ts->achieved_ns / 1000,
+			ts->maxlate_ns / 1000);
+	fprintf(fp, "\n");
+}
+
 /*
  * Get data (blocking, unless timeout is 0)
  */
@@ -273,14 +385,16 @@ int diag_l1_gettype(struct diag_l0_device *dl0d)
 }
 
 
-//return <0 on error, number of bytes on success
+//return <0 on error, DIAG_ERR_TIMEOUT if nothing came, number of bytes on success
 static int
 diag_l1_saferead(struct diag_l0_device *dl0d, char *buf, size_t bufsiz, int timeout)
 {
 	int xferd;
 
-	/* And read back the single byte echo, which shows TX completes */
+	/* And read back the echo, which shows TX completes */
 	while ( (xferd = diag_tty_read(dl0d, buf, bufsiz, timeout)) < 0) {
+		if (xferd == DIAG_ERR_TIMEOUT)
+			return xferd;
 		if (errno != EINTR)
 			return diag_iseterr(DIAG_ERR_BUSERROR);
 		xferd = 0; /* Interrupted read, nothing transferred. */
@@ -104,6 +104,16 @@ extern "C" {
 #define	DIAG_L1_CAN		0x10	/* CAN bus */
 #define	DIAG_L1_RAW		0x80	/* Raw data interface */
 
+/*
+ * On DIAG_L1_CAN interfaces each send()/recv() carries exactly one CAN
+ * frame : the identifier in 4 bytes, MSB first, then the 0-8 data bytes
+ * (so the DLC is len - 4). 29 bit identifiers have DIAG_L1_CAN_EFF set,
+ * as in the Linux can_id. The interface must also report DOESL2FRAME.
+ */
+#define DIAG_L1_CAN_EFF		0x80000000UL	/* 29 bit (extended) identifier */
+#define DIAG_L1_CAN_IDLEN	4		/* Bytes of identifier */
+#define DIAG_L1_CAN_MAXFRAME	(DIAG_L1_CAN_IDLEN + 8)
+
 /*
  * Number of concurrently supported logical interfaces
  * remember a single physical interface may be many logical interfaces
@@ -135,6 +145,19 @@ struct diag_l1_initbus_args
 #define DIAG_L1_INITBUS_5BAUD	2	/* 5 baud init */
 #define DIAG_L1_INITBUS_2SLOW	3	/* 2 second low on bus */
 
+/*
+ * Per-device transmit timing statistics, kept by diag_l1_send() when it
+ * paces a message byte by byte. "requested" is the sum of the scheduled
+ * first->last byte spans, "achieved" what was actually measured.
+ */
+struct diag_l1_txstats
+{
+	unsigned long frames;		/* Paced messages sent */
+	unsigned long long requested_ns;
+	unsigned long long achieved_ns;
+	unsigned long maxlate_ns;	/* Worst lateness of any single byte */
+};
+
 /*
  * init(), returns 0 on success (always succeeds)
  * open(), returns a fd on success, 0 on failure (pseterr)
@@ -162,6 +185,7 @@ int diag_l1_setspeed(struct diag_l0_device *dl0d,
 const struct diag_serial_settings *pset);
 int diag_l1_getflags(struct diag_l0_device *);
 int diag_l1_gettype(struct diag_l0_device *);
+void diag_l1_print_txstats(struct diag_l0_device *dl0d, FILE *fp);
 
 int diag_l1_add_l0dev(const struct diag_l0 *l0dev);
 
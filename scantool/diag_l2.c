@@ -31,8 +31,10 @@
  *
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "diag.h"
 #include "diag_l1.h"
@@ -117,17 +119,20 @@ static int diag_l2_init_done;	/* Init done */
  */
 static struct diag_l2_link *diag_l2_links;
 
+static void diag_l2_queue_stop(struct diag_l2_link *dl2l);
+
 /*
- * Find our link to the L1 device, by name
+ * Find our link to the L1 device, by name and subinterface
  */
 static struct diag_l2_link *
-diag_l2_findlink(const char *dev_name)
+diag_l2_findlink(const char *dev_name, const char *subinterface)
 {
 	struct diag_l2_link *dl2l = diag_l2_links;
 
 	while (dl2l)
 	{
-		if ( strcmp(dl2l -> diag_l2_name , dev_name) == 0)
+		if ( (strcmp(dl2l -> diag_l2_name , dev_name) == 0) &&
+				(strcmp(dl2l -> diag_l2_subinterface, subinterface) == 0))
 			return dl2l;
 		dl2l = dl2l -> next;
 	}
@@ -150,7 +155,7 @@ diag_l2_rmlink(struct diag_l2_link *d)
 		if (dl2l == d)
 		{
 			if (d_l2_last)
-				d_l2_last = d->next;
+				d_l2_last->next = d->next;
 			else
 				diag_l2_links = d->next;
 			break;
@@ -199,45 +204,81 @@ diag_l2_rmconn(struct diag_l2_conn *d)
 	return 0;
 }
 
+void
+diag_l2_link_enter(struct diag_l2_link *dl2l)
+{
+	pthread_t self = pthread_self();
+
+	while (dl2l->diag_l2_busy && !pthread_equal(dl2l->diag_l2_owner, self))
+		diag_os_lock_wait();
+	dl2l->diag_l2_owner = self;
+	dl2l->diag_l2_busy++;
+}
+
+void
+diag_l2_link_leave(struct diag_l2_link *dl2l)
+{
+	if (--dl2l->diag_l2_busy == 0) {
+		/* Timers that found the link busy, then other threads */
+		diag_os_timer_kick(dl2l);
+		diag_os_lock_wake();
+	}
+}
+
+int
+diag_l2_link_busy(struct diag_l2_link *dl2l)
+{
+	return dl2l->diag_l2_busy != 0;
+}
+
 /*
- * Called regularly to check timeouts etc (call at least once per
- * second)
- * Note: This is called from a signal handler.
- *
- * XXX Uses functions not async-signal-safe.
- * Note that this does nothing now except handle the timeouts.
- * Thus, it is now easy to eliminate "diag_l2_timer" and replace it
- * with posix timers.
+ * Keepalive timer callback, armed by diag_l2_kastamp(). Runs in the timer
+ * thread, with the diag lock held. Sends only push diag_l2_expiry back,
+ * so if a real request went out since the timer was armed we just re-arm
+ * for the rest of the period and skip the keepalive. Otherwise the
+ * protocol timeout routine normally sends something, which re-arms the
+ * timer through diag_l2_send().
  */
-void
-diag_l2_timer(void)
+static void
+diag_l2_conn_timer(void *arg)
 {
-	struct diag_l2_conn	*d_l2_conn;
-	struct timeval now;
+	struct diag_l2_conn *d_l2_conn = (struct diag_l2_conn *)arg;
+	struct diag_l2_link *dl2l = d_l2_conn->diag_link;
+	tstamp_type now = diag_os_getns();
+
+	if (diag_l2_link_busy(dl2l)) {
+		/* Some thread is waiting for the ECU on this link;
+		 * diag_l2_link_leave() will bring us back */
+		diag_os_timer_defer(&d_l2_conn->diag_l2_katimer, dl2l);
+		return;
+	}
 
-	(void)gettimeofday(&now, NULL);	/* XXX Not async safe */
+	if (d_l2_conn->diag_l2_expiry > now + 1000000) {
+		if (diag_l2_debug & DIAG_DEBUG_TIMER)
+			fprintf(stderr, FLFMT "conn %p busy, keepalive skipped\n",
+				FL, (void *)d_l2_conn);
+		diag_os_timer_set(&d_l2_conn->diag_l2_katimer,
+			(unsigned int) ((d_l2_conn->diag_l2_expiry - now) / 1000000));
+		return;
+	}
 
-	for (d_l2_conn = diag_l2_connections;
-		d_l2_conn; d_l2_conn = d_l2_conn -> next)
+	/*
+	 * If in monitor mode, we don't do anything as we're
+	 * just listening
+	 */
+	if ((d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK)
+		== DIAG_L2_TYPE_MONINIT)
 	{
-		int expired = 0;
-
-		/*
-		 * If in monitor mode, we don't do anything as we're
-		 * just listening
-		 */
-		if ((d_l2_conn->diag_l2_type & DIAG_L2_TYPE_INITMASK)
-			== DIAG_L2_TYPE_MONINIT)
-		{
-			continue;
-		}
+		return;
+	}
 
-		/* Check the send timers vs the p3max timer */
-		expired = timercmp(&now, &d_l2_conn->diag_l2_expiry, >);
+	if (d_l2_conn->diag_l2_state != DIAG_L2_STATE_OPEN)
+		return;
 
-		/* If expired, call the timeout routine */
-		if (expired && d_l2_conn->l2proto->diag_l2_proto_timeout)
-			d_l2_conn->l2proto->diag_l2_proto_timeout(d_l2_conn);
+	if (d_l2_conn->l2proto->diag_l2_proto_timeout) {
+		diag_l2_link_enter(dl2l);
+		d_l2_conn->l2proto->diag_l2_proto_timeout(d_l2_conn);
+		diag_l2_link_leave(dl2l);
 	}
 }
 
@@ -247,26 +288,138 @@ diag_l2_timer(void)
 void
 diag_l2_addmsg(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 {
-	struct diag_msg *tmsg = d_l2_conn->diag_msg;
+	msg->next = NULL;
+	diag_msglist_append(&d_l2_conn->diag_msgs, msg);
+}
 
-	if (d_l2_conn->diag_msg == NULL)
-	{
-		d_l2_conn->diag_msg = msg;
-		d_l2_conn->diag_msg->mcnt = 1;
+int
+diag_l2_rxbuf_get(struct diag_l2_conn *d_l2_conn, size_t size)
+{
+	if (d_l2_conn->rxbuf && d_l2_conn->rxsize >= size)
+		return 0;
+
+	if (d_l2_conn->rxbuf) {
+		/* Too small (protocol changed?), but keep what's pending */
+		uint8_t *buf;
+		size_t got;
+
+		buf = diag_rxarena_get(&d_l2_conn->diag_link->diag_l2_rxarena,
+			size, &got);
+		if (buf == NULL)
+			return diag_iseterr(DIAG_ERR_NOMEM);
+		memcpy(buf, d_l2_conn->rxbuf, (size_t)d_l2_conn->rxoffset);
+		diag_rxarena_put(&d_l2_conn->diag_link->diag_l2_rxarena,
+			d_l2_conn->rxbuf, d_l2_conn->rxsize);
+		d_l2_conn->rxbuf = buf;
+		d_l2_conn->rxsize = got;
+		return 0;
+	}
+
+	d_l2_conn->rxbuf = diag_rxarena_get(&d_l2_conn->diag_link->diag_l2_rxarena,
+		size, &d_l2_conn->rxsize);
+	if (d_l2_conn->rxbuf == NULL)
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	d_l2_conn->rxoffset = 0;
+	return 0;
+}
+
+void
+diag_l2_rxbuf_put(struct diag_l2_conn *d_l2_conn)
+{
+	if (d_l2_conn->rxbuf == NULL || d_l2_conn->rxoffset)
+		return;
+
+	diag_rxarena_put(&d_l2_conn->diag_link->diag_l2_rxarena,
+		d_l2_conn->rxbuf, d_l2_conn->rxsize);
+	d_l2_conn->rxbuf = NULL;
+	d_l2_conn->rxsize = 0;
+}
+
+/*
+ * Note the class of a request being sent, see diag_l2_resp_take()
+ */
+static void
+diag_l2_resp_start(struct diag_l2_conn *d_l2_conn, const struct diag_msg *msg)
+{
+	struct diag_l2_respclass *rc;
+	uint8_t sid, pid;
+
+	if (msg->len == 0) {
+		d_l2_conn->resp_cur = NULL;
 		return;
 	}
-	/* Add to end of list */
-	while (tmsg)
-	{
-		if (tmsg->next == NULL)
-		{
-			msg->next = NULL;
-			tmsg->next = msg;
-			d_l2_conn->diag_msg->mcnt ++;
-			break;
-		}
-		tmsg = tmsg->next;
+	sid = msg->data[0];
+	pid = (msg->len > 1) ? msg->data[1] : 0;
+
+	rc = &d_l2_conn->resp[(sid * 7 + pid) % DIAG_L2_RESP_CLASSES];
+	if (!rc->used || rc->sid != sid || rc->pid != pid) {
+		/* New class (or a collision), start learning again */
+		memset(rc, 0, sizeof(*rc));
+		rc->used = 1;
+		rc->sid = sid;
+		rc->pid = pid;
 	}
+	d_l2_conn->resp_cur = rc;
+}
+
+struct diag_l2_respclass *
+diag_l2_resp_take(struct diag_l2_conn *d_l2_conn)
+{
+	struct diag_l2_respclass *rc = d_l2_conn->resp_cur;
+
+	/* Only the first receive after a send is its response */
+	d_l2_conn->resp_cur = NULL;
+	return rc;
+}
+
+unsigned int
+diag_l2_resp_expect(const struct diag_l2_respclass *rc)
+{
+	if (rc == NULL || !rc->confirmed || rc->early >= DIAG_L2_RESP_RECHECK)
+		return 0;
+	return rc->count;
+}
+
+void
+diag_l2_resp_learn(struct diag_l2_respclass *rc, const struct diag_msglist *ml,
+	int early)
+{
+	const struct diag_msg *m, *o;
+	unsigned int nframes, nsrc;
+
+	if (rc == NULL)
+		return;
+
+	if (early) {
+		rc->early++;
+		return;
+	}
+
+	/* Went to the timeout: this is the real count */
+	nframes = nsrc = 0;
+	for (m = ml ? ml->head : NULL; m; m = m->next) {
+		nframes++;
+		for (o = ml->head; o != m && o->src != m->src; o = o->next)
+			;
+		if (o == m)
+			nsrc++;
+	}
+	if (nframes > 0xFF)
+		nframes = 0xFF;
+
+	if (diag_l2_debug & DIAG_DEBUG_PROTO)
+		fprintf(stderr, FLFMT "request %02X %02X: %u frames from %u "
+			"sources (had %u%s)\n", FL, rc->sid, rc->pid, nframes,
+			nsrc, rc->count, rc->confirmed ? ", confirmed" : "");
+
+	/*
+	 * Only trust one frame per responder: multi-frame answers (DTC
+	 * lists, VIN...) can grow from one request to the next.
+	 */
+	rc->confirmed = (nframes != 0 && nframes == nsrc &&
+		nframes == rc->count);
+	rc->count = (uint8_t) nframes;
+	rc->early = 0;
 }
 
 /************************************************************************/
@@ -308,9 +461,16 @@ diag_l2_closelink(struct diag_l2_link **pdl2l)
 
 		if (dl2l)
 		{
+			int depth;
+
 			/* Clear out this link */
 			diag_l2_rmlink(dl2l);	/* Take off list */
+			/* Its request thread may be waiting for the diag lock */
+			depth = diag_os_lock_drop();
+			diag_l2_queue_stop(dl2l);
+			diag_os_lock_retake(depth);
 			diag_l1_close(&dl2l->diag_l2_dl0d);
+			diag_rxarena_free(&dl2l->diag_l2_rxarena);
 			free(dl2l);
 		}
 
@@ -345,7 +505,8 @@ diag_l2_open(const char *dev_name, const char *subinterface, int L1protocol)
 			FLFMT "diag_l2_open %s subinterface %s L1proto %d called\n",
 			FL, dev_name, subinterface, L1protocol);
 
-	dl2l = diag_l2_findlink(dev_name);
+	diag_os_lock();
+	dl2l = diag_l2_findlink(dev_name, subinterface);
 
 	if (dl2l)
 	{
@@ -358,20 +519,25 @@ diag_l2_open(const char *dev_name, const char *subinterface, int L1protocol)
 		else
 		{
 			/* Device was already open, with correct protocol  */
-		return dl2l->diag_l2_dl0d;
+			dl0d = dl2l->diag_l2_dl0d;
+			diag_os_unlock();
+			return dl0d;
 		}
 	}
 
 
 	/* Else, create the link */
-	if ((rv=diag_calloc(&dl2l, 1)))
+	if ((rv=diag_calloc(&dl2l, 1))) {
+		diag_os_unlock();
 		return (struct diag_l0_device *)diag_pseterr(rv);
+	}
 
 	dl0d = diag_l1_open(dev_name, subinterface, L1protocol);
 	if (dl0d == 0)	//pointer to 0 => failure
 	{
 		rv=diag_geterr();
 		free(dl2l);
+		diag_os_unlock();
 		return (struct diag_l0_device *)diag_pseterr(rv);	//forward error to next level
 	}
 
@@ -383,14 +549,17 @@ diag_l2_open(const char *dev_name, const char *subinterface, int L1protocol)
 	dl2l->diag_l2_l1protocol = L1protocol;
 
 	strcpy(dl2l->diag_l2_name, dev_name);
+	strncpy(dl2l->diag_l2_subinterface, subinterface,
+		sizeof(dl2l->diag_l2_subinterface) - 1);
 
 	/*
 	 * Put ourselves at the head of the list.
 	 */
 	dl2l->next = diag_l2_links;
 	diag_l2_links = dl2l;
+	diag_os_unlock();
 		
-	return dl2l->diag_l2_dl0d;
+	return dl0d;
 }
 
 /*
@@ -440,6 +609,15 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, uint32_
 			FL, dl0d, L2protocol, type ,
 			bitrate, target&0xff, source&0xff);
 
+	diag_os_lock();
+
+	dl2l = diag_l0_dl2_link(dl0d);
+	if (dl2l == NULL) {
+		diag_os_unlock();
+		return NULL;
+	}
+	diag_l2_link_enter(dl2l);
+
 	/*
 	 * Check connection doesn't exist already, if it does, then use it
 	 * but reinitialise ECU - when checking connection, we look at the
@@ -463,16 +641,17 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, uint32_
 	if (d_l2_conn == NULL)
 	{
 		/* New connection */
-		if (diag_calloc(&d_l2_conn, 1))
+		if (diag_calloc(&d_l2_conn, 1)) {
+			diag_l2_link_leave(dl2l);
+			diag_os_unlock();
 			return 0;
+		}
 
 		reusing = 0;
+		diag_os_timer_init(&d_l2_conn->diag_l2_katimer,
+			diag_l2_conn_timer, d_l2_conn);
 	}
 
-	dl2l = diag_l0_dl2_link(dl0d);
-	if (dl2l == NULL)
-		return NULL;
-
 	/* Link to the L1 device info that we keep (name, type, flags, dl0d) */
 	d_l2_conn->diag_link = dl2l;
 
@@ -490,6 +669,8 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, uint32_
 	if (d_l2_conn->l2proto == 0) {
 		fprintf(stderr,
 			FLFMT "Protocol %d not installed.\n", FL, L2protocol);
+		diag_l2_link_leave(dl2l);
+		diag_os_unlock();
 		return NULL;
 	}
 
@@ -527,12 +708,15 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, uint32_
 		//if (diag_l2_debug & DIAG_DEBUG_OPEN)
 		//	fprintf(stderr,FLFMT "protocol startcomms returned %d\n", FL, rv);
 
+		diag_os_timer_cancel(&d_l2_conn->diag_l2_katimer);
 		if (reusing == 0)
 			free(d_l2_conn);
 
 		/* XXX tidy structures... We possibly freed d_l2_conn but we set to NULL anyway ?? */
 
 		d_l2_conn = NULL;
+		diag_l2_link_leave(dl2l);
+		diag_os_unlock();
 		return (struct diag_l2_conn *)diag_pseterr(rv);
 	}
 
@@ -547,19 +731,24 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, uint32_
 		d_l2_conn->next = diag_l2_connections ;
 		diag_l2_connections = d_l2_conn ;
 
-/* XXX insert in second linked list */
-
+		/* Other connections to this ID, on other links */
+		d_l2_conn->diag_l2_next = diag_l2_conbyid[target];
 		diag_l2_conbyid[target] = d_l2_conn;
 
 	}
-	if (d_l2_conn)
+	if (d_l2_conn) {
 		d_l2_conn -> diag_l2_state = DIAG_L2_STATE_OPEN;
+		/* Keep it alive from now on, even if nothing is ever sent */
+		diag_l2_kastamp(d_l2_conn, diag_os_getns());
+	}
 
 	if (diag_l2_debug & DIAG_DEBUG_OPEN)
 		fprintf(stderr,
 			FLFMT "diag_l2_StartComms returns %p\n",
 				FL, d_l2_conn);
 
+	diag_l2_link_leave(dl2l);
+	diag_os_unlock();
 	return d_l2_conn;
 }
 
@@ -571,6 +760,9 @@ diag_l2_StartCommunications(struct diag_l0_device *dl0d, int L2protocol, uint32_
 int
 diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn)
 {
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
+	diag_os_timer_cancel(&d_l2_conn->diag_l2_katimer);
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSING;
 
 	/*
@@ -579,10 +771,45 @@ diag_l2_StopCommunications(struct diag_l2_conn *d_l2_conn)
 	if (d_l2_conn->l2proto->diag_l2_proto_stopcomms)
 		(void)d_l2_conn->l2proto->diag_l2_proto_stopcomms(d_l2_conn);
 
+	/* Drop any partial frame and hand the buffer back */
+	d_l2_conn->rxoffset = 0;
+	diag_l2_rxbuf_put(d_l2_conn);
+
 	d_l2_conn->diag_l2_state = DIAG_L2_STATE_CLOSED;
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
 	return 0;
 }
 
+/*
+ * Renegotiate the P2/P3/P4 timing with the ECU, if the protocol can
+ */
+int
+diag_l2_AccessTimingParameters(struct diag_l2_conn *d_l2_conn, int mode)
+{
+	int rv;
+
+	if (d_l2_conn->l2proto->diag_l2_proto_atp == NULL)
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	if (d_l2_conn->diag_l2_state != DIAG_L2_STATE_OPEN)
+		return diag_iseterr(DIAG_ERR_GENERAL);
+
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
+	rv = d_l2_conn->l2proto->diag_l2_proto_atp(d_l2_conn, mode);
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
+
+	if (diag_l2_debug & DIAG_DEBUG_PROTO)
+		fprintf(stderr, FLFMT "atp mode %d returns %d: P2 %u-%u P3 %u-%u "
+			"P4 %u ms\n", FL, mode, rv,
+			d_l2_conn->diag_l2_p2min, d_l2_conn->diag_l2_p2max,
+			d_l2_conn->diag_l2_p3min, d_l2_conn->diag_l2_p3max,
+			d_l2_conn->diag_l2_p4min);
+
+	return rv;
+}
+
 /*
  * Get the time of the last send time, and calculate expiration.
  */
@@ -593,23 +820,39 @@ diag_l2_sendstamp(struct diag_l2_conn *d_l2_conn) {
 	/*
 	 * Get the current time.
 	 */
-	(void) gettimeofday(&d_l2_conn->diag_l2_lastsend, NULL);
+	d_l2_conn->diag_l2_lastsend = diag_os_getns();
+
+	diag_l2_kastamp(d_l2_conn, d_l2_conn->diag_l2_lastsend);
+}
+
+/*
+ * (Re)start the keepalive period from "when". Also used when the ECU
+ * answers responsePending: the link is busy, not idle.
+ *
+ * The deadline only ever moves later here, so an already armed timer is
+ * left alone; diag_l2_conn_timer() catches up when it fires. That keeps
+ * the timer wheel out of the send path.
+ */
+void
+diag_l2_kastamp(struct diag_l2_conn *d_l2_conn, tstamp_type when) {
+	tstamp_type now;
+	unsigned int ms;
 
 	/*
 	 * Calculate the expiration time, we use 2/3 of P3max
 	 * to calculate when to call the L2 protocol timeout() routine
 	 */
-	d_l2_conn->diag_l2_expiry = d_l2_conn->diag_l2_lastsend;
+	d_l2_conn->diag_l2_expiry = when +
+		(tstamp_type) (d_l2_conn->diag_l2_p3max*2/3) * 1000000;
 
-	d_l2_conn->diag_l2_expiry.tv_sec +=  (d_l2_conn->diag_l2_p3max*2/3) / 1000;
-	d_l2_conn->diag_l2_expiry.tv_usec += 
-		((d_l2_conn->diag_l2_p3max*2/3) % 1000) * 1000;
+	if (d_l2_conn->diag_l2_katimer.pending)
+		return;
 
-	if (d_l2_conn->diag_l2_expiry.tv_usec > 1000000)
-	{
-		d_l2_conn->diag_l2_expiry.tv_sec ++;
-		d_l2_conn->diag_l2_expiry.tv_usec -= 1000000;
-	}
+	now = diag_os_getns();
+	ms = 0;
+	if (d_l2_conn->diag_l2_expiry > now)
+		ms = (unsigned int) ((d_l2_conn->diag_l2_expiry - now) / 1000000);
+	diag_os_timer_set(&d_l2_conn->diag_l2_katimer, ms);
 }
 
 /*
@@ -625,10 +868,18 @@ diag_l2_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 			FLFMT "diag_l2_send %p msg %p msglen %d called\n",
 				FL, d_l2_conn, msg, msg->len);
 
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
 	diag_l2_sendstamp(d_l2_conn);	/* Save timestamps */
+	diag_l2_resp_start(d_l2_conn, msg);
 
 	/* Call protocol specific send routine */
 	rv = d_l2_conn->l2proto->diag_l2_proto_send(d_l2_conn, msg);
+	if (rv >= 0)
+		d_l2_conn->diag_l2_txdone =
+			diag_l0_txstamp(d_l2_conn->diag_link->diag_l2_dl0d);
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
 
 	if (diag_l2_debug & DIAG_DEBUG_WRITE)
 		fprintf(stderr, FLFMT "diag_l2_send returns %d\n",
@@ -653,7 +904,11 @@ diag_l2_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg, int *errva
 				FL, d_l2_conn, msg);
 
 	/* Call protocol specific send routine */
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
 	rv = d_l2_conn->l2proto->diag_l2_proto_request(d_l2_conn, msg, errval);
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
 
 	if (diag_l2_debug & DIAG_DEBUG_WRITE)
 		fprintf(stderr, FLFMT "diag_l2_request returns %p, err %d\n",
@@ -662,6 +917,559 @@ diag_l2_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg, int *errva
 	return rv;
 }
 
+/*
+ * Wait out P3min before sending a request. P3 runs from the end of the
+ * last response (or of our own request, if nothing answered it), so the
+ * time the application spent since then counts towards it.
+ */
+void
+diag_l2_p3wait(struct diag_l2_conn *d_l2_conn)
+{
+	tstamp_type from = d_l2_conn->diag_l2_rxdone;
+	tstamp_type until;
+
+	if (from < d_l2_conn->diag_l2_txdone)
+		from = d_l2_conn->diag_l2_txdone;
+	if (from == 0) {
+		diag_os_millisleep(d_l2_conn->diag_l2_p3min);
+		return;
+	}
+	until = from + (tstamp_type) d_l2_conn->diag_l2_p3min * 1000000;
+	if (until <= diag_os_getns())
+		return;		/* Already waited out */
+	(void) diag_os_sleepuntil(until);
+}
+
+/*
+ * Asynchronous request engine. One per link, as requests to different
+ * ECUs on the same bus can't overlap anyway; the thread is started by the
+ * first diag_l2_submit() and stopped when the link is closed. It takes
+ * the diag lock for each request, so keepalives and synchronous callers
+ * are simply interleaved between queued requests.
+ *
+ * The link's queue pointer is only read or changed under
+ * diag_l2_queue_mtx, and callers hold a reference (see
+ * diag_l2_queue_get()) while they use the queue, so closing the link
+ * can't free it under them.
+ *
+ * Responses come from the request thread's message pool and are handed
+ * over as they are: the queue lock passes them, with every header that
+ * shares their payload, from the request thread to the reaper, and the
+ * reaper's pool takes them back (the per-thread pools are capped, see
+ * diag_msgpool_put()). The request structures themselves are reused
+ * through the "spare" list.
+ *
+ * Lock ordering : diag lock, then diag_l2_queue_mtx, then a queue's
+ * lock; the queue lock is never held while taking the diag lock.
+ */
+struct diag_l2_queue
+{
+	pthread_t	thread;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	work;		/* Something to send, or stop */
+	pthread_cond_t	done;		/* A request completed, or stop */
+	struct diag_l2_areq *qhead, *qtail;	/* Waiting to be sent */
+	struct diag_l2_areq *dhead, *dtail;	/* Done, waiting to be reaped */
+	struct diag_l2_areq *cur;	/* Being sent */
+	struct diag_l2_areq *spare;	/* Free for diag_l2_submit() */
+	int	stop;
+	int	refs;			/* The link's, plus callers'; diag_l2_queue_mtx */
+};
+
+static pthread_mutex_t diag_l2_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+diag_l2_areq_free(struct diag_l2_areq *req)
+{
+	if (req->msg)
+		diag_freemsg(req->msg);
+	if (req->resp)
+		diag_freemsg(req->resp);
+	free(req);
+}
+
+static void
+diag_l2_areq_freelist(struct diag_l2_areq *req)
+{
+	struct diag_l2_areq *next;
+
+	for (; req; req = next) {
+		next = req->next;
+		diag_l2_areq_free(req);
+	}
+}
+
+static void *
+diag_l2_queue_main(void *arg)
+{
+	struct diag_l2_queue *q = (struct diag_l2_queue *)arg;
+	struct diag_l2_areq *req;
+	struct diag_errent err;
+
+	pthread_mutex_lock(&q->mtx);
+	while (1) {
+		while ((q->qhead == NULL) && !q->stop)
+			pthread_cond_wait(&q->work, &q->mtx);
+		if (q->stop)
+			break;
+
+		req = q->qhead;
+		q->qhead = req->next;
+		if (q->qhead == NULL)
+			q->qtail = NULL;
+		req->next = NULL;
+		q->cur = req;
+		pthread_mutex_unlock(&q->mtx);
+
+		(void) diag_geterr();
+		diag_os_lock();
+		if (req->conn->diag_l2_state == DIAG_L2_STATE_OPEN) {
+			req->errval = DIAG_ERR_GENERAL;
+			req->resp = diag_l2_request(req->conn, req->msg,
+				&req->errval);
+		} else {
+			req->errval = DIAG_ERR_GENERAL;
+		}
+		diag_os_unlock();
+
+		/* Where it failed, for the submitter (see diag_l2_reap()) */
+		if (req->resp == NULL) {
+			if (diag_geterr() && (diag_errhistory(&err, 1) == 1)) {
+				req->err = err;
+			} else {
+				memset(&req->err, 0, sizeof(req->err));
+				req->err.name = __FILE__;
+				req->err.line = __LINE__;
+				req->err.layer = 2;
+				req->err.tstamp = diag_os_getns();
+			}
+			req->err.code = req->errval;
+		}
+
+		pthread_mutex_lock(&q->mtx);
+		q->cur = NULL;
+		if (q->dtail)
+			q->dtail->next = req;
+		else
+			q->dhead = req;
+		q->dtail = req;
+		pthread_cond_broadcast(&q->done);
+	}
+	pthread_mutex_unlock(&q->mtx);
+	return NULL;
+}
+
+/* Create a queue and start its thread */
+static struct diag_l2_queue *
+diag_l2_queue_new(void)
+{
+	struct diag_l2_queue *q;
+	pthread_condattr_t cattr;
+	int rv;
+
+	if (diag_calloc(&q, 1))
+		return NULL;
+
+	pthread_mutex_init(&q->mtx, NULL);
+	pthread_cond_init(&q->work, NULL);
+	/* diag_l2_reap() waits with monotonic deadlines */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->done, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	rv = pthread_create(&q->thread, NULL, diag_l2_queue_main, q);
+	if (rv) {
+		fprintf(stderr, FLFMT "Could not start request thread: %s\n",
+			FL, strerror(rv));
+		pthread_cond_destroy(&q->done);
+		pthread_cond_destroy(&q->work);
+		pthread_mutex_destroy(&q->mtx);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+/*
+ * Take a reference on the link's queue (NULL if it has none), starting
+ * one if "start". Give it back with diag_l2_queue_put().
+ */
+static struct diag_l2_queue *
+diag_l2_queue_get(struct diag_l2_link *dl2l, int start)
+{
+	struct diag_l2_queue *q;
+
+	pthread_mutex_lock(&diag_l2_queue_mtx);
+	q = dl2l->diag_l2_queue;
+	if ((q == NULL) && start) {
+		q = diag_l2_queue_new();
+		if (q) {
+			q->refs = 1;		/* The link's */
+			dl2l->diag_l2_queue = q;
+		}
+	}
+	if (q)
+		q->refs++;
+	pthread_mutex_unlock(&diag_l2_queue_mtx);
+	return q;
+}
+
+static void
+diag_l2_queue_put(struct diag_l2_queue *q)
+{
+	int last;
+
+	pthread_mutex_lock(&diag_l2_queue_mtx);
+	last = (--q->refs == 0);
+	pthread_mutex_unlock(&diag_l2_queue_mtx);
+	if (!last)
+		return;
+
+	diag_l2_areq_freelist(q->qhead);
+	diag_l2_areq_freelist(q->dhead);
+	diag_l2_areq_freelist(q->spare);
+	pthread_cond_destroy(&q->done);
+	pthread_cond_destroy(&q->work);
+	pthread_mutex_destroy(&q->mtx);
+	free(q);
+}
+
+/*
+ * Stop the engine; requests not yet reaped are dropped without their
+ * callback, and reapers waiting on them return. The request thread
+ * needs the diag lock to finish what it's doing, so this must not be
+ * called with the diag lock held.
+ */
+static void
+diag_l2_queue_stop(struct diag_l2_link *dl2l)
+{
+	struct diag_l2_queue *q;
+
+	pthread_mutex_lock(&diag_l2_queue_mtx);
+	q = dl2l->diag_l2_queue;
+	dl2l->diag_l2_queue = NULL;
+	pthread_mutex_unlock(&diag_l2_queue_mtx);
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->mtx);
+	q->stop = 1;
+	pthread_cond_signal(&q->work);
+	pthread_cond_broadcast(&q->done);
+	pthread_mutex_unlock(&q->mtx);
+	(void) pthread_join(q->thread, NULL);
+
+	diag_l2_queue_put(q);
+}
+
+/*
+ * Queue a request; callback (may be NULL) is called by diag_l2_reap()
+ * once the response is in.
+ */
+int
+diag_l2_submit(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+	void (*callback)(struct diag_l2_areq *, void *), void *arg)
+{
+	struct diag_l2_queue *q;
+	struct diag_l2_areq *req;
+	int rv;
+
+	if (d_l2_conn->diag_l2_state != DIAG_L2_STATE_OPEN)
+		return diag_iseterr(DIAG_ERR_GENERAL);
+
+	q = diag_l2_queue_get(d_l2_conn->diag_link, 1);
+	if (q == NULL)
+		return diag_iseterr(DIAG_ERR_GENERAL);
+
+	pthread_mutex_lock(&q->mtx);
+	req = q->spare;
+	if (req)
+		q->spare = req->next;
+	pthread_mutex_unlock(&q->mtx);
+	if (req == NULL) {
+		if ((rv = diag_calloc(&req, 1))) {
+			diag_l2_queue_put(q);
+			return diag_iseterr(rv);
+		}
+	}
+
+	req->msg = diag_dupsinglemsg(msg);
+	if (req->msg == NULL) {
+		free(req);
+		diag_l2_queue_put(q);
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	}
+	req->next = NULL;
+	req->conn = d_l2_conn;
+	req->resp = NULL;
+	req->errval = 0;
+	req->callback = callback;
+	req->arg = arg;
+
+	if (diag_l2_debug & DIAG_DEBUG_WRITE)
+		fprintf(stderr, FLFMT "diag_l2_submit %p msg %p len %d\n",
+			FL, d_l2_conn, msg, msg->len);
+
+	pthread_mutex_lock(&q->mtx);
+	rv = 0;
+	if (q->stop) {
+		/* Link closed meanwhile */
+		rv = DIAG_ERR_GENERAL;
+	} else {
+		if (q->qtail)
+			q->qtail->next = req;
+		else
+			q->qhead = req;
+		q->qtail = req;
+		pthread_cond_signal(&q->work);
+	}
+	pthread_mutex_unlock(&q->mtx);
+	diag_l2_queue_put(q);
+
+	if (rv) {
+		diag_l2_areq_free(req);
+		return diag_iseterr(rv);
+	}
+	return 0;
+}
+
+/*
+ * Requests on this connection submitted but not reaped yet
+ */
+unsigned int
+diag_l2_outstanding(struct diag_l2_conn *d_l2_conn)
+{
+	struct diag_l2_queue *q;
+	struct diag_l2_areq *req;
+	unsigned int n = 0;
+
+	q = diag_l2_queue_get(d_l2_conn->diag_link, 0);
+	if (q == NULL)
+		return 0;
+
+	pthread_mutex_lock(&q->mtx);
+	for (req = q->qhead; req; req = req->next)
+		n += (req->conn == d_l2_conn);
+	for (req = q->dhead; req; req = req->next)
+		n += (req->conn == d_l2_conn);
+	if (q->cur && (q->cur->conn == d_l2_conn))
+		n++;
+	pthread_mutex_unlock(&q->mtx);
+	diag_l2_queue_put(q);
+
+	return n;
+}
+
+/*
+ * Complete the finished requests on this connection, in submission order,
+ * waiting up to timeout ms for the first one if none is ready. Returns
+ * how many were completed, 0 if there was nothing outstanding, or
+ * DIAG_ERR_TIMEOUT. A failed request's error (errval, and where it
+ * happened) is passed on to the caller's diag_geterr() and error
+ * history, as if it had happened in this thread.
+ */
+int
+diag_l2_reap(struct diag_l2_conn *d_l2_conn, int timeout)
+{
+	struct diag_l2_queue *q;
+	struct diag_l2_areq *req, *prev, *mine = NULL, **tail = &mine;
+	struct timespec ts;
+	int n = 0;
+
+	q = diag_l2_queue_get(d_l2_conn->diag_link, 0);
+	if (q == NULL)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (long) (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&q->mtx);
+	while (!q->stop) {
+		/* Unlink our finished ones */
+		for (prev = NULL, req = q->dhead; req; ) {
+			struct diag_l2_areq *next = req->next;
+
+			if (req->conn == d_l2_conn) {
+				if (prev)
+					prev->next = next;
+				else
+					q->dhead = next;
+				if (q->dtail == req)
+					q->dtail = prev;
+				req->next = NULL;
+				*tail = req;
+				tail = &req->next;
+				n++;
+			} else {
+				prev = req;
+			}
+			req = next;
+		}
+		if (n)
+			break;
+
+		/* Anything of ours still to come ? */
+		for (req = q->qhead; req; req = req->next)
+			if (req->conn == d_l2_conn)
+				break;
+		if ((req == NULL) &&
+				((q->cur == NULL) || (q->cur->conn != d_l2_conn)))
+			break;
+
+		if (pthread_cond_timedwait(&q->done, &q->mtx, &ts)) {
+			pthread_mutex_unlock(&q->mtx);
+			diag_l2_queue_put(q);
+			return diag_iseterr(DIAG_ERR_TIMEOUT);
+		}
+	}
+	pthread_mutex_unlock(&q->mtx);
+
+	for (req = mine; req; req = req->next) {
+		if (req->resp == NULL)
+			diag_errhistory_add(&req->err);
+		if (req->callback)
+			req->callback(req, req->arg);
+		if (req->resp) {
+			diag_freemsg(req->resp);
+			req->resp = NULL;
+		}
+		diag_freemsg(req->msg);
+		req->msg = NULL;
+	}
+
+	if (mine) {
+		pthread_mutex_lock(&q->mtx);
+		if (q->stop) {
+			pthread_mutex_unlock(&q->mtx);
+			diag_l2_areq_freelist(mine);
+		} else {
+			*tail = q->spare;
+			q->spare = mine;
+			pthread_mutex_unlock(&q->mtx);
+		}
+	}
+	diag_l2_queue_put(q);
+	return n;
+}
+
+
+/*
+ * Reactor callback : feed the framer whatever the device has, and tell
+ * it when its deadline has passed (which may be right away, e.g. at the
+ * end of a frame from a DOESL2FRAME interface). The L0 may read ahead,
+ * so once woken up for input we read until it has nothing left; that
+ * also means nothing is buffered when we're only woken by the deadline.
+ */
+static int
+diag_l2_reactor_event(struct diag_os_rsrc *rs, int events)
+{
+	struct diag_l2_conn *d_l2_conn = (struct diag_l2_conn *)rs->arg;
+	const struct diag_l2_proto *dp = d_l2_conn->l2proto;
+	int rv, err = 0;
+
+	diag_l2_link_enter(d_l2_conn->diag_link);
+	while (1) {
+		if (d_l2_conn->diag_l2_rxdeadline &&
+				(d_l2_conn->diag_l2_rxdeadline <= diag_os_getns())) {
+			rv = dp->diag_l2_proto_rxstep(d_l2_conn, 0);
+		} else if (events & DIAG_OS_RREAD) {
+			rv = diag_l1_recv(d_l2_conn->diag_link->diag_l2_dl0d, 0,
+				&d_l2_conn->rxbuf[d_l2_conn->rxoffset],
+				d_l2_conn->rxsize - d_l2_conn->rxoffset, 0);
+			if (rv == DIAG_ERR_TIMEOUT)
+				break;		/* Nothing more for now */
+			if (rv <= 0) {
+				/* Device gone or broken, don't spin on it */
+				err = (rv < 0) ? rv : diag_iseterr(DIAG_ERR_GENERAL);
+				break;
+			}
+			rv = dp->diag_l2_proto_rxstep(d_l2_conn, rv);
+		} else {
+			break;
+		}
+		if (rv == 0)
+			continue;
+
+		if (rv > 0) {
+			if (d_l2_conn->diag_l2_rxcallback)
+				d_l2_conn->diag_l2_rxcallback(d_l2_conn->diag_l2_rxhandle,
+					d_l2_conn->diag_msgs.head);
+			diag_msglist_free(&d_l2_conn->diag_msgs);
+		} else if (diag_l2_debug & DIAG_DEBUG_READ) {
+			fprintf(stderr, FLFMT "conn %p: receive error %d\n",
+				FL, (void *)d_l2_conn, rv);
+		}
+		/* Ready for the next one */
+		rv = dp->diag_l2_proto_rxstart(d_l2_conn, -1);
+		if (rv < 0) {
+			err = rv;
+			break;
+		}
+	}
+	rs->deadline = err ? 0 : d_l2_conn->diag_l2_rxdeadline;
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	return err;
+}
+
+int
+diag_l2_reactor_add(struct diag_os_reactor *r, struct diag_l2_conn *d_l2_conn,
+	void (*callback)(void *handle, struct diag_msg *msg), void *handle)
+{
+	struct diag_os_rsrc *rs = &d_l2_conn->diag_l2_rsrc;
+	int rv;
+
+	if ((d_l2_conn->l2proto->diag_l2_proto_rxstart == NULL) ||
+			(d_l2_conn->l2proto->diag_l2_proto_rxstep == NULL))
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
+	rv = d_l2_conn->l2proto->diag_l2_proto_rxstart(d_l2_conn, -1);
+	if (rv < 0) {
+		diag_l2_link_leave(d_l2_conn->diag_link);
+		diag_os_unlock();
+		return rv;
+	}
+	d_l2_conn->diag_l2_rxcallback = callback;
+	d_l2_conn->diag_l2_rxhandle = handle;
+
+	memset(rs, 0, sizeof(*rs));
+	rs->fd = d_l2_conn->diag_link->diag_l2_dl0d->fd;
+	rs->callback = diag_l2_reactor_event;
+	rs->arg = d_l2_conn;
+	rv = diag_os_reactor_add(r, rs);
+	if (rv == 0) {
+		/* Collect what's buffered already */
+		rv = diag_l2_reactor_event(rs, DIAG_OS_RREAD);
+		if (rv < 0)
+			diag_l2_reactor_del(r, d_l2_conn);
+	}
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
+
+	return rv;
+}
+
+void
+diag_l2_reactor_del(struct diag_os_reactor *r, struct diag_l2_conn *d_l2_conn)
+{
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
+	diag_os_reactor_del(r, &d_l2_conn->diag_l2_rsrc);
+	diag_msglist_free(&d_l2_conn->diag_msgs);
+	d_l2_conn->rxoffset = 0;
+	d_l2_conn->diag_l2_rxdeadline = 0;
+	diag_l2_rxbuf_put(d_l2_conn);
+	d_l2_conn->diag_l2_rxcallback = NULL;
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
+}
 
 /*
  * Recv a message - will end up calling the callback routine with a message
@@ -684,7 +1492,11 @@ diag_l2_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 				FL, d_l2_conn, timeout);
 
 	/* Call protocol specific recv routine */
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
 	rv = d_l2_conn->l2proto->diag_l2_proto_recv(d_l2_conn, timeout, callback, handle);
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
 
 	if (diag_l2_debug & DIAG_DEBUG_READ)
 		fprintf(stderr, FLFMT "diag_l2_recv returns %d\n", FL, rv);
@@ -710,6 +1522,8 @@ int diag_l2_ioctl(struct diag_l2_conn *d_l2_conn, int cmd, void *data)
 
 	dl0d = d_l2_conn->diag_link->diag_l2_dl0d ;
 
+	diag_os_lock();
+	diag_l2_link_enter(d_l2_conn->diag_link);
 	switch (cmd)
 	{
 	case DIAG_IOCTL_GET_L1_TYPE:
@@ -738,6 +1552,40 @@ int diag_l2_ioctl(struct diag_l2_conn *d_l2_conn, int cmd, void *data)
 		rv = 0;	/* Do nothing, quietly */
 		break;
 	}
+	diag_l2_link_leave(d_l2_conn->diag_link);
+	diag_os_unlock();
 
 	return rv;
 }
+
+/*
+ * Print what each link and connection holds: the fixed structure, the
+ * receive buffer currently borrowed and any queued received messages
+ */
+void
+diag_l2_memstats(FILE *fp)
+{
+	struct diag_l2_link *dl2l;
+	struct diag_l2_conn *d_l2_conn;
+	struct diag_rxarena *a;
+
+	diag_os_lock();
+	for (dl2l = diag_l2_links; dl2l; dl2l = dl2l->next) {
+		a = &dl2l->diag_l2_rxarena;
+		fprintf(fp, "L2 link %s: %u bytes, rx buffers of %u bytes: "
+			"%u in use, %u idle, peak %u\n",
+			dl2l->diag_l2_name, (unsigned int) sizeof(*dl2l),
+			(unsigned int) a->bufsize, a->nused, a->nfree, a->peak);
+	}
+	for (d_l2_conn = diag_l2_connections; d_l2_conn;
+			d_l2_conn = d_l2_conn->next) {
+		fprintf(fp, "L2 conn %p proto %d addr 0x%02x state %d: "
+			"%u bytes + %u rx buffer, %u msgs queued\n",
+			(void *) d_l2_conn, d_l2_conn->l2proto->diag_l2_protocol,
+			d_l2_conn->diag_l2_destaddr, d_l2_conn->diag_l2_state,
+			(unsigned int) sizeof(*d_l2_conn),
+			(unsigned int) d_l2_conn->rxsize,
+			d_l2_conn->diag_msgs.cnt);
+	}
+	diag_os_unlock();
+}
@@ -33,6 +33,8 @@
  * Structure of definitions of L2 types supported
  */
 
+#include <pthread.h>
+
 /*
  * Links down to layer 1, there will only be one link per protocol per device,
  * may be many connections (defined in diag_l2.h) per link
@@ -47,10 +49,21 @@ struct diag_l2_link
 	int	diag_l2_l1protocol;		/* L1 protocol */
 
 	char	diag_l2_name[DIAG_NAMELEN];	/* Short, unique text name for user interface */
+	char	diag_l2_subinterface[DIAG_NAMELEN];	/* Device it was opened on */
 
 	int	diag_l2_l1flags;		/* L1 flags, see L1 info */
 	int	diag_l2_l1type;			/* L1 type (see diag_l1.h) */
 
+	/* Receive buffers lent to connections on this link */
+	struct diag_rxarena	diag_l2_rxarena;
+
+	/* Asynchronous request engine, started by the first diag_l2_submit() */
+	struct diag_l2_queue	*diag_l2_queue;
+
+	/* Thread using the link, see diag_l2_link_enter() */
+	pthread_t	diag_l2_owner;
+	int	diag_l2_busy;		/* Its diag_l2_link_enter() nesting */
+
 	struct diag_l2_link *next;		/* linked list of all connections */
 	struct diag_l2_link *l1_next;		/* linked list of all ECUs with same ID on different interfaces */
 	struct diag_l2_link *l1_prev;		/* prev to make list removal easy */
@@ -63,14 +76,39 @@ struct diag_msg;
  * There is one of these per ECU we are talking to - we may be talking to
  * more than one ECU per L1 link
  */
+/*
+ * Learned response size of one request class (the first two bytes of a
+ * request, e.g. J1979 mode + PID): how many frames came back before the
+ * end-of-responses timeout. When the same count has been seen twice in
+ * a row, with one frame per source address, int_recv may stop as soon
+ * as that many frames are in instead of waiting out the idle time.
+ * Every DIAG_L2_RESP_RECHECK'th request of the class still waits for
+ * the timeout, to notice extra responders.
+ */
+#define DIAG_L2_RESP_CLASSES	32	/* Table size, direct mapped */
+#define DIAG_L2_RESP_RECHECK	16
+
+struct diag_l2_respclass
+{
+	uint8_t	used;
+	uint8_t	sid;
+	uint8_t	pid;
+	uint8_t	count;		/* Frames in the last timed out response */
+	uint8_t	confirmed;	/* count seen twice in a row */
+	uint8_t	early;		/* Early completions since the last timeout */
+};
+
 struct diag_l2_conn
 {
 	uint8_t	diag_l2_state;		/* State of this */
 
 	struct diag_l2_link *diag_link;		/* info about L1 connection */
 
-	struct timeval	diag_l2_lastsend;	/* Time we sent last message */
-	struct timeval	diag_l2_expiry;		/* When it expires */
+	tstamp_type	diag_l2_lastsend;	/* Time we sent last message */
+	tstamp_type	diag_l2_txdone;		/* Time it was completely sent */
+	tstamp_type	diag_l2_rxdone;		/* End of the last response */
+	tstamp_type	diag_l2_expiry;		/* When it expires */
+	struct diag_os_timer diag_l2_katimer;	/* Fires at diag_l2_expiry */
 
 	const struct diag_l2_proto *l2proto;	/* Protocol handlers */
 
@@ -123,13 +161,27 @@ struct diag_l2_conn
 	struct diag_l2_conn *diag_l2_next;
 	struct diag_l2_conn *diag_l2_prev;
 
-	/* Generic receive buffer */
-	uint8_t	rxbuf[MAXRBUF];
+	/*
+	 * Receive buffer for building frames in, borrowed from the link
+	 * with diag_l2_rxbuf_get() and only held while a frame is
+	 * being received.
+	 */
+	uint8_t	*rxbuf;
+	size_t	rxsize;
 	int		rxoffset;
+	tstamp_type	diag_l2_rxdeadline;	/* Framer timeout, 0 = none */
+
+	/* When driven by a reactor, see diag_l2_reactor_add() */
+	struct diag_os_rsrc	diag_l2_rsrc;
+	void	(*diag_l2_rxcallback)(void *handle, struct diag_msg *msg);
+	void	*diag_l2_rxhandle;
 
-	/* Generic 'msg' holder */
-	struct diag_msg	*diag_msg;
+	/* Received messages, see diag_l2_addmsg() */
+	struct diag_msglist	diag_msgs;
 
+	/* Responder counts, see diag_l2_resp_take() */
+	struct diag_l2_respclass resp[DIAG_L2_RESP_CLASSES];
+	struct diag_l2_respclass *resp_cur;	/* Class of the last request sent */
 };
 
 // Special Timeout for so-called "Smart" interfaces;
@@ -169,7 +221,7 @@ struct diag_l2_conn
 #define DIAG_L2_PROT_ISO14230	3	/* Iso 14230 using appropriate message
 						format */
 #define DIAG_L2_PROT_SAEJ1850	4	/* SAEJ1850 */
-#define DIAG_L2_PROT_CAN	5	/* CAN L2 (is this defined ??) */
+#define DIAG_L2_PROT_CAN	5	/* ISO 15765-2/-4 (CAN) */
 #define DIAG_L2_PROT_VAG	6	/* VAG ISO9141 based protocol */
 #define DIAG_L2_PROT_MB1	7	/* MB protocol 1 */
 #define DIAG_L2_PROT_MB2	8	/* MB protocol 2 */
@@ -219,6 +271,12 @@ struct diag_l2_conn
  */
 #define DIAG_L2_IDLE_J1978	0x40
 
+/*
+ * Bit 7 tells the CAN (ISO 15765) code to use 29 bit identifiers
+ * (normal fixed addressing) instead of the 11 bit OBD ones
+ */
+#define DIAG_L2_TYPE_CAN29BIT	0x80
+
 
 /* Used for L2_IOCTL_GETDATA */
 struct	diag_l2_data
@@ -266,6 +324,24 @@ struct	diag_l2_data
  */
 /* Add a msg to a L2 connection */
 void diag_l2_addmsg(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg);
+/*
+ * Borrow a receive buffer of at least size bytes (the protocol's
+ * largest frame) from the link, unless the connection has one already;
+ * put it back when the frame has been turned into a message. put does
+ * nothing while rxoffset != 0.
+ */
+int diag_l2_rxbuf_get(struct diag_l2_conn *d_l2_conn, size_t size);
+void diag_l2_rxbuf_put(struct diag_l2_conn *d_l2_conn);
+/*
+ * Early end of responses. int_recv takes the class of the request it
+ * is collecting responses for (NULL if none is pending), may stop once
+ * diag_l2_resp_expect() frames are in (0 = unknown, wait for the
+ * timeout), and hands back the decoded frames it ended up with.
+ */
+struct diag_l2_respclass *diag_l2_resp_take(struct diag_l2_conn *d_l2_conn);
+unsigned int diag_l2_resp_expect(const struct diag_l2_respclass *rc);
+void diag_l2_resp_learn(struct diag_l2_respclass *rc,
+	const struct diag_msglist *ml, int early);
 
 /*
  * Public interface
@@ -300,6 +376,11 @@ void diag_l2_addmsg(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg);
  * AccessTimingParameters()
  *	use:	change access timing parameter defaults
  *	params:	connection - the connection
+ *		mode - DIAG_L2_ATP_FAST: ask the ECU for its timing limits
+ *			and switch to the shortest P2/P3/P4 it accepts;
+ *			DIAG_L2_ATP_DEFAULT: go back to the standard values
+ *	returns: 0 if the new timing is in use, diag error num (<0) on
+ *		error, in which case the connection keeps its old timing
  *
  *
  * send()
@@ -354,21 +435,72 @@ struct diag_l2_conn * diag_l2_StartCommunications(struct diag_l0_device *, int L
 
 int diag_l2_StopCommunications(struct diag_l2_conn *);
 
+#define DIAG_L2_ATP_DEFAULT	0	/* Standard timing */
+#define DIAG_L2_ATP_FAST	1	/* Shortest timing the ECU accepts */
+int diag_l2_AccessTimingParameters(struct diag_l2_conn *, int mode);
+
 int diag_l2_send(struct diag_l2_conn *connection, struct diag_msg *msg);
 void diag_l2_sendstamp(struct diag_l2_conn *d_l2_conn);
+void diag_l2_kastamp(struct diag_l2_conn *d_l2_conn, tstamp_type when);
 
 int diag_l2_recv(struct diag_l2_conn *connection, int timeout,
 	void (* rcv_call_back)(void *, struct diag_msg *), void *handle );
 
 struct diag_msg *diag_l2_request(struct diag_l2_conn *connection, struct diag_msg *msg,
 		int *errval);
+void diag_l2_p3wait(struct diag_l2_conn *d_l2_conn);
+
+/*
+ * Asynchronous requests. diag_l2_submit() queues a copy of msg and returns
+ * at once; a thread per link then runs the queued requests through
+ * diag_l2_request(), back to back, while the application decodes the
+ * previous answers. diag_l2_reap() hands finished requests back: it calls
+ * their callback in the caller's thread, without the diag lock, then
+ * frees them. The response chain is the one the request thread received,
+ * and belongs to the callback, which may keep it by setting resp to NULL.
+ */
+struct diag_l2_areq
+{
+	struct diag_l2_areq	*next;
+	struct diag_l2_conn	*conn;
+	struct diag_msg	*msg;		/* Our copy of the request */
+	struct diag_msg	*resp;		/* Response(s), NULL on error */
+	int	errval;			/* Why resp is NULL */
+	struct diag_errent	err;	/* ... and where */
+	void	(*callback)(struct diag_l2_areq *, void *arg);
+	void	*arg;
+};
+
+int diag_l2_submit(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+	void (*callback)(struct diag_l2_areq *, void *), void *arg);
+int diag_l2_reap(struct diag_l2_conn *d_l2_conn, int timeout);	/* # reaped */
+unsigned int diag_l2_outstanding(struct diag_l2_conn *d_l2_conn);
+
+/*
+ * Let a reactor (see diag_os_reactor_new()) receive on this connection:
+ * every response is handed to callback as it completes, as with
+ * diag_l2_recv(), so one thread can listen to many links. Only for
+ * protocols with a non-blocking receive (DIAG_ERR_PROTO_NOTSUPP else).
+ */
+int diag_l2_reactor_add(struct diag_os_reactor *r, struct diag_l2_conn *d_l2_conn,
+	void (*callback)(void *handle, struct diag_msg *msg), void *handle);
+void diag_l2_reactor_del(struct diag_os_reactor *r, struct diag_l2_conn *d_l2_conn);
 
 int diag_l2_ioctl(struct diag_l2_conn *connection, int cmd, void *data);
+void diag_l2_memstats(FILE *fp);	/* Print memory held by links/connections */
 
-void diag_l2_timer(void);	/* Regular timer routine */
+/*
+ * Claim a link for the calling thread, waiting while another thread has
+ * it (nests). The entry points hold it while they use the link, as the
+ * diag lock is let go during sleeps and waits for input. Called with the
+ * diag lock held. Timer callbacks must not wait : they check
+ * diag_l2_link_busy() first, and try again later.
+ */
+void diag_l2_link_enter(struct diag_l2_link *dl2l);
+void diag_l2_link_leave(struct diag_l2_link *dl2l);
+int diag_l2_link_busy(struct diag_l2_link *dl2l);
 
 extern int diag_l2_debug;
-extern struct diag_l2_conn  *global_l2_conn;
 
 /*
  * Interface to individual protocols
@@ -388,6 +520,18 @@ struct diag_l2_proto {
 	struct diag_msg * (*diag_l2_proto_request)(struct diag_l2_conn*,
 		struct diag_msg*, int*);
 	void (*diag_l2_proto_timeout)(struct diag_l2_conn*);
+	/* Optional, NULL if the protocol can't renegotiate its timing */
+	int (*diag_l2_proto_atp)(struct diag_l2_conn*, int mode);
+	/*
+	 * Optional non-blocking receive, for diag_l2_reactor_add(). rxstart
+	 * arms the framer for a response within timeout ms (< 0: no limit);
+	 * rxstep is then called with the len bytes just added at
+	 * rxbuf[rxoffset], or with len 0 once diag_l2_rxdeadline has passed.
+	 * rxstep returns 0 while the response is incomplete, > 0 once it is
+	 * in diag_msgs (headers stripped), or an error.
+	 */
+	int (*diag_l2_proto_rxstart)(struct diag_l2_conn*, int timeout);
+	int (*diag_l2_proto_rxstep)(struct diag_l2_conn*, int len);
 };
 
 int diag_l2_add_protocol(const struct diag_l2_proto *l2proto);
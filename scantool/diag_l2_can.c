@@ -1,11 +1,718 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ * Copyright (C) 2001 Richard Almeida & Ibex Ltd (rpa@ibex.co.uk)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Diag
+ *
+ * L2 driver for ISO 15765-2 (the CAN transport protocol, "ISO-TP") using
+ * the ISO 15765-4 (OBD on CAN) identifiers :
+ *
+ *	11 bit : requests to 0x7DF (functional) or 0x7E0-0x7E7,
+ *		 responses from 0x7E8-0x7EF (request ID + 8)
+ *	29 bit : requests to 0x18DB33F1 (functional) or 0x18DA<ecu><tester>,
+ *		 responses from 0x18DA<tester><ecu>
+ *
+ * Messages of up to 7 bytes go in one Single Frame, longer ones as a First
+ * Frame followed by Consecutive Frames, paced by Flow Control frames from
+ * the receiver. Several ECUs may answer a functional request at once, so
+ * we keep one reassembly per responding identifier.
+ *
+ * The L1 interface passes whole CAN frames, see DIAG_L1_CAN_EFF.
+ *
+ * diag_msg lengths are 8 bits, so we only accept segmented messages of up
+ * to 255 bytes (plenty for OBD, where VINs etc are around 20 bytes) and
+ * refuse longer ones with a Flow Control overflow.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
 #include "diag.h"
+#include "diag_err.h"
+#include "diag_os.h"
+#include "diag_tty.h"
+#include "diag_l1.h"
 #include "diag_l2.h"
-#include "diag_l2_can.h"
+
+#include "diag_l2_can.h" /* prototypes for this file */
+
+CVSID("$Id$");
+
+/* Frame types, high nibble of the 1st (PCI) byte */
+#define ISOTP_SF	0x00	/* Single Frame */
+#define ISOTP_FF	0x10	/* First Frame */
+#define ISOTP_CF	0x20	/* Consecutive Frame */
+#define ISOTP_FC	0x30	/* Flow Control */
+
+/* Flow Control status, low nibble */
+#define ISOTP_FC_CTS	0	/* Continue to send */
+#define ISOTP_FC_WAIT	1
+#define ISOTP_FC_OVFLW	2	/* Message too long for receiver */
+
+/* ISO 15765-4 timing, ms */
+#define CAN_P2		50	/* Request to response, and between responders */
+#define CAN_N_BS	1000	/* Waiting for a Flow Control */
+#define CAN_N_CR	1000	/* Waiting for a Consecutive Frame */
+#define CAN_MAXWFT	10	/* FC.WAIT frames we put up with in a row */
+
+/* ISO 15765-4 wants all frames 8 bytes long, padded */
+#define CAN_PAD		0x00
+
+/* Segmented messages being received at once (one per ECU) */
+#define CAN_MAXRX	8
+
+#define CAN_ID11_FUNC	0x7DF
+#define CAN_ID11_RESP	0x7E8
+#define CAN_ID29_FUNC	0x18DB0000UL	/* | target << 8 | source */
+#define CAN_ID29_PHYS	0x18DA0000UL	/* | target << 8 | source */
+#define CAN_ID29_MASK	0x1FFFFF00UL	/* Everything but the source */
+
+uint8_t diag_l2_can_bs = 0;	/* No limit */
+uint8_t diag_l2_can_stmin = 0;	/* As fast as you like */
+
+/* A segmented message being received */
+struct diag_l2_can_rx
+{
+	uint32_t id;		/* Identifier it comes from */
+	struct diag_msg *msg;	/* NULL if the slot is free */
+	uint8_t	offset;		/* Bytes received so far */
+	uint8_t	sn;		/* Next sequence number expected */
+	uint8_t	bsleft;		/* CFs before we send another FC, 0 = no limit */
+};
+
+/*
+ * CAN specific data
+ */
+struct diag_l2_can
+{
+	uint8_t srcaddr;	/* Src address used */
+	uint8_t dstaddr;	/* Dest address used */
+	uint16_t modeflags;	/* Flags */
+
+	int	functional;	/* Requests are functionally addressed */
+	uint32_t txid;		/* Identifier we send on */
+	uint32_t rxid;		/* Identifier we expect back, if physical */
+
+	struct diag_l2_can_rx rx[CAN_MAXRX];
+	int	nrx;		/* Slots in use */
+};
+
+static int
+diag_l2_proto_can_txframe(struct diag_l2_conn *d_l2_conn, uint32_t id,
+	const uint8_t *data, int len)
+{
+	uint8_t frame[DIAG_L1_CAN_MAXFRAME];
+
+	frame[0] = (uint8_t) (id >> 24);
+	frame[1] = (uint8_t) (id >> 16);
+	frame[2] = (uint8_t) (id >> 8);
+	frame[3] = (uint8_t) id;
+	memcpy(&frame[DIAG_L1_CAN_IDLEN], data, (size_t)len);
+	memset(&frame[DIAG_L1_CAN_IDLEN + len], CAN_PAD, (size_t)(8 - len));
+
+	if (diag_l2_debug & DIAG_DEBUG_WRITE) {
+		fprintf(stderr, FLFMT "can_txframe id 0x%lx: ", FL,
+			(unsigned long) (id & ~DIAG_L1_CAN_EFF));
+		diag_data_dump(stderr, data, (size_t)len);
+		fprintf(stderr, "\n");
+	}
+
+	return diag_l1_send(d_l2_conn->diag_link->diag_l2_dl0d, 0,
+		frame, sizeof(frame), 0);
+}
+
+/* Identifier to send Flow Control on, for a responder on id */
+static uint32_t
+diag_l2_proto_can_fcid(uint32_t id)
+{
+	if (id & DIAG_L1_CAN_EFF)
+		/* Swap target and source */
+		return (id & 0xFFFF0000UL) | ((id & 0xFF) << 8)
+			| ((id >> 8) & 0xFF);
+	return id - 8;
+}
+
+/* Is id one of the responses we want ? */
+static int
+diag_l2_proto_can_ours(struct diag_l2_can *dp, uint32_t id)
+{
+	if (!dp->functional)
+		return id == dp->rxid;
+
+	if (dp->modeflags & DIAG_L2_TYPE_CAN29BIT)
+		return (id & DIAG_L1_CAN_EFF) && ((id & CAN_ID29_MASK)
+			== (CAN_ID29_PHYS | ((uint32_t)dp->srcaddr << 8)));
+
+	return id >= CAN_ID11_RESP && id <= CAN_ID11_RESP + 7;
+}
+
+/*
+ * Convert a received STmin to us (0xF1-0xF9 are 100-900us); reserved
+ * values mean the maximum
+ */
+static int
+diag_l2_proto_can_stmin(uint8_t stmin)
+{
+	if (stmin <= 0x7F)
+		return stmin * 1000;
+	if (stmin >= 0xF1 && stmin <= 0xF9)
+		return (stmin - 0xF0) * 100;
+	return 0x7F * 1000;
+}
+
+static void
+diag_l2_proto_can_rxdone(struct diag_l2_can *dp, struct diag_l2_can_rx *rx)
+{
+	rx->msg = NULL;
+	dp->nrx--;
+}
+
+/* Complete message from id, send it upward */
+static void
+diag_l2_proto_can_addmsg(struct diag_l2_conn *d_l2_conn, uint32_t id,
+	struct diag_msg *msg)
+{
+	struct diag_l2_can *dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+
+	msg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_DATAONLY | DIAG_FMT_CKSUMMED;
+	if (dp->functional)
+		msg->fmt |= DIAG_FMT_ISO_FUNCADDR;
+	msg->src = (uint8_t) id;
+	if (id & DIAG_L1_CAN_EFF)
+		msg->dest = (uint8_t) (id >> 8);
+	else
+		msg->dest = dp->srcaddr;
+
+	diag_l2_addmsg(d_l2_conn, msg);
+}
+
+/*
+ * Handle one received frame. Completed messages are added to the
+ * connection's message list. Returns 1 if the frame was for us,
+ * 0 if it was someone else's (or rubbish)
+ */
+static int
+diag_l2_proto_can_rxframe(struct diag_l2_conn *d_l2_conn,
+	const uint8_t *frame, int len)
+{
+	struct diag_l2_can *dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+	struct diag_l2_can_rx *rx, *freerx;
+	struct diag_msg *msg;
+	const uint8_t *data;
+	uint8_t fc[3];
+	uint32_t id;
+	int dlc, i, n, msglen;
+
+	if (len <= DIAG_L1_CAN_IDLEN)
+		return 0;
+
+	id = ((uint32_t)frame[0] << 24) | ((uint32_t)frame[1] << 16)
+		| ((uint32_t)frame[2] << 8) | frame[3];
+	data = &frame[DIAG_L1_CAN_IDLEN];
+	dlc = len - DIAG_L1_CAN_IDLEN;
+
+	if (!diag_l2_proto_can_ours(dp, id))
+		return 0;
+
+	if (diag_l2_debug & DIAG_DEBUG_READ) {
+		fprintf(stderr, FLFMT "can_rxframe id 0x%lx: ", FL,
+			(unsigned long) (id & ~DIAG_L1_CAN_EFF));
+		diag_data_dump(stderr, data, (size_t)dlc);
+		fprintf(stderr, "\n");
+	}
+
+	/* Find the reassembly for this sender, if any */
+	rx = freerx = NULL;
+	for (i = 0; i < CAN_MAXRX; i++) {
+		if (dp->rx[i].msg == NULL) {
+			if (freerx == NULL)
+				freerx = &dp->rx[i];
+		} else if (dp->rx[i].id == id) {
+			rx = &dp->rx[i];
+		}
+	}
+
+	switch (data[0] & 0xF0) {
+	case ISOTP_SF:
+	case ISOTP_FF:
+		if (rx) {
+			/* New message interrupts the old one, which is lost */
+			if (diag_l2_debug & DIAG_DEBUG_READ)
+				fprintf(stderr, FLFMT "can: 0x%lx restarted, "
+					"dropping %d bytes\n", FL,
+					(unsigned long) (id & ~DIAG_L1_CAN_EFF),
+					rx->offset);
+			diag_freemsg(rx->msg);
+			diag_l2_proto_can_rxdone(dp, rx);
+			freerx = rx;
+		}
+
+		if ((data[0] & 0xF0) == ISOTP_SF) {
+			msglen = data[0] & 0x0F;
+			if (msglen == 0 || msglen > dlc - 1)
+				return 1;
+			msg = diag_allocmsg((size_t)msglen);
+			if (msg == NULL)
+				return 1;
+			msg->len = (uint8_t) msglen;
+			memcpy(msg->data, &data[1], (size_t)msglen);
+			msg->rxtime = diag_l0_rxstamp(d_l2_conn->diag_link->diag_l2_dl0d);
+			diag_l2_proto_can_addmsg(d_l2_conn, id, msg);
+			return 1;
+		}
+
+		if (dlc < 8)
+			return 1;
+		msglen = ((data[0] & 0x0F) << 8) | data[1];
+		if (msglen < 8)
+			return 1;
+		if (msglen > 0xFF || freerx == NULL) {
+			/* Can't take it, tell the ECU to give up */
+			fc[0] = ISOTP_FC | ISOTP_FC_OVFLW;
+			fc[1] = 0;
+			fc[2] = 0;
+			(void)diag_l2_proto_can_txframe(d_l2_conn,
+				diag_l2_proto_can_fcid(id), fc, 3);
+			return 1;
+		}
+
+		msg = diag_allocmsg((size_t)msglen);
+		if (msg == NULL)
+			return 1;
+		msg->len = (uint8_t) msglen;
+		msg->rxtime = diag_l0_rxstamp(d_l2_conn->diag_link->diag_l2_dl0d);
+		memcpy(msg->data, &data[2], 6);
+
+		rx = freerx;
+		rx->id = id;
+		rx->msg = msg;
+		rx->offset = 6;
+		rx->sn = 1;
+		rx->bsleft = diag_l2_can_bs;
+		dp->nrx++;
+
+		fc[0] = ISOTP_FC | ISOTP_FC_CTS;
+		fc[1] = diag_l2_can_bs;
+		fc[2] = diag_l2_can_stmin;
+		if (diag_l2_proto_can_txframe(d_l2_conn,
+				diag_l2_proto_can_fcid(id), fc, 3) < 0) {
+			diag_freemsg(msg);
+			diag_l2_proto_can_rxdone(dp, rx);
+		}
+		return 1;
+
+	case ISOTP_CF:
+		if (rx == NULL)
+			return 1;	/* Not expecting one, ignore it */
+		if ((data[0] & 0x0F) != rx->sn) {
+			/* Lost a frame, so the whole message */
+			if (diag_l2_debug & DIAG_DEBUG_READ)
+				fprintf(stderr, FLFMT "can: 0x%lx bad sequence "
+					"number %d, wanted %d\n", FL,
+					(unsigned long) (id & ~DIAG_L1_CAN_EFF),
+					data[0] & 0x0F, rx->sn);
+			diag_freemsg(rx->msg);
+			diag_l2_proto_can_rxdone(dp, rx);
+			return 1;
+		}
+
+		msg = rx->msg;
+		n = MIN(dlc - 1, msg->len - rx->offset);
+		memcpy(&msg->data[rx->offset], &data[1], (size_t)n);
+		rx->offset += n;
+		rx->sn = (rx->sn + 1) & 0x0F;
+
+		if (rx->offset == msg->len) {
+			diag_l2_proto_can_rxdone(dp, rx);
+			diag_l2_proto_can_addmsg(d_l2_conn, id, msg);
+		} else if (rx->bsleft && --rx->bsleft == 0) {
+			/* End of block, let it have another */
+			rx->bsleft = diag_l2_can_bs;
+			fc[0] = ISOTP_FC | ISOTP_FC_CTS;
+			fc[1] = diag_l2_can_bs;
+			fc[2] = diag_l2_can_stmin;
+			(void)diag_l2_proto_can_txframe(d_l2_conn,
+				diag_l2_proto_can_fcid(id), fc, 3);
+		}
+		return 1;
+
+	default:
+		/* Flow control is only of interest while sending */
+		return 1;
+	}
+}
+
+/* Drop any partly received messages */
+static void
+diag_l2_proto_can_rxflush(struct diag_l2_can *dp)
+{
+	int i;
+
+	for (i = 0; i < CAN_MAXRX; i++) {
+		if (dp->rx[i].msg) {
+			diag_freemsg(dp->rx[i].msg);
+			diag_l2_proto_can_rxdone(dp, &dp->rx[i]);
+		}
+	}
+}
+
+/*
+ * The complex initialisation routine for CAN; there isn't any, we just
+ * work out the identifiers to use
+ */
+static int
+diag_l2_proto_can_startcomms(struct diag_l2_conn *d_l2_conn,
+flag_type flags,
+int bitrate,
+target_type target, source_type source)
+{
+	struct diag_l2_can *dp;
+
+	if (diag_l2_debug & DIAG_DEBUG_OPEN)
+		fprintf(stderr,
+			FLFMT "diag_l2_can_startcomms conn %p\n",
+				FL, d_l2_conn);
+
+	if ((d_l2_conn->diag_link->diag_l2_l1flags & DIAG_L1_DOESL2FRAME) == 0)
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+
+	if (diag_calloc(&dp, 1))
+		return(DIAG_ERR_NOMEM);
+
+	d_l2_conn->diag_l2_proto_data = (void *)dp;
+
+	dp->srcaddr = source;
+	dp->dstaddr = target;
+	dp->modeflags = flags;
+
+	/* 0x33 is the J1979 functional address on every protocol */
+	dp->functional = (flags & DIAG_L2_TYPE_FUNCADDR) || (target == 0x33);
+
+	if (flags & DIAG_L2_TYPE_CAN29BIT) {
+		if (dp->functional)
+			dp->txid = CAN_ID29_FUNC | (0x33 << 8) | source;
+		else
+			dp->txid = CAN_ID29_PHYS | ((uint32_t)target << 8) | source;
+		dp->txid |= DIAG_L1_CAN_EFF;
+	} else {
+		if (dp->functional)
+			dp->txid = CAN_ID11_FUNC;
+		else if (target >= (CAN_ID11_RESP & 0xFF))
+			/* Given the ECU's response ID, as scantool shows */
+			dp->txid = 0x700 | (target - 8);
+		else
+			dp->txid = 0x700 | target;
+	}
+	if (flags & DIAG_L2_TYPE_CAN29BIT)
+		dp->rxid = DIAG_L1_CAN_EFF | CAN_ID29_PHYS
+			| ((uint32_t)source << 8) | target;
+	else
+		dp->rxid = dp->txid + 8;
+
+	d_l2_conn->diag_l2_speed = bitrate ? bitrate : 500000;
+	d_l2_conn->diag_l2_p2min = 0;
+	d_l2_conn->diag_l2_p2max = CAN_P2;
+
+	if (diag_l2_debug & DIAG_DEBUG_OPEN)
+		fprintf(stderr,
+			FLFMT "diag_l2_can_startcomms tx id 0x%lx%s\n",
+				FL, (unsigned long) (dp->txid & ~DIAG_L1_CAN_EFF),
+				dp->functional ? " (functional)" : "");
+
+	/* Always OK, the bus needs no waking up */
+	return(0);
+}
+
+static int
+diag_l2_proto_can_stopcomms(struct diag_l2_conn* d_l2_conn)
+{
+	struct diag_l2_can *dp;
+
+	dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+
+	if (dp) {
+		diag_l2_proto_can_rxflush(dp);
+		free(dp);
+	}
+	d_l2_conn->diag_l2_proto_data = NULL;
+
+	/* Always OK for now */
+	return (0);
+}
+
+/*
+ * Wait for the Flow Control that lets us send the next block of
+ * Consecutive Frames; fills in the block size and gap (us) the ECU wants
+ */
+static int
+diag_l2_proto_can_waitfc(struct diag_l2_conn *d_l2_conn, int *bs, int *stmin)
+{
+	struct diag_l2_can *dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+	uint8_t frame[DIAG_L1_CAN_MAXFRAME];
+	tstamp_type deadline;
+	uint32_t id;
+	int rv, tout, waits = 0;
+
+	deadline = diag_os_getns() + (tstamp_type)CAN_N_BS * 1000000;
+
+	while (1) {
+		tout = (int) ((int64_t)(deadline - diag_os_getns()) / 1000000);
+		if (tout <= 0)
+			return diag_iseterr(DIAG_ERR_TIMEOUT);
+
+		rv = diag_l1_recv(d_l2_conn->diag_link->diag_l2_dl0d, 0,
+			frame, sizeof(frame), tout);
+		if (rv < 0)
+			return diag_iseterr(rv);
+		if (rv < DIAG_L1_CAN_IDLEN + 3)
+			continue;
+
+		id = ((uint32_t)frame[0] << 24) | ((uint32_t)frame[1] << 16)
+			| ((uint32_t)frame[2] << 8) | frame[3];
+		if (id != dp->rxid
+			|| (frame[DIAG_L1_CAN_IDLEN] & 0xF0) != ISOTP_FC)
+			continue;
+
+		switch (frame[DIAG_L1_CAN_IDLEN] & 0x0F) {
+		case ISOTP_FC_CTS:
+			*bs = frame[DIAG_L1_CAN_IDLEN + 1];
+			*stmin = diag_l2_proto_can_stmin(frame[DIAG_L1_CAN_IDLEN + 2]);
+			return 0;
+		case ISOTP_FC_WAIT:
+			if (++waits > CAN_MAXWFT)
+				return diag_iseterr(DIAG_ERR_TIMEOUT);
+			deadline = diag_os_getns() + (tstamp_type)CAN_N_BS * 1000000;
+			break;
+		case ISOTP_FC_OVFLW:
+			return diag_iseterr(DIAG_ERR_BADLEN);
+		default:
+			return diag_iseterr(DIAG_ERR_BADDATA);
+		}
+	}
+}
+
+/*
+ * Send the data, segmenting it if it doesn't fit in one frame
+ */
+static int
+diag_l2_proto_can_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
+{
+	struct diag_l2_can *dp;
+	uint8_t buf[8];
+	tstamp_type sent;
+	int rv, offset, n, sn, bs, stmin;
+
+	if (diag_l2_debug & DIAG_DEBUG_WRITE)
+		fprintf(stderr,
+			FLFMT "diag_l2_can_send %p msg %p len %d called\n",
+				FL, d_l2_conn, msg, msg->len);
+
+	dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+
+	if (msg->len == 0)
+		return diag_iseterr(DIAG_ERR_BADLEN);
+
+	if (msg->len <= 7) {
+		buf[0] = ISOTP_SF | msg->len;
+		memcpy(&buf[1], msg->data, msg->len);
+		return diag_l2_proto_can_txframe(d_l2_conn, dp->txid,
+			buf, 1 + msg->len);
+	}
+
+	/* ISO 15765-4 : functional requests have to fit in one frame */
+	if (dp->functional)
+		return diag_iseterr(DIAG_ERR_BADLEN);
+
+	buf[0] = ISOTP_FF;
+	buf[1] = msg->len;
+	memcpy(&buf[2], msg->data, 6);
+	rv = diag_l2_proto_can_txframe(d_l2_conn, dp->txid, buf, 8);
+	if (rv < 0)
+		return rv;
+
+	offset = 6;
+	sn = 1;
+	bs = stmin = 0;
+	while (offset < msg->len) {
+		rv = diag_l2_proto_can_waitfc(d_l2_conn, &bs, &stmin);
+		if (rv < 0)
+			return rv;
+
+		do {
+			n = MIN(7, msg->len - offset);
+			buf[0] = ISOTP_CF | sn;
+			memcpy(&buf[1], &msg->data[offset], (size_t)n);
+			sent = diag_os_getns();
+			rv = diag_l2_proto_can_txframe(d_l2_conn, dp->txid,
+				buf, 1 + n);
+			if (rv < 0)
+				return rv;
+			offset += n;
+			sn = (sn + 1) & 0x0F;
+
+			/*
+			 * The next CF is due STmin after this one went out,
+			 * an absolute deadline : the time spent sending this
+			 * one counts towards the gap.
+			 */
+			if (stmin && offset < msg->len)
+				diag_os_sleepuntil(sent +
+					(tstamp_type) stmin * 1000);
+		} while (offset < msg->len && (bs == 0 || --bs));
+	}
+
+	return 0;
+}
+
+/*
+ * Protocol receive routine
+ *
+ * Waits up to timeout for the first response, then collects responses
+ * until none has come for P2 (other ECUs may still be answering) and
+ * no segmented message is left half received
+ */
+static int
+diag_l2_proto_can_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
+{
+	struct diag_l2_can *dp = (struct diag_l2_can *)d_l2_conn->diag_l2_proto_data;
+	uint8_t frame[DIAG_L1_CAN_MAXFRAME];
+	tstamp_type deadline;
+	int rv, tout;
+
+	if (diag_l2_debug & DIAG_DEBUG_READ)
+		fprintf(stderr,
+			FLFMT "diag_l2_can_int_recv timeout %d\n",
+				FL, timeout);
+
+	deadline = diag_os_getns() + (tstamp_type)timeout * 1000000;
+
+	while (1) {
+		tout = (int) ((int64_t)(deadline - diag_os_getns()) / 1000000);
+		if (tout < 0)
+			tout = 0;
+
+		rv = diag_l1_recv(d_l2_conn->diag_link->diag_l2_dl0d, 0,
+			frame, sizeof(frame), tout);
+		if (rv == DIAG_ERR_TIMEOUT)
+			break;
+		if (rv < 0)
+			return rv;
+
+		if (diag_l2_proto_can_rxframe(d_l2_conn, frame, rv) == 0) {
+			if (tout == 0)
+				break;
+			continue;	/* Not ours, deadline stands */
+		}
+
+		if (dp->nrx)
+			tout = CAN_N_CR;
+		else if (d_l2_conn->diag_msgs.head)
+			tout = CAN_P2;
+		else
+			tout = timeout;
+		deadline = diag_os_getns() + (tstamp_type)tout * 1000000;
+	}
+
+	if (dp->nrx) {
+		if (diag_l2_debug & DIAG_DEBUG_READ)
+			fprintf(stderr, FLFMT "can: %d messages incomplete\n",
+				FL, dp->nrx);
+		diag_l2_proto_can_rxflush(dp);
+	}
+
+	if (d_l2_conn->diag_msgs.head == NULL)
+		return diag_iseterr(DIAG_ERR_TIMEOUT);
+
+	return 0;
+}
+
+static int
+diag_l2_proto_can_recv(struct diag_l2_conn *d_l2_conn, int timeout,
+	void (*callback)(void *handle, struct diag_msg *msg),
+	void *handle)
+{
+	int rv;
+	struct diag_msg	*tmsg;
+
+	rv = diag_l2_proto_can_int_recv(d_l2_conn, timeout);
+	if (rv < 0)	/* Failed */
+		return(rv);
+
+	if (diag_l2_debug & DIAG_DEBUG_READ)
+	{
+		fprintf(stderr, FLFMT "calling rcv callback %p handle %p msg %p\n",
+			FL, callback, handle, d_l2_conn->diag_msgs.head);
+	}
+
+	tmsg = diag_msglist_take(&d_l2_conn->diag_msgs);
+
+	/* Call used callback */
+	if (callback)
+		callback(handle, tmsg);
+
+	/* message no longer needed */
+	diag_freemsg(tmsg);
+
+	if (diag_l2_debug & DIAG_DEBUG_READ)
+		fprintf(stderr, FLFMT "rcv callback completed\n", FL);
+
+	return(0);
+}
+
+/*
+ * Send a request and wait for the response(s)
+ */
+static struct diag_msg *
+diag_l2_proto_can_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
+		int *errval)
+{
+	int rv;
+
+	/* First send the message */
+	rv = diag_l2_send(d_l2_conn, msg);
+	if (rv < 0)
+	{
+		*errval = rv;
+		return(NULL);
+	}
+
+	/* And now wait for a response; allow the adapter some slack over P2 */
+	rv = diag_l2_proto_can_int_recv(d_l2_conn, 2 * CAN_P2);
+	if (rv < 0)
+	{
+		*errval = rv;
+		return(NULL);
+	}
+
+	/* Return the message to user, who is responsible for freeing it */
+	return diag_msglist_take(&d_l2_conn->diag_msgs);
+}
 
 static const struct diag_l2_proto diag_l2_proto_can = {
-	DIAG_L2_PROT_CAN, 0,
-	NULL,
-	NULL,
+	DIAG_L2_PROT_CAN, DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_DATA_ONLY
+	| DIAG_L2_FLAG_DOESCKSUM | DIAG_L2_FLAG_CONNECTS_ALWAYS,
+	diag_l2_proto_can_startcomms,
+	diag_l2_proto_can_stopcomms,
+	diag_l2_proto_can_send,
+	diag_l2_proto_can_recv,
+	diag_l2_proto_can_request,
 	NULL,
 	NULL,
 	NULL,
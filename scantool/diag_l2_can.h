@@ -23,8 +23,8 @@
  *
  *************************************************************************
  *
- * CAN.  Not written, but put in its own file for modularity.  It used
- * to be inline in L2.
+ * CAN : ISO 15765-2 transport (ISO-TP) with ISO 15765-4 (OBD on CAN)
+ * addressing, 11 or 29 bit identifiers.
  *
  */
 
@@ -34,6 +34,15 @@ extern "C" {
 
 int diag_l2_can_add(void);
 
+/*
+ * Flow control we ask ECUs for when they send us segmented messages :
+ * BlockSize (consecutive frames between flow controls, 0 = no limit) and
+ * STmin (minimum gap between them, encoded as in ISO 15765-2). Read each
+ * time a flow control frame is sent.
+ */
+extern uint8_t diag_l2_can_bs;
+extern uint8_t diag_l2_can_stmin;
+
 #if defined(__cplusplus)
 }
 #endif
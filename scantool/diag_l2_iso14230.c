@@ -65,10 +65,24 @@ struct diag_l2_14230
 					out whether we see a CARB or normal
 					init */
 
-	uint8_t rxbuf[MAXRBUF];	/* Receive buffer, for building message in */
-	int rxoffset;		/* Offset to write into buffer */
+	tstamp_type rxstamp;	/* When rxbuf[0] was received */
+
+	unsigned int rxexpect;	/* Frames still owed by responsePending ECUs */
+
+	/* Receive framer, see diag_l2_proto_14230_rxstep() */
+	uint8_t rxstate;
+	uint8_t rxnoread;	/* Frame ends now, don't read */
+	uint8_t rxearly;	/* Ended when all rxwant ECUs answered */
+	int rxtimeout;		/* ST_STATE1 timeout, ms (< 0: none) */
+	unsigned int rxwant;	/* ECUs that make a complete response */
+	struct diag_l2_respclass *rxrc;
+	uint8_t *rxcopy;	/* Raw copy of the 1st frame for int_recv */
+	int *rxcopylen;
 };
 
+/* Largest frame: format, target, source, length, 255 data, checksum */
+#define ISO14230_MAXFRAME	(4 + 255 + 1)
+
 #define STATE_CLOSED	  0	/* Established comms */
 #define STATE_CONNECTING  1	/* Connecting */
 #define STATE_ESTABLISHED 2	/* Established */
@@ -190,186 +204,148 @@ diag_l2_proto_14230_decode(uint8_t *data, int len,
 }
 
 /*
- * Internal receive function (does all the message building, but doesn't
- * do call back, returns the complete message, hasn't removed checksum
- * and header info
- *
- * Data from the first message is put into *data, and len into *datalen
+ * Receive framer. It is a state machine driven from outside, so one
+ * thread can drive many links (see diag_l2_reactor_add()): rxstart arms
+ * it for a response, then rxstep is fed bytes as they are added to
+ * rxbuf, or told that diag_l2_rxdeadline has passed. The blocking
+ * int_recv below just loops around it.
  *
+ * ST_STATE1 waits for the first byte; ST_STATE2 is inside a frame, which
+ * ends after an interbyte gap; ST_STATE3 waits P2max for another frame.
  * If the L1 interface is clever (DOESL2FRAME), then each read will give
- * us a complete message, and we will wait a little bit longer than the normal
- * timeout to detect "end of all responses"
+ * us a complete message, and we will wait a little bit longer than the
+ * normal timeout to detect "end of all responses"
  */
-static int
-diag_l2_proto_14230_int_recv(struct diag_l2_conn *d_l2_conn, int timeout,
-	uint8_t *data, int *pDatalen)
-{
-	struct diag_l2_14230 *dp;
-	int rv, l1_doesl2frame, l1flags;
-	int tout;
-	int state;
-	struct diag_msg	*tmsg, *lastmsg;
-
 #define ST_STATE1	1	/* Start */
 #define ST_STATE2	2	/* Interbyte */
 #define ST_STATE3	3	/* Inter message */
 
-	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+/* Enter a receive state, and work out when it times out */
+static void
+diag_l2_proto_14230_rxstate(struct diag_l2_conn *d_l2_conn, int state)
+{
+	struct diag_l2_14230 *dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+	int l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
+	int tout;
 
-	if (diag_l2_debug & DIAG_DEBUG_READ)
-		fprintf(stderr,
-			FLFMT "diag_l2_14230_intrecv offset %x\n",
-				FL, dp->rxoffset);
+	dp->rxstate = (uint8_t) state;
+	switch (state) {
+	case ST_STATE2:
+		tout = d_l2_conn->diag_l2_p2min - 2;
+		if (tout < d_l2_conn->diag_l2_p1max)
+			tout = d_l2_conn->diag_l2_p1max;
+		break;
+	case ST_STATE3:
+		if (l1flags & DIAG_L1_DOESL2FRAME)
+			tout = 150;	/* Arbitrary, short, value ... */
+		else
+			tout = d_l2_conn->diag_l2_p2max;
+		break;
+	default:
+		tout = dp->rxtimeout;
+		break;
+	}
+
+	/*
+	 * In l1_doesl2frame mode, we get full frames, so a frame ends as
+	 * soon as it's in; same when the buffer is full
+	 */
+	dp->rxnoread = (state == ST_STATE2) && ((l1flags & DIAG_L1_DOESL2FRAME) ||
+		d_l2_conn->rxoffset >= (int)d_l2_conn->rxsize);
 
-	state = ST_STATE1;
-	tout = timeout;
+	if (dp->rxnoread)
+		d_l2_conn->diag_l2_rxdeadline = diag_os_getns();
+	else if (tout < 0)
+		d_l2_conn->diag_l2_rxdeadline = 0;	/* Monitoring, no end */
+	else
+		d_l2_conn->diag_l2_rxdeadline = diag_os_getns() +
+			(tstamp_type) tout * 1000000;
+}
+
+/*
+ * Arm the framer for a response within timeout ms (< 0 : wait forever)
+ */
+static int
+diag_l2_proto_14230_rxstart(struct diag_l2_conn *d_l2_conn, int timeout)
+{
+	struct diag_l2_14230 *dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+	int rv;
 
 	/* Clear out last received message if not done already */
-	if (d_l2_conn->diag_msg) {
-		diag_freemsg(d_l2_conn->diag_msg);
-		d_l2_conn->diag_msg = NULL;
-	}
+	diag_msglist_free(&d_l2_conn->diag_msgs);
+
+	/* How many ECUs usually answer this request, one frame each */
+	dp->rxrc = diag_l2_resp_take(d_l2_conn);
+	dp->rxwant = diag_l2_resp_expect(dp->rxrc);
+	if (dp->rxexpect)
+		dp->rxwant = dp->rxexpect;
+	dp->rxearly = 0;
 
-	l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
-	if (l1flags & (DIAG_L1_DOESL2FRAME|DIAG_L1_DOESP4WAIT)) {
-		if (timeout < 100)	/* Extend timeouts */
+	rv = diag_l2_rxbuf_get(d_l2_conn, ISO14230_MAXFRAME);
+	if (rv < 0)
+		return rv;
+
+	if (d_l2_conn->diag_link->diag_l2_l1flags &
+			(DIAG_L1_DOESL2FRAME|DIAG_L1_DOESP4WAIT)) {
+		if ((timeout >= 0) && (timeout < 100))	/* Extend timeouts */
 			timeout = 100;
 	}
-	if (l1flags & DIAG_L1_DOESL2FRAME)
-		l1_doesl2frame = 1;
-	else
-		l1_doesl2frame = 0;
-
-	while (1) {
-		switch (state) {
-		case ST_STATE1:
-			tout = timeout;
-			break;
-		case ST_STATE2:
-			tout = d_l2_conn->diag_l2_p2min - 2;
-			if (tout < d_l2_conn->diag_l2_p1max)
-				tout = d_l2_conn->diag_l2_p1max;
-			break;
-		case ST_STATE3:
-			if (l1_doesl2frame)
-				tout = 150;	/* Arbitrary, short, value ... */
-			else
-				tout = d_l2_conn->diag_l2_p2max;
-		}
+	dp->rxtimeout = timeout;
+	diag_l2_proto_14230_rxstate(d_l2_conn, ST_STATE1);
+	return 0;
+}
 
-		/* Receive data into the buffer */
-#if FULL_DEBUG
-		fprintf(stderr, FLFMT "before recv, state %d timeout %d, rxoffset %d\n",
-			FL, state, tout, dp->rxoffset);
-#endif
+/*
+ * Source address of a frame not decoded yet (0 without address bytes,
+ * as diag_l2_proto_14230_decode() gives).
+ */
+static int
+diag_l2_proto_14230_rawsrc(const struct diag_msg *m)
+{
+	if ((m->data[0] & 0x80) && (m->len >= 3))
+		return m->data[2];
+	return 0;
+}
 
-		/*
-		 * In l1_doesl2frame mode, we get full frames, so we don't
-		 * do the read in state2
-		 */
-		if ( (state == ST_STATE2) && l1_doesl2frame )
-			rv = DIAG_ERR_TIMEOUT;
-		else
-			rv = diag_l1_recv(d_l2_conn->diag_link->diag_l2_dl0d, 0,
-				&dp->rxbuf[dp->rxoffset],
-				sizeof(dp->rxbuf) - dp->rxoffset,
-				tout);
-#if FULL_DEBUG
-		fprintf(stderr,
-			FLFMT "after recv, rv %d rxoffset %d\n", FL, rv, dp->rxoffset);
-#endif
+/*
+ * How many ECUs the frames received so far come from; frames are still
+ * raw, with their headers.
+ */
+static unsigned int
+diag_l2_proto_14230_rxsrcs(const struct diag_msglist *ml)
+{
+	const struct diag_msg *m, *o;
+	unsigned int nsrc = 0;
 
-		if (rv == DIAG_ERR_TIMEOUT) {
-			/* Timeout, end of message, or end of responses */
-			switch (state) {
-			case ST_STATE1:
-				/*
-				 * 1st read, if we got 0 bytes, just return
-				 * the timeout error
-				 */
-				if (dp->rxoffset == 0)
-					break;
-				/*
-				 * Otherwise see if there are more bytes in
-				 * this message,
-				 */
-				state = ST_STATE2;
-				continue;
-			case ST_STATE2:
-				/*
-				 * End of that message, maybe more to come
-				 * Copy data into a message
-				 */
-				tmsg = diag_allocmsg((size_t)dp->rxoffset);
-				tmsg->len = dp->rxoffset;
-				memcpy(tmsg->data, dp->rxbuf, (size_t)dp->rxoffset);
-				(void)gettimeofday(&tmsg->rxtime, NULL);
-				dp->rxoffset = 0;
-				/*
-				 * ADD message to list
-				 */
-				diag_l2_addmsg(d_l2_conn, tmsg);
-				if (d_l2_conn->diag_msg == tmsg) {
-#if FULL_DEBUG
-					int i;
-					fprintf(stderr, FLFMT "Copying %d bytes to data\n",
-						FL, tmsg->len);
-					for (i=0; i<tmsg->len; i++)
-						fprintf(stderr, "0x%x ",tmsg->data[i]);
-					fprintf(stderr, "\n");
-#endif
-					/* 1st one */
-					if (data) {
-						memcpy(data, tmsg->data,
-							(size_t)tmsg->len);
-						*pDatalen = tmsg->len;
-					}
-				}
-				state = ST_STATE3;
-				continue;
-			case ST_STATE3:
-				/*
-				 * No more messages, but we did get one
-				 */
-				rv = d_l2_conn->diag_msg->len;
-				break;
-			}
-			if (state == ST_STATE3)
+	for (m = ml->head; m; m = m->next) {
+		for (o = ml->head; o != m; o = o->next)
+			if (diag_l2_proto_14230_rawsrc(o) ==
+					diag_l2_proto_14230_rawsrc(m))
 				break;
-		}
-		
-		if (rv<0)
-			break;
+		if (o == m)
+			nsrc++;
+	}
+	return nsrc;
+}
 
-		/* Data received OK */
-		dp->rxoffset += rv;
+/*
+ * Response over (rv >= 0) or failed : check the messages that we have,
+ * stripping off headers etc. Returns the number of frames, or error.
+ */
+static int
+diag_l2_proto_14230_rxdone(struct diag_l2_conn *d_l2_conn, int rv)
+{
+	struct diag_l2_14230 *dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+	int l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
+	struct diag_msg	*tmsg, *lastmsg;
 
-		if (dp->rxoffset && (dp->rxbuf[0] == '\0')) {
-			/*
-			 * We get this when in
-			 * monitor mode and there is
-			 * a fastinit, pretend it didn't exist
-			 */
-			dp->rxoffset--;
-			if (dp->rxoffset)
-				memcpy(&dp->rxbuf[0], &dp->rxbuf[1],
-					(size_t)dp->rxoffset);
-			continue;
-		}
-		if ( (state == ST_STATE1) || (state == ST_STATE3) ) {
-			/*
-			 * Got some data in state1/3, now we're in a message
-			 */
-			state = ST_STATE2;
-		}
-	}
+	/* Frames are all in messages now, the buffer can go back */
+	diag_l2_rxbuf_put(d_l2_conn);
+	dp->rxstate = 0;
+	d_l2_conn->diag_l2_rxdeadline = 0;
 
-	/*
-	 * Now check the messages that we have checksum etc, stripping
-	 * off headers etc
-	 */
 	if (rv >= 0) {
-		tmsg = d_l2_conn->diag_msg;
+		tmsg = d_l2_conn->diag_msgs.head;
 		lastmsg = NULL;
 
 		while (tmsg) {
@@ -379,7 +355,6 @@ diag_l2_proto_14230_int_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 			 * We have the message with the header etc, we
 			 * need to strip the header and checksum
 			 */
-			dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
 			rv = diag_l2_proto_14230_decode( tmsg->data,
 				tmsg->len,
 				&hdrlen, &datalen, &source, &dest,
@@ -393,7 +368,7 @@ diag_l2_proto_14230_int_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 			 * we have misframed this message and it is infact
 			 * more than one message, so see if we can decode it
 			 */
-			if ((l1_doesl2frame == 0) && (rv < tmsg->len)) {
+			if (((l1flags & DIAG_L1_DOESL2FRAME) == 0) && (rv < tmsg->len)) {
 				/*
 				 * This message contains more than one	
 				 * data frame (because it arrived with
@@ -402,17 +377,13 @@ diag_l2_proto_14230_int_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 				 * things ....
 				 */
 				struct diag_msg	*amsg;
-				amsg = diag_dupsinglemsg(tmsg);
+				amsg = diag_msg_retain(tmsg);
 				amsg->len = rv;
 				tmsg->len -=rv;
 				tmsg->data += rv;
 
 				/*  Insert new amsg before old msg */
-				amsg->next = tmsg;
-				if (lastmsg == NULL)
-					d_l2_conn->diag_msg = amsg;
-				else
-					lastmsg->next = amsg;
+				diag_msglist_insert(&d_l2_conn->diag_msgs, lastmsg, amsg);
 
 				tmsg = amsg; /* Finish processing this one */
 			}
@@ -449,7 +420,169 @@ diag_l2_proto_14230_int_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 			lastmsg = tmsg;
 			tmsg = tmsg->next;
 		}
+		rv = (int) d_l2_conn->diag_msgs.cnt;
 	}
+	if (rv >= 0)
+		d_l2_conn->diag_l2_rxdone = diag_os_getns();	/* For P3 */
+	diag_l2_resp_learn(dp->rxrc, (rv >= 0) ? &d_l2_conn->diag_msgs : NULL,
+		dp->rxearly);
+	dp->rxrc = NULL;
+	return rv;
+}
+
+/*
+ * Advance the framer : len bytes were just added at rxbuf[rxoffset], or
+ * with len == 0, diag_l2_rxdeadline has passed. Returns 0 while the
+ * response is incomplete, else what rxdone() returns.
+ */
+static int
+diag_l2_proto_14230_rxstep(struct diag_l2_conn *d_l2_conn, int len)
+{
+	struct diag_l2_14230 *dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+	struct diag_msg	*tmsg;
+
+	if (len > 0) {
+		/* Data received OK */
+		if (d_l2_conn->rxoffset == 0)
+			dp->rxstamp = diag_l0_rxstamp(d_l2_conn->diag_link->diag_l2_dl0d);
+		d_l2_conn->rxoffset += len;
+
+		if (d_l2_conn->rxbuf[0] == '\0') {
+			/*
+			 * We get this when in
+			 * monitor mode and there is
+			 * a fastinit, pretend it didn't exist
+			 */
+			d_l2_conn->rxoffset--;
+			if (d_l2_conn->rxoffset)
+				memmove(&d_l2_conn->rxbuf[0], &d_l2_conn->rxbuf[1],
+					(size_t)d_l2_conn->rxoffset);
+			diag_l2_proto_14230_rxstate(d_l2_conn, dp->rxstate);
+			return 0;
+		}
+		/* Now we're in a message (or still are) */
+		diag_l2_proto_14230_rxstate(d_l2_conn, ST_STATE2);
+		return 0;
+	}
+
+	/* Timeout, end of message, or end of responses */
+	switch (dp->rxstate) {
+	case ST_STATE1:
+		/*
+		 * 1st read, if we got 0 bytes, just return
+		 * the timeout error
+		 */
+		if (d_l2_conn->rxoffset == 0)
+			return diag_l2_proto_14230_rxdone(d_l2_conn,
+				diag_iseterr(DIAG_ERR_TIMEOUT));
+		/*
+		 * Otherwise see if there are more bytes in
+		 * this message,
+		 */
+		diag_l2_proto_14230_rxstate(d_l2_conn, ST_STATE2);
+		return 0;
+	case ST_STATE2:
+		/*
+		 * End of that message, maybe more to come
+		 * Copy data into a message
+		 */
+		tmsg = diag_allocmsg((size_t)d_l2_conn->rxoffset);
+		if (tmsg == NULL)
+			return diag_l2_proto_14230_rxdone(d_l2_conn,
+				diag_iseterr(DIAG_ERR_NOMEM));
+		tmsg->len = d_l2_conn->rxoffset;
+		memcpy(tmsg->data, d_l2_conn->rxbuf, (size_t)d_l2_conn->rxoffset);
+		tmsg->rxtime = dp->rxstamp;
+		d_l2_conn->rxoffset = 0;
+		/*
+		 * ADD message to list
+		 */
+		diag_l2_addmsg(d_l2_conn, tmsg);
+		if ((d_l2_conn->diag_msgs.head == tmsg) && dp->rxcopy) {
+			/* 1st one, raw, for int_recv's caller */
+			memcpy(dp->rxcopy, tmsg->data, (size_t)tmsg->len);
+			*dp->rxcopylen = tmsg->len;
+		}
+		if (dp->rxwant && diag_l2_proto_14230_rxsrcs(
+				&d_l2_conn->diag_msgs) >= dp->rxwant) {
+			/*
+			 * Everybody who usually answers has,
+			 * don't wait out the idle time
+			 */
+			if (diag_l2_debug & DIAG_DEBUG_READ)
+				fprintf(stderr, FLFMT "all %u responses in\n",
+					FL, dp->rxwant);
+			dp->rxearly = 1;
+			return diag_l2_proto_14230_rxdone(d_l2_conn, 0);
+		}
+		diag_l2_proto_14230_rxstate(d_l2_conn, ST_STATE3);
+		return 0;
+	default:
+		/*
+		 * No more messages, but we did get one
+		 */
+		return diag_l2_proto_14230_rxdone(d_l2_conn, 0);
+	}
+}
+
+/*
+ * Internal receive function (does all the message building, but doesn't
+ * do call back), blocking until the response is complete or timeout.
+ *
+ * Data from the first message is put into *data, and len into *datalen,
+ * with header and checksum; the messages in diag_msgs have them stripped.
+ */
+static int
+diag_l2_proto_14230_int_recv(struct diag_l2_conn *d_l2_conn, int timeout,
+	uint8_t *data, int *pDatalen)
+{
+	struct diag_l2_14230 *dp;
+	tstamp_type now;
+	int rv, tout;
+
+	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
+
+	if (diag_l2_debug & DIAG_DEBUG_READ)
+		fprintf(stderr,
+			FLFMT "diag_l2_14230_intrecv offset %x\n",
+				FL, d_l2_conn->rxoffset);
+
+	if (timeout < 0)
+		timeout = 0;
+	rv = diag_l2_proto_14230_rxstart(d_l2_conn, timeout);
+	if (rv < 0)
+		return rv;
+	dp->rxcopy = data;
+	dp->rxcopylen = pDatalen;
+
+	do {
+		if (dp->rxnoread) {
+			rv = diag_l2_proto_14230_rxstep(d_l2_conn, 0);
+			continue;
+		}
+
+		now = diag_os_getns();
+		tout = 0;
+		if (d_l2_conn->diag_l2_rxdeadline > now)
+			tout = (int) ((d_l2_conn->diag_l2_rxdeadline - now + 999999) / 1000000);
+#if FULL_DEBUG
+		fprintf(stderr, FLFMT "before recv, state %d timeout %d, rxoffset %d\n",
+			FL, dp->rxstate, tout, d_l2_conn->rxoffset);
+#endif
+		rv = diag_l1_recv(d_l2_conn->diag_link->diag_l2_dl0d, 0,
+			&d_l2_conn->rxbuf[d_l2_conn->rxoffset],
+			d_l2_conn->rxsize - d_l2_conn->rxoffset,
+			tout);
+
+		if (rv == DIAG_ERR_TIMEOUT)
+			rv = diag_l2_proto_14230_rxstep(d_l2_conn, 0);
+		else if (rv < 0)
+			rv = diag_l2_proto_14230_rxdone(d_l2_conn, rv);
+		else if (rv > 0)
+			rv = diag_l2_proto_14230_rxstep(d_l2_conn, rv);
+	} while (rv == 0);
+
+	dp->rxcopy = NULL;
 	return rv;
 }
 
@@ -797,7 +930,7 @@ diag_l2_proto_14230_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 
 	/* Wait p3min milliseconds, but not if doing fast/slow init */
 	if (dp->state == STATE_ESTABLISHED)
-		diag_os_millisleep(d_l2_conn->diag_l2_p3min);
+		diag_l2_p3wait(d_l2_conn);
 
 	rv = diag_l1_send (d_l2_conn->diag_link->diag_l2_dl0d, 0,
 		buf, len, d_l2_conn->diag_l2_p4min);
@@ -845,11 +978,10 @@ diag_l2_proto_14230_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	 * Call user callback routine
 	 */
 	if (callback)
-		callback(handle, d_l2_conn->diag_msg);
+		callback(handle, d_l2_conn->diag_msgs.head);
 
 	/* No longer needed */
-	diag_freemsg(d_l2_conn->diag_msg);
-	d_l2_conn->diag_msg = NULL;
+	diag_msglist_free(&d_l2_conn->diag_msgs);
 
 	if (diag_l2_debug & DIAG_DEBUG_READ)
 		fprintf(stderr, FLFMT "rcv callback completed\n", FL);
@@ -857,12 +989,31 @@ diag_l2_proto_14230_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	return 0;
 }
 
+/*
+ * Send a request and collect the final responses.
+ *
+ * An ECU that needs more time answers requestCorrectlyReceived-
+ * ResponsePending (7F xx 78), possibly several times; its final answer
+ * then comes within P2*max of the last one, instead of P2max. We keep
+ * waiting, in P2* windows, only for the ECUs that said so, and stop as
+ * soon as the last of them has answered. Those pending frames keep the
+ * link busy, so the keepalive is pushed back for each of them.
+ *
+ * busyRepeatRequest (7F xx 21) makes us send the request again; other
+ * negative responses are final, and handed back like any other answer.
+ */
 static struct diag_msg *
 diag_l2_proto_14230_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 		int *errval)
 {
-	int rv;
-	struct diag_msg *rmsg = NULL;
+	int rv, timeout;
+	struct diag_l2_14230 *dp;
+	struct diag_msglist final;
+	struct diag_msg *rmsg, *m;
+	uint8_t pending[256];
+	unsigned int npending;
+
+	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
 
 	rv = diag_l2_send(d_l2_conn, msg);
 	if (rv < 0) {
@@ -870,11 +1021,20 @@ diag_l2_proto_14230_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg
 		return (struct diag_msg *)diag_pseterr(rv);
 	}
 
+	memset(&final, 0, sizeof(final));
+	memset(pending, 0, sizeof(pending));
+	npending = 0;
+	timeout = d_l2_conn->diag_l2_p2max + 10;
+
 	while (1) {
-		rv = diag_l2_proto_14230_int_recv(d_l2_conn,
-			d_l2_conn->diag_l2_p2max + 10, NULL, NULL);
+		/* Only the ECUs still owing an answer, if we know who */
+		dp->rxexpect = npending;
+		rv = diag_l2_proto_14230_int_recv(d_l2_conn, timeout, NULL, NULL);
+		dp->rxexpect = 0;
 
 		if (rv < 0) {
+			if (final.head)
+				break;	/* Some ECU went quiet, keep what we have */
 			*errval = DIAG_ERR_TIMEOUT;
 			return (struct diag_msg *)diag_pseterr(rv);
 		}
@@ -883,41 +1043,66 @@ diag_l2_proto_14230_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg
 		 * The connection now has the received message data
 		 * stored, remove it and deal with it
 		 */
-		rmsg = d_l2_conn->diag_msg;
-		d_l2_conn->diag_msg = NULL;
-
-		/* Got a Error message */
-		if (rmsg->data[0] == DIAG_KW2K_RC_NR) {
-			if (rmsg->data[2] == DIAG_KW2K_RC_B_RR) {
-				/*
-				 * Msg is busyRepeatRequest
-				 * So do a send again
-				 */
+		rmsg = diag_msglist_take(&d_l2_conn->diag_msgs);
+		while (rmsg) {
+			m = rmsg;
+			rmsg = m->next;
+			m->next = NULL;
+
+			if (m->len >= 3 && m->data[0] == DIAG_KW2K_RC_NR &&
+					m->data[2] == DIAG_KW2K_RC_RCR_RP) {
+				/* responsePending: more to come from this one */
+				if (!pending[m->src]) {
+					pending[m->src] = 1;
+					npending++;
+				}
+				diag_l2_kastamp(d_l2_conn, m->rxtime);
+				diag_freemsg(m);
+				continue;
+			}
+			if (m->len >= 3 && m->data[0] == DIAG_KW2K_RC_NR &&
+					m->data[2] == DIAG_KW2K_RC_B_RR &&
+					final.head == NULL && npending == 0) {
+				/* Msg is busyRepeatRequest, so send again */
+				diag_freemsg(m);
+				if (rmsg)
+					diag_freemsg(rmsg);
+				rmsg = NULL;
 				rv = diag_l2_send(d_l2_conn, msg);
 				if (rv < 0) {
 					*errval = rv;
 					return (struct diag_msg *)diag_pseterr(rv);
 				}
-				diag_freemsg(rmsg);
-				continue;
+				break;
 			}
-
-			if (rmsg->data[2] == DIAG_KW2K_RC_RCR_RP) {
-				/*
-				 * Msg is a requestCorrectlyRcvd-RspPending
-				 * so do read again
-				 */
-				diag_freemsg(rmsg);
-				continue;
+			/* A final answer, positive or not */
+			if (pending[m->src]) {
+				pending[m->src] = 0;
+				npending--;
 			}
-			/* Some other type of error */
-		} else {
-			/* Success */
+			diag_msglist_append(&final, m);
+		}
+
+		if (final.head && npending == 0)
 			break;
+
+		if (npending) {
+			if (diag_l2_debug & DIAG_DEBUG_PROTO)
+				fprintf(stderr, FLFMT "%u ECU(s) pending, "
+					"waiting up to P2*max %u ms\n",
+					FL, npending, d_l2_conn->diag_l2_p2emax);
+			timeout = d_l2_conn->diag_l2_p2emax;
+		} else {
+			timeout = d_l2_conn->diag_l2_p2max + 10;
 		}
 	}
+
+	if (diag_l2_debug & DIAG_DEBUG_PROTO)
+		fprintf(stderr, FLFMT "request done, %u answer(s)%s\n", FL,
+			final.cnt, npending ? ", some ECUs never answered" : "");
+
 	/* Return the message to user, who is responsible for freeing it */
-	return rmsg;
+	return diag_msglist_take(&final);
 }
 
 /*
@@ -934,7 +1119,6 @@ diag_l2_proto_14230_timeout(struct diag_l2_conn *d_l2_conn)
 
 	dp = (struct diag_l2_14230 *)d_l2_conn->diag_l2_proto_data;
 
-	/* XXX fprintf not async-signal-safe */
 	if (diag_l2_debug & DIAG_DEBUG_TIMER) {
 		fprintf(stderr, FLFMT "timeout impending for %p type %d\n",
 				FL, d_l2_conn, dp->type);
@@ -977,6 +1161,193 @@ diag_l2_proto_14230_timeout(struct diag_l2_conn *d_l2_conn)
 	}
 	(void)diag_l2_recv(d_l2_conn, timeout, NULL, NULL);
 }
+
+/*
+ * AccessTimingParameters (SID 0x83). The timing bytes are P2min, P2max,
+ * P3min, P3max, P4min; the min values count 0.5 ms, P2max 25 ms (over
+ * 0xF0 the low nibble counts 256 * 25 ms) and P3max 250 ms.
+ */
+#define ATP_TPI_LIMITS	0x00	/* Read limits of possible timing */
+#define ATP_TPI_DEFAULT	0x01	/* Set timing to the default values */
+#define ATP_TPI_SET	0x03	/* Set timing to the given values */
+
+#define ATP_P2MIN	0
+#define ATP_P2MAX	1
+#define ATP_P3MIN	2
+#define ATP_P3MAX	3
+#define ATP_P4MIN	4
+#define ATP_NPARAM	5
+
+static uint16_t
+diag_l2_proto_14230_atp_halfms(uint8_t b)
+{
+	return (uint16_t)((b + 1) / 2);	/* Round up, these are minimums */
+}
+
+/* P2max in ms, 0 if the byte is 0 or one of the reserved values */
+static uint16_t
+diag_l2_proto_14230_atp_p2max(uint8_t b)
+{
+	if (b <= 0xF0)
+		return (uint16_t)(b * 25);
+	if ((b & 0x0F) > 10)
+		return 0;
+	return (uint16_t)((b & 0x0F) * 256 * 25);
+}
+
+static void
+diag_l2_proto_14230_atp_defaults(struct diag_l2_conn *d_l2_conn)
+{
+	d_l2_conn->diag_l2_p2min = ISO_14230_TIM_MIN_P2;
+	d_l2_conn->diag_l2_p2max = ISO_14230_TIM_MAX_P2;
+	d_l2_conn->diag_l2_p3min = ISO_14230_TIM_MIN_P3;
+	d_l2_conn->diag_l2_p3max = ISO_14230_TIM_MAX_P3;
+	d_l2_conn->diag_l2_p4min = ISO_14230_TIM_MIN_P4;
+}
+
+/*
+ * Send an ATP request and return the responses, or NULL if there were
+ * none or any ECU refused
+ */
+static struct diag_msg *
+diag_l2_proto_14230_atp_rqst(struct diag_l2_conn *d_l2_conn, uint8_t tpi,
+	const uint8_t *param, int *errval)
+{
+	struct diag_msg msg, *rmsg, *m;
+	uint8_t data[2 + ATP_NPARAM];
+
+	memset(&msg, 0, sizeof(msg));
+	msg.data = data;
+	data[0] = DIAG_KW2K_SI_ATP;
+	data[1] = tpi;
+	msg.len = 2;
+	if (param) {
+		memcpy(&data[2], param, ATP_NPARAM);
+		msg.len += ATP_NPARAM;
+	}
+
+	rmsg = diag_l2_request(d_l2_conn, &msg, errval);
+	if (rmsg == NULL)
+		return NULL;
+
+	for (m = rmsg; m; m = m->next) {
+		if (m->len < 2 || m->data[0] != DIAG_KW2K_RC_ATPPR ||
+				m->data[1] != tpi ||
+				(tpi == ATP_TPI_LIMITS && m->len < 2 + ATP_NPARAM)) {
+			if (diag_l2_debug & DIAG_DEBUG_PROTO)
+				fprintf(stderr, FLFMT "atp 0x%02X refused by 0x%02X\n",
+					FL, tpi, m->src);
+			diag_freemsg(rmsg);
+			*errval = DIAG_ERR_ECUSAIDNO;
+			return NULL;
+		}
+	}
+	return rmsg;
+}
+
+static int
+diag_l2_proto_14230_atp(struct diag_l2_conn *d_l2_conn, int mode)
+{
+	struct diag_msg *rmsg, *m;
+	uint8_t p[ATP_NPARAM];
+	uint16_t p3max;
+	int i, errval = 0;
+
+	if (mode == DIAG_L2_ATP_DEFAULT) {
+		rmsg = diag_l2_proto_14230_atp_rqst(d_l2_conn, ATP_TPI_DEFAULT,
+			NULL, &errval);
+		if (rmsg == NULL)
+			return diag_iseterr(errval);
+		diag_freemsg(rmsg);
+		diag_l2_proto_14230_atp_defaults(d_l2_conn);
+		return 0;
+	}
+
+	rmsg = diag_l2_proto_14230_atp_rqst(d_l2_conn, ATP_TPI_LIMITS, NULL,
+		&errval);
+	if (rmsg == NULL)
+		return diag_iseterr(errval);
+
+	for (m = rmsg; m; m = m->next) {
+		if (diag_l2_proto_14230_atp_p2max(m->data[2 + ATP_P2MAX]) == 0) {
+			if (diag_l2_debug & DIAG_DEBUG_PROTO)
+				fprintf(stderr, FLFMT "atp: bad P2max 0x%02X from 0x%02X\n",
+					FL, m->data[2 + ATP_P2MAX], m->src);
+			diag_freemsg(rmsg);
+			return diag_iseterr(DIAG_ERR_BADDATA);
+		}
+	}
+
+	/* With several ECUs answering, take what suits all of them */
+	memcpy(p, &rmsg->data[2], ATP_NPARAM);
+	for (m = rmsg->next; m; m = m->next) {
+		for (i = 0; i < ATP_NPARAM; i++) {
+			if (i == ATP_P3MAX) {
+				if (m->data[2 + i] < p[i])
+					p[i] = m->data[2 + i];
+			} else if (i == ATP_P2MAX) {
+				if (diag_l2_proto_14230_atp_p2max(m->data[2 + i]) >
+						diag_l2_proto_14230_atp_p2max(p[i]))
+					p[i] = m->data[2 + i];
+			} else if (m->data[2 + i] > p[i]) {
+				p[i] = m->data[2 + i];
+			}
+		}
+	}
+	diag_freemsg(rmsg);
+
+	/*
+	 * Don't start the next request before every ECU could have
+	 * answered the last one, and keep P3max (the keepalive period):
+	 * shortening it buys nothing. P3min can't go past 127.5ms; with a
+	 * longer P2max, stay on the current timing.
+	 */
+	if (diag_l2_proto_14230_atp_halfms(p[ATP_P3MIN]) <
+			diag_l2_proto_14230_atp_p2max(p[ATP_P2MAX])) {
+		i = diag_l2_proto_14230_atp_p2max(p[ATP_P2MAX]) * 2;
+		if (i > 0xFF) {
+			if (diag_l2_debug & DIAG_DEBUG_PROTO)
+				fprintf(stderr, FLFMT "atp: P2max %dms > max P3min, "
+					"timing left alone\n", FL, i / 2);
+			return diag_iseterr(DIAG_ERR_BADDATA);
+		}
+		p[ATP_P3MIN] = (uint8_t)i;
+	}
+	p3max = d_l2_conn->diag_l2_p3max / 250;
+	if (p3max < p[ATP_P3MAX])
+		p[ATP_P3MAX] = (uint8_t)p3max;
+
+	if (p[ATP_P3MAX] == 0)
+		return diag_iseterr(DIAG_ERR_BADDATA);
+
+	rmsg = diag_l2_proto_14230_atp_rqst(d_l2_conn, ATP_TPI_SET, p, &errval);
+	if (rmsg == NULL) {
+		if (errval != DIAG_ERR_ECUSAIDNO) {
+			/*
+			 * Lost the answer, the ECU may be on the new timing
+			 * already: put both sides back on the defaults.
+			 */
+			rmsg = diag_l2_proto_14230_atp_rqst(d_l2_conn,
+				ATP_TPI_DEFAULT, NULL, &i);
+			if (rmsg) {
+				diag_freemsg(rmsg);
+				diag_l2_proto_14230_atp_defaults(d_l2_conn);
+			}
+		}
+		return diag_iseterr(errval);
+	}
+	diag_freemsg(rmsg);
+
+	/* Accepted, it applies from the next request on */
+	d_l2_conn->diag_l2_p2min = diag_l2_proto_14230_atp_halfms(p[ATP_P2MIN]);
+	d_l2_conn->diag_l2_p2max = diag_l2_proto_14230_atp_p2max(p[ATP_P2MAX]);
+	d_l2_conn->diag_l2_p3min = diag_l2_proto_14230_atp_halfms(p[ATP_P3MIN]);
+	d_l2_conn->diag_l2_p3max = (uint16_t)(p[ATP_P3MAX] * 250);
+	d_l2_conn->diag_l2_p4min = diag_l2_proto_14230_atp_halfms(p[ATP_P4MIN]);
+
+	return 0;
+}
+
 static const struct diag_l2_proto diag_l2_proto_14230 = {
 	DIAG_L2_PROT_ISO14230, DIAG_L2_FLAG_FRAMED | DIAG_L2_FLAG_DATA_ONLY
 	| DIAG_L2_FLAG_KEEPALIVE | DIAG_L2_FLAG_DOESCKSUM,
@@ -985,7 +1356,10 @@ static const struct diag_l2_proto diag_l2_proto_14230 = {
 	diag_l2_proto_14230_send,
 	diag_l2_proto_14230_recv,
 	diag_l2_proto_14230_request,
-	diag_l2_proto_14230_timeout
+	diag_l2_proto_14230_timeout,
+	diag_l2_proto_14230_atp,
+	diag_l2_proto_14230_rxstart,
+	diag_l2_proto_14230_rxstep
 };
 
 int diag_l2_14230_add(void) {
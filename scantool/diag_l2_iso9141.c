@@ -328,179 +328,164 @@ diag_l2_proto_iso9141_decode(uint8_t *data, int len,
  * Multiple ECUS may send responses to one request.
  * The end of all responses is marked by p3max timeout, but since that is very
  * long (5 seconds), we're using p3min (55ms).
+ *
+ * Like the ISO14230 one, the receive framer is a state machine driven from
+ * outside, so one thread can drive many links (see diag_l2_reactor_add()):
+ * rxstart arms it for a response, then rxstep is fed bytes as they are
+ * added to rxbuf, or told that diag_l2_rxdeadline has passed. The blocking
+ * int_recv below just loops around it.
+ *
+ * Message read cycle: byte-per-byte for passive interfaces,
+ * frame-per-frame for smart interfaces (DOESL2FRAME).
+ * ISO-9141-2 says:
+ * 	Inter-byte gap in a frame < p1max
+ *	Inter-frame gap < p2max
+ * We are a bit more flexible than that, see below.
+ * Frames get acumulated in the protocol structure list.
  */
-int
-diag_l2_proto_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
-{
-	int rv, l1_doesl2frame, l1flags;
-	int tout = 0;
-	int state;
-	struct diag_l2_iso9141 *dp;
-	struct diag_msg *tmsg, *lastmsg;
-
 #define ST_STATE1 1 // Start - wait for a frame.
 #define ST_STATE2 2 // In frame - wait for more bytes.
 #define ST_STATE3 3 // End of frame - wait for more frames.
 
-	if (diag_l2_debug & DIAG_DEBUG_READ)
-		fprintf(stderr,
-			FLFMT "diag_l2_iso9141_int_recv offset %x\n",
-			FL, d_l2_conn->rxoffset);
-
-	state = ST_STATE1;
-	dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
+// Enter a receive state, and work out when it times out.
+static void
+diag_l2_proto_iso9141_rxstate(struct diag_l2_conn *d_l2_conn, int state)
+{
+	struct diag_l2_iso9141 *dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
+	int l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
+	int tout;
 
-	// Clear out last received message if not done already.
-	if (d_l2_conn->diag_msg)
+	dp->rxstate = (uint8_t) state;
+	switch(state)
 	{
-		diag_freemsg(d_l2_conn->diag_msg);
-		d_l2_conn->diag_msg = NULL;
+		case ST_STATE2:
+			// Inter-byte timeout within a frame.
+			// ISO says p1max is the maximum, but in fact
+			// we give ourselves up to p2min minus a little bit.
+			tout = d_l2_conn->diag_l2_p2min - 2;
+			if (tout < d_l2_conn->diag_l2_p1max)
+				tout = d_l2_conn->diag_l2_p1max;
+			break;
+
+		case ST_STATE3:
+			// This is the timeout waiting for any more
+			// responses from the ECU. ISO says min is p3max
+			// but we'll cut it short at p3min.
+			// Aditionaly, for "smart" interfaces, we expand
+			// the timeout to let them process the data.
+			tout = d_l2_conn->diag_l2_p3min;
+			if (l1flags & DIAG_L1_DOESL2FRAME)
+				tout += SMART_TIMEOUT;
+			break;
+
+		default:
+			// Ready for first byte, use timeout
+			// specified by user.
+			tout = dp->rxtimeout;
+			break;
 	}
 
-	// Check if L1 device does L2 framing:
-	l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
-	l1_doesl2frame = (l1flags & DIAG_L1_DOESL2FRAME);
-	if ( l1flags & ( DIAG_L1_DOESL2FRAME | DIAG_L1_DOESP4WAIT ) )
+	// If L0/L1 does L2 framing, we get full frames, so we don't
+	// need to do the read byte-per-byte (skip state2); same if
+	// the buffer is full:
+	dp->rxnoread = (state == ST_STATE2) && ((l1flags & DIAG_L1_DOESL2FRAME) ||
+		d_l2_conn->rxoffset >= (int)d_l2_conn->rxsize);
+
+	if (dp->rxnoread)
+		d_l2_conn->diag_l2_rxdeadline = diag_os_getns();
+	else if (tout < 0)
+		d_l2_conn->diag_l2_rxdeadline = 0;	// Monitoring, no end.
+	else
+		d_l2_conn->diag_l2_rxdeadline = diag_os_getns() +
+			(tstamp_type) tout * 1000000;
+}
+
+// Arm the framer for a response within timeout ms (< 0 : wait forever).
+static int
+diag_l2_proto_iso9141_rxstart(struct diag_l2_conn *d_l2_conn, int timeout)
+{
+	struct diag_l2_iso9141 *dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
+	int rv;
+
+	// Clear out last received message if not done already.
+	diag_msglist_free(&d_l2_conn->diag_msgs);
+
+	// How many ECUs usually answer this request, one frame each.
+	dp->rxrc = diag_l2_resp_take(d_l2_conn);
+	dp->rxwant = diag_l2_resp_expect(dp->rxrc);
+	dp->rxearly = 0;
+
+	// Borrow a frame buffer from the link while we receive.
+	rv = diag_l2_rxbuf_get(d_l2_conn, MAXLEN_ISO9141);
+	if (rv < 0)
+		return rv;
+
+	if (d_l2_conn->diag_link->diag_l2_l1flags &
+			(DIAG_L1_DOESL2FRAME | DIAG_L1_DOESP4WAIT))
 	{
 		// Extend timeouts for the "smart" interfaces:
-		if (timeout < SMART_TIMEOUT)
+		if ((timeout >= 0) && (timeout < SMART_TIMEOUT))
 			timeout = SMART_TIMEOUT;
 	}
+	dp->rxtimeout = timeout;
+	diag_l2_proto_iso9141_rxstate(d_l2_conn, ST_STATE1);
+	return 0;
+}
 
-	// Message read cycle: byte-per-byte for passive interfaces,
-	// frame-per-frame for smart interfaces (DOESL2FRAME).
-	// ISO-9141-2 says:
-	// 	Inter-byte gap in a frame < p1max
-	//	Inter-frame gap < p2max
-	// We are a bit more flexible than that, see below.
-	// Frames get acumulated in the protocol structure list.
-	while (1)
-	{
-		switch(state)
-		{
-			case ST_STATE1:
-				// Ready for first byte, use timeout
-				// specified by user.
-				tout = timeout;
-				break;
-
-			case ST_STATE2:
-				// Inter-byte timeout within a frame.
-				// ISO says p1max is the maximum, but in fact
-				// we give ourselves up to p2min minus a little bit.
-				tout = d_l2_conn->diag_l2_p2min - 2;
-				if (tout < d_l2_conn->diag_l2_p1max)
-				tout = d_l2_conn->diag_l2_p1max;
-				break;
+// How many ECUs the frames received so far come from. They are still
+// raw: the source is in the header, unless L1 strips it (DOESL2FRAME),
+// in which case they all count as one, as in rxdone().
+static unsigned int
+diag_l2_proto_iso9141_rxsrcs(struct diag_l2_conn *d_l2_conn)
+{
+	const struct diag_msg *m, *o;
+	unsigned int nsrc = 0;
+	int src, osrc;
 
-			case ST_STATE3:
-				// This is the timeout waiting for any more
-				// responses from the ECU. ISO says min is p3max
-				// but we'll cut it short at p3min.
-				// Aditionaly, for "smart" interfaces, we expand
-				// the timeout to let them process the data.
-				tout = d_l2_conn->diag_l2_p3min;
-				if (l1_doesl2frame)
-				tout += SMART_TIMEOUT;
-		}
+	if (d_l2_conn->diag_link->diag_l2_l1flags & DIAG_L1_DOESL2FRAME)
+		return d_l2_conn->diag_msgs.head ? 1 : 0;
 
-		// If L0/L1 does L2 framing, we get full frames, so we don't
-		// need to do the read byte-per-byte (skip state2):
-		if ( (state == ST_STATE2) && l1_doesl2frame )
-			rv = DIAG_ERR_TIMEOUT;
-		else
-			// Receive data into the buffer:
-			rv = diag_l1_recv (d_l2_conn->diag_link->diag_l2_dl0d, 0,
-					&dp->rxbuf[dp->rxoffset],
-					MAXLEN_ISO9141 - dp->rxoffset,
-					tout);
-			
-		// Timeout = end of message or end of responses.
-		if (rv == DIAG_ERR_TIMEOUT)
+	for (m = d_l2_conn->diag_msgs.head; m; m = m->next)
+	{
+		src = (m->len >= 3) ? m->data[2] : -1;
+		for (o = d_l2_conn->diag_msgs.head; o != m; o = o->next)
 		{
-			switch (state)
-			{
-				case ST_STATE1:
-					// If we got 0 bytes on the 1st read,
-					// just return the timeout error.
-					if (dp->rxoffset == 0)
-						break;
-
-					// Otherwise try to read more bytes into
-					// this message.
-					state = ST_STATE2;
-					continue;
-
-				case ST_STATE2:
-					// End of that message, maybe more to come;
-					// Copy data into a message.
-					tmsg = diag_allocmsg((size_t)dp->rxoffset);
-					tmsg->len = dp->rxoffset;
-					tmsg->fmt |= DIAG_FMT_FRAMED ;
-					memcpy(tmsg->data, dp->rxbuf,
-						(size_t)dp->rxoffset);
-					(void)gettimeofday(&tmsg->rxtime, NULL);
-
-					if (diag_l2_debug & DIAG_DEBUG_READ)
-					{
-						fprintf(stderr, "l2_iso9141_recv: ");
-						diag_data_dump(stderr, dp->rxbuf, (size_t)dp->rxoffset);
-						fprintf(stderr, "\n");
-					}
-
-					dp->rxoffset = 0;
-
-					// Add received message to response list:
-					diag_l2_addmsg(d_l2_conn, tmsg);
-
-					// Finished this one, get more:
-					state = ST_STATE3;
-					continue;
-
-				case ST_STATE3:
-					/*
-					 * No more messages, but we did get one
-					 */
-					rv = d_l2_conn->diag_msg->len;
-				break;
-			}
-
-			// end of all response messages:
-			if (state == ST_STATE3)
+			osrc = (o->len >= 3) ? o->data[2] : -1;
+			if (osrc == src)
 				break;
 		}
+		if (o == m)
+			nsrc++;
+	}
+	return nsrc;
+}
 
-		// Other reception errors.
-		if (rv < 0)
-			break;
-		
-		// Data received OK.
-		// Add length to offset.
-		dp->rxoffset += rv;
-
-		// This is where some tweaking might be needed if
-		// we are in monitor mode... but not yet.
+// Response over (rv >= 0) or failed: check the messages that we have,
+// stripping off headers etc. Returns the number of frames, or error.
+static int
+diag_l2_proto_iso9141_rxdone(struct diag_l2_conn *d_l2_conn, int rv)
+{
+	struct diag_l2_iso9141 *dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
+	int l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
+	struct diag_msg *tmsg, *lastmsg;
 
-		// Got some data in state1/3, now we're in a message!
-		if ( (state == ST_STATE1) || (state == ST_STATE3) )
-			state = ST_STATE2;
+	// Frames are all in messages now, give the buffer back.
+	diag_l2_rxbuf_put(d_l2_conn);
+	dp->rxstate = 0;
+	d_l2_conn->diag_l2_rxdeadline = 0;
 
-	}//end while (read cycle).
-	
 	// Now walk through the response message list, 
 	// and strip off their headers and checksums 
 	// after verifying them.
 	if (rv >= 0)
 	{
-		tmsg = d_l2_conn->diag_msg;
+		tmsg = d_l2_conn->diag_msgs.head;
 		lastmsg = NULL;
 		
 		while (tmsg)
 		{
 			int hdrlen, datalen, source, dest;
 
-			dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
-
 			// If L1 doesn't strip the checksum byte, validate it:
 			if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0)
 			{
@@ -508,14 +493,15 @@ diag_l2_proto_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
 				if(rx_cs != diag_l2_proto_iso9141_cs(tmsg->data, tmsg->len - 1))
 				{
 					fprintf(stderr, FLFMT "Checksum error in received message!\n", FL);
-					return -1;
+					rv = diag_iseterr(DIAG_ERR_BADCSUM);
+					break;
 				}
 				// "Remove" the checksum byte:
 				tmsg->len--;
 			}
 
 			// Process L2 framing, if L1 doesn't do it.
-			if(l1_doesl2frame == 0)
+			if ((l1flags & DIAG_L1_DOESL2FRAME) == 0)
 			{
 				// Get frame geometry and data:
 				rv = diag_l2_proto_iso9141_decode( tmsg->data,
@@ -523,7 +509,7 @@ diag_l2_proto_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
 								&hdrlen, &datalen, &source, &dest);
 
 				if (rv < 0) // decode failure!
-					return rv;
+					break;
 
 				//It is possible we have misframed this message and it is infact
 				//more than one message, so see if we can decode it.
@@ -535,17 +521,13 @@ diag_l2_proto_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
 					// do horrible copy about the data
 					// things ....
 					struct diag_msg	*amsg;
-					amsg = diag_dupsinglemsg(tmsg);
+					amsg = diag_msg_retain(tmsg);
 					amsg->len = rv;
 					tmsg->len -=rv;
 					tmsg->data += rv;
 
 					/*  Insert new amsg before old msg */
-					amsg->next = tmsg;
-					if (lastmsg == NULL)
-					d_l2_conn->diag_msg = amsg;
-					else
-					lastmsg->next = amsg;
+					diag_msglist_insert(&d_l2_conn->diag_msgs, lastmsg, amsg);
 					
 					tmsg = amsg; /* Finish processing this one */
 				}
@@ -569,8 +551,155 @@ diag_l2_proto_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
 			lastmsg = tmsg;
 			tmsg = tmsg->next;
 		}
+		if (rv >= 0)
+			rv = (int) d_l2_conn->diag_msgs.cnt;
 	}
 
+	if (rv >= 0)
+		d_l2_conn->diag_l2_rxdone = diag_os_getns();	/* For P3 */
+	diag_l2_resp_learn(dp->rxrc, (rv >= 0) ? &d_l2_conn->diag_msgs : NULL,
+		dp->rxearly);
+	dp->rxrc = NULL;
+	return rv;
+}
+
+// Advance the framer: len bytes were just added at rxbuf[rxoffset], or
+// with len == 0, diag_l2_rxdeadline has passed. Returns 0 while the
+// response is incomplete, else what rxdone() returns.
+static int
+diag_l2_proto_iso9141_rxstep(struct diag_l2_conn *d_l2_conn, int len)
+{
+	struct diag_l2_iso9141 *dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
+	struct diag_msg *tmsg;
+
+	if (len > 0)
+	{
+		// Data received OK.
+		// Note when the frame started, add length to offset.
+		if (d_l2_conn->rxoffset == 0)
+			dp->rxstamp = diag_l0_rxstamp(d_l2_conn->diag_link->diag_l2_dl0d);
+		d_l2_conn->rxoffset += len;
+
+		// This is where some tweaking might be needed if
+		// we are in monitor mode... but not yet.
+
+		// Got some data in state1/3, now we're in a message!
+		diag_l2_proto_iso9141_rxstate(d_l2_conn, ST_STATE2);
+		return 0;
+	}
+
+	// Timeout = end of message or end of responses.
+	switch (dp->rxstate)
+	{
+		case ST_STATE1:
+			// If we got 0 bytes on the 1st read,
+			// just return the timeout error.
+			if (d_l2_conn->rxoffset == 0)
+				return diag_l2_proto_iso9141_rxdone(d_l2_conn,
+					DIAG_ERR_TIMEOUT);
+
+			// Otherwise try to read more bytes into
+			// this message.
+			diag_l2_proto_iso9141_rxstate(d_l2_conn, ST_STATE2);
+			return 0;
+
+		case ST_STATE2:
+			// End of that message, maybe more to come;
+			// Copy data into a message.
+			tmsg = diag_allocmsg((size_t)d_l2_conn->rxoffset);
+			if (tmsg == NULL)
+				return diag_l2_proto_iso9141_rxdone(d_l2_conn,
+					diag_iseterr(DIAG_ERR_NOMEM));
+			tmsg->len = d_l2_conn->rxoffset;
+			tmsg->fmt |= DIAG_FMT_FRAMED ;
+			memcpy(tmsg->data, d_l2_conn->rxbuf,
+				(size_t)d_l2_conn->rxoffset);
+			tmsg->rxtime = dp->rxstamp;
+
+			if (diag_l2_debug & DIAG_DEBUG_READ)
+			{
+				fprintf(stderr, "l2_iso9141_recv: ");
+				diag_data_dump(stderr, d_l2_conn->rxbuf, (size_t)d_l2_conn->rxoffset);
+				fprintf(stderr, "\n");
+			}
+
+			d_l2_conn->rxoffset = 0;
+
+			// Add received message to response list:
+			diag_l2_addmsg(d_l2_conn, tmsg);
+
+			if (dp->rxwant &&
+				diag_l2_proto_iso9141_rxsrcs(d_l2_conn) >= dp->rxwant)
+			{
+				// Everybody who usually answers has,
+				// don't wait out p3min.
+				if (diag_l2_debug & DIAG_DEBUG_READ)
+					fprintf(stderr, FLFMT "all %u responses in\n",
+						FL, dp->rxwant);
+				dp->rxearly = 1;
+				return diag_l2_proto_iso9141_rxdone(d_l2_conn, 0);
+			}
+
+			// Finished this one, get more:
+			diag_l2_proto_iso9141_rxstate(d_l2_conn, ST_STATE3);
+			return 0;
+
+		default:
+			/*
+			 * No more messages, but we did get one
+			 */
+			return diag_l2_proto_iso9141_rxdone(d_l2_conn, 0);
+	}
+}
+
+// Blocking receive, returns the number of frames received or error.
+int
+diag_l2_proto_iso9141_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
+{
+	struct diag_l2_iso9141 *dp;
+	tstamp_type now;
+	int rv, tout;
+
+	if (diag_l2_debug & DIAG_DEBUG_READ)
+		fprintf(stderr,
+			FLFMT "diag_l2_iso9141_int_recv offset %x\n",
+			FL, d_l2_conn->rxoffset);
+
+	dp = (struct diag_l2_iso9141 *)d_l2_conn->diag_l2_proto_data;
+
+	if (timeout < 0)
+		timeout = 0;
+	rv = diag_l2_proto_iso9141_rxstart(d_l2_conn, timeout);
+	if (rv < 0)
+		return rv;
+
+	do
+	{
+		if (dp->rxnoread)
+		{
+			rv = diag_l2_proto_iso9141_rxstep(d_l2_conn, 0);
+			continue;
+		}
+
+		now = diag_os_getns();
+		tout = 0;
+		if (d_l2_conn->diag_l2_rxdeadline > now)
+			tout = (int) ((d_l2_conn->diag_l2_rxdeadline - now + 999999) / 1000000);
+
+		// Receive data into the buffer:
+		rv = diag_l1_recv (d_l2_conn->diag_link->diag_l2_dl0d, 0,
+				&d_l2_conn->rxbuf[d_l2_conn->rxoffset],
+				d_l2_conn->rxsize - d_l2_conn->rxoffset,
+				tout);
+
+		if (rv == DIAG_ERR_TIMEOUT)
+			rv = diag_l2_proto_iso9141_rxstep(d_l2_conn, 0);
+		else if (rv < 0)
+			rv = diag_l2_proto_iso9141_rxdone(d_l2_conn, rv);
+		else if (rv > 0)
+			rv = diag_l2_proto_iso9141_rxstep(d_l2_conn, rv);
+	} while (rv == 0);
+
 	return rv;
 }
 
@@ -583,7 +712,7 @@ diag_l2_proto_iso9141_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	int rv;
 
 	rv = diag_l2_proto_iso9141_int_recv(d_l2_conn, timeout);
-	if ((rv >= 0) && d_l2_conn->diag_msg)
+	if ((rv >= 0) && d_l2_conn->diag_msgs.head)
 	{
 		if (diag_l2_debug & DIAG_DEBUG_READ)
 			fprintf(stderr, FLFMT "rcv callback calling %p(%p)\n", FL,
@@ -592,11 +721,10 @@ diag_l2_proto_iso9141_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 		 * Call user callback routine
 		 */
 		if (callback)
-			callback(handle, d_l2_conn->diag_msg);
+			callback(handle, d_l2_conn->diag_msgs.head);
 
 		/* No longer needed */
-		diag_freemsg(d_l2_conn->diag_msg);
-		d_l2_conn->diag_msg = NULL;
+		diag_msglist_free(&d_l2_conn->diag_msgs);
 	}
 
 	return rv;
@@ -612,7 +740,6 @@ static int
 diag_l2_proto_iso9141_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 {
 	int rv;
-	int sleeptime;
 	uint8_t buf[MAXLEN_ISO9141];
 	int offset;
 	struct diag_l2_iso9141 *dp;
@@ -632,14 +759,10 @@ diag_l2_proto_iso9141_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 	}
 	
 	/*
-	 * Make sure enough time between last receive and this send
-	 * In fact, because of the timeout on recv(), this is pretty small, but
-	 * we take the safe road and wait the whole of p3min plus whatever
-	 * delay happened before
+	 * Make sure enough time between last receive and this send; time
+	 * spent by the caller since the last response counts.
 	 */
-	sleeptime = d_l2_conn->diag_l2_p3min;
-	if (sleeptime > 0)
-		diag_os_millisleep(sleeptime);
+	diag_l2_p3wait(d_l2_conn);
 
 	offset = 0;
 
@@ -702,11 +825,10 @@ diag_l2_proto_iso9141_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *m
 	/* And wait for response */
 
 	rv = diag_l2_proto_iso9141_int_recv(d_l2_conn, 1000);
-	if ((rv >= 0) && d_l2_conn->diag_msg)
+	if ((rv >= 0) && d_l2_conn->diag_msgs.head)
 	{
 		/* OK */
-		rmsg = d_l2_conn->diag_msg;
-		d_l2_conn->diag_msg = NULL;
+		rmsg = diag_msglist_take(&d_l2_conn->diag_msgs);
 	}
 	else
 	{
@@ -727,7 +849,10 @@ static const struct diag_l2_proto diag_l2_proto_iso9141 =
 	diag_l2_proto_iso9141_send,
 	diag_l2_proto_iso9141_recv,
 	diag_l2_proto_iso9141_request,
-	NULL
+	NULL,
+	NULL,
+	diag_l2_proto_iso9141_rxstart,
+	diag_l2_proto_iso9141_rxstep
 };
 
 
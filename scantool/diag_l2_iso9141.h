@@ -74,8 +74,15 @@ struct diag_l2_iso9141
 //	uint8_t kb1;	  // key Byte 1
 //	uint8_t kb2;	// key Byte 2
 
-	uint8_t rxbuf[MAXLEN_ISO9141]; // Receive buffer, for building message in.
-	uint8_t rxoffset;
+	tstamp_type rxstamp;	// When rxbuf[0] was received.
+
+	// Receive framer, see diag_l2_proto_iso9141_rxstep().
+	uint8_t rxstate;
+	uint8_t rxnoread;	// Frame ends now, don't read.
+	uint8_t rxearly;	// Ended when all rxwant ECUs answered.
+	int rxtimeout;		// ST_STATE1 timeout, ms (< 0: none).
+	unsigned int rxwant;	// ECUs that make a complete response.
+	struct diag_l2_respclass *rxrc;
 
 	uint8_t state;
 #define STATE_CLOSED	  0	// Closed connection.
@@ -290,7 +290,7 @@ diag_l2_proto_mb1_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	msg = diag_allocmsg((size_t)(rv - 4));
 	msg->data[0] = rxbuf[1];		/* Command */
 	memcpy(&msg->data[1], &rxbuf[3], (size_t)(rv - 3));	/* Data */
-	(void)gettimeofday(&msg->rxtime, NULL);
+	msg->rxtime = diag_os_getns();
 	msg->len = rv - 4;
 	msg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_DATAONLY;
 
@@ -406,7 +406,7 @@ diag_l2_proto_mb1_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 		rmsg = diag_allocmsg((size_t)(rv - 4));
 		rmsg->data[0] = rxbuf[1];		/* Command */
 		memcpy(&rmsg->data[1], &rxbuf[3], (size_t)(rv - 3));	/* Data */
-		(void)gettimeofday(&rmsg->rxtime, NULL);
+		rmsg->rxtime = diag_os_getns();
 		rmsg->len = rv - 4;
 		rmsg->fmt = DIAG_FMT_FRAMED | DIAG_FMT_DATAONLY;
 	}
@@ -425,7 +425,6 @@ diag_l2_proto_mb1_timeout(struct diag_l2_conn *d_l2_conn)
 	uint8_t rxbuf[1000];
 	int rv;
 
-	/* XXX Not async-signal-safe */
 	if (diag_l2_debug & DIAG_DEBUG_TIMER)
 		fprintf(stderr, FLFMT "timeout conn %p\n",
 				FL, d_l2_conn);
@@ -452,7 +451,10 @@ static const struct diag_l2_proto diag_l2_proto_mb1 = {
 	diag_l2_proto_mb1_send,
 	diag_l2_proto_mb1_recv,
 	diag_l2_proto_mb1_request,
-	diag_l2_proto_mb1_timeout
+	diag_l2_proto_mb1_timeout,
+	NULL,
+	NULL,
+	NULL
 };
 
 int diag_l2_mb1_add(void) {
@@ -130,7 +130,7 @@ diag_l2_proto_raw_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	/* This is raw, unframed data */
 	msg.fmt = 0;
 	msg.next = 0;
-	(void)gettimeofday(&msg.rxtime, NULL);
+	msg.rxtime = diag_os_getns();
 
 	if (diag_l2_debug & DIAG_DEBUG_READ)
 	{
@@ -182,7 +182,7 @@ diag_l2_proto_raw_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 		memcpy(&rmsg->data, rxbuf, (size_t)rv);	/* Data */
 		rmsg->len = rv;
 		rmsg->fmt = 0;
-		(void)gettimeofday(&rmsg->rxtime, NULL);
+		rmsg->rxtime = diag_os_getns();
 	}
 	return(rmsg);
 }
@@ -194,6 +194,9 @@ const struct diag_l2_proto diag_l2_proto_raw = {
 	diag_l2_proto_raw_send,
 	diag_l2_proto_raw_recv,
 	diag_l2_proto_raw_request,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -55,10 +55,11 @@ struct diag_l2_j1850
 	uint16_t modeflags;	/* Flags */
 
 	uint8_t state;
-	uint8_t rxbuf[MAXRBUF];	/* Receive buffer, for building message in */
-	int rxoffset;		/* Offset to write into buffer */
 };
 
+/* Largest frame, SAE J1850 allows 12 bytes including the CRC */
+#define J1850_MAXFRAME	12
+
 #define STATE_CLOSED	  0	/* Established comms */
 #define STATE_CONNECTING  1	/* Connecting */
 #define STATE_ESTABLISHED 2	/* Established */
@@ -225,97 +226,167 @@ diag_l2_proto_j1850_send(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg)
 }
 
 /*
- * Protocol receive routine
+ * Receive framer. Like the ISO14230 one it is driven from outside, so one
+ * thread can drive many links (see diag_l2_reactor_add()): rxstart arms
+ * it for a response, then rxstep is fed the bytes read into rxbuf, or
+ * told that diag_l2_rxdeadline has passed. The blocking int_recv below
+ * just loops around it.
  *
- * Will sleep until a complete set of responses has been received, or fail
- * with a timeout error
+ * Only L1 interfaces that do the L2 framing are supported, so every read
+ * gives us a complete frame and there is a single state : waiting for it.
  */
 static int
-diag_l2_proto_j1850_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
+diag_l2_proto_j1850_rxstart(struct diag_l2_conn *d_l2_conn, int timeout)
 {
 	int rv;
+
+	if ((d_l2_conn->diag_link->diag_l2_l1flags & DIAG_L1_DOESL2FRAME) == 0)
+	{
+		// No support for non framing L2 interfaces yet ...
+		return(diag_iseterr(DIAG_ERR_PROTO_NOTSUPP));
+	}
+
+	/* Clear out last received message if not done already */
+	diag_msglist_free(&d_l2_conn->diag_msgs);
+
+	rv = diag_l2_rxbuf_get(d_l2_conn, J1850_MAXFRAME);
+	if (rv < 0)
+		return rv;
+
+	if ((timeout >= 0) && (timeout < 100))	/* Extend timeouts for clever interfaces */
+		timeout = 100;
+
+	if (timeout < 0)
+		d_l2_conn->diag_l2_rxdeadline = 0;	/* Monitoring, no end */
+	else
+		d_l2_conn->diag_l2_rxdeadline = diag_os_getns() +
+			(tstamp_type) timeout * 1000000;
+	return 0;
+}
+
+/*
+ * Frame over (rv > 0, the number of frames) or failed : give the buffer
+ * back and disarm
+ */
+static int
+diag_l2_proto_j1850_rxdone(struct diag_l2_conn *d_l2_conn, int rv)
+{
+	d_l2_conn->rxoffset = 0;
+	diag_l2_rxbuf_put(d_l2_conn);
+	d_l2_conn->diag_l2_rxdeadline = 0;
+	return rv;
+}
+
+/*
+ * Advance the framer : len bytes were just added at rxbuf[rxoffset], or
+ * with len == 0, diag_l2_rxdeadline has passed. Returns 0 while the
+ * frame is incomplete (never, with framing interfaces), the number of
+ * frames once it is in diag_msgs, or error.
+ */
+static int
+diag_l2_proto_j1850_rxstep(struct diag_l2_conn *d_l2_conn, int len)
+{
 	struct diag_l2_j1850 *dp;
-	int tout;
 	struct diag_msg	*tmsg;
 	int l1flags = d_l2_conn->diag_link->diag_l2_l1flags;
 
 	dp = (struct diag_l2_j1850 *)d_l2_conn->diag_l2_proto_data;
 
-	if (diag_l2_debug & DIAG_DEBUG_READ)
-		fprintf(stderr,
-			FLFMT "diag_l2_j1850_int_recv offset %x\n",
-				FL, dp->rxoffset);
+	if (len == 0)
+		return diag_l2_proto_j1850_rxdone(d_l2_conn, DIAG_ERR_TIMEOUT);
 
-	if (l1flags & DIAG_L1_DOESL2FRAME)
-	{
-		tout = timeout;
-		if (tout < 100)	/* Extend timeouts for clever interfaces */
-			tout = 100;
+	d_l2_conn->rxoffset += len;
 
-		rv = diag_l1_recv (d_l2_conn->diag_link->diag_l2_dl0d, 0,
-				&dp->rxbuf[dp->rxoffset],
-				sizeof(dp->rxbuf) - dp->rxoffset,
-				tout);
-		if (rv < 0)
+	// Ok, got a complete frame to send upward
+	tmsg = diag_allocmsg((size_t)d_l2_conn->rxoffset);
+	if (tmsg == NULL)
+		return diag_l2_proto_j1850_rxdone(d_l2_conn,
+			diag_iseterr(DIAG_ERR_NOMEM));
+	tmsg->len = d_l2_conn->rxoffset;
+	memcpy(tmsg->data, d_l2_conn->rxbuf, (size_t)d_l2_conn->rxoffset);
+
+	/*
+	 * Minimum message length is 3 header bytes
+	 * 1 data, 1 checksum
+	 */
+	if (tmsg->len >= 5)
+	{
+		if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0)
 		{
-			// Error
-			return(rv);
+			/* XXX check checksum */
 		}
-		dp->rxoffset += rv;
+		tmsg->dest = tmsg->data[1];
+		tmsg->src = tmsg->data[2];
+		tmsg->data +=3;
+		tmsg->len -=3;
+
+		/* remove checksum byte if needed */
+		if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0)
+			tmsg->len--;
 	}
 	else
 	{
-		// No support for non framing L2 interfaces yet ...
-		return(diag_iseterr(DIAG_ERR_PROTO_NOTSUPP));
+		diag_freemsg(tmsg);
+		return diag_l2_proto_j1850_rxdone(d_l2_conn,
+			diag_iseterr(DIAG_ERR_BADDATA));
 	}
 
-	// Ok, got a complete frame to send upward
-
-	if (dp->rxoffset)
-	{
-		// There is data left to add to the message list ..
-		tmsg = diag_allocmsg((size_t)dp->rxoffset);
-		tmsg->len = dp->rxoffset;
-		memcpy(tmsg->data, dp->rxbuf, (size_t)dp->rxoffset);
-
-		/*
-		 * Minimum message length is 3 header bytes
-		 * 1 data, 1 checksum
-		 */
-		if (tmsg->len >= 5)
-		{
-			if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0)
-			{
-				/* XXX check checksum */
-			}
-			tmsg->dest = tmsg->data[1];
-			tmsg->src = tmsg->data[2];
-			tmsg->data +=3;
-			tmsg->len -=3;
-
-			/* remove checksum byte if needed */
-			if ((l1flags & DIAG_L1_STRIPSL2CKSUM) == 0)
-				tmsg->len--;
-		}
-		else
-		{
-			diag_freemsg(tmsg);
-			return(diag_iseterr(DIAG_ERR_BADDATA));
-		}
-
-		(void)gettimeofday(&tmsg->rxtime, NULL);
-		dp->rxoffset = 0;
+	tmsg->rxtime = diag_os_getns();
 
-		/*
-		 * ADD message to list
-		 */
-		diag_l2_addmsg(d_l2_conn, tmsg);
-	}
+	/*
+	 * ADD message to list
+	 */
+	diag_l2_addmsg(d_l2_conn, tmsg);
 
 	dp->state = STATE_ESTABLISHED;
-	return(0);
+	return diag_l2_proto_j1850_rxdone(d_l2_conn,
+		(int) d_l2_conn->diag_msgs.cnt);
 }
 
+/*
+ * Protocol receive routine
+ *
+ * Will sleep until a complete set of responses has been received, or fail
+ * with a timeout error
+ */
+static int
+diag_l2_proto_j1850_int_recv(struct diag_l2_conn *d_l2_conn, int timeout)
+{
+	tstamp_type now;
+	int rv, tout;
+
+	if (diag_l2_debug & DIAG_DEBUG_READ)
+		fprintf(stderr,
+			FLFMT "diag_l2_j1850_int_recv offset %x\n",
+				FL, d_l2_conn->rxoffset);
+
+	if (timeout < 0)
+		timeout = 0;
+	rv = diag_l2_proto_j1850_rxstart(d_l2_conn, timeout);
+	if (rv < 0)
+		return(rv);
+
+	do
+	{
+		now = diag_os_getns();
+		tout = 0;
+		if (d_l2_conn->diag_l2_rxdeadline > now)
+			tout = (int) ((d_l2_conn->diag_l2_rxdeadline - now + 999999) / 1000000);
+
+		rv = diag_l1_recv (d_l2_conn->diag_link->diag_l2_dl0d, 0,
+				&d_l2_conn->rxbuf[d_l2_conn->rxoffset],
+				d_l2_conn->rxsize - d_l2_conn->rxoffset,
+				tout);
+		if (rv == DIAG_ERR_TIMEOUT)
+			rv = diag_l2_proto_j1850_rxstep(d_l2_conn, 0);
+		else if (rv < 0)
+			rv = diag_l2_proto_j1850_rxdone(d_l2_conn, rv);
+		else if (rv > 0)
+			rv = diag_l2_proto_j1850_rxstep(d_l2_conn, rv);
+	} while (rv == 0);
+
+	return(rv);
+}
 
 static int
 diag_l2_proto_j1850_recv(struct diag_l2_conn *d_l2_conn, int timeout,
@@ -335,12 +406,11 @@ diag_l2_proto_j1850_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	if (diag_l2_debug & DIAG_DEBUG_READ)
 	{
 		fprintf(stderr, FLFMT "calling rcv callback %p handle %p msg %p\n",
-			FL, d_l2_conn->diag_msg,
+			FL, d_l2_conn->diag_msgs.head,
 			callback, handle);
 	}
 
-	tmsg = d_l2_conn->diag_msg;
-	d_l2_conn->diag_msg = NULL;
+	tmsg = diag_msglist_take(&d_l2_conn->diag_msgs);
 
 	tmsg->fmt |= DIAG_FMT_FRAMED | DIAG_FMT_DATAONLY ;
 	tmsg->fmt |= DIAG_FMT_CKSUMMED;
@@ -387,8 +457,7 @@ diag_l2_proto_j1850_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg
 	}
 
 	/* Return the message to user, who is responsible for freeing it */
-	rmsg = d_l2_conn->diag_msg;
-	d_l2_conn->diag_msg = NULL;
+	rmsg = diag_msglist_take(&d_l2_conn->diag_msgs);
 	return(rmsg);
 }
 
@@ -400,7 +469,10 @@ static const struct diag_l2_proto diag_l2_proto_j1850 = {
 	diag_l2_proto_j1850_send,
 	diag_l2_proto_j1850_recv,
 	diag_l2_proto_j1850_request,
-	NULL
+	NULL,
+	NULL,
+	diag_l2_proto_j1850_rxstart,
+	diag_l2_proto_j1850_rxstep
 };
 
 int diag_l2_j1850_add(void) {
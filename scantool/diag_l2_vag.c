@@ -55,8 +55,6 @@ struct diag_l2_vag
 	uint8_t master;	/* Master flag, 1 = us, 0 = ECU */
 
 
-	uint8_t rxbuf[MAXRBUF];	/* Receive buffer, for building message in */
-	int rxoffset;		/* Offset to write into buffer */
 };
 
 #define STATE_CLOSED	  0	/* Established comms */
@@ -205,23 +203,16 @@ uint8_t *data __attribute__((unused)),
 int *datalen __attribute__((unused)))
 #endif
 {
-	struct diag_l2_vag *dp;
 	int rv = 0;
 /*	struct diag_msg	*tmsg;*/
 
-	dp = (struct diag_l2_vag *)d_l2_conn->diag_l2_proto_data;
-
 	if (diag_l2_debug & DIAG_DEBUG_READ)
 		fprintf(stderr,
 			FLFMT "diag_l2_vag_intrecv offset %x\n",
-				FL, dp->rxoffset);
+				FL, d_l2_conn->rxoffset);
 
 	/* Clear out last received message if not done already */
-	if (d_l2_conn->diag_msg)
-	{
-		diag_freemsg(d_l2_conn->diag_msg);
-		d_l2_conn->diag_msg = NULL;
-	}
+	diag_msglist_free(&d_l2_conn->diag_msgs);
 
 	/*
 	 * And receive the new message
@@ -235,7 +226,7 @@ int *datalen __attribute__((unused)))
 	 */
 	if (rv >= 0)
 	{
-		tmsg = d_l2_conn->diag_msg;
+		tmsg = d_l2_conn->diag_msgs.head;
 
 		while (tmsg)
 		{
@@ -575,11 +566,10 @@ diag_l2_proto_vag_recv(struct diag_l2_conn *d_l2_conn, int timeout,
 	 * Call user callback routine
 	 */
 	if (callback)
-		callback(handle, d_l2_conn->diag_msg);
+		callback(handle, d_l2_conn->diag_msgs.head);
 
 	/* No longer needed */
-	diag_freemsg(d_l2_conn->diag_msg);
-	d_l2_conn->diag_msg = NULL;
+	diag_msglist_free(&d_l2_conn->diag_msgs);
 
 	if (diag_l2_debug & DIAG_DEBUG_READ)
 	{
@@ -606,11 +596,10 @@ diag_l2_proto_vag_request(struct diag_l2_conn *d_l2_conn, struct diag_msg *msg,
 	/* And wait for response */
 
 	rv = diag_l2_proto_iso9141_int_recv(d_l2_conn, 1000);	/* XXX Really 9141? */
-	if ((rv >= 0) && d_l2_conn->diag_msg)
+	if ((rv >= 0) && d_l2_conn->diag_msgs.head)
 	{
 		/* OK */
-		rmsg = d_l2_conn->diag_msg;
-		d_l2_conn->diag_msg = NULL;
+		rmsg = diag_msglist_take(&d_l2_conn->diag_msgs);
 	}
 	else
 	{
@@ -664,7 +653,10 @@ static const struct diag_l2_proto diag_l2_proto_vag = {
 	diag_l2_proto_vag_send,
 	diag_l2_proto_vag_recv,
 	diag_l2_proto_vag_request,
-	diag_l2_proto_vag_timeout
+	diag_l2_proto_vag_timeout,
+	NULL,
+	NULL,
+	NULL
 };
 
 int diag_l2_vag_add(void) {
@@ -26,9 +26,12 @@
  *
  *
  * Timers. As most L3 protocols run idle timers, the hard work is done here,
- *	The timer code calls the L3 timer for each L3 connection with the
- *	time difference between "now" and the timer in the L3 connection
- *	structure, so L3 can quickly check to see if it needs to do a retry
+ *	Each L3 connection notes when it last sent, and keeps its timer
+ *	armed for the end of the protocol's keepalive period; when it
+ *	expires and the connection has really been idle that long, the L3
+ *	timer routine is called with the time difference between "now" and
+ *	the timer in the L3 connection structure, so L3 can quickly check
+ *	to see if it needs to do a retry
  */
 
 #include <stdlib.h>
@@ -58,6 +61,45 @@ static const diag_l3_proto_t * const diag_l3_protocols[] =
 
 static struct diag_l3_conn	*diag_l3_list;
 
+/*
+ * Idle timer callback, runs in the timer thread with the diag lock held.
+ */
+static void
+diag_l3_conn_timer(void *arg)
+{
+	struct diag_l3_conn *conn = (struct diag_l3_conn *)arg;
+	const diag_l3_proto_t *dp = conn->d_l3_proto;
+	struct diag_l2_link *dl2l = conn->d_l3l2_conn->diag_link;
+	int ms;
+
+	/* Some thread is waiting for the ECU on this link; try again
+	 * when it lets go (diag_l2_link_leave()) */
+	if (diag_l2_link_busy(dl2l)) {
+		diag_os_timer_defer(&conn->l3_timer, dl2l);
+		return;
+	}
+
+	ms = (int) ((diag_os_getns() - conn->timer) / 1000000);
+
+	/* Something was sent since we were armed; no keepalive needed yet */
+	if (ms < dp->diag_l3_proto_keepalive) {
+		diag_os_timer_set(&conn->l3_timer, dp->diag_l3_proto_keepalive - ms);
+		return;
+	}
+
+	diag_l2_link_enter(dl2l);
+	dp->diag_l3_proto_timer(conn, ms);
+	diag_l2_link_leave(dl2l);
+
+	/* If the timer routine didn't send anything, check again later */
+	if (!conn->l3_timer.pending) {
+		ms = dp->diag_l3_proto_keepalive - ms;
+		if (ms <= 0)
+			ms = dp->diag_l3_proto_keepalive;
+		diag_os_timer_set(&conn->l3_timer, ms);
+	}
+}
+
 /*
  * Protocol start (connect a protocol on top of a L2 connection
  */
@@ -98,6 +140,8 @@ diag_l3_start(const char *protocol, struct diag_l2_conn *d_l2_conn)
 
 		d_l3_conn->d_l3l2_conn = d_l2_conn;
 		d_l3_conn->d_l3_proto = dp;
+		diag_os_timer_init(&d_l3_conn->l3_timer,
+			diag_l3_conn_timer, d_l3_conn);
 
 		/* Get L2 flags */
 		(void)diag_l2_ioctl(d_l2_conn,
@@ -110,6 +154,8 @@ diag_l3_start(const char *protocol, struct diag_l2_conn *d_l2_conn)
 			&d_l3_conn->d_l3l1_flags);
 
 		/* Call the proto routine */
+		diag_os_lock();
+		diag_l2_link_enter(d_l2_conn->diag_link);
 		rv = dp->diag_l3_proto_start(d_l3_conn);
 		if (rv < 0)
 		{
@@ -121,13 +167,19 @@ diag_l3_start(const char *protocol, struct diag_l2_conn *d_l2_conn)
 			/*
 			 * Set time to now
 			 */
-			(void)gettimeofday(&d_l3_conn->timer, NULL);
+			d_l3_conn->timer = diag_os_getns();
 			/*
 			 * And add to list
 			 */
 			d_l3_conn->next = diag_l3_list;
 			diag_l3_list = d_l3_conn;
+
+			if (dp->diag_l3_proto_timer)
+				diag_os_timer_set(&d_l3_conn->l3_timer,
+					dp->diag_l3_proto_keepalive);
 		}
+		diag_l2_link_leave(d_l2_conn->diag_link);
+		diag_os_unlock();
 	}
 
 	if (diag_l3_debug & DIAG_DEBUG_OPEN)
@@ -147,6 +199,10 @@ int diag_l3_stop(struct diag_l3_conn *d_l3_conn)
 
 	const diag_l3_proto_t *dp = d_l3_conn->d_l3_proto;
 
+	diag_os_lock();
+	diag_l2_link_enter(d_l3_conn->d_l3l2_conn->diag_link);
+	diag_os_timer_cancel(&d_l3_conn->l3_timer);
+
 	/* Remove from list */
 	if (d_l3_conn == diag_l3_list)
 	{
@@ -167,18 +223,83 @@ int diag_l3_stop(struct diag_l3_conn *d_l3_conn)
 
 	rv = dp->diag_l3_proto_stop(d_l3_conn);
 
+	d_l3_conn->rxoffset = 0;
+	diag_l3_rxbuf_put(d_l3_conn);
+	diag_l2_link_leave(d_l3_conn->d_l3l2_conn->diag_link);
+	diag_os_unlock();
+
+	diag_msglist_free(&d_l3_conn->msgs);
 	free(d_l3_conn);
 
 	return(rv);
 }
 
+int
+diag_l3_rxbuf_get(struct diag_l3_conn *d_l3_conn, size_t size)
+{
+	struct diag_rxarena *a = &d_l3_conn->d_l3l2_conn->diag_link->diag_l2_rxarena;
+	uint8_t *buf;
+	size_t got;
+
+	if (d_l3_conn->rxbuf && d_l3_conn->rxsize >= size)
+		return 0;
+
+	buf = diag_rxarena_get(a, size, &got);
+	if (buf == NULL)
+		return diag_iseterr(DIAG_ERR_NOMEM);
+	if (d_l3_conn->rxbuf) {
+		memcpy(buf, d_l3_conn->rxbuf, (size_t)d_l3_conn->rxoffset);
+		diag_rxarena_put(a, d_l3_conn->rxbuf, d_l3_conn->rxsize);
+	} else {
+		d_l3_conn->rxoffset = 0;
+	}
+	d_l3_conn->rxbuf = buf;
+	d_l3_conn->rxsize = got;
+	return 0;
+}
+
+void
+diag_l3_rxbuf_put(struct diag_l3_conn *d_l3_conn)
+{
+	if (d_l3_conn->rxbuf == NULL || d_l3_conn->rxoffset)
+		return;
+
+	diag_rxarena_put(&d_l3_conn->d_l3l2_conn->diag_link->diag_l2_rxarena,
+		d_l3_conn->rxbuf, d_l3_conn->rxsize);
+	d_l3_conn->rxbuf = NULL;
+	d_l3_conn->rxsize = 0;
+}
+
+void
+diag_l3_memstats(FILE *fp)
+{
+	struct diag_l3_conn *d_l3_conn;
+
+	diag_os_lock();
+	for (d_l3_conn = diag_l3_list; d_l3_conn; d_l3_conn = d_l3_conn->next) {
+		fprintf(fp, "L3 conn %p %s on L2 conn %p: "
+			"%u bytes + %u rx buffer, %u msgs queued\n",
+			(void *) d_l3_conn, d_l3_conn->d_l3_proto->proto_name,
+			(void *) d_l3_conn->d_l3l2_conn,
+			(unsigned int) sizeof(*d_l3_conn),
+			(unsigned int) d_l3_conn->rxsize, d_l3_conn->msgs.cnt);
+	}
+	diag_os_unlock();
+}
+
 int diag_l3_send(struct diag_l3_conn *d_l3_conn, struct diag_msg *msg)
 {
 	int rv;
 	const diag_l3_proto_t *dp = d_l3_conn->d_l3_proto;
 
-	(void)gettimeofday(&d_l3_conn->timer, NULL);
+	diag_os_lock();
+	diag_l2_link_enter(d_l3_conn->d_l3l2_conn->diag_link);
+	d_l3_conn->timer = diag_os_getns();
+	if (dp->diag_l3_proto_timer && !d_l3_conn->l3_timer.pending)
+		diag_os_timer_set(&d_l3_conn->l3_timer, dp->diag_l3_proto_keepalive);
 	rv = dp->diag_l3_proto_send(d_l3_conn, msg);
+	diag_l2_link_leave(d_l3_conn->d_l3l2_conn->diag_link);
+	diag_os_unlock();
 
 	return(rv);
 }
@@ -187,9 +308,16 @@ int diag_l3_recv(struct diag_l3_conn *d_l3_conn, int timeout,
 	void (* rcv_call_back)(void *handle ,struct diag_msg *) , void *handle)
 {
 	const diag_l3_proto_t *dp = d_l3_conn->d_l3_proto;
+	int rv;
+
+	diag_os_lock();
+	diag_l2_link_enter(d_l3_conn->d_l3l2_conn->diag_link);
+	rv = dp->diag_l3_proto_recv(d_l3_conn, timeout,
+		rcv_call_back, handle);
+	diag_l2_link_leave(d_l3_conn->d_l3l2_conn->diag_link);
+	diag_os_unlock();
 
-	return(dp->diag_l3_proto_recv(d_l3_conn, timeout,
-		rcv_call_back, handle));
+	return(rv);
 }
 
 char *diag_l3_decode(struct diag_l3_conn *d_l3_conn, 
@@ -219,39 +347,6 @@ int diag_l3_ioctl(struct diag_l3_conn *d_l3_conn, int cmd, void *data)
 }
 
 
-/*
- * Note: This is called from a signal handler.
- * XXX This calls non async-signal-safe functions!
- */
-
-void diag_l3_timer(void)
-{
-	/*
-	 * Regular timer routine
-	 * Call protocol specific timer
-	 */
-	struct diag_l3_conn *conn;
-	struct timeval now;
-
-	(void)gettimeofday(&now, NULL);	/* XXX NOT ASYNC SIGNAL SAFE */
-
-	for (conn = diag_l3_list ; conn ; conn = conn->next )
-	{
-		/* Call L3 timer routine for this connection */
-		const diag_l3_proto_t *dp = conn->d_l3_proto;
-
-		if (dp->diag_l3_proto_timer) {
-			struct timeval diff;
-			int ms;
-
-			timersub(&now, &conn->timer, &diff);
-			ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
-
-			(void)dp->diag_l3_proto_timer(conn, ms);
-		}
-	}
-}
-
 #ifdef WIN32
 int diag_l3_base_start(struct diag_l3_conn *d_l3_conn)
 #else
@@ -52,15 +52,20 @@ struct diag_l3_conn
 	void (*callback)(void *handle, struct diag_msg *msg);
 	void *handle;
 
-	/* Data buffer, and offset into it */
-	uint8_t rxbuf[MAXRBUF];	/* Receive data buffer */
+	/*
+	 * Data buffer, and offset into it; borrowed from the L2 link with
+	 * diag_l3_rxbuf_get() only while unframed data is pending
+	 */
+	uint8_t	*rxbuf;		/* Receive data buffer */
+	size_t	rxsize;
 	int	rxoffset;
 
 	/* Received messages */
-	struct diag_msg	*msg;
+	struct diag_msglist	msgs;
 
 	/* General purpose timer */
-	struct timeval	timer;
+	tstamp_type	timer;
+	struct diag_os_timer l3_timer;	/* Calls the proto timer when idle */
 
 	/* Linked list held by main L3 code */
 	struct diag_l3_conn	*next;
@@ -94,6 +99,7 @@ typedef struct diag_l3_proto
 
 	/* Timer */
 	void (*diag_l3_proto_timer)(struct diag_l3_conn *, int ms);
+	int diag_l3_proto_keepalive;	/* ms of idle before calling the timer */
 
 } diag_l3_proto_t;
 
@@ -118,12 +124,14 @@ int diag_l3_base_ioctl(struct diag_l3_conn *, int cmd, void *data);
 /* Pretty text decode routine */
 char *diag_l3_proto_decode(struct diag_l3_conn *, struct diag_msg *);
 
-void diag_l3_timer(void);	/* Regular timer routine */
-
 int diag_l3_ioctl(struct diag_l3_conn *connection, int cmd, void *data);
+void diag_l3_memstats(FILE *fp);	/* Print memory held by connections */
+
+/* Same as diag_l2_rxbuf_get() / diag_l2_rxbuf_put(), for L3 connections */
+int diag_l3_rxbuf_get(struct diag_l3_conn *d_l3_conn, size_t size);
+void diag_l3_rxbuf_put(struct diag_l3_conn *d_l3_conn);
 
 extern int diag_l3_debug;
-extern struct diag_l3_conn *global_l3_conn;
 
 #if defined(__cplusplus)
 }
@@ -278,6 +278,16 @@ if (diag_l3_iso14230_decode_response(msg, buffer, sizeof(buffer)))
 	{
 printf("[CJH] WARNING!! Should we be here?   %s %d\n",__FUNCTION__,__LINE__);
 		/* Add data to the receive buffer on the L3 connection */
+		if (d_l3_conn->rxoffset + msg->len > MAXRBUF) {
+			/* Never framed up, drop it */
+			if (diag_l3_debug & DIAG_DEBUG_READ)
+				fprintf(stderr,FLFMT "rcv_callback discarding %d unframed bytes\n",
+					FL, d_l3_conn->rxoffset);
+			d_l3_conn->rxoffset = 0;
+		}
+		if (diag_l3_rxbuf_get(d_l3_conn,
+				(size_t)(d_l3_conn->rxoffset + msg->len)))
+			return;
 		memcpy(&d_l3_conn->rxbuf[d_l3_conn->rxoffset],
 			msg->data, msg->len);
 		d_l3_conn->rxoffset += msg->len;
@@ -365,7 +375,7 @@ diag_l3_iso14230_recv(struct diag_l3_conn *d_l3_conn, int timeout,
 				/* Finished */
 				break;
 			}
-			if ( (state == ST_STATE1) && (d_l3_conn->msg == NULL) )
+			if ( (state == ST_STATE1) && (d_l3_conn->msgs.head == NULL) )
 			{
 				/*
 				 * Try again, with real timeout
@@ -385,18 +395,16 @@ printf("[CJH] %s %d: No process_data function!\n",__FUNCTION__,__LINE__);
 
 			if (diag_l3_debug & DIAG_DEBUG_PROTO)
 				fprintf(stderr,FLFMT "recv process_data called, msg %p rxoffset %d\n",
-					FL, d_l3_conn->msg,
+					FL, d_l3_conn->msgs.head,
 					d_l3_conn->rxoffset);
 
 			/*
 			 * If there is a full message, remove it, call back
 			 * the user call back routine with it, and free it
 			 */
-			msg = d_l3_conn->msg;
+			msg = diag_msglist_pop(&d_l3_conn->msgs);
 			if (msg)
 			{
-				d_l3_conn->msg = msg->next;
-
 				if ( (d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_DATA_ONLY) == 0)
 				{
 					/* Strip hdr/checksum */
@@ -404,9 +412,7 @@ printf("[CJH] %s %d: No process_data function!\n",__FUNCTION__,__LINE__);
 					msg->len -= 4;
 				}
 				rcv_call_back(handle, msg);
-				if (msg->len)
-					free (msg->data);
-				free (msg);
+				diag_freemsg(msg);
 				rv = 0;
 				/* And quit while we are ahead */
 				break;
@@ -482,7 +488,6 @@ diag_l3_iso14230_timer(struct diag_l3_conn *d_l3_conn, int ms)
 
 	if (diag_l3_debug & DIAG_DEBUG_TIMER)
 	{
-		/* XXX Not async-signal-safe */
 		fprintf(stderr, FLFMT "timeout impending for %p %d ms\n",
 				FL, d_l3_conn, ms);
 	}
@@ -621,5 +626,6 @@ static const char *l3_iso14230_neglookup(const int id)
 const diag_l3_proto_t diag_l3_iso14230 = {
 	"ISO14230", diag_l3_base_start, diag_l3_base_stop,
 	diag_l3_iso14230_send, diag_l3_iso14230_recv, NULL,
-	diag_l3_iso14230_decode, diag_l3_iso14230_timer 
+	diag_l3_iso14230_decode, diag_l3_iso14230_timer,
+	ISO14230_KEEPALIVE
 };
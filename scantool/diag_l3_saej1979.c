@@ -40,7 +40,7 @@ CVSID("$Id: diag_l3_saej1979.c,v 1.8 2011/06/09 01:11:25 fenugrec Exp $");
  * This includes the 3 header bytes, up to 7 data bytes, 1 ERR byte
  *
  * XXX DOESN'T COPE WITH in-frame-response - will break check routine as well
- * Also doesn't support 15765 (CAN) which has more modes.
+ * CAN (15765) isn't an issue : its L2 frames the messages, so this isn't used.
  *
  * Get this wrong and all will fail, it's used to frame the incoming messages
  * properly
@@ -274,6 +274,27 @@ diag_l3_j1979_send(struct diag_l3_conn *d_l3_conn, struct diag_msg *msg)
 	return rv;
 }
 
+/*
+ * On CAN (ISO 15765-4) the mode 3/7/0x0A responses carry a count of DTCs
+ * before the DTCs themselves, which can be more than the fixed 3 that
+ * K-line and J1850 send. Drop the count so that upper layers see the same
+ * mode byte + DTC pairs format everywhere, just with a variable length.
+ */
+static void
+diag_l3_j1979_candtcs(struct diag_msg *msg)
+{
+	for (; msg; msg = msg->next) {
+		if (msg->len < 2)
+			continue;
+		if (msg->data[0] != 0x43 && msg->data[0] != 0x47
+				&& msg->data[0] != 0x4A)
+			continue;
+		msg->data[1] = msg->data[0];
+		msg->data++;
+		msg->len--;
+	}
+}
+
 /*
  * RX callback, called as data received from L2. If we get a full message,
  * call L3 callback routine
@@ -317,11 +338,24 @@ diag_l3_rcv_callback(void *handle, struct diag_msg *msg)
 			/* XXX check checksum */
 
 		}
+		if (d_l3_conn->d_l3l2_conn->diag_link->diag_l2_l1protocol
+				== DIAG_L1_CAN)
+			diag_l3_j1979_candtcs(msg);
 		/* And send data upward if needed */
 		if (d_l3_conn->callback)
 			d_l3_conn->callback(d_l3_conn->handle, msg);
 	} else {
 		/* Add data to the receive buffer on the L3 connection */
+		if (d_l3_conn->rxoffset + msg->len > MAXRBUF) {
+			/* Never framed up, drop it */
+			if (diag_l3_debug & DIAG_DEBUG_READ)
+				fprintf(stderr,FLFMT "rcv_callback discarding %d unframed bytes\n",
+					FL, d_l3_conn->rxoffset);
+			d_l3_conn->rxoffset = 0;
+		}
+		if (diag_l3_rxbuf_get(d_l3_conn,
+				(size_t)(d_l3_conn->rxoffset + msg->len)))
+			return;
 		memcpy(&d_l3_conn->rxbuf[d_l3_conn->rxoffset],
 			msg->data, msg->len);
 		d_l3_conn->rxoffset += msg->len;
@@ -387,54 +421,34 @@ diag_l3_j1979_process_data(struct diag_l3_conn *d_l3_conn)
 		if (badpacket || (sae_msglen <= d_l3_conn->rxoffset )) {
 
 			/* Bad packet, or full packet, need to tell user */
-			uint8_t *data = NULL;
-			struct diag_msg *lmsg;
-
-			if (diag_calloc(&msg, 1)) {
+			/* Failure indicated by zero len msg */
+			msg = diag_allocmsg(badpacket ? 0 : (size_t)(sae_msglen - 4));
+			if (msg == NULL) {
 				/* Stuffed, no memory, cant do anything */
 				return;
 			}
 
-			if (!badpacket)
-				if (diag_malloc(&data, (size_t)sae_msglen))
-					return;
-	
-			if (badpacket || (data == NULL)) {
-				/* Failure indicated by zero len msg */
-				msg->data = NULL;
-				msg->len = 0;
-			} else {
+			if (!badpacket) {
 				msg->fmt = DIAG_FMT_ISO_FUNCADDR;
 				msg->type = d_l3_conn->rxbuf[0];
 				msg->dest = d_l3_conn->rxbuf[1];
 				msg->src = d_l3_conn->rxbuf[2];
 				/* Copy in J1979 part of message */
-				memcpy(data, &d_l3_conn->rxbuf[3], (size_t)(sae_msglen - 4));
+				memcpy(msg->data, &d_l3_conn->rxbuf[3], (size_t)(sae_msglen - 4));
 				/* remove whole message from rx buf */
-				memcpy(d_l3_conn->rxbuf, 
+				memmove(d_l3_conn->rxbuf,
 					&d_l3_conn->rxbuf[sae_msglen],
-					(size_t)sae_msglen);
+					(size_t)(d_l3_conn->rxoffset - sae_msglen));
 
 				d_l3_conn->rxoffset -= sae_msglen;
 
-				msg->data = data;
 				msg->len = sae_msglen - 4;
 			}
-			free(data);
 
-			gettimeofday(&msg->rxtime, NULL);
+			msg->rxtime = diag_os_getns();
 
 			/* Add it to the list */
-			if (d_l3_conn->msg == NULL) {
-				d_l3_conn->msg = msg;
-			} else {
-				lmsg = d_l3_conn->msg;
-				while (lmsg->next != NULL) {
-					lmsg = lmsg->next;
-				}
-				lmsg->next = msg;
-			}
-			free(msg);
+			diag_msglist_append(&d_l3_conn->msgs, msg);
 			if (badpacket) {
 				/* No point in continuing */
 				break;
@@ -444,6 +458,7 @@ diag_l3_j1979_process_data(struct diag_l3_conn *d_l3_conn)
 			break;
 		}
 	}
+	diag_l3_rxbuf_put(d_l3_conn);
 }
 
 /*
@@ -533,7 +548,7 @@ diag_l3_j1979_recv(struct diag_l3_conn *d_l3_conn, int timeout,
 				/* Finished */
 				break;
 			}
-			if ( (state == ST_STATE1) && (d_l3_conn->msg == NULL) ) {
+			if ( (state == ST_STATE1) && (d_l3_conn->msgs.head == NULL) ) {
 				/*
 				 * Try again, with real timeout
 				 * (and thus sleep)
@@ -550,26 +565,19 @@ diag_l3_j1979_recv(struct diag_l3_conn *d_l3_conn, int timeout,
 
 			if (diag_l3_debug & DIAG_DEBUG_PROTO)
 				fprintf(stderr,FLFMT "recv process_data called, msg %p rxoffset %d\n",
-					FL, d_l3_conn->msg,
+					FL, d_l3_conn->msgs.head,
 					d_l3_conn->rxoffset);
 
 			/*
 			 * If there is a full message, remove it, call back
 			 * the user call back routine with it, and free it
 			 */
-			msg = d_l3_conn->msg;
+			msg = diag_msglist_pop(&d_l3_conn->msgs);
 			if (msg) {
-				d_l3_conn->msg = msg->next;
 
-				if ( (d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_DATA_ONLY) == 0) {
-					/* Strip hdr/checksum */
-					msg->data += 3;
-					msg->len -= 4;
-				}
+				/* hdr/checksum were stripped by process_data */
 				rcv_call_back(handle, msg);
-				if (msg->len)
-					free (msg->data);
-				free (msg);
+				diag_freemsg(msg);
 				rv = 0;
 				/* And quit while we are ahead */
 				break;
@@ -656,14 +664,23 @@ struct diag_msg *msg, char *buf, size_t bufsize)
 				"Request Non-Continuous Monitor System Test Results");
 			smartcat(buf, bufsize, buf2);
 			break;
+		case 0x0A:
+			smartcat(buf, bufsize, "Request Permanent DTCs");
+			break;
+		case 0x4A:
+			smartcat(buf, bufsize, "Permanent ");
+			/* Fallthru */
 		case 0x47:
-			snprintf(buf2, sizeof(buf2), "Non-Continuous Monitor System ");
-			smartcat(buf, bufsize, buf2);
+			if (msg->data[0] == 0x47) {
+				snprintf(buf2, sizeof(buf2), "Non-Continuous Monitor System ");
+				smartcat(buf, bufsize, buf2);
+			}
 			/* Fallthru */
 		case 0x43:
 			snprintf(buf2, sizeof(buf2),"DTCs: ");
 			smartcat(buf, bufsize, buf2);
-			for (i=0, j=1; i<3; i++, j+=2) {
+			/* 3 DTCs per message, or as many as fit on CAN */
+			for (j=1; j+1 < msg->len; j+=2) {
 				if ((msg->data[j]==0) && (msg->data[j+1]==0))
 					continue;
 				
@@ -778,10 +795,13 @@ diag_l3_j1979_timer(struct diag_l3_conn *d_l3_conn, int ms)
 	if (d_l3_conn->d_l3l2_flags & DIAG_L2_FLAG_KEEPALIVE)
 		return;
 
+	/* ISO 15765-4 has no session to keep alive */
+	if (d_l3_conn->d_l3l2_conn->diag_link->diag_l2_l1protocol == DIAG_L1_CAN)
+		return;
+
 	/* OK, do keep alive on this connection */
 
 	if (diag_l3_debug & DIAG_DEBUG_TIMER) {
-		/* XXX Not async-signal-safe */
 		fprintf(stderr, FLFMT "timeout impending for %p %d ms\n",
 				FL, d_l3_conn, ms);
 	}
@@ -816,5 +836,6 @@ diag_l3_j1979_timer(struct diag_l3_conn *d_l3_conn, int ms)
 const diag_l3_proto_t diag_l3_j1979 = {
 	"SAEJ1979", diag_l3_base_start, diag_l3_base_stop,
 	diag_l3_j1979_send, diag_l3_j1979_recv, NULL,
-	diag_l3_j1979_decode, diag_l3_j1979_timer 
+	diag_l3_j1979_decode, diag_l3_j1979_timer,
+	J1979_KEEPALIVE
 };
@@ -41,6 +41,7 @@
 
 #ifdef WIN32
 #include <process.h>
+#include <windows.h>	/* Sleep() */
 
 //#include <winsock.h>
 
@@ -53,16 +54,21 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#include <linux/rtc.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include "diag.h"
 #include "diag_tty.h"
@@ -76,62 +82,495 @@ CVSID("$Id: diag_os.c,v 1.4 2011/08/07 02:17:46 fenugrec Exp $");
 
 int diag_os_init_done;
 
+static void diag_os_calibrate(void);
+
+/*
+ * Timers.
+ *
+ * L2 and L3 connections arm one-shot timers (struct diag_os_timer) on
+ * their real deadlines (keepalive etc.); a single timer thread sleeps
+ * until the nearest one, so there are no wakeups at all while nothing is
+ * due. Pending timers live in a hashed timing wheel: DIAG_OS_WHEEL_SLOTS
+ * slots of 1ms, a timer goes in slot (expiry % DIAG_OS_WHEEL_SLOTS) and
+ * timers more than one revolution away simply stay there until their
+ * round comes up.
+ *
+ * Callbacks run in the timer thread with the diag lock held (see
+ * diag_os_lock()). Threads let go of the lock while they sleep or wait
+ * for input, so a callback may find its link in the middle of a request
+ * (see diag_l2_link_busy()). If the lock is busy (the application is
+ * doing work between waits) the expired timers are deferred: the thread
+ * sleeps until the outermost diag_os_unlock() kicks it, and they run
+ * right after the request, once their owners have had a chance to push
+ * their deadlines back (a keepalive is moot after a real request).
+ * A callback that finds its link busy parks its timer on the link
+ * (diag_os_timer_defer()) and releasing the link makes it due again
+ * (diag_os_timer_kick()), so nothing polls while a link is in use.
+ * Due timers are taken out of the wheel one at a time and marked as
+ * firing while their callback runs, since other threads may re-arm or
+ * cancel them whenever the callback lets go of the diag lock.
+ *
+ * Lock ordering : the diag lock is always taken before the wheel lock;
+ * the timer thread only ever trylocks the diag lock while holding the
+ * wheel lock.
+ */
+#define DIAG_OS_WHEEL_SLOTS	256	/* Must be a power of 2 */
+#define DIAG_OS_WHEEL_MASK	(DIAG_OS_WHEEL_SLOTS - 1)
+
+static struct diag_os_timer *diag_os_wheel[DIAG_OS_WHEEL_SLOTS];
+static struct diag_os_timer *diag_os_parked;	/* diag_os_timer_defer() */
+static unsigned long diag_os_wheel_tick;	/* Next tick to be processed */
+static unsigned long diag_os_wheel_wakeup;	/* When the thread will wake up */
+static int diag_os_wheel_deferred;	/* Thread waits for diag_os_unlock() */
+#ifdef __GNUC__
+#define DIAG_OS_TLS	__thread
+#else
+/* Can't tell which thread holds the lock, so never let go of it */
+#define DIAG_OS_TLS
+#define DIAG_OS_NODROP
+#endif
+static DIAG_OS_TLS int diag_os_lockdepth;	/* This thread's diag lock recursion */
+static struct timespec diag_os_wheel_base;	/* Tick 0 */
+
+static pthread_mutex_t diag_os_wheel_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diag_os_wheel_cond;
+static pthread_cond_t diag_os_fired_cond = PTHREAD_COND_INITIALIZER;	/* A callback returned */
+static pthread_mutex_t diag_os_biglock;
+/* diag_os_lock_wait() / diag_os_lock_wake() */
+static pthread_mutex_t diag_os_wake_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t diag_os_wake_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int diag_os_wake_gen;
+static pthread_t diag_os_timer_thread;
+
+/* Current time, in wheel ticks (ms) */
+static unsigned long
+diag_os_wheel_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long) ((now.tv_sec - diag_os_wheel_base.tv_sec) * 1000 +
+		(now.tv_nsec - diag_os_wheel_base.tv_nsec) / 1000000);
+}
+
+/* Unlink from its slot (or the parked list); wheel lock held */
+static void
+diag_os_wheel_unlink(struct diag_os_timer *t)
+{
+	struct diag_os_timer **head;
+
+	if (t->pending)
+		head = &diag_os_wheel[t->expires & DIAG_OS_WHEEL_MASK];
+	else if (t->parked)
+		head = &diag_os_parked;
+	else
+		return;
+
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*head = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	t->pending = 0;
+	t->parked = 0;
+}
+
+/* Link into the wheel, ms from now; wheel lock held */
+static void
+diag_os_wheel_add(struct diag_os_timer *t, unsigned int ms)
+{
+	unsigned long expires;
+
+	expires = diag_os_wheel_now() + ms;
+	if (expires < diag_os_wheel_tick)
+		expires = diag_os_wheel_tick;	/* Don't land in a slot already swept */
+	t->expires = expires;
+	t->prev = NULL;
+	t->next = diag_os_wheel[expires & DIAG_OS_WHEEL_MASK];
+	if (t->next)
+		t->next->prev = t;
+	diag_os_wheel[expires & DIAG_OS_WHEEL_MASK] = t;
+	t->pending = 1;
+
+	if (!diag_os_wheel_deferred &&
+			((diag_os_wheel_wakeup == 0) || (expires < diag_os_wheel_wakeup)))
+		pthread_cond_signal(&diag_os_wheel_cond);
+}
+
 /*
- * SIGALRM handler.
-+* XXX Should be replaced with Posix timers, where available.
-+* Those are much better behaved, you get one handler per installed
-+* handler.
-+* Also, the current implementation uses non-async-signal-safe functions
-+* in the signal handlers.  Their behavior is undefined if they happen
-+* to occur during any other non-async-signal-safe function.
+ * Unlink and return the next timer due by "now", or NULL once the
+ * wheel has been swept up to now; wheel lock held.
  */
+static struct diag_os_timer *
+diag_os_wheel_pop(unsigned long now)
+{
+	struct diag_os_timer *t;
+	int i;
+
+	for (i = 0; (i < DIAG_OS_WHEEL_SLOTS) && (diag_os_wheel_tick <= now); i++) {
+		for (t = diag_os_wheel[diag_os_wheel_tick & DIAG_OS_WHEEL_MASK];
+				t; t = t->next) {
+			if (t->expires <= now) {
+				diag_os_wheel_unlink(t);
+				return t;
+			}
+		}
+		diag_os_wheel_tick++;
+	}
+	/* Swept to now, or a whole revolution with nothing due */
+	diag_os_wheel_tick = now + 1;
+	return NULL;
+}
+
+/* Earliest expiry in the wheel, or 0 if it's empty; wheel lock held */
+static unsigned long
+diag_os_wheel_next(void)
+{
+	struct diag_os_timer *t;
+	unsigned long tick, first = 0;
+	int i;
+
+	/* Usual case : something due within this revolution */
+	for (i = 0, tick = diag_os_wheel_tick; i < DIAG_OS_WHEEL_SLOTS; i++, tick++) {
+		for (t = diag_os_wheel[tick & DIAG_OS_WHEEL_MASK]; t; t = t->next) {
+			if (t->expires <= tick)
+				return tick;
+			if ((first == 0) || (t->expires < first))
+				first = t->expires;
+		}
+	}
+	return first;
+}
+
 #ifdef WIN32
+static void *
+diag_os_timer_main(void *unused)
+#else
+static void *
+diag_os_timer_main(void *unused __attribute__((unused)))
+#endif
+{
+	struct diag_os_timer *t;
+	unsigned long now, next;
+	struct timespec ts;
+
+	diag_err_background();
+
+	pthread_mutex_lock(&diag_os_wheel_mtx);
+	while (1) {
+		now = diag_os_wheel_now();
+
+		if (pthread_mutex_trylock(&diag_os_biglock) == 0) {
+			diag_os_lockdepth++;
+
+			/*
+			 * One at a time : the callback may let go of the diag
+			 * lock while it waits for the ECU, and meanwhile other
+			 * threads may re-arm or cancel any timer, this one
+			 * included (see "firing").
+			 */
+			while ((t = diag_os_wheel_pop(now)) != NULL) {
+				t->firing = 1;
+				pthread_mutex_unlock(&diag_os_wheel_mtx);
+				t->callback(t->arg);
+				(void) diag_geterr();	/* Nobody else will */
+				pthread_mutex_lock(&diag_os_wheel_mtx);
+				t->firing = 0;
+				pthread_cond_broadcast(&diag_os_fired_cond);
+			}
+			diag_os_lockdepth--;
+			pthread_mutex_unlock(&diag_os_biglock);
+
+			next = diag_os_wheel_next();
+		} else {
+			/* Busy; whatever is due waits for diag_os_unlock() */
+			next = diag_os_wheel_next();
+			if (next && (next <= now)) {
+				diag_os_wheel_deferred = 1;
+				next = 0;
+			}
+		}
+
+		/* Sleep until the next deadline (or forever), or until woken up
+		 * by diag_os_timer_set() because an earlier one was added, or
+		 * by diag_os_unlock() if deferred */
+		diag_os_wheel_wakeup = next;
+		if (next == 0) {
+			pthread_cond_wait(&diag_os_wheel_cond, &diag_os_wheel_mtx);
+		} else {
+			ts.tv_sec = diag_os_wheel_base.tv_sec + next / 1000;
+			ts.tv_nsec = diag_os_wheel_base.tv_nsec + (next % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			(void) pthread_cond_timedwait(&diag_os_wheel_cond,
+				&diag_os_wheel_mtx, &ts);
+		}
+		diag_os_wheel_wakeup = 0;
+		diag_os_wheel_deferred = 0;
+	}
+	return NULL;
+}
+
+void
+diag_os_timer_init(struct diag_os_timer *t, void (*callback)(void *), void *arg)
+{
+	memset(t, 0, sizeof(*t));
+	t->callback = callback;
+	t->arg = arg;
+}
+
+/*
+ * (Re)arm timer to expire ms milliseconds from now.
+ */
 void
+diag_os_timer_set(struct diag_os_timer *t, unsigned int ms)
+{
+	pthread_mutex_lock(&diag_os_wheel_mtx);
+	diag_os_wheel_unlink(t);
+	diag_os_wheel_add(t, ms);
+	pthread_mutex_unlock(&diag_os_wheel_mtx);
+}
+
+/*
+ * Park the timer until diag_os_timer_kick(key), typically from a
+ * callback that found the resource it needs (key) in use : rather than
+ * polling, whoever releases it kicks the timers waiting on it.
+ */
+void
+diag_os_timer_defer(struct diag_os_timer *t, void *key)
+{
+	pthread_mutex_lock(&diag_os_wheel_mtx);
+	diag_os_wheel_unlink(t);
+	t->key = key;
+	t->prev = NULL;
+	t->next = diag_os_parked;
+	if (t->next)
+		t->next->prev = t;
+	diag_os_parked = t;
+	t->parked = 1;
+	pthread_mutex_unlock(&diag_os_wheel_mtx);
+}
+
+/* Make the timers parked on key due now */
+void
+diag_os_timer_kick(void *key)
+{
+	struct diag_os_timer *t, *tnext;
+
+	pthread_mutex_lock(&diag_os_wheel_mtx);
+	for (t = diag_os_parked; t; t = tnext) {
+		tnext = t->next;
+		if (t->key == key) {
+			diag_os_wheel_unlink(t);
+			diag_os_wheel_add(t, 0);
+		}
+	}
+	pthread_mutex_unlock(&diag_os_wheel_mtx);
+}
+
+/*
+ * Disarm the timer. If its callback is running in the timer thread,
+ * wait for it to return (without the diag lock, which the callback may
+ * be waiting for), so the caller can free what the timer serves.
+ */
+void
+diag_os_timer_cancel(struct diag_os_timer *t)
+{
+	int depth;
+
+	pthread_mutex_lock(&diag_os_wheel_mtx);
+	while (1) {
+		diag_os_wheel_unlink(t);
+		if (!t->firing || pthread_equal(pthread_self(), diag_os_timer_thread))
+			break;
+
+		pthread_mutex_unlock(&diag_os_wheel_mtx);
+		depth = diag_os_lock_drop();
+		pthread_mutex_lock(&diag_os_wheel_mtx);
+		while (t->firing)
+			pthread_cond_wait(&diag_os_fired_cond, &diag_os_wheel_mtx);
+		pthread_mutex_unlock(&diag_os_wheel_mtx);
+		diag_os_lock_retake(depth);
+		/* The callback may have re-armed it meanwhile */
+		pthread_mutex_lock(&diag_os_wheel_mtx);
+	}
+	pthread_mutex_unlock(&diag_os_wheel_mtx);
+}
+
+/*
+ * The diag lock serializes the L2/L3 entry points with the timer
+ * callbacks. It is recursive, as timer callbacks (keepalives) and
+ * L3 code call back into L2.
+ */
+void
+diag_os_lock(void)
+{
+	pthread_mutex_lock(&diag_os_biglock);
+	diag_os_lockdepth++;
+}
+
+/* Kick the timer thread if it waits for the lock */
+static void
+diag_os_lock_released(void)
+{
+	pthread_mutex_lock(&diag_os_wheel_mtx);
+	if (diag_os_wheel_deferred) {
+		diag_os_wheel_deferred = 0;
+		pthread_cond_signal(&diag_os_wheel_cond);
+	}
+	pthread_mutex_unlock(&diag_os_wheel_mtx);
+}
+
+void
+diag_os_unlock(void)
+{
+	int last = (--diag_os_lockdepth == 0);
+
+	pthread_mutex_unlock(&diag_os_biglock);
+
+	/* Run any timers that expired while we held the lock */
+	if (last)
+		diag_os_lock_released();
+}
+
+/*
+ * Let go of the diag lock entirely, for as long as this thread is going
+ * to sleep or wait for input; other threads can use their own links
+ * meanwhile (ours is kept by diag_l2_link_enter()). Returns how deep we
+ * held it (0 : we didn't), to be given back to diag_os_lock_retake().
+ */
+int
+diag_os_lock_drop(void)
+{
+	int depth = diag_os_lockdepth;
+	int i;
+
+#ifdef DIAG_OS_NODROP
+	depth = 0;
+#endif
+	if (depth == 0)
+		return 0;
+
+	diag_os_lockdepth = 0;
+	for (i = 0; i < depth; i++)
+		pthread_mutex_unlock(&diag_os_biglock);
+	diag_os_lock_released();
+
+	return depth;
+}
+
+void
+diag_os_lock_retake(int depth)
+{
+	int i;
+
+	for (i = 0; i < depth; i++)
+		pthread_mutex_lock(&diag_os_biglock);
+	diag_os_lockdepth = depth;
+}
+
+/*
+ * Called with the diag lock held : let go of it until the next
+ * diag_os_lock_wake() (by any thread), then take it back. Whatever we
+ * wait for must be checked again, under the lock, on return.
+ */
+void
+diag_os_lock_wait(void)
+{
+	unsigned int gen;
+	int depth;
+
+	pthread_mutex_lock(&diag_os_wake_mtx);
+	gen = diag_os_wake_gen;
+	depth = diag_os_lock_drop();
+	if (depth) {
+		while (gen == diag_os_wake_gen)
+			pthread_cond_wait(&diag_os_wake_cond, &diag_os_wake_mtx);
+	}
+	pthread_mutex_unlock(&diag_os_wake_mtx);
+	diag_os_lock_retake(depth);
+}
+
+void
+diag_os_lock_wake(void)
+{
+	pthread_mutex_lock(&diag_os_wake_mtx);
+	diag_os_wake_gen++;
+	pthread_cond_broadcast(&diag_os_wake_cond);
+	pthread_mutex_unlock(&diag_os_wake_mtx);
+}
+
+#if !defined(__linux__) || (TRY_POSIX == 1)
+/*
+ * The POSIX diag_tty_read() counts on a regular SIGALRM to interrupt its
+ * blocking read(); the handler itself has nothing to do.
+ */
+#ifdef WIN32
+static void
 diag_os_sigalrm(int unused)
 #else
-void
+static void
 diag_os_sigalrm(int unused __attribute__((unused)))
 #endif
 {
-	diag_l3_timer();	/* Call L3 Timer */
-	diag_l2_timer();	/* Call L2 timers, which will call L1 timer */
+	return;
 }
+#endif
 
 int
 diag_os_init(void)
 {
-#ifdef WIN32
-	struct sigaction_t stNew;
-#else
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	int rv;
+#if !defined(__linux__) || (TRY_POSIX == 1)
 	struct sigaction stNew;
 	struct itimerval tv;
-#endif
 	long tmo = 1;	/* 1 ms */
+#endif
 
 	if (diag_os_init_done)
 		return(0);
 	diag_os_init_done = 1;
 
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&diag_os_biglock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	/* The wheel runs on the monotonic clock, so must its condvar */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&diag_os_wheel_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	clock_gettime(CLOCK_MONOTONIC, &diag_os_wheel_base);
+	diag_os_wheel_tick = 0;
+
+	diag_os_calibrate();
+
+	rv = pthread_create(&diag_os_timer_thread, NULL, diag_os_timer_main, NULL);
+	if (rv) {
+		fprintf(stderr, FLFMT "Could not start timer thread: %s\n",
+			FL, strerror(rv));
+		diag_os_init_done = 0;
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+	(void) pthread_detach(diag_os_timer_thread);
+
+#if !defined(__linux__) || (TRY_POSIX == 1)
 	/*
 	 * Install alarm handler
 	 */
 	memset(&stNew, 0, sizeof(stNew));
 	stNew.sa_handler = diag_os_sigalrm;
 	stNew.sa_flags = 0;
-
-	/*
-	 * I want to use POSIX timers to interrupt the reads, but I can't
-	 * if SA_RESTART is in effect.  The best thing would be to use
-	 * POSIX threads since the behavior is well-defined.
-	 */
-#if defined(__linux__) && (TRY_POSIX == 0)
-	stNew.sa_flags = SA_RESTART;
-#else
-	stNew.sa_flags = 0;
-#endif
 	sigaction(SIGALRM, &stNew, NULL);
 
-#ifndef WIN32
 	/* 
 	 * Start repeating timer
 	 */
@@ -147,175 +586,366 @@ diag_os_init(void)
 }
 
 
-//different os_millisleep implementations
-#if defined(__linux__) && (TRY_POSIX == 0)
+/*
+ * Sleeping.
+ *
+ * Everything ends up in diag_os_sleepuntil(), which sleeps on an
+ * absolute CLOCK_MONOTONIC deadline (so errors don't accumulate over
+ * successive waits), waking up a little early and busy-waiting for the
+ * final "spin slice". The slice is calibrated by diag_os_init() from the
+ * measured overshoot of plain clock_nanosleep()s on this machine.
+ * The diag lock is let go of for the whole wait, spin included, so that
+ * a thread pacing bytes doesn't hold up the other sessions.
+ * A deadline that has passed already returns right away : callers like
+ * diag_l2_p3wait() often ask for one, and how late they are is not an
+ * overshoot of ours.
+ *
+ * The overshoot of every sleep is kept in a small ring for
+ * diag_os_sleepstats(). Any thread may sleep (callers, L2 workers, the
+ * timer thread), so the ring has its own mutex.
+ */
+#define DIAG_OS_SPIN_MAX	2000000L	/* ns; never busy-wait longer */
+#define DIAG_OS_CAL_SAMPLES	20
+#define DIAG_OS_JITTER_SAMPLES	256
+
+static long diag_os_spinslice;		/* ns */
+static long diag_os_jitter[DIAG_OS_JITTER_SAMPLES];	/* Overshoot, ns */
+static unsigned int diag_os_jitter_next, diag_os_jitter_cnt;
+static pthread_mutex_t diag_os_jitter_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+diag_os_cmplong(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+
+	return (la > lb) - (la < lb);
+}
 
+/*
+ * Sleep until the monotonic time "deadline" (see diag_os_getns())
+ */
 int
-diag_os_millisleep(int ms)
+diag_os_sleepuntil(tstamp_type deadline)
 {
+#ifndef WIN32
+	struct timespec ts;
+#endif
+	tstamp_type now, wake;
+	int rv, depth;
 
-	int i, fd, retval;
-	unsigned long tmp,data;
-	struct rtc_time rtc_tm;
+	now = diag_os_getns();
+	if (deadline <= now)
+		return 0;
 
-	/* adjust time for 2048 rate */
+	depth = diag_os_lock_drop();
+	if (deadline > now + diag_os_spinslice) {
+		wake = deadline - diag_os_spinslice;
+#ifdef WIN32
+		/*
+		 * No absolute sleep here : Sleep() in whole ms, rounded down,
+		 * the spin below makes up the rest.
+		 */
+		rv = 0;
+		Sleep((DWORD) ((wake - now) / 1000000));
+#else
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		while ((rv = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&ts, NULL)) == EINTR)
+			;
+#endif
+		if (rv) {
+			diag_os_lock_retake(depth);
+			fprintf(stderr, FLFMT "clock_nanosleep failed: %s\n",
+				FL, strerror(rv));
+			return -1;
+		}
+	}
 
-	ms *= 4096/2000;
+	/* Spin for the rest */
+	while ((now = diag_os_getns()) < deadline)
+		;
 
-	if (ms > 2)
-		ms-=2;
+	pthread_mutex_lock(&diag_os_jitter_mtx);
+	diag_os_jitter[diag_os_jitter_next] = (long) (now - deadline);
+	diag_os_jitter_next = (diag_os_jitter_next + 1) % DIAG_OS_JITTER_SAMPLES;
+	if (diag_os_jitter_cnt < DIAG_OS_JITTER_SAMPLES)
+		diag_os_jitter_cnt++;
+	pthread_mutex_unlock(&diag_os_jitter_mtx);
 
-	fd = open ("/dev/rtc", O_RDONLY);
+	diag_os_lock_retake(depth);
+	return 0;
+}
 
-	if (fd ==  -1) {
-		perror("/dev/rtc");
-		exit(errno);
-	}
+int
+diag_os_usleep(unsigned long us)
+{
+	return diag_os_sleepuntil(diag_os_getns() + (tstamp_type) us * 1000);
+}
 
-	/* Read periodic IRQ rate */
-	retval = ioctl(fd, RTC_IRQP_READ, &tmp);
-	if (retval == -1) {
-		perror("ioctl");
-		exit(errno);
-	}
+int
+diag_os_millisleep(int ms)
+{
+	if (ms <= 0)
+		return 0;
+	return diag_os_usleep((unsigned long) ms * 1000);
+}
 
-	if (retval != 2048) {
+/*
+ * Measure how late plain sleeps wake up, and spin for that long
+ * (well, its worst case + a margin) at the end of each sleep.
+ */
+static void
+diag_os_calibrate(void)
+{
+	long samples[DIAG_OS_CAL_SAMPLES];
+	int i;
 
-		retval = ioctl(fd, RTC_IRQP_SET, 2048);
-		if (retval == -1) {
-			perror("ioctl");
-			exit(errno);
-		}
+	diag_os_spinslice = 0;
+	for (i = 0; i < DIAG_OS_CAL_SAMPLES; i++) {
+		tstamp_type deadline = diag_os_getns() + 1000000;	/* 1ms */
+		(void) diag_os_sleepuntil(deadline);
+		samples[i] = (long) (diag_os_getns() - deadline);
 	}
+	qsort(samples, DIAG_OS_CAL_SAMPLES, sizeof(long), diag_os_cmplong);
 
-	/* Enable periodic interrupts */
-	retval = ioctl(fd, RTC_PIE_ON, 0);
-	if (retval == -1) {
-		perror("ioctl");
-		exit(errno);
-	}
+	diag_os_spinslice = samples[DIAG_OS_CAL_SAMPLES - 1] + 50000;
+	if (diag_os_spinslice > DIAG_OS_SPIN_MAX)
+		diag_os_spinslice = DIAG_OS_SPIN_MAX;
 
-	i = 0;
-	while (1) {
-		/* This blocks */
-		retval = read(fd, &data, sizeof(unsigned long));
-		if (retval == -1) {
-			perror("read");
-			exit(errno);
-		}
-		data >>= 8;
-		i+=(int)data;
-		if (i>=(ms*2))
-			break;
-	}
+	pthread_mutex_lock(&diag_os_jitter_mtx);
+	diag_os_jitter_next = diag_os_jitter_cnt = 0;
+	pthread_mutex_unlock(&diag_os_jitter_mtx);
+}
 
-	/* Disable periodic interrupts */
-	retval = ioctl(fd, RTC_PIE_OFF, 0);
-	if (retval == -1) {
-		perror("ioctl");
-		exit(errno);
-	}
+/*
+ * Print the sleep overshoot stats (last DIAG_OS_JITTER_SAMPLES sleeps)
+ */
+void
+diag_os_sleepstats(FILE *fp)
+{
+	long sorted[DIAG_OS_JITTER_SAMPLES];
+	unsigned int n;
 
-	close(fd);
+	fprintf(fp, "Sleep spin slice: %ldus\n", diag_os_spinslice / 1000);
+	pthread_mutex_lock(&diag_os_jitter_mtx);
+	n = diag_os_jitter_cnt;
+	memcpy(sorted, diag_os_jitter, n * sizeof(long));
+	pthread_mutex_unlock(&diag_os_jitter_mtx);
+	if (n == 0) {
+		fprintf(fp, "No sleeps yet.\n");
+		return;
+	}
+	qsort(sorted, n, sizeof(long), diag_os_cmplong);
 
-	return (0);
+	fprintf(fp, "Overshoot over the last %u sleeps: p50 %ldus, p99 %ldus, max %ldus\n",
+		n, sorted[n / 2] / 1000, sorted[(n * 99) / 100] / 1000,
+		sorted[n - 1] / 1000);
 }
 
-//old millisleep
-#if 0
+/*
+ * diag_os_getns: current CLOCK_MONOTONIC time, in ns.
+ * Used for all message timestamps and timing measurements.
+ */
+tstamp_type
+diag_os_getns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (tstamp_type) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
 /*
-+* Original LINUX implementation for a millisecond sleep:
- *
- * Sleep for N milliseconds
+ * Reactor. One thread waits for any of its sources (an fd to read, a
+ * deadline, or both) with a single epoll_wait() (poll() elsewhere), and
+ * runs the callbacks of those that are ready with the diag lock held.
+ * Deadlines are kept in the sources themselves, which set them again
+ * from their callbacks; there are at most a few dozen, so finding the
+ * nearest one is a plain walk.
  *
- * This is aimed at small waits as it does very accurate "busy wait"
- * sleeping 2ms at a time (nanosleep does busy wait sleeps for <=2ms requests)
+ * Every callback runs under the global diag lock, and they run one after
+ * the other : a source whose callback is slow (or sleeps without letting
+ * go of the lock) holds up all the others, so callbacks should only do
+ * what's ready and return.
  *
-+* XXX I'm not sure what the above comment means.  The POSIX definition
-+* of nanosleep is:
-+*
-+* "The nanosleep() function shall cause the current thread to be
-+* suspended from execution until hte time interval specified by the
-+* rqtp argument has elapsed, a signal is delivered to the calling
-+* thread and the action of the signal is to invoke a signal-catching
-+* function, or the process is terminated"
-+*
-+* Note that this is thread specific, the process is suspended (it
-+* doesn't busy wait), and signals wake it up again.  I've provided what
-+* I think is the correct implementation below.  This one is much more overhead
-+* than it needs to be.
+ * A callback may remove its own source, but not another one.
  */
-int
-diag_os_millisleep(int ms)
+#define DIAG_OS_REACTOR_EVENTS	32
+
+struct diag_os_reactor
 {
-	struct timespec rqst, resp;
+	struct diag_os_rsrc *srcs;
+	unsigned int nsrcs;
+#if defined(__linux__)
+	int epfd;
+#endif
+};
 
-	if (ms > 1)
-		ms /= 2;
+struct diag_os_reactor *
+diag_os_reactor_new(void)
+{
+	struct diag_os_reactor *r;
+	int rv;
 
-	while (ms)
-	{
-		if (ms > 2)
-		{
-			rqst.tv_nsec = 2000000;
-			ms -= 2;
+	if ((rv = diag_calloc(&r, 1)))
+		return (struct diag_os_reactor *)diag_pseterr(rv);
+#if defined(__linux__)
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd < 0) {
+		fprintf(stderr, FLFMT "epoll_create1 failed: %s\n",
+			FL, strerror(errno));
+		free(r);
+		return (struct diag_os_reactor *)diag_pseterr(DIAG_ERR_GENERAL);
+	}
+#endif
+	return r;
+}
 
-		}
-		else
-		{
-			rqst.tv_nsec = ms * 1000000;
-			ms = 0;
-		}
-		rqst.tv_sec = 0;
-
-		while (nanosleep(&rqst, &resp) != 0)
-		{
-			if (errno == EINTR)
-			{
-				/* Interrupted, continue */
-				memcpy(&rqst, &resp, sizeof(resp));
-			}
-			else
-				return(-1);	/* Some other failure */
+/* The sources must have been removed (or be dead) already */
+void
+diag_os_reactor_free(struct diag_os_reactor *r)
+{
+#if defined(__linux__)
+	close(r->epfd);
+#endif
+	free(r);
+}
+
+int
+diag_os_reactor_add(struct diag_os_reactor *r, struct diag_os_rsrc *rs)
+{
+#if defined(__linux__)
+	if (rs->fd >= 0) {
+		struct epoll_event ev;
 
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = rs;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, rs->fd, &ev) < 0) {
+			fprintf(stderr, FLFMT "epoll_ctl fd %d failed: %s\n",
+				FL, rs->fd, strerror(errno));
+			return diag_iseterr(DIAG_ERR_GENERAL);
 		}
 	}
-
-	return(0);
+#endif
+	rs->next = r->srcs;
+	r->srcs = rs;
+	r->nsrcs++;
+	return 0;
 }
 
-#endif
+void
+diag_os_reactor_del(struct diag_os_reactor *r, struct diag_os_rsrc *rs)
+{
+	struct diag_os_rsrc **p;
 
-//following from initial "if linux && !posix" :
-#else
+	for (p = &r->srcs; *p; p = &(*p)->next) {
+		if (*p == rs) {
+			*p = rs->next;
+			r->nsrcs--;
+#if defined(__linux__)
+			if (rs->fd >= 0)
+				(void) epoll_ctl(r->epfd, EPOLL_CTL_DEL, rs->fd, NULL);
+#endif
+			break;
+		}
+	}
+}
 
 /*
-+* I think this implementation works in all cases, with less overhead.
+ * Wait up to timeout ms (< 0 : until something happens) and dispatch.
+ * Returns the number of callbacks made, or the first error a callback
+ * (or the wait itself) returned.
  */
 int
-diag_os_millisleep(int ms) {
-#ifndef WIN32
-	struct timespec rqst, resp;
+diag_os_reactor_run(struct diag_os_reactor *r, int timeout)
+{
+	struct diag_os_rsrc *rs, *next;
+	tstamp_type now;
+	int i, n, ms, rv, err = 0, calls = 0;
+#if defined(__linux__)
+	struct epoll_event ev[DIAG_OS_REACTOR_EVENTS];
+#else
+	struct pollfd *pfd;
+	struct diag_os_rsrc **pfdsrc;
+#endif
 
-	rqst.tv_sec = ms / 1000;
-	rqst.tv_nsec = (ms - (rqst.tv_sec * 1000)) * 1000000L;
+	/* Sleep no later than the nearest deadline */
+	now = diag_os_getns();
+	for (rs = r->srcs; rs; rs = rs->next) {
+		if (rs->deadline == 0)
+			continue;
+		ms = 0;
+		if (rs->deadline > now)
+			ms = (int) ((rs->deadline - now + 999999) / 1000000);
+		if ((timeout < 0) || (ms < timeout))
+			timeout = ms;
+	}
 
-	errno = 0;
-	while (nanosleep(&rqst, &resp) == -1) {
-		if (errno == EINTR) {
-			rqst = resp;
-			errno = 0;
+#if defined(__linux__)
+	n = epoll_wait(r->epfd, ev, DIAG_OS_REACTOR_EVENTS, timeout);
+	if (n < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, FLFMT "epoll_wait failed: %s\n",
+				FL, strerror(errno));
+			return diag_iseterr(DIAG_ERR_GENERAL);
 		}
-		else
-			return -1;
+		n = 0;
+	}
+
+	diag_os_lock();
+	for (i = 0; i < n; i++) {
+		rs = (struct diag_os_rsrc *)ev[i].data.ptr;
+		rv = rs->callback(rs, DIAG_OS_RREAD);
+		if ((rv < 0) && (err == 0))
+			err = rv;
+		calls++;
 	}
 #else
-    Sleep(ms);
+	if ((rv = diag_calloc(&pfd, r->nsrcs + 1)))
+		return diag_iseterr(rv);
+	if ((rv = diag_calloc(&pfdsrc, r->nsrcs + 1))) {
+		free(pfd);
+		return diag_iseterr(rv);
+	}
+	for (n = 0, rs = r->srcs; rs; rs = rs->next) {
+		if (rs->fd < 0)
+			continue;
+		pfd[n].fd = rs->fd;
+		pfd[n].events = POLLIN;
+		pfdsrc[n++] = rs;
+	}
+	n = poll(pfd, (nfds_t) n, timeout);
+
+	diag_os_lock();
+	for (i = 0; n > 0 && pfdsrc[i]; i++) {
+		if (pfd[i].revents) {
+			rv = pfdsrc[i]->callback(pfdsrc[i], DIAG_OS_RREAD);
+			if ((rv < 0) && (err == 0))
+				err = rv;
+			calls++;
+			n--;
+		}
+	}
+	free(pfdsrc);
+	free(pfd);
 #endif
-	return 0;
+
+	now = diag_os_getns();
+	for (rs = r->srcs; rs; rs = next) {
+		next = rs->next;
+		if (rs->deadline && (rs->deadline <= now)) {
+			rv = rs->callback(rs, DIAG_OS_RTIMEOUT);
+			if ((rv < 0) && (err == 0))
+				err = rv;
+			calls++;
+		}
+	}
+	diag_os_unlock();
+
+	return err ? err : calls;
 }
-#endif
 
 /*
  * diag_os_ipending: Is input avilable at the given file descriptor?
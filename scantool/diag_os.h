@@ -42,10 +42,77 @@ extern "C" {
 // is different and defined in OS specific
 // c files.
 */
-void diag_os_sigalrm(int);
 int diag_os_init(void);
 int diag_os_millisleep(int ms);
+int diag_os_usleep(unsigned long us);
+int diag_os_sleepuntil(tstamp_type deadline);	/* Absolute, see diag_os_getns() */
+void diag_os_sleepstats(FILE *fp);		/* Sleep jitter report */
 int diag_os_ipending(int fd);
+tstamp_type diag_os_getns(void);	/* Monotonic timestamp */
+
+/*
+ * One-shot timers, serviced by the timer thread. Embed one in the
+ * structure it serves and diag_os_timer_init() it once; the callback
+ * runs with the diag lock held. The callback may re-arm its own timer
+ * but must not free it; diag_os_timer_cancel() waits for a running
+ * callback to return, so the owner can be freed after cancelling.
+ */
+struct diag_os_timer {
+	struct diag_os_timer *next, *prev;	/* Timer wheel slot list */
+	unsigned long expires;		/* In ms ticks */
+	int pending;			/* In the wheel */
+	int parked;			/* Waiting for diag_os_timer_kick() */
+	int firing;			/* Callback running */
+	void *key;			/* What it's parked on */
+	void (*callback)(void *arg);
+	void *arg;
+};
+
+void diag_os_timer_init(struct diag_os_timer *t,
+	void (*callback)(void *), void *arg);
+void diag_os_timer_set(struct diag_os_timer *t, unsigned int ms);
+void diag_os_timer_cancel(struct diag_os_timer *t);
+void diag_os_timer_defer(struct diag_os_timer *t, void *key);
+void diag_os_timer_kick(void *key);
+
+/*
+ * Reactor, to drive many devices from one thread. A source is an fd to
+ * read (or -1) and an absolute deadline (diag_os_getns(), 0 = none) that
+ * its callback keeps up to date; callbacks run with the diag lock held.
+ * A callback returning < 0 makes diag_os_reactor_run() return that error,
+ * otherwise run returns the number of callbacks made.
+ */
+#define DIAG_OS_RREAD		1	/* fd is readable */
+#define DIAG_OS_RTIMEOUT	2	/* deadline has passed */
+
+struct diag_os_rsrc {
+	int	fd;
+	tstamp_type	deadline;
+	int	(*callback)(struct diag_os_rsrc *rs, int events);
+	void	*arg;
+	struct diag_os_rsrc *next;	/* Reactor's list */
+};
+
+struct diag_os_reactor;
+
+struct diag_os_reactor *diag_os_reactor_new(void);
+void diag_os_reactor_free(struct diag_os_reactor *r);
+int diag_os_reactor_add(struct diag_os_reactor *r, struct diag_os_rsrc *rs);
+void diag_os_reactor_del(struct diag_os_reactor *r, struct diag_os_rsrc *rs);
+int diag_os_reactor_run(struct diag_os_reactor *r, int timeout);
+
+/* Serializes L2/L3 entry points with the timer callbacks (recursive) */
+void diag_os_lock(void);
+void diag_os_unlock(void);
+/*
+ * Let go of / take back all of this thread's hold on the diag lock around
+ * a sleep or a wait for input (diag_os_sleepuntil() and diag_tty_read()
+ * do it); diag_os_lock_wait() waits for diag_os_lock_wake() without it.
+ */
+int diag_os_lock_drop(void);
+void diag_os_lock_retake(int depth);
+void diag_os_lock_wait(void);
+void diag_os_lock_wake(void);
 
 /* Scheduler */
 int diag_os_sched(void);
@@ -33,9 +33,11 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "diag.h"
 #include "diag_err.h"
+#include "diag_os.h"
 #include "diag_iso14230.h"
 #include "diag_tty.h"
 #include "diag_l1.h"
@@ -50,6 +52,8 @@ CVSID("$Id: diag_test.c,v 1.3 2011/05/29 15:00:35 fenugrec Exp $");
 
 static int
 do_l2_raw_test(int funcaddr, target_type destecu, int inittype);
+static int
+do_reactor_test(int nlinks, char **specs);
 
 uint8_t global_data[MAXRBUF];
 int global_datalen;
@@ -68,16 +72,22 @@ alarm_handler(int sig __attribute__((unused)))
 	alarm(1);
 }
 
-#ifdef WIN32
+/*
+ * diag_test -r proto:interface:device ... runs the reactor test (see
+ * do_reactor_test()) on those links, e.g. against diag_vecu ptys :
+ *	diag_vecu -i dumb -p iso9141 -l /tmp/vecuA &
+ *	diag_vecu -i dumb -p iso14230 -l /tmp/vecuB &
+ *	diag_test -r iso9141:DUMB:/tmp/vecuA iso14230:DUMB:/tmp/vecuB
+ * Without arguments, the old L2 raw test.
+ */
 int
 main(int argc,  char **argv)
-#else
-int
-main(int argc __attribute__((unused)),  char **argv __attribute__((unused)))
-#endif
 {
 	struct sigaction stNew;
 
+	if ((argc > 2) && (strcmp(argv[1], "-r") == 0))
+		return do_reactor_test(argc - 2, &argv[2]);
+
 	diag_l0_debug = 0xff;
 	diag_l1_debug = 0xff;
 	diag_l2_debug = 0xff;
@@ -319,3 +329,177 @@ do_l1_test(void)
 
 	return 0;
 }
+
+
+/*
+ * Reactor test : open every link, hand them all to one reactor, then for
+ * a few rounds send a J1979 mode 1 PID 0 request on each and run the
+ * reactor until every link has its response. Returns 0 if they all
+ * answered every round.
+ */
+#define RTEST_ROUNDS	10
+#define RTEST_WAIT	3000	/* ms, for all the responses of a round */
+
+struct rtest_link {
+	char *spec;
+	struct diag_l0_device *dl0d;
+	struct diag_l2_conn *conn;
+	int added;
+	unsigned int got;		/* Responses this round */
+	unsigned int total;
+};
+
+static void
+rtest_rcv(void *handle, struct diag_msg *msg)
+{
+	struct rtest_link *rl = (struct rtest_link *)handle;
+
+	for (; msg; msg = msg->next) {
+		if ((msg->len >= 1) && (msg->data[0] == 0x41))
+			rl->got++;
+	}
+}
+
+/* Parse "proto:interface:device", then open and start the link */
+static int
+rtest_open(struct rtest_link *rl)
+{
+	char *proto, *iface, *dev;
+	int l1proto, l2proto;
+	flag_type flags;
+	target_type target = 0x33;
+
+	proto = rl->spec;
+	iface = strchr(proto, ':');
+	if (iface == NULL)
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	*iface++ = '\0';
+	dev = strchr(iface, ':');
+	if (dev == NULL)
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	*dev++ = '\0';
+
+	if (strcasecmp(proto, "iso9141") == 0) {
+		l1proto = DIAG_L1_ISO9141;
+		l2proto = DIAG_L2_PROT_ISO9141;
+		flags = DIAG_L2_TYPE_SLOWINIT;
+	} else if (strcasecmp(proto, "iso14230") == 0) {
+		l1proto = DIAG_L1_ISO14230;
+		l2proto = DIAG_L2_PROT_ISO14230;
+		flags = DIAG_L2_TYPE_FASTINIT | DIAG_L2_TYPE_FUNCADDR;
+	} else if (strcasecmp(proto, "j1850") == 0) {
+		l1proto = DIAG_L1_J1850_VPW;
+		l2proto = DIAG_L2_PROT_SAEJ1850;
+		flags = 0;
+		target = 0x6a;
+	} else {
+		return diag_iseterr(DIAG_ERR_PROTO_NOTSUPP);
+	}
+
+	rl->dl0d = diag_l2_open(iface, dev, l1proto);
+	if (rl->dl0d == NULL)
+		return diag_geterr();
+	rl->conn = diag_l2_StartCommunications(rl->dl0d, l2proto, flags,
+		10400, target, TESTER_ID);
+	if (rl->conn == NULL) {
+		diag_l2_close(rl->dl0d);
+		rl->dl0d = NULL;
+		return diag_geterr();
+	}
+	return 0;
+}
+
+static int
+do_reactor_test(int nlinks, char **specs)
+{
+	struct rtest_link *links;
+	struct diag_os_reactor *r;
+	struct diag_msg msg;
+	uint8_t data[2] = { 0x01, 0x00 };
+	tstamp_type t0, deadline, now;
+	int i, round, waiting, rv, failed = 0;
+
+	if (diag_init())
+		return 1;
+	if (diag_calloc(&links, (size_t)nlinks))
+		return 1;
+	r = diag_os_reactor_new();
+	if (r == NULL) {
+		free(links);
+		return 1;
+	}
+
+	for (i = 0; i < nlinks; i++) {
+		links[i].spec = specs[i];
+		rv = rtest_open(&links[i]);
+		if (rv == 0) {
+			rv = diag_l2_reactor_add(r, links[i].conn, rtest_rcv,
+				&links[i]);
+			links[i].added = (rv >= 0);
+		}
+		if (rv < 0) {
+			printf("%s: setup failed, %d\n", specs[i], rv);
+			failed = 1;
+		}
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.data = data;
+	msg.len = sizeof(data);
+
+	for (round = 0; !failed && (round < RTEST_ROUNDS); round++) {
+		t0 = diag_os_getns();
+		for (i = 0; i < nlinks; i++) {
+			links[i].got = 0;
+			msg.dest = 0x33;
+			msg.src = TESTER_ID;
+			if (diag_l2_send(links[i].conn, &msg) < 0) {
+				printf("%s: send failed\n", links[i].spec);
+				failed = 1;
+			}
+		}
+
+		/* One thread collects the responses of every link */
+		deadline = t0 + (tstamp_type) RTEST_WAIT * 1000000;
+		do {
+			now = diag_os_getns();
+			if (now >= deadline)
+				break;
+			rv = diag_os_reactor_run(r,
+				(int) ((deadline - now) / 1000000) + 1);
+			if (rv < 0) {
+				printf("reactor failed, %d\n", rv);
+				failed = 1;
+				break;
+			}
+			for (waiting = 0, i = 0; i < nlinks; i++)
+				waiting += (links[i].got == 0);
+		} while (waiting);
+
+		for (i = 0; i < nlinks; i++) {
+			if (links[i].got == 0) {
+				printf("%s: no response in round %d\n",
+					links[i].spec, round);
+				failed = 1;
+			}
+			links[i].total += links[i].got;
+		}
+		printf("round %d: %lu ms\n", round,
+			(unsigned long) ((diag_os_getns() - t0) / 1000000));
+	}
+
+	for (i = 0; i < nlinks; i++) {
+		printf("%s: %u responses\n", links[i].spec, links[i].total);
+		if (links[i].added)
+			diag_l2_reactor_del(r, links[i].conn);
+		if (links[i].conn)
+			diag_l2_StopCommunications(links[i].conn);
+		if (links[i].dl0d)
+			diag_l2_close(links[i].dl0d);
+	}
+	diag_os_reactor_free(r);
+	free(links);
+
+	printf("%s\n", failed ? "FAIL" : "PASS");
+	return failed;
+}
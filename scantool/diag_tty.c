@@ -22,9 +22,14 @@
 
 #if !defined(__linux__) || (TRY_POSIX == 1)
 #include <time.h>		/* For POSIX timers */
+#else
+#include <time.h>		/* For clock_gettime */
+#include <limits.h>		/* For PATH_MAX */
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
 #endif
 
-#include <linux/rtc.h>
 #include <sys/time.h>
 
 #include "diag.h"
@@ -32,6 +37,13 @@
 #include "diag_err.h"
 #include "diag_tty.h"
 
+int diag_tty_lowlatency;	/* Use the low latency profile on new devices */
+
+#if defined(__linux__) && (TRY_POSIX == 0)
+static int diag_tty_latency_path(struct diag_l0_device *dl0d, char *path, size_t len);
+static int diag_tty_latency_rw(const char *path, int val);
+#endif
+
 const struct diag_l0 *diag_l0_device_dl0(struct diag_l0_device *dl0d) {
 	return dl0d->dl0;
 }
@@ -54,13 +66,21 @@ void *dl0_handle)
 		return diag_iseterr(rv);
 
 	dl0d->fd = -1;
+#if defined(__linux__) && (TRY_POSIX == 0)
+	dl0d->timerfd = -1;
+#endif
 	dl0d->dl0_handle = dl0_handle;
 	dl0d->dl0 = dl0;
+	dl0d->lowlat = diag_tty_lowlatency;
 
 	if ((rv=diag_calloc(&dl0d->ttystate, 1))) {
 		free(dl0d);
 		return diag_iseterr(rv);
 	}
+	dl0d->ttystate->dt_istty = 1;
+#if defined(__linux__) && (TRY_POSIX == 0)
+	dl0d->ttystate->dt_olatency = -1;
+#endif
 
 	*ppdl0d = dl0d;
 
@@ -98,6 +118,12 @@ void *dl0_handle)
 	errno = 0;
 #if defined(__linux__) && (TRY_POSIX == 0)
 	dl0d->fd = open(dl0d->name, O_RDWR);
+
+	/* Deadline timer for diag_tty_read; we can do without it */
+	dl0d->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if ((dl0d->timerfd < 0) && (diag_l0_debug & DIAG_DEBUG_OPEN))
+		fprintf(stderr, FLFMT "timerfd_create failed: %s, using poll timeouts\n",
+			FL, strerror(errno));
 #else
 	/*
 	+* For POSIX behavior:  Open serial device non-blocking to avoid
@@ -155,22 +181,38 @@ void *dl0_handle)
 	 */
 
 #if defined(__linux__) && (TRY_POSIX == 0)
+	/*
+	 * Ptys (see diag_vecu) and some USB adapters have no serial_struct
+	 * and/or no modem lines : carry on without them.
+	 */
 	if (ioctl(dl0d->fd, TIOCGSERIAL, &dt->dt_osinfo) < 0)
 	{
-		fprintf(stderr,
-			FLFMT "open: Ioctl TIOCGSERIAL failed %d\n", FL, errno);
-		(void)diag_tty_close(ppdl0d);
-		return diag_iseterr(DIAG_ERR_GENERAL);
+		if ((errno != ENOTTY) && (errno != EINVAL)) {
+			fprintf(stderr,
+				FLFMT "open: Ioctl TIOCGSERIAL failed %d\n", FL, errno);
+			(void)diag_tty_close(ppdl0d);
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+		if (diag_l0_debug & DIAG_DEBUG_OPEN)
+			fprintf(stderr, FLFMT "%s has no serial_struct, "
+				"standard speeds only\n", FL, dl0d->name);
+		dt->dt_noserial = 1;
 	}
 	dt->dt_sinfo = dt->dt_osinfo;
 #endif
 
 	if (ioctl(dl0d->fd, TIOCMGET, &dt->dt_modemflags) < 0)
 	{
-		fprintf(stderr,
-			FLFMT "open: Ioctl TIOCMGET failed: %s\n", FL, strerror(errno));
-		(void)diag_tty_close(ppdl0d);
-		return diag_iseterr(DIAG_ERR_GENERAL);
+		if ((errno != ENOTTY) && (errno != EINVAL)) {
+			fprintf(stderr,
+				FLFMT "open: Ioctl TIOCMGET failed: %s\n", FL, strerror(errno));
+			(void)diag_tty_close(ppdl0d);
+			return diag_iseterr(DIAG_ERR_GENERAL);
+		}
+		if (diag_l0_debug & DIAG_DEBUG_OPEN)
+			fprintf(stderr, FLFMT "%s has no modem control lines\n",
+				FL, dl0d->name);
+		dt->dt_nomodem = 1;
 	}
 
 	if (tcgetattr(dl0d->fd, &dt->dt_otinfo) < 0)
@@ -191,17 +233,28 @@ int diag_tty_close(struct diag_l0_device **ppdl0d)
 	if (ppdl0d) {
 		struct diag_l0_device *dl0d = *ppdl0d;
 		if (dl0d) {
+			if ((diag_l0_debug & DIAG_DEBUG_TIMER) && dl0d->rdstats.timeouts)
+				diag_tty_rdstats(dl0d, stderr);
+
 			if (dl0d->ttystate) {
 				if (dl0d->fd != -1) {
 			#if defined(__linux__) && (TRY_POSIX == 0)
-					(void)ioctl(dl0d->fd,
-						TIOCSSERIAL, &dl0d->ttystate->dt_osinfo);
+					char path[PATH_MAX + 64];
+
+					if (!dl0d->ttystate->dt_noserial)
+						(void)ioctl(dl0d->fd,
+							TIOCSSERIAL, &dl0d->ttystate->dt_osinfo);
+					if ((dl0d->ttystate->dt_olatency >= 0) &&
+							(diag_tty_latency_path(dl0d, path, sizeof(path)) == 0))
+						(void)diag_tty_latency_rw(path,
+							dl0d->ttystate->dt_olatency);
 			#endif
 
 					(void)tcsetattr(dl0d->fd,
 						TCSADRAIN, &dl0d->ttystate->dt_otinfo);
-					(void)ioctl(dl0d->fd,
-						TIOCMSET, &dl0d->ttystate->dt_modemflags);
+					if (!dl0d->ttystate->dt_nomodem)
+						(void)ioctl(dl0d->fd,
+							TIOCMSET, &dl0d->ttystate->dt_modemflags);
 				}
 				free(dl0d->ttystate);
 				dl0d->ttystate = 0;
@@ -215,6 +268,12 @@ int diag_tty_close(struct diag_l0_device **ppdl0d)
 				(void)close(dl0d->fd);
 				dl0d->fd = -1;
 			}
+#if defined(__linux__) && (TRY_POSIX == 0)
+			if (dl0d->timerfd != -1) {
+				(void)close(dl0d->timerfd);
+				dl0d->timerfd = -1;
+			}
+#endif
 			free(dl0d);
 			*ppdl0d = 0;
 		}
@@ -238,6 +297,22 @@ diag_l0_set_dl2_link(struct diag_l0_device *dl0d,
 	dl0d->dl2_link = dl2_link;
 }
 
+/*
+ * Timestamps of the last read that returned data, and of the end of the
+ * last write on the wire (or, on half duplex links, of its echo, set by L1).
+ * write() returns as soon as the bytes are queued in the driver, so the
+ * latter is an estimate : queue time plus the wire time of the bytes written.
+ */
+tstamp_type
+diag_l0_rxstamp(struct diag_l0_device *dl0d) {
+	return dl0d->rxstamp;
+}
+
+tstamp_type
+diag_l0_txstamp(struct diag_l0_device *dl0d) {
+	return dl0d->txstamp;
+}
+
 
 /*
  * Set speed/parity etc
@@ -300,7 +375,11 @@ diag_tty_setup(struct diag_l0_device *dl0d,
 	dt->dt_sinfo.flags |= ASYNC_SPD_CUST | ASYNC_LOW_LATENCY;
 
 	/* And tell the kernel the new settings */
-	if (ioctl(fd, TIOCSSERIAL, &dt->dt_sinfo) < 0)
+	if (dt->dt_noserial) {
+		if (diag_l0_debug & DIAG_DEBUG_IOCTL)
+			fprintf(stderr, FLFMT "no serial_struct, %d bps not set\n",
+				FL, pset->speed);
+	} else if (ioctl(fd, TIOCSSERIAL, &dt->dt_sinfo) < 0)
 	{
 		fprintf(stderr,
 			FLFMT "Ioctl TIOCSSERIAL failed %s\n", FL, strerror(errno));
@@ -459,10 +538,126 @@ diag_tty_setup(struct diag_l0_device *dl0d,
 			strerror(errno));
 		return diag_iseterr(DIAG_ERR_GENERAL);
 	}
+
+	/* Time one byte takes on the wire : start + data + parity + stop bits */
+	dl0d->byte_ns = (1 + pset->databits + pset->stopbits +
+		(pset->parflag == diag_par_n ? 0 : 1)) * 1000000000UL / pset->speed;
+
+	if (dl0d->lowlat)
+		return diag_tty_set_lowlatency(dl0d, 1);
 	
 	return 0;
 }
 
+#if defined(__linux__) && (TRY_POSIX == 0)
+/*
+ * USB-serial converters (FTDI and others) buffer received bytes for up to
+ * latency_timer ms (16 by default) before passing them on. The knob is in
+ * sysfs, named after the tty the device node (or /dev/obdII symlink)
+ * points to. Returns 0 and fills path if there is one.
+ */
+static int
+diag_tty_latency_path(struct diag_l0_device *dl0d, char *path, size_t len)
+{
+	char real[PATH_MAX];
+	const char *tty;
+
+	if (realpath(dl0d->name, real) == NULL)
+		return -1;
+	tty = strrchr(real, '/');
+	tty = tty ? tty + 1 : real;
+
+	snprintf(path, len, "/sys/bus/usb-serial/devices/%s/latency_timer", tty);
+	return access(path, R_OK | W_OK);
+}
+
+/* Read / write the latency_timer value; -1 on failure. */
+static int
+diag_tty_latency_rw(const char *path, int val)
+{
+	FILE *fp;
+	int rv = -1;
+
+	if ((fp = fopen(path, (val < 0) ? "r" : "w")) == NULL)
+		return -1;
+	if (val < 0) {
+		if (fscanf(fp, "%d", &rv) != 1)
+			rv = -1;
+	} else if (fprintf(fp, "%d\n", val) > 0) {
+		rv = val;
+	}
+	if (fclose(fp) != 0)
+		rv = -1;
+	return rv;
+}
+#endif
+
+int
+diag_tty_istty(struct diag_l0_device *dl0d)
+{
+	return (dl0d->ttystate != NULL) && dl0d->ttystate->dt_istty &&
+		(dl0d->fd != -1);
+}
+
+/*
+ * Low latency profile, on top of the kernel low latency flag that
+ * diag_tty_setup() always sets: VMIN=1/VTIME=0 makes read() and poll()
+ * return on the first byte (the read deadlines are ours, see
+ * diag_tty_read()); a 1ms USB-serial latency timer takes away the
+ * biggest delay with FTDI based cables. Turning the profile off restores
+ * what was there when the device was opened.
+ *
+ * Only termios failures are errors : the latency timer doesn't exist on
+ * every kind of port.
+ */
+int
+diag_tty_set_lowlatency(struct diag_l0_device *dl0d, int on)
+{
+	struct diag_ttystate *dt = dl0d->ttystate;
+#if defined(__linux__) && (TRY_POSIX == 0)
+	char path[PATH_MAX + 64];
+	int cur;
+#endif
+
+	if (!diag_tty_istty(dl0d))
+		return diag_iseterr(DIAG_ERR_GENERAL);	/* not a tty */
+
+#if defined(__linux__) && (TRY_POSIX == 0)
+	if (diag_tty_latency_path(dl0d, path, sizeof(path)) == 0) {
+		if (on) {
+			cur = diag_tty_latency_rw(path, -1);
+			if (dt->dt_olatency < 0)
+				dt->dt_olatency = cur;
+			cur = diag_tty_latency_rw(path, 1);
+		} else if (dt->dt_olatency >= 0) {
+			cur = diag_tty_latency_rw(path, dt->dt_olatency);
+		} else {
+			cur = diag_tty_latency_rw(path, -1);
+		}
+		if (diag_l0_debug & DIAG_DEBUG_IOCTL)
+			fprintf(stderr, FLFMT "%s: latency_timer %dms\n",
+				FL, dl0d->name, cur);
+	}
+#endif
+
+	if (on) {
+		dt->dt_tinfo.c_cc[VMIN] = 1;
+		dt->dt_tinfo.c_cc[VTIME] = 0;
+	} else {
+		dt->dt_tinfo.c_cc[VMIN] = dt->dt_otinfo.c_cc[VMIN];
+		dt->dt_tinfo.c_cc[VTIME] = dt->dt_otinfo.c_cc[VTIME];
+	}
+	errno = 0;
+	if (tcsetattr(dl0d->fd, TCSANOW, &dt->dt_tinfo) < 0) {
+		fprintf(stderr, FLFMT "%s: can't set VMIN/VTIME: %s\n",
+			FL, dl0d->name, strerror(errno));
+		return diag_iseterr(DIAG_ERR_GENERAL);
+	}
+
+	dl0d->lowlat = on ? 1 : 0;
+	return 0;
+}
+
 /*
  * Set/Clear DTR and RTS lines, as specified
  */
@@ -483,6 +678,9 @@ diag_tty_control(struct diag_l0_device *dl0d,  int dtr, int rts)
 	else
 		clearflags = TIOCM_RTS;
 
+	if (dl0d->ttystate->dt_nomodem)
+		return 0;	/* Nothing to control */
+
 	errno = 0;
 	if (ioctl(dl0d->fd, TIOCMGET, &flags) < 0) {
 		fprintf(stderr, 
@@ -515,7 +713,16 @@ ssize_t
 diag_tty_write(struct diag_l0_device *dl0d,
 const void *buf, const size_t count)
 {
-	return write(dl0d->fd, buf, count);
+	ssize_t rv;
+
+	rv = write(dl0d->fd, buf, count);
+	dl0d->txqueued = diag_os_getns();
+	dl0d->txstamp = dl0d->txqueued;
+	if (rv > 0) {
+		dl0d->txstamp += (tstamp_type) rv * dl0d->byte_ns;
+		dl0d->rtt_pending = 1;
+	}
+	return rv;
 }
 
 #if 0
@@ -597,103 +804,248 @@ diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
 // goes with previous #if 0 (replacing old tty_read)
 
 /*
- * We have to be read to loop in write since we've cleared SA_RESTART.
+ * First data back after a write : account the turnaround, see
+ * struct diag_tty_rtt.
  */
-
-//#if 1
-
-ssize_t
-diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
+static void
+diag_tty_rtt_sample(struct diag_l0_device *dl0d, tstamp_type t)
 {
-	struct timeval tv;
-	int time,rv,fd,retval;
-	unsigned long data;
+	struct diag_tty_rtt *r = &dl0d->rtt[dl0d->lowlat];
+	tstamp_type ready = dl0d->txqueued + dl0d->byte_ns;
+	unsigned long us;
+
+	dl0d->rtt_pending = 0;
+	us = (t > ready) ? (unsigned long) ((t - ready) / 1000) : 0;
+	r->samples++;
+	r->total += us;
+	if (us > r->max)
+		r->max = us;
+}
 
-	if (diag_l0_debug & DIAG_DEBUG_READ) {
-			fprintf(stderr, FLFMT "Entered diag_tty_read with count=%d, timeout=%dms\n", FL, count, timeout);
+/*
+ * Fill the receive ring, waiting up to timeout ms for data.
+ * We poll() the tty together with a timerfd armed on an absolute
+ * CLOCK_MONOTONIC deadline, so we sleep until either data arrives or the
+ * deadline passes : no periodic wakeups, no /dev/rtc, no root needed.
+ * If the timerfd couldn't be created at open, poll()'s own timeout is used.
+ * How late we woke up past the deadline is accumulated in dl0d->rdstats
+ * (see diag_tty_rdstats()).
+ * A single read() takes everything the driver has, up to the free space
+ * in the ring. The bytes are timestamped backwards from the read() time,
+ * one wire byte time apart.
+ *
+ * Returns DIAG_ERR_TIMEOUT on timeout (without diag_iseterr(), since
+ * diag_tty_iflush() and friends use that as a normal occurence),
+ * or the read() return value.
+ */
+static ssize_t
+diag_tty_fill(struct diag_l0_device *dl0d, int timeout)
+{
+	struct diag_tty_rxbuf *rb = &dl0d->rxbuf;
+	unsigned int head, room, i;
+	tstamp_type t;
+	struct pollfd pfd[2];
+	struct timespec now, deadline;
+	struct itimerspec its;
+	uint64_t expirations;
+	int nfds, rv, ptmo, err;
+	long lat;
+
+	if (timeout < 0)
+		timeout = 0;
+
+	head = rb->head;
+	room = DIAG_TTY_RXBUF - (head - rb->tail);
+	if (room == 0)
+		return diag_iseterr(DIAG_ERR_GENERAL);	/* caller must consume */
+	/* Contiguous part only; the rest will be picked up next time */
+	if (room > DIAG_TTY_RXBUF - (head & (DIAG_TTY_RXBUF - 1)))
+		room = DIAG_TTY_RXBUF - (head & (DIAG_TTY_RXBUF - 1));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	deadline.tv_sec = now.tv_sec + timeout / 1000;
+	deadline.tv_nsec = now.tv_nsec + (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
 	}
 
-	errno = 0;
-	time = 0;
+	pfd[0].fd = dl0d->fd;
+	pfd[0].events = POLLIN;
+	nfds = 1;
+
+	if ((dl0d->timerfd >= 0) && (timeout > 0)) {
+		memset(&its, 0, sizeof(its));
+		its.it_value = deadline;
+		if (timerfd_settime(dl0d->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+			pfd[1].fd = dl0d->timerfd;
+			pfd[1].events = POLLIN;
+			nfds = 2;
+		}
+	}
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
+	while (1) {
+		if (nfds == 2) {
+			ptmo = -1;	/* the timerfd wakes us up */
+		} else {
+			/* remaining time, rounded up to the next ms */
+			ptmo = (int) ((deadline.tv_sec - now.tv_sec) * 1000 +
+				(deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L);
+			if (ptmo < 0)
+				ptmo = 0;
+		}
 
-	timeout *= 4096/2000;
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+		if (ptmo != 0) {
+			/* Let other threads in while we wait */
+			int depth = diag_os_lock_drop();
 
-	fd = open ("/dev/rtc", O_RDONLY);
+			errno = 0;
+			rv = poll(pfd, nfds, ptmo);
+			err = errno;
+			diag_os_lock_retake(depth);
+			errno = err;
+		} else {
+			errno = 0;
+			rv = poll(pfd, nfds, ptmo);
+		}
 
-	/* Read periodic IRQ rate */
-	retval = ioctl(fd, RTC_IRQP_READ, &data);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				continue;
+			}
+			fprintf(stderr, FLFMT "poll on fd %d returned %s.\n",
+				FL, dl0d->fd, strerror(errno));
+			rv = diag_iseterr(DIAG_ERR_GENERAL);
+			break;
+		}
 
-	if (retval != 2048)
-		ioctl(fd, RTC_IRQP_SET, 2048);
+		if (pfd[0].revents) {
+			/* Ready for read (or error/hangup, which read() will report) */
+			rv = read(dl0d->fd, &rb->data[head & (DIAG_TTY_RXBUF - 1)], room);
+			if (rv > 0) {
+				t = diag_os_getns();
+				if (dl0d->rtt_pending)
+					diag_tty_rtt_sample(dl0d, t);
+				for (i = 0; i < (unsigned int) rv; i++)
+					rb->stamp[(head + i) & (DIAG_TTY_RXBUF - 1)] =
+						t - (tstamp_type) (rv - 1 - i) * dl0d->byte_ns;
+				rb->fills++;
+				rb->bytes += rv;
+				rb->head = head + rv;
+			}
+			break;
+		}
 
-	/* Enable periodic interrupts */
-	ioctl(fd, RTC_PIE_ON, 0);
+		if ((rv == 0) || (pfd[1].revents & POLLIN)) {
+			/* Deadline passed */
+			rv = DIAG_ERR_TIMEOUT;
+			if (timeout == 0)
+				break;	/* non-blocking check, nothing to measure */
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			lat = (now.tv_sec - deadline.tv_sec) * 1000000L +
+				(now.tv_nsec - deadline.tv_nsec) / 1000;
+			if (lat < 0)
+				lat = 0;
+			dl0d->rdstats.timeouts++;
+			dl0d->rdstats.lat_total += lat;
+			if ((unsigned long) lat > dl0d->rdstats.lat_max)
+				dl0d->rdstats.lat_max = lat;
+
+			if (diag_l0_debug & DIAG_DEBUG_TIMER) {
+				fprintf(stderr, FLFMT "timed out: %dms, woke up %ldus late\n",
+					FL, timeout, lat);
+			}
+			break;
+		}
+		/* Spurious wakeup; loop */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
 
-	read(fd, &data, sizeof(unsigned long));
-	data >>= 8;
-	time+=(int)data;
+	if (nfds == 2) {
+		/* Disarm, and clear any pending expiration */
+		memset(&its, 0, sizeof(its));
+		(void) timerfd_settime(dl0d->timerfd, 0, &its, NULL);
+		(void) read(dl0d->timerfd, &expirations, sizeof(expirations));
+	}
 
-	while ( 1 ) {
-		fd_set set;
+	return rv;
+}
 
-		FD_ZERO(&set);
-		FD_SET(dl0d->fd, &set);
+size_t
+diag_tty_avail(struct diag_l0_device *dl0d)
+{
+	struct diag_tty_rxbuf *rb = &dl0d->rxbuf;
 
-		rv = select ( dl0d->fd + 1,  &set, NULL, NULL, &tv ) ;
+	return rb->head - rb->tail;
+}
 
-		if ( rv > 0 ) break ;
+ssize_t
+diag_tty_peek(struct diag_l0_device *dl0d, void *buf, tstamp_type *stamps,
+	size_t count, int timeout)
+{
+	struct diag_tty_rxbuf *rb = &dl0d->rxbuf;
+	uint8_t *p = (uint8_t *)buf;
+	size_t avail, i;
+	ssize_t rv;
 
-		if (errno != 0 && errno != EINTR) break;
-		errno = 0 ;
+	avail = diag_tty_avail(dl0d);
+	if (avail == 0) {
+		rv = diag_tty_fill(dl0d, timeout);
+		if (rv <= 0)
+			return rv;
+		avail = diag_tty_avail(dl0d);
+	}
 
-		read(fd, &data, sizeof(unsigned long));
-		data >>= 8;
-		time+=(int)data;
-		if (time>=timeout)
-			break;
+	if (count > avail)
+		count = avail;
+	for (i = 0; i < count; i++) {
+		p[i] = rb->data[(rb->tail + i) & (DIAG_TTY_RXBUF - 1)];
+		if (stamps)
+			stamps[i] = rb->stamp[(rb->tail + i) & (DIAG_TTY_RXBUF - 1)];
 	}
+	return (ssize_t) count;
+}
 
-	/* Disable periodic interrupts */
-	ioctl(fd, RTC_PIE_OFF, 0);
-	close(fd);
+void
+diag_tty_consume(struct diag_l0_device *dl0d, size_t count)
+{
+	struct diag_tty_rxbuf *rb = &dl0d->rxbuf;
+	size_t avail = diag_tty_avail(dl0d);
 
-	if (diag_l0_debug & DIAG_DEBUG_IOCTL)
-		if (time>=timeout){
-			fprintf(stderr, FLFMT "timed out: %dms\n",FL,timeout);
-		}
+	if (count > avail)
+		count = avail;
+	if (count == 0)
+		return;
 
-	switch (rv)
-	{
-	case 0:
-		/* Timeout */
-	//this doesn't require a diag_iseterr() call, as is the case when diag_tty_read
-	//is called to flush
-		return (DIAG_ERR_TIMEOUT);
-	case 1:
-		/* Ready for read */
-		rv = 0;
-		/*
-		 * XXX Won't you hang here if "count" bytes don't arrive?
-		 * We've enabled SA_RESTART in the alarm handler, so this could
-		 * never return.
-		 */
-		if (count)
-			rv = read(dl0d->fd, buf, count);
-		return (rv);
-
-	default:
-		fprintf(stderr, FLFMT "select on fd %d returned %s.\n",
-			FL, dl0d->fd, strerror(errno));
+	dl0d->rxstamp = rb->stamp[(rb->tail + count - 1) & (DIAG_TTY_RXBUF - 1)];
+	rb->tail += (unsigned int) count;
+}
+
+/*
+ * Read with a timeout (in ms) : hand out what the receive ring already
+ * holds, or wait for the next chunk to come in.
+ * Returns DIAG_ERR_TIMEOUT on timeout, the number of bytes read, or 0
+ * at end of file (or when count is 0 and data is available).
+ */
+ssize_t
+diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
+{
+	ssize_t rv;
 
-		/* Unspecific Error */
-		return (diag_iseterr(DIAG_ERR_GENERAL));
+	if (diag_l0_debug & DIAG_DEBUG_READ) {
+			fprintf(stderr, FLFMT "Entered diag_tty_read with count=%d, timeout=%dms\n", FL, (int) count, timeout);
 	}
+
+	rv = diag_tty_peek(dl0d, buf, NULL, count, timeout);
+	if (rv > 0)
+		diag_tty_consume(dl0d, rv);
+	return rv;
 }
 
-//#else
 #endif
 
 
@@ -728,6 +1080,8 @@ const void *buf, const size_t count)
 	}
 
 	if (n > 0 || rv >= 0) {
+		dl0d->txqueued = diag_os_getns();
+		dl0d->txstamp = dl0d->txqueued + (tstamp_type) n * dl0d->byte_ns;
 		return n;
 	}
 
@@ -747,6 +1101,7 @@ diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
 	ssize_t rv;
 	ssize_t n;
 	char *p;
+	int depth, err;
 
 
 #if defined(_POSIX_TIMERS)
@@ -792,6 +1147,7 @@ diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
 	rv = 0;
 
 	/* Loop until timeout or we've gotten something. */
+	depth = diag_os_lock_drop();	/* Let other threads in meanwhile */
 	errno = 0;
 
 	while (count > 0 &&
@@ -812,6 +1168,9 @@ diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
 #endif
 #endif
 	}
+	err = errno;
+	diag_os_lock_retake(depth);
+	errno = err;
 
 	/*
 	 * XXX I'm not exactly sure what we want here.  If we timeout and have
@@ -819,8 +1178,10 @@ diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
 	 * I'm doing now.
 	 */
 	if (rv >= 0) {
-		if (n > 0)
+		if (n > 0) {
+			dl0d->rxstamp = diag_os_getns();
 			return n;
+		}
 		else if (dl0d->expired)
 			return diag_iseterr(DIAG_ERR_TIMEOUT);
 	}
@@ -834,6 +1195,34 @@ diag_tty_read(struct diag_l0_device *dl0d, void *buf, size_t count, int timeout)
 #endif
 
 
+/*
+ * Print the wake-up latency stats collected by diag_tty_read().
+ */
+void
+diag_tty_rdstats(struct diag_l0_device *dl0d, FILE *fp)
+{
+	const struct diag_tty_rdstats *rs = &dl0d->rdstats;
+	int i;
+
+	fprintf(fp, "%s: %lu read timeouts, wake-up latency avg %luus, max %luus\n",
+		dl0d->name, rs->timeouts,
+		rs->timeouts ? (unsigned long) (rs->lat_total / rs->timeouts) : 0,
+		rs->lat_max);
+#if defined(__linux__) && (TRY_POSIX == 0)
+	fprintf(fp, "%s: %lu bytes received in %lu read() calls\n",
+		dl0d->name, dl0d->rxbuf.bytes, dl0d->rxbuf.fills);
+#endif
+	for (i = 0; i < 2; i++) {
+		const struct diag_tty_rtt *r = &dl0d->rtt[i];
+
+		if (r->samples == 0)
+			continue;
+		fprintf(fp, "%s: %s profile turnaround avg %luus, max %luus (%lu samples)\n",
+			dl0d->name, i ? "low latency" : "normal",
+			(unsigned long) (r->total / r->samples), r->max, r->samples);
+	}
+}
+
 //different _iflush implementations (POSIX or not)
 #if defined(__linux__) && (TRY_POSIX == 0)
 /*
@@ -844,7 +1233,8 @@ int diag_tty_iflush(struct diag_l0_device *dl0d)
 	char buf[MAXRBUF];
 	int i, rv;
 
-	/* Read any old data hanging about on the port */
+	/* Drop what was read ahead, then any old data hanging about on the port */
+	diag_tty_consume(dl0d, diag_tty_avail(dl0d));
 	rv = diag_tty_read(dl0d, buf, sizeof(buf), 150);
 	if ((rv > 0) && (diag_l0_debug & DIAG_DEBUG_OPEN))
 	{
@@ -60,15 +60,64 @@ struct diag_ttystate
 #endif
 	struct termios dt_otinfo;
 	int dt_modemflags;
+	int dt_nomodem;		/* No modem control lines (pty) */
+	int dt_istty;		/* Set by diag_tty_open(), see diag_tty_istty() */
+#if defined(__linux__) && (TRY_POSIX == 0)
+	int dt_noserial;	/* No serial_struct (pty, some USB adapters) */
+#endif
 
 	/* For recording state after/as we mess with the interface */
 #if defined(__linux__) && (TRY_POSIX == 0)
 	struct serial_struct dt_sinfo;
+	int dt_olatency;	/* USB-serial latency_timer before we set it, or -1 */
 #endif
 	struct termios dt_tinfo;
 
 };
 
+/*
+ * Wake-up latency of diag_tty_read() : how late we got back
+ * control after the read deadline passed, in microseconds.
+ */
+struct diag_tty_rdstats
+{
+	unsigned long timeouts;		/* reads that hit the deadline */
+	unsigned long lat_max;		/* worst latency */
+	unsigned long long lat_total;	/* sum, for the average */
+};
+
+/*
+ * Receive ring buffer. When it runs dry, diag_tty_read() refills it with
+ * one read() of everything the driver has, and hands out bytes from it,
+ * so drivers reading byte by byte don't cost a syscall per byte. Each
+ * byte carries an estimate of when it came off the wire. It is only
+ * filled on demand, by the thread reading the device (under its link
+ * claim): between reads, incoming bytes wait in the kernel's buffer.
+ */
+#define DIAG_TTY_RXBUF	2048	/* must be a power of 2 */
+
+struct diag_tty_rxbuf
+{
+	unsigned int head;		/* next byte to be written */
+	unsigned int tail;		/* next byte to be read */
+	uint8_t data[DIAG_TTY_RXBUF];
+	tstamp_type stamp[DIAG_TTY_RXBUF];
+	unsigned long fills;		/* read() calls made */
+	unsigned long bytes;		/* bytes they returned */
+};
+
+/*
+ * Turnaround latency : from the return of a write() to the first byte read
+ * back (the echo on half duplex interfaces), less one byte wire time.
+ * Kept separately for the normal [0] and low latency [1] tty profiles.
+ */
+struct diag_tty_rtt
+{
+	unsigned long samples;
+	unsigned long max;		/* us */
+	unsigned long long total;	/* us */
+};
+
 struct diag_l0_device
 {
 	void *dl0_handle;					/* Handle for the L0 switch */
@@ -78,6 +127,24 @@ struct diag_l0_device
 	int fd;						/* File descriptor */
 	char *name;					/* device name */
 	struct diag_ttystate *ttystate;	/* Holds OS specific tty info */
+	struct diag_tty_rdstats rdstats;	/* diag_tty_read wake-up latency */
+
+	tstamp_type rxstamp;		/* When the last read returned data */
+	tstamp_type txqueued;		/* When the last write() returned (bytes queued) */
+	tstamp_type txstamp;		/* Estimated end of the last write on the wire :
+								 * txqueued + count * byte_ns, or the echo time
+								 * on half duplex links (set by L1) */
+	unsigned long byte_ns;		/* Wire time of one byte, set by diag_tty_setup */
+	struct diag_l1_txstats txstats;	/* L1 P4 scheduling accuracy */
+
+	int lowlat;					/* Low latency tty profile in use */
+	int rtt_pending;			/* A write is waiting for its first reply byte */
+	struct diag_tty_rtt rtt[2];	/* Turnaround, per profile */
+
+#if defined(__linux__) && (TRY_POSIX == 0)
+	int timerfd;				/* Read deadline timer */
+	struct diag_tty_rxbuf rxbuf;	/* Read-ahead */
+#endif
 
 #if !defined(__linux__) || (TRY_POSIX == 1)
 	volatile int expired;		/* Timer expiration */
@@ -158,7 +225,11 @@ diag_l0_set_dl2_link(struct diag_l0_device *dl0d,
 
 const struct diag_l0 *diag_l0_device_dl0(struct diag_l0_device *dl0d);
 
+tstamp_type diag_l0_rxstamp(struct diag_l0_device *dl0d);
+tstamp_type diag_l0_txstamp(struct diag_l0_device *dl0d);
+
 extern int diag_l0_debug;
+extern int diag_tty_lowlatency;	/* Profile for newly opened devices */
 
 /* Open, close device */
 int diag_tty_open(struct diag_l0_device **ppdl0d,
@@ -174,6 +245,19 @@ int diag_tty_setup(struct diag_l0_device *dl0d,
 
 int diag_tty_control(struct diag_l0_device *dl0d, int dtr, int rts);
 
+/*
+ * Switch an open device to/from the low latency profile : VMIN=1/VTIME=0
+ * and a 1ms USB-serial latency timer (the kernel low latency flag is
+ * always set).
+ */
+int diag_tty_set_lowlatency(struct diag_l0_device *dl0d, int on);
+
+/*
+ * Is this an open serial port (or pty) from diag_tty_open() ? The
+ * termios based calls don't apply to other devices (SocketCAN, CARSIM).
+ */
+int diag_tty_istty(struct diag_l0_device *dl0d);
+
 /* Flush pending input */
 int diag_tty_iflush(struct diag_l0_device *dl0d);
 
@@ -184,6 +268,21 @@ ssize_t diag_tty_write(struct diag_l0_device *dl0d,
 	const void *buf, const size_t count);
 int diag_tty_break(struct diag_l0_device *dl0d, const int);
 
+#if defined(__linux__) && (TRY_POSIX == 0)
+/*
+ * Direct access to the receive ring : peek waits up to timeout ms for
+ * data, then copies (and timestamps, if stamps isn't NULL) up to count
+ * bytes without consuming them. Same return values as diag_tty_read().
+ */
+ssize_t diag_tty_peek(struct diag_l0_device *dl0d,
+	void *buf, tstamp_type *stamps, size_t count, int timeout);
+void diag_tty_consume(struct diag_l0_device *dl0d, size_t count);
+size_t diag_tty_avail(struct diag_l0_device *dl0d);
+#endif
+
+/* Print diag_tty_read wake-up latency stats */
+void diag_tty_rdstats(struct diag_l0_device *dl0d, FILE *fp);
+
 #if defined(__cplusplus)
 }
 #endif
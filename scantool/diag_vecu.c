@@ -0,0 +1,898 @@
+/*
+ *	freediag - Vehicle Diagnostic Utility
+ *
+ *
+ * Copyright (C) 2001 Richard Almeida & Ibex Ltd (rpa@ibex.co.uk)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *************************************************************************
+ *
+ * Virtual ECU on a pseudo-terminal.
+ *
+ * Creates a pty pair and plays, on the master side, an interface + ECU
+ * that scantool (or diag_test) can be pointed at through the slave side
+ * with the unmodified DUMB, ELM or BR1 drivers :
+ *
+ *	diag_vecu -i dumb -p iso14230 -l /tmp/vecu &
+ *	scantool, then "set interface DUMB /tmp/vecu"
+ *
+ * Unlike the CARSIM driver, this goes through diag_tty.c, so the real
+ * serial read/write, echo handling, framing and timing code is used.
+ *
+ * - dumb : K-line, half duplex. Every byte received is echoed back;
+ *	5 baud init (a lone address byte) and fast init (the 0x00 byte
+ *	diag_tty_break() sends) are answered.
+ * - elm : ELM327 style AT command interpreter, hex ASCII data.
+ * - br1 : B. Roadman BR-1 framed protocol, J1850 or ISO9141.
+ *
+ * The ECU answers a few J1979 mode 1/3/4/7 requests and the basic
+ * ISO14230 services, AccessTimingParameters included; routines (0x31)
+ * take two seconds, announced by responsePending. Other J1979 modes are ignored, other services
+ * get a negative response.
+ * Byte spacing (-b) and response delay (-r) are configurable and what
+ * was actually achieved is reported on exit (SIGINT / SIGTERM).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <ctype.h>
+#ifdef __linux__
+#include <pty.h>
+#else
+#include <util.h>
+#endif
+
+#include "diag.h"
+#include "diag_os.h"
+
+CVSID("$Id$");
+
+#define VECU_P2		25	/* Default response delay, ms */
+#define VECU_IDLE	20	/* ISO9141 request ends after that much idle, ms */
+#define VECU_W1		60	/* 5 baud init : address to sync byte, ms */
+#define VECU_W2		10	/* sync byte to KB1, ms */
+#define VECU_W4		30	/* ~KB2 to ~address, ms */
+
+enum vecu_if { VECU_DUMB, VECU_ELM, VECU_BR1 };
+enum vecu_proto { VECU_ISO9141, VECU_ISO14230, VECU_J1850 };
+
+static struct vecu {
+	int master, slave;
+	enum vecu_if iface;
+	enum vecu_proto proto;
+	uint8_t initaddr;	/* 5 baud init address we answer */
+	uint8_t ecuaddr;	/* Our source address */
+	unsigned long byte_ns;	/* Spacing of the bytes we send */
+	int p2;			/* Response delay, ms */
+	int debug;
+
+	uint8_t rx[MAXRBUF];	/* Request being received */
+	int rxlen;
+
+	int elm_echo;		/* ELM : echo commands */
+	int elm_headers;	/* ELM : show headers and checksum */
+
+	/* Stats */
+	unsigned long requests;
+	unsigned long bytes_in, bytes_out;
+	unsigned long long p2_total;	/* ns */
+	unsigned long p2_max;		/* ns */
+} vecu;
+
+static volatile sig_atomic_t vecu_quit;
+
+static void
+vecu_sighandler(int sig __attribute__((unused)))
+{
+	vecu_quit = 1;
+}
+
+static void
+vecu_dump(const char *what, const uint8_t *data, int len)
+{
+	int i;
+
+	if (!vecu.debug)
+		return;
+	fprintf(stderr, "%s", what);
+	for (i = 0; i < len; i++)
+		fprintf(stderr, " %02X", data[i]);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Send bytes to the tester, one every byte_ns starting now. Wire time at
+ * the interface speed, plus ECU inter byte time P1, is what -b sets.
+ */
+static void
+vecu_send(const uint8_t *data, int len)
+{
+	tstamp_type t0 = diag_os_getns();
+	int i;
+
+	vecu_dump("vecu >", data, len);
+	for (i = 0; i < len; i++) {
+		if (i && vecu.byte_ns)
+			diag_os_sleepuntil(t0 + (tstamp_type) i * vecu.byte_ns);
+		if (write(vecu.master, &data[i], 1) != 1) {
+			perror("vecu: write");
+			return;
+		}
+	}
+	vecu.bytes_out += len;
+}
+
+static void
+vecu_sendstr(const char *s)
+{
+	vecu_send((const uint8_t *) s, (int) strlen(s));
+}
+
+/*
+ * Wait for P2 after the end of the request, and account how late we are.
+ */
+static void
+vecu_p2wait(tstamp_type reqend)
+{
+	tstamp_type deadline = reqend + (tstamp_type) vecu.p2 * 1000000;
+	tstamp_type now;
+
+	diag_os_sleepuntil(deadline);
+	now = diag_os_getns();
+	vecu.requests++;
+	vecu.p2_total += now - reqend;
+	if (now - reqend > vecu.p2_max)
+		vecu.p2_max = (unsigned long) (now - reqend);
+}
+
+/* Read one byte with a timeout in ms; -1 if none */
+static int
+vecu_getbyte(int timeout)
+{
+	struct pollfd pfd;
+	uint8_t c;
+
+	pfd.fd = vecu.master;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) <= 0)
+		return -1;
+	if (read(vecu.master, &c, 1) != 1)
+		return -1;
+	vecu.bytes_in++;
+	return c;
+}
+
+static uint8_t
+vecu_cksum(const uint8_t *data, int len)
+{
+	uint8_t cs = 0;
+
+	while (len--)
+		cs += *data++;
+	return cs;
+}
+
+/* SAE J1850 CRC */
+static uint8_t
+vecu_crc(const uint8_t *data, int len)
+{
+	uint8_t crc = 0xff;
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x1d) : (uint8_t) (crc << 1);
+	}
+	return (uint8_t) ~crc;
+}
+
+/*
+ * The ECU. Mode 1 PIDs are fixed values so runs are reproducible.
+ */
+static const struct {
+	uint8_t pid;
+	uint8_t len;
+	uint8_t data[4];
+} vecu_pids[] = {
+	{ 0x01, 4, { 0x00, 0x07, 0xE5, 0x00 } },	/* No MIL, no DTC */
+	{ 0x05, 1, { 0x7B } },				/* Coolant 83C */
+	{ 0x0C, 2, { 0x0C, 0x80 } },			/* 800 rpm */
+	{ 0x0D, 1, { 0x00 } },				/* 0 km/h */
+	{ 0x0F, 1, { 0x46 } },				/* Intake air 30C */
+	{ 0x11, 1, { 0x20 } },				/* Throttle 12.5% */
+};
+
+/*
+ * Answer a request (service id + parameters). Returns the response length,
+ * 0 for no response.
+ */
+static int
+vecu_service(const uint8_t *req, int len, uint8_t *resp)
+{
+	unsigned int i;
+	uint32_t mask;
+
+	if (len < 1)
+		return 0;
+
+	resp[0] = req[0] + 0x40;
+	switch (req[0]) {
+	case 0x01:	/* J1979 current data */
+		if (len < 2)
+			break;
+		resp[1] = req[1];
+		if (req[1] == 0x00) {
+			mask = 0;
+			for (i = 0; i < ARRAY_SIZE(vecu_pids); i++)
+				mask |= 1UL << (32 - vecu_pids[i].pid);
+			resp[2] = (uint8_t) (mask >> 24);
+			resp[3] = (uint8_t) (mask >> 16);
+			resp[4] = (uint8_t) (mask >> 8);
+			resp[5] = (uint8_t) mask;
+			return 6;
+		}
+		for (i = 0; i < ARRAY_SIZE(vecu_pids); i++) {
+			if (vecu_pids[i].pid == req[1]) {
+				memcpy(&resp[2], vecu_pids[i].data, vecu_pids[i].len);
+				return 2 + vecu_pids[i].len;
+			}
+		}
+		return 0;	/* J1979 : no answer for unsupported PIDs */
+	case 0x03:	/* J1979 stored DTCs : P0133 */
+		memset(&resp[1], 0, 6);
+		resp[1] = 0x01;
+		resp[2] = 0x33;
+		return 7;
+	case 0x04:	/* J1979 clear DTCs */
+		return 1;
+	case 0x07:	/* J1979 pending DTCs : none */
+		memset(&resp[1], 0, 6);
+		return 7;
+	case 0x02: case 0x05: case 0x06: case 0x08: case 0x09:
+		return 0;	/* J1979 : unsupported modes are not answered */
+	case 0x10:	/* KWP StartDiagnosticSession */
+		if (len < 2)
+			break;
+		resp[1] = req[1];
+		return 2;
+	case 0x31:	/* KWP StartRoutineByLocalIdentifier, see vecu_request */
+		if (len < 2)
+			break;
+		resp[1] = req[1];
+		return 2;
+	case 0x3E:	/* KWP TesterPresent */
+		return 1;
+	case 0x81:	/* KWP StartCommunication : keybytes */
+		resp[1] = 0xEF;
+		resp[2] = 0x8F;
+		return 3;
+	case 0x82:	/* KWP StopCommunication */
+		return 1;
+	case 0x83:	/* KWP AccessTimingParameters */
+		if (len < 2)
+			break;
+		resp[1] = req[1];
+		switch (req[1]) {
+		case 0x00:	/* Limits : P2max 25 ms, P3max 5 s, no minimums */
+			resp[2] = 0;
+			resp[3] = 1;
+			resp[4] = 0;
+			resp[5] = 20;
+			resp[6] = 0;
+			return 7;
+		case 0x01:	/* Back to defaults */
+			return 2;
+		case 0x03:	/* Set : accepted, but not applied */
+			if (len < 7)
+				break;
+			return 2;
+		default:
+			break;
+		}
+		resp[0] = 0x7F;
+		resp[1] = req[0];
+		resp[2] = 0x12;	/* subFunctionNotSupported */
+		return 3;
+	default:
+		break;
+	}
+	/* Negative response, service not supported */
+	resp[0] = 0x7F;
+	resp[1] = req[0];
+	resp[2] = 0x11;
+	return 3;
+}
+
+/*
+ * Framing. Requests are decoded into service bytes, and responses built
+ * around them, for the protocol in use.
+ *
+ * Returns the length of the service data in frame, 0 if not a valid
+ * request, -1 if more bytes are needed. *flen is set to the frame length.
+ */
+static int
+vecu_unframe(const uint8_t *frame, int len, int *offset, int *flen,
+	uint8_t *fmt, uint8_t *src)
+{
+	int hdr, dlen;
+
+	*fmt = 0;
+	*src = 0xF1;
+	*flen = len;
+	switch (vecu.proto) {
+	case VECU_ISO14230:
+		if (len < 1)
+			return -1;
+		*fmt = frame[0];
+		hdr = 1 + ((frame[0] & 0xC0) ? 2 : 0);
+		if ((frame[0] & 0x3F) == 0) {
+			if (len < hdr + 1)
+				return -1;
+			dlen = frame[hdr];
+			hdr++;
+		} else {
+			dlen = frame[0] & 0x3F;
+		}
+		if (len < hdr + dlen + 1)
+			return -1;
+		*flen = hdr + dlen + 1;
+		if (frame[0] & 0xC0)
+			*src = frame[2];
+		if (vecu_cksum(frame, hdr + dlen) != frame[hdr + dlen])
+			return 0;
+		*offset = hdr;
+		return dlen;
+	case VECU_ISO9141:
+		if ((len < 5) || (frame[0] != 0x68) ||
+				(vecu_cksum(frame, len - 1) != frame[len - 1]))
+			return 0;
+		*src = frame[2];
+		*offset = 3;
+		return len - 4;
+	case VECU_J1850:
+		if ((len < 5) || (vecu_crc(frame, len - 1) != frame[len - 1]))
+			return 0;
+		*src = frame[2];
+		*offset = 3;
+		return len - 4;
+	}
+	return 0;
+}
+
+static int
+vecu_frame(const uint8_t *data, int len, uint8_t fmt, uint8_t dst, uint8_t *frame)
+{
+	int n = 0;
+
+	switch (vecu.proto) {
+	case VECU_ISO14230:
+		if (fmt & 0xC0) {
+			frame[n++] = 0x80 | ((len < 64) ? len : 0);
+			frame[n++] = dst;
+			frame[n++] = vecu.ecuaddr;
+		} else {
+			frame[n++] = (len < 64) ? len : 0;
+		}
+		if (len >= 64)
+			frame[n++] = (uint8_t) len;
+		memcpy(&frame[n], data, len);
+		n += len;
+		frame[n] = vecu_cksum(frame, n);
+		return n + 1;
+	case VECU_ISO9141:
+	case VECU_J1850:
+		frame[n++] = 0x48;
+		frame[n++] = 0x6B;
+		frame[n++] = vecu.ecuaddr;
+		memcpy(&frame[n], data, len);
+		n += len;
+		frame[n] = (vecu.proto == VECU_J1850) ? vecu_crc(frame, n) : vecu_cksum(frame, n);
+		return n + 1;
+	}
+	return 0;
+}
+
+/*
+ * Handle one complete request frame : answer with a framed response after P2.
+ * Returns the response frame length (0 : no answer).
+ */
+static int
+vecu_request(const uint8_t *frame, int len, tstamp_type reqend, uint8_t *out)
+{
+	uint8_t resp[MAXRBUF], fmt, src;
+	int off = 0, flen, dlen, rlen;
+
+	vecu_dump("vecu <", frame, len);
+	dlen = vecu_unframe(frame, len, &off, &flen, &fmt, &src);
+	if (dlen <= 0)
+		return 0;
+	rlen = vecu_service(&frame[off], dlen, resp);
+	if (rlen == 0)
+		return 0;
+	if (frame[off] == 0x31) {
+		/* Slow routine : responsePending twice, 1 s apart */
+		uint8_t rp[3] = { 0x7F, 0x31, 0x78 }, pf[MAXRBUF];
+		int i;
+
+		for (i = 0; i < 2; i++) {
+			vecu_p2wait(reqend);
+			vecu_send(pf, vecu_frame(rp, 3, fmt, src, pf));
+			reqend = diag_os_getns() + 1000000000ULL -
+				(tstamp_type) vecu.p2 * 1000000;
+		}
+	}
+	vecu_p2wait(reqend);
+	return vecu_frame(resp, rlen, fmt, src, out);
+}
+
+/*
+ * DUMB interface : K-line with echo.
+ */
+static void
+vecu_dumb_slowinit(void)
+{
+	uint8_t kb[2], c;
+	int b;
+
+	if (vecu.proto == VECU_ISO14230) {
+		kb[0] = 0xEF;
+		kb[1] = 0x8F;
+	} else {
+		kb[0] = 0x08;
+		kb[1] = 0x08;
+	}
+	diag_os_millisleep(VECU_W1);
+	c = 0x55;
+	vecu_send(&c, 1);
+	diag_os_millisleep(VECU_W2);
+	vecu_send(kb, 2);
+
+	/* Tester answers ~KB2 within W4, echo it */
+	b = vecu_getbyte(1000);
+	if (b < 0) {
+		if (vecu.debug)
+			fprintf(stderr, "vecu : no ~KB2 from tester\n");
+		return;
+	}
+	c = (uint8_t) b;
+	vecu_send(&c, 1);
+	if (c != (uint8_t) ~kb[1]) {
+		if (vecu.debug)
+			fprintf(stderr, "vecu : bad ~KB2 0x%02X\n", c);
+		return;
+	}
+	diag_os_millisleep(VECU_W4);
+	c = (uint8_t) ~vecu.initaddr;
+	vecu_send(&c, 1);
+}
+
+static void
+vecu_dumb_rx(const uint8_t *data, int len)
+{
+	uint8_t out[MAXRBUF];
+	int n, rlen, off;
+	uint8_t fmt, src;
+
+	/* Half duplex : the tester sees its own bytes */
+	if (write(vecu.master, data, len) != len)
+		perror("vecu: echo");
+
+	if (vecu.rxlen == 0 && len == 1) {
+		/* Wake up patterns, only on an idle bus */
+		if (data[0] == 0x00) {
+			if (vecu.debug)
+				fprintf(stderr, "vecu : fast init\n");
+			return;
+		}
+		if (data[0] == vecu.initaddr) {
+			if (vecu.debug)
+				fprintf(stderr, "vecu : 5 baud init, address 0x%02X\n", data[0]);
+			vecu_dumb_slowinit();
+			return;
+		}
+	}
+
+	if (vecu.rxlen + len > (int) sizeof(vecu.rx))
+		vecu.rxlen = 0;
+	memcpy(&vecu.rx[vecu.rxlen], data, len);
+	vecu.rxlen += len;
+
+	/* ISO14230 frames carry their length; ISO9141 ends on idle */
+	if (vecu.proto != VECU_ISO14230)
+		return;
+	while (vecu.rxlen && (vecu_unframe(vecu.rx, vecu.rxlen, &off, &n, &fmt, &src) != -1)) {
+		rlen = vecu_request(vecu.rx, n, diag_os_getns(), out);
+		memmove(vecu.rx, &vecu.rx[n], vecu.rxlen - n);
+		vecu.rxlen -= n;
+		if (rlen)
+			vecu_send(out, rlen);
+	}
+}
+
+/* Bus went idle : end of an ISO9141 request */
+static void
+vecu_dumb_idle(tstamp_type last)
+{
+	uint8_t out[MAXRBUF];
+	int rlen;
+
+	if (vecu.rxlen == 0)
+		return;
+	if (vecu.proto == VECU_ISO14230) {
+		/* Incomplete frame, P1 expired : drop it */
+		vecu.rxlen = 0;
+		return;
+	}
+	rlen = vecu_request(vecu.rx, vecu.rxlen, last, out);
+	vecu.rxlen = 0;
+	if (rlen)
+		vecu_send(out, rlen);
+}
+
+/*
+ * ELM327 interface.
+ */
+static void
+vecu_elm_line(char *line, tstamp_type reqend)
+{
+	uint8_t req[MAXRBUF], resp[MAXRBUF], frame[MAXRBUF];
+	char buf[4 * MAXRBUF];
+	int i, n, rlen, pos;
+	unsigned int v;
+	uint8_t fmt = 0xC0, *p;
+
+	if (strncasecmp(line, "AT", 2) == 0) {
+		char *cmd = line + 2;
+
+		if (strcasecmp(cmd, "Z") == 0) {
+			vecu.elm_echo = 1;
+			vecu.elm_headers = 0;
+			vecu_sendstr("\r\rELM327 v1.5\r\r>");
+			return;
+		} else if (strcasecmp(cmd, "I") == 0) {
+			vecu_sendstr("ELM327 v1.5\r\r>");
+			return;
+		} else if (strncasecmp(cmd, "E", 1) == 0 && isdigit((unsigned char) cmd[1])) {
+			vecu.elm_echo = cmd[1] - '0';
+		} else if (strncasecmp(cmd, "H", 1) == 0 && isdigit((unsigned char) cmd[1])) {
+			vecu.elm_headers = cmd[1] - '0';
+		} else if ((strcasecmp(cmd, "SI") == 0) || (strcasecmp(cmd, "FI") == 0)) {
+			vecu_sendstr("BUS INIT: ...OK\r\r>");
+			return;
+		}
+		vecu_sendstr("OK\r\r>");
+		return;
+	}
+
+	for (n = 0; line[2 * n] && line[2 * n + 1] && n < (int) sizeof(req); n++) {
+		if (sscanf(&line[2 * n], "%2x", &v) != 1)
+			break;
+		req[n] = (uint8_t) v;
+	}
+	if (n == 0) {
+		vecu_sendstr("?\r\r>");
+		return;
+	}
+	vecu_dump("vecu <", req, n);
+
+	rlen = vecu_service(req, n, resp);
+	if (rlen == 0) {
+		vecu_sendstr("NO DATA\r\r>");
+		return;
+	}
+	vecu_p2wait(reqend);
+
+	p = resp;
+	if (vecu.elm_headers) {
+		rlen = vecu_frame(resp, rlen, fmt, 0xF1, frame);
+		p = frame;
+	}
+	pos = 0;
+	for (i = 0; i < rlen; i++)
+		pos += sprintf(&buf[pos], "%02X ", p[i]);
+	strcpy(&buf[pos], "\r\r>");
+	vecu_sendstr(buf);
+}
+
+static void
+vecu_elm_rx(const uint8_t *data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (vecu.elm_echo)
+			vecu_send(&data[i], 1);
+		if (data[i] == '\r') {
+			vecu.rx[vecu.rxlen] = 0;
+			if (vecu.rxlen)
+				vecu_elm_line((char *) vecu.rx, diag_os_getns());
+			else
+				vecu_sendstr(">");
+			vecu.rxlen = 0;
+		} else if (!isspace(data[i]) && (vecu.rxlen < (int) sizeof(vecu.rx) - 1)) {
+			vecu.rx[vecu.rxlen++] = data[i];
+		}
+	}
+}
+
+/*
+ * BR-1 interface. Tester -> interface messages are a control byte
+ * (0x40 : init, low nibble : length) and the data; in J1850 mode the
+ * data ends with a frame number. Interface -> tester J1850 messages are
+ * a length byte and the frame; 0x80 means no (more) data. In ISO modes
+ * the responses are passed through raw.
+ */
+static void
+vecu_br1_msg(const uint8_t *msg, int len, int init, tstamp_type reqend)
+{
+	uint8_t out[MAXRBUF + 1];
+	int rlen;
+
+	if (init) {
+		out[0] = 0x02;
+		switch (msg[0]) {
+		case 0x02:	/* 5 baud init : keybytes */
+			if (vecu.proto == VECU_ISO14230) {
+				out[1] = 0xEF;
+				out[2] = 0x8F;
+			} else {
+				out[1] = 0x08;
+				out[2] = 0x08;
+			}
+			vecu_send(out, 3);
+			return;
+		case 0x03:	/* Fast init with StartComms : raw response */
+			rlen = vecu_request(&msg[1], len - 1, reqend, out);
+			if (rlen)
+				vecu_send(out, rlen);
+			return;
+		default:	/* J1850 VPW / PWM setup */
+			out[1] = 0x00;
+			out[2] = 0x00;
+			vecu_send(out, 3);
+			return;
+		}
+	}
+
+	if (vecu.proto == VECU_J1850) {
+		if (msg[len - 1] != 1) {
+			/* Next frame requested : we only ever have one */
+			out[0] = 0x80;
+			vecu_send(out, 1);
+			return;
+		}
+		rlen = vecu_request(msg, len - 1, reqend, &out[1]);
+		if ((rlen == 0) || (rlen > 15)) {
+			out[0] = 0x80;
+			vecu_send(out, 1);
+			return;
+		}
+		out[0] = (uint8_t) rlen;
+		vecu_send(out, rlen + 1);
+		return;
+	}
+
+	rlen = vecu_request(msg, len, reqend, out);
+	if (rlen)
+		vecu_send(out, rlen);
+}
+
+static void
+vecu_br1_rx(const uint8_t *data, int len)
+{
+	uint8_t c;
+	int need;
+
+	if (vecu.rxlen + len > (int) sizeof(vecu.rx))
+		vecu.rxlen = 0;
+	memcpy(&vecu.rx[vecu.rxlen], data, len);
+	vecu.rxlen += len;
+
+	while (vecu.rxlen) {
+		c = vecu.rx[0];
+		if (c == 0x20) {
+			/* CHIP CONNECT */
+			c = 0xFF;
+			vecu_send(&c, 1);
+			need = 1;
+		} else {
+			need = 1 + (c & 0x0F);
+			if (vecu.rxlen < need)
+				return;
+			vecu_br1_msg(&vecu.rx[1], need - 1, c & 0x40, diag_os_getns());
+		}
+		memmove(vecu.rx, &vecu.rx[need], vecu.rxlen - need);
+		vecu.rxlen -= need;
+	}
+}
+
+static void
+vecu_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-i dumb|elm|br1] [-p iso9141|iso14230|j1850]\n"
+		"\t[-a initaddr] [-e ecuaddr] [-b byte_us] [-r p2_ms] [-l link] [-d]\n"
+		"  -b : time between bytes sent by the ECU, in us (default : 10400 bps wire time)\n"
+		"  -r : response delay after the end of a request, in ms (default %d)\n"
+		"  -l : create a symlink to the pty slave\n",
+		prog, VECU_P2);
+}
+
+int
+main(int argc, char **argv)
+{
+	char name[256];
+	const char *link = NULL;
+	struct termios tio;
+	struct sigaction sa;
+	struct pollfd pfd;
+	uint8_t buf[MAXRBUF];
+	tstamp_type last = 0;
+	int opt, n, tmo;
+
+	vecu.iface = VECU_DUMB;
+	vecu.proto = VECU_ISO9141;
+	vecu.initaddr = 0x33;
+	vecu.ecuaddr = 0x10;
+	vecu.byte_ns = 10 * 1000000000UL / 10400;
+	vecu.p2 = VECU_P2;
+	vecu.elm_echo = 1;
+
+	while ((opt = getopt(argc, argv, "i:p:a:e:b:r:l:dh")) != -1) {
+		switch (opt) {
+		case 'i':
+			if (strcasecmp(optarg, "dumb") == 0)
+				vecu.iface = VECU_DUMB;
+			else if (strcasecmp(optarg, "elm") == 0)
+				vecu.iface = VECU_ELM;
+			else if (strcasecmp(optarg, "br1") == 0)
+				vecu.iface = VECU_BR1;
+			else {
+				vecu_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (strcasecmp(optarg, "iso9141") == 0)
+				vecu.proto = VECU_ISO9141;
+			else if (strcasecmp(optarg, "iso14230") == 0)
+				vecu.proto = VECU_ISO14230;
+			else if (strcasecmp(optarg, "j1850") == 0)
+				vecu.proto = VECU_J1850;
+			else {
+				vecu_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'a':
+			vecu.initaddr = (uint8_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			vecu.ecuaddr = (uint8_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			vecu.byte_ns = strtoul(optarg, NULL, 0) * 1000;
+			break;
+		case 'r':
+			vecu.p2 = atoi(optarg);
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		case 'd':
+			vecu.debug = 1;
+			break;
+		default:
+			vecu_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((vecu.iface == VECU_DUMB) && (vecu.proto == VECU_J1850)) {
+		fprintf(stderr, "%s: J1850 needs the br1 or elm interface\n", argv[0]);
+		return 1;
+	}
+
+	diag_os_init();
+
+	/* Raw both ways; the tester will set up its side anyway */
+	if (openpty(&vecu.master, &vecu.slave, name, NULL, NULL) < 0) {
+		perror("openpty");
+		return 1;
+	}
+	if (tcgetattr(vecu.slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		(void) tcsetattr(vecu.slave, TCSANOW, &tio);
+	}
+	/* We keep the slave open so the tester can close/reopen it */
+
+	if (link) {
+		(void) unlink(link);
+		if (symlink(name, link) < 0) {
+			perror("symlink");
+			return 1;
+		}
+	}
+	printf("%s\n", link ? link : name);
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = vecu_sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pfd.fd = vecu.master;
+	pfd.events = POLLIN;
+	while (!vecu_quit) {
+		/* Only an ISO9141 K-line request needs the idle timeout */
+		tmo = ((vecu.iface != VECU_ELM) && vecu.rxlen) ? VECU_IDLE : 500;
+		n = poll(&pfd, 1, tmo);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (n == 0) {
+			if ((vecu.iface == VECU_DUMB) && vecu.rxlen)
+				vecu_dumb_idle(last);
+			else if (vecu.iface == VECU_BR1)
+				vecu.rxlen = 0;		/* resync */
+			continue;
+		}
+		n = read(vecu.master, buf, sizeof(buf));
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			perror("read");
+			break;
+		}
+		last = diag_os_getns();
+		vecu.bytes_in += n;
+
+		switch (vecu.iface) {
+		case VECU_DUMB:
+			vecu_dumb_rx(buf, n);
+			break;
+		case VECU_ELM:
+			vecu_elm_rx(buf, n);
+			break;
+		case VECU_BR1:
+			vecu_br1_rx(buf, n);
+			break;
+		}
+	}
+
+	printf("%lu requests answered, %lu bytes in, %lu bytes out\n",
+		vecu.requests, vecu.bytes_in, vecu.bytes_out);
+	if (vecu.requests)
+		printf("response delay : asked %dms, got avg %luus, max %luus\n",
+			vecu.p2, (unsigned long) (vecu.p2_total / vecu.requests / 1000),
+			vecu.p2_max / 1000);
+
+	if (link)
+		(void) unlink(link);
+	close(vecu.master);
+	close(vecu.slave);
+	return 0;
+}
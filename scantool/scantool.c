@@ -90,28 +90,7 @@ uint8_t global_data[MAXRBUF];
 int global_datalen;
 #endif
 
-struct diag_l2_conn *global_l2_conn;
-struct diag_l3_conn *global_l3_conn;
-
-/*
- * Data received from each ecu
- */
-ecu_data_t	ecu_info[MAX_ECU];
-unsigned int ecu_count;		/* How many ecus are active */
-
-
-/* Merge of all the suported mode1 pids by all the ECUs */
-uint8_t	merged_mode1_info[0x100];
-uint8_t	merged_mode5_info[0x100];
-
-uint8_t	global_O2_sensors;	/* O2 sensors bit mask */
-
-int	global_conmode;
-int	global_protocol;
-
-int	global_state;		/* See STATE_ definitions in .h file */
-
-struct diag_l0_device *		global_l2_dl0d;		/* L2 dl0d */
+SCANTOOL_TLS struct scantool_session *session;
 
 /* Prototypes */
 int print_single_dtc(databyte_type d0, databyte_type d1) ;
@@ -124,6 +103,107 @@ int do_l3_md1pid0_rqst( struct diag_l2_conn *d_conn ) ;
 void initialse_ecu_data(void);
 
 
+ecu_data_t *
+ecu_lookup(uint8_t addr, int create)
+{
+	ecu_data_t *ep;
+
+	if (session->ecu_index[addr])
+		return &session->ecu_info[session->ecu_index[addr] - 1];
+	if (!create)
+		return NULL;
+
+	if (session->ecu_count == session->ecu_alloc) {
+		unsigned int n = session->ecu_alloc ? session->ecu_alloc * 2 : 4;
+
+		if (diag_calloc(&ep, n))
+			return NULL;
+		if (session->ecu_count)
+			memcpy(ep, session->ecu_info, session->ecu_count * sizeof(*ep));
+		free(session->ecu_info);
+		session->ecu_info = ep;
+		session->ecu_alloc = n;
+	}
+
+	ep = &session->ecu_info[session->ecu_count++];
+	ep->valid = 1;
+	ep->ecu_addr = addr;
+	session->ecu_index[addr] = (uint16_t) session->ecu_count;
+
+	return ep;
+}
+
+
+/* Number of PIDs in the store below pid */
+static unsigned int
+response_rank(const response_store_t *rs, unsigned int pid)
+{
+	unsigned int i, rank = 0;
+	uint8_t b;
+
+	for (i = 0; i < (pid >> 3); i++)
+		for (b = rs->present[i]; b; b &= (uint8_t)(b - 1))
+			rank++;
+	for (b = rs->present[pid >> 3] & ((1 << (pid & 7)) - 1); b;
+			b &= (uint8_t)(b - 1))
+		rank++;
+
+	return rank;
+}
+
+const response_t *
+response_get(const response_store_t *rs, unsigned int pid)
+{
+	static const response_t untested;	/* TYPE_UNTESTED */
+
+	if (!PIDSET_HAS(rs->present, pid))
+		return &untested;
+
+	return &rs->r[response_rank(rs, pid)];
+}
+
+response_t *
+response_put(response_store_t *rs, unsigned int pid)
+{
+	unsigned int rank;
+	response_t *r;
+
+	if (pid >= 0x100)
+		return NULL;
+
+	rank = response_rank(rs, pid);
+	if (PIDSET_HAS(rs->present, pid))
+		return &rs->r[rank];
+
+	if (rs->cnt == rs->alloc) {
+		unsigned int n = rs->alloc ? rs->alloc * 2 : 8;
+
+		if (diag_calloc(&r, n))
+			return NULL;
+		if (rs->cnt)
+			memcpy(r, rs->r, rs->cnt * sizeof(*r));
+		free(rs->r);
+		rs->r = r;
+		rs->alloc = (uint16_t) n;
+	}
+
+	r = &rs->r[rank];
+	memmove(r + 1, r, (rs->cnt - rank) * sizeof(*r));
+	memset(r, 0, sizeof(*r));
+	rs->cnt++;
+	PIDSET_ADD(rs->present, pid);
+
+	return r;
+}
+
+void
+response_store_free(response_store_t *rs)
+{
+	free(rs->r);
+	memset(rs, 0, sizeof(*rs));
+}
+
+
 struct diag_msg *
 find_ecu_msg(int byte, databyte_type val)
 {
@@ -131,11 +211,11 @@ find_ecu_msg(int byte, databyte_type val)
 	struct diag_msg *rv = NULL;
 	unsigned int i;
 
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if (ep->rxmsg) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		if (ep->rxmsgs.head) {
 			/* Some data arrived from this ecu */
-			if (ep->rxmsg->data[byte] == val) {
-				rv = ep->rxmsg;
+			if (ep->rxmsgs.head->data[byte] == val) {
+				rv = ep->rxmsgs.head;
 				break;
 			}
 		}
@@ -152,7 +232,8 @@ print_msg_header(FILE *fp, struct diag_msg *msg, int timestamp, int i)
 {
 	if (timestamp)
 		fprintf(fp, "%ld.%04ld: ",
-			(long)msg->rxtime.tv_sec, (long)msg->rxtime.tv_usec/100);
+			(long)(msg->rxtime / 1000000000),
+			(long)(msg->rxtime % 1000000000) / 100000);
 	fprintf(fp, "msg %02d src 0x%lx dest 0x%lx ", i, (long)msg->src, (long)msg->dest);
 	fprintf(fp, "msg %02d: ", i);
 }
@@ -197,7 +278,7 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 	uint8_t *data = msg->data;
 	struct diag_msg *tmsg;
 	unsigned int i;
-	int * ihandle= (int *) handle;
+	long ihandle = (long) handle;
 	ecu_data_t	*ep;
 
 	const char *O2_strings[] = {
@@ -214,8 +295,10 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 		};
 
 	if (diag_cmd_debug > DIAG_DEBUG_DATA) {
-		fprintf(stderr, "scantool: Got handle %p; %d bytes of data, src %x, dest %x; msgcnt %d\n",
-			handle, len, msg->src, msg->dest, msg->mcnt);
+		for (i=0, tmsg=msg; tmsg; tmsg=tmsg->next)
+			i++;
+		fprintf(stderr, "scantool: Got handle %p; %d bytes of data, src %x, dest %x; msgcnt %u\n",
+			handle, len, msg->src, msg->dest, i);
 	}
 
 	/* Debug level for showing received data */
@@ -225,7 +308,7 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 	}
 
 	/* Deal with the diag type responses (send/recv/watch) */
-	switch (*ihandle) {
+	switch (ihandle) {
 	/* There is no difference between watch and decode ... */
 		case RQST_HANDLE_WATCH:
 		case RQST_HANDLE_DECODE:
@@ -239,12 +322,9 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 	/* All other responses are J1979 response messages */
 
 	/* Clear out old messages */
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if (ep->rxmsg) {
-			/* Old msg. release it */
-			diag_freemsg(ep->rxmsg);
-			ep->rxmsg = NULL;
-		}
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		/* Old msgs, release them */
+		diag_msglist_free(&ep->rxmsgs);
 	}
 
 	/*
@@ -254,24 +334,9 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 	for (tmsg = msg; tmsg; tmsg=tmsg->next) {
 		uint8_t src = tmsg->src;
 		struct diag_msg *rmsg;
-		int found;
-	
-		for (i=0, ep=ecu_info, found=0; i<MAX_ECU;i++, ep++) {
-			if (ep->valid) {
-				if (ep->ecu_addr == src) {
-					found = 1;
-					break;
-				}
-			} else {
-				ecu_count++;
-				ep->valid = 1;
-				ep->ecu_addr = src;
-				found = 1;
-				break;
-			}
-		}
-		if (found == 0) {
-			fprintf(stderr, "ERROR: Too many ECUs responded\n");
+
+		ep = ecu_lookup(src, 1);
+		if (ep == NULL) {
 			fprintf(stderr, "ERROR: Info from ECU addr 0x%x ignored\n", src);
 			return;
 		}
@@ -279,19 +344,8 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 		/* Ok, we now have the ecu_info for this message fragment */
 
 		/* Attach the fragment to the ecu_info */
-		rmsg = diag_dupsinglemsg(tmsg);	
-		if (ep->rxmsg) {
-			struct diag_msg *xmsg = ep->rxmsg;
-			while (xmsg) {
-				if (xmsg->next == NULL) {
-					xmsg->next = rmsg;
-					break;
-				}
-				xmsg = xmsg->next;
-			}
-		} else {
-			ep->rxmsg = rmsg;
-		}
+		rmsg = diag_msg_retain(tmsg);
+		diag_msglist_append(&ep->rxmsgs, rmsg);
 
 		/*
 		 * Deal with readiness tests, ncms and O2 sensor tests
@@ -300,7 +354,7 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 		 * response
 		 */
 		data = msg->data;
-		switch (*ihandle) {
+		switch (ihandle) {
 			case RQST_HANDLE_READINESS:
 				/* Handled in cmd_test_readiness() */
 				break;
@@ -329,7 +383,7 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 					lim = (data[5]*255) + data[6];
 
 					if ((data[2] & 0x80) == 0) {
-						if (*ihandle == RQST_HANDLE_NCMS2) {
+						if (ihandle == RQST_HANDLE_NCMS2) {
 							/* Only print fails */
 							if (val > lim) {
 								fprintf(stderr, "Test 0x%x Component 0x%x FAILED ",
@@ -352,7 +406,7 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 								lim, val);
 						}
 					} else {
-						if (*ihandle == RQST_HANDLE_NCMS2) {
+						if (ihandle == RQST_HANDLE_NCMS2) {
 							if (val < lim) {
 								fprintf(stderr, "Test 0x%x Component 0x%x FAILED ",
 									data[1], data[2] & 0x7f);
@@ -375,7 +429,7 @@ j1979_data_rcv(void *handle, struct diag_msg *msg)
 				}
 				return;
 			case RQST_HANDLE_O2S:
-				if (ecu_count>1)
+				if (session->ecu_count>1)
 					fprintf(stderr, "ECU %d ", i);
 
 				/* O2 Sensor test results */
@@ -448,7 +502,8 @@ j1979_watch_rcv(void *handle, struct diag_msg *msg)
 	int i, j;
 
 	for ( tmsg = msg , i = 0; tmsg; tmsg=tmsg->next, i++ ) {
-		fprintf(stderr, "%ld.%04ld: ", (long)tmsg->rxtime.tv_sec, (long)tmsg->rxtime.tv_usec/100);
+		fprintf(stderr, "%ld.%04ld: ", (long)(tmsg->rxtime / 1000000000),
+			(long)(tmsg->rxtime % 1000000000) / 100000);
 		fprintf(stderr, "msg %02d src 0x%x dest 0x%x ", i, msg->src, msg->dest);
 		fprintf(stderr, "msg %02d: ", i);
 
@@ -526,6 +581,49 @@ l2_check_pid_bits(uint8_t *data, int pid)
 	return 0;
 }
 
+/*
+ * Go thru the ecu_data and file what was received for mode/pid
+ */
+static void
+j1979_store(int mode, uint8_t pid)
+{
+	ecu_data_t *ep;
+	unsigned int i;
+	uint8_t *rxdata;
+	struct diag_msg *rxmsg;
+	response_t *resp;
+
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		if (ep->rxmsgs.head) {
+			/* Some data arrived from this ecu */
+			rxmsg = ep->rxmsgs.head;
+			rxdata = ep->rxmsgs.head->data;
+
+			switch (mode) {
+				case 1:
+					resp = response_put(&ep->mode1_data, pid);
+					break;
+				case 2:
+					resp = response_put(&ep->mode2_data, pid);
+					break;
+				default:
+					resp = NULL;
+					break;
+			}
+			if (resp == NULL)
+				continue;
+
+			if (rxdata[0] != (mode + 0x40)) {
+				resp->type = TYPE_FAILED;
+				continue;
+			}
+			resp->len = (uint8_t) MIN(rxmsg->len, sizeof(resp->data));
+			memcpy(resp->data, rxdata, resp->len);
+			resp->type = TYPE_GOOD;
+		}
+	}
+}
+
 /*
  * Send a SAE J1979 request, and get a response, and part process it
  * XXX why is there "mode" + 7 bytes ? J1979 messages are 7 data bytes long (includes any mode / SID byte)
@@ -536,13 +634,8 @@ l3_do_j1979_rqst(struct diag_l3_conn *d_conn, int mode, uint8_t p1, uint8_t p2,
 {
 	struct diag_msg	msg;
 	uint8_t data[7];	//was 256?
-	int * ihandle=(int *) handle;
+	long ihandle = (long) handle;
 	int rv;
-	ecu_data_t *ep;
-	unsigned int i;
-
-	uint8_t *rxdata;
-	struct diag_msg *rxmsg;
 
 	/* Lengths of msg for each mode, 0 = this routine doesn't support */
 	char mode_lengths[] = { 0, 2, 3, 1, 1, 3, 2, 1, 7, 2 };
@@ -555,8 +648,8 @@ l3_do_j1979_rqst(struct diag_l3_conn *d_conn, int mode, uint8_t p1, uint8_t p2,
 	}
 
 	/* Put in src/dest etc, L3 or L2 may override/ignore them */
-	msg.src = set_testerid;
-	msg.dest = set_destaddr;	/* Current set destination */
+	msg.src = session->testerid;
+	msg.dest = session->destaddr;	/* Current set destination */
 
 	/* XXX add funcmode flags */
 
@@ -584,54 +677,21 @@ l3_do_j1979_rqst(struct diag_l3_conn *d_conn, int mode, uint8_t p1, uint8_t p2,
 		rv = diag_l3_recv(d_conn, 300, j1979_data_rcv, handle);
 		if (rv < 0) {
 			fprintf(stderr, "Retry failed, resynching...\n");
-			rv = do_l3_md1pid0_rqst(global_l2_conn);
+			rv = do_l3_md1pid0_rqst(session->l2_conn);
 			if (rv < 0)
 				fprintf(stderr, "Resync failed, connection to ECU may be lost!\n");
 			return rv;
 		}
 	}
 
-	switch (*ihandle) {
+	switch (ihandle) {
 		/* We dont process the info in watch/decode mode */
 		case RQST_HANDLE_WATCH:
 		case RQST_HANDLE_DECODE:
 			return rv;
 		}
 
-		/*
-		 * Go thru the ecu_data and see what was received.
-		 */
-		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-			if (ep->rxmsg) {
-				/* Some data arrived from this ecu */
-				rxmsg = ep->rxmsg;
-				rxdata = ep->rxmsg->data;
-
-				switch (mode) {
-					case 1:
-						if (rxdata[0] != 0x41) {
-							ep->mode1_data[p1].type = TYPE_FAILED;
-							break;
-						}
-						memcpy(ep->mode1_data[p1].data, rxdata,
-							rxmsg->len);
-						ep->mode1_data[p1].len = rxmsg->len;
-						ep->mode1_data[p1].type = TYPE_GOOD;
-
-						break;
-					case 2:
-						if (rxdata[0] != 0x42) {
-							ep->mode2_data[p1].type = TYPE_FAILED;
-							break;
-						}
-						memcpy(ep->mode2_data[p1].data, rxdata,
-							rxmsg->len);
-						ep->mode2_data[p1].len = rxmsg->len;
-						ep->mode2_data[p1].type = TYPE_GOOD;
-						break;
-				}	
-			}
-		}
+		j1979_store(mode, p1);
 		return 0;
 }
 
@@ -647,8 +707,8 @@ l3_do_send(struct diag_l3_conn *d_conn, void *data, size_t len, void *handle)
 
 
 	/* Put in src/dest etc, L3 or L2 may override/ignore them */
-	msg.src = set_testerid;
-	msg.dest = set_destaddr;
+	msg.src = session->testerid;
+	msg.dest = session->destaddr;
 
 	msg.len = len;	
 	msg.data = (uint8_t *)data;
@@ -669,8 +729,8 @@ l2_do_send(struct diag_l2_conn *d_conn, void *data, size_t len, void *handle)
 	int rv;
 
 	/* Put in src/dest etc, L2 may override/ignore them */
-	msg.src = set_testerid;
-	msg.dest = set_destaddr;
+	msg.src = session->testerid;
+	msg.dest = session->destaddr;
 
 	msg.len = len;	
 	msg.data = (uint8_t *)data;
@@ -687,17 +747,75 @@ l2_do_send(struct diag_l2_conn *d_conn, void *data, size_t len, void *handle)
  * Clear data that is relevant to an ECU
  */
 static int
-clear_data(void)
+clear_data(struct scantool_session *s)
 {
-	ecu_count = 0;
-	memset(ecu_info, 0, sizeof(ecu_info));
+	unsigned int i;
+
+	for (i=0; i<s->ecu_count; i++) {
+		diag_msglist_free(&s->ecu_info[i].rxmsgs);
+		response_store_free(&s->ecu_info[i].mode1_data);
+		response_store_free(&s->ecu_info[i].mode2_data);
+	}
+
+	s->ecu_count = 0;
+	memset(s->ecu_info, 0, s->ecu_alloc * sizeof(*s->ecu_info));
+	memset(s->ecu_index, 0, sizeof(s->ecu_index));
 
-	memset(merged_mode1_info, 0, sizeof(merged_mode1_info));
-	memset(merged_mode5_info, 0, sizeof(merged_mode5_info));
+	memset(s->merged_mode1_info, 0, sizeof(s->merged_mode1_info));
+	memset(s->merged_mode5_info, 0, sizeof(s->merged_mode5_info));
 
 	return 0;
 }
 
+struct scantool_session *
+scantool_session_new(void)
+{
+	struct scantool_session *s;
+	int rv;
+
+	if ((rv = diag_calloc(&s, 1)))
+		return diag_pseterr(rv);
+
+	s->state = STATE_IDLE;
+	set_defaults(s);
+
+	return s;
+}
+
+void
+scantool_session_free(struct scantool_session *s)
+{
+	if (s == NULL)
+		return;
+	clear_data(s);
+	free(s->ecu_info);
+	if (session == s)
+		session = NULL;
+	free(s);
+}
+
+struct scantool_session *
+scantool_session_use(struct scantool_session *s)
+{
+	struct scantool_session *prev = session;
+
+	session = s;
+	return prev;
+}
+
+/*
+ * Open the current interface for L1protocol. diag_l2_open() closes (and
+ * frees) the link if it was open with another L1 protocol, so
+ * session->dl0d is forgotten first; it is set again once connected.
+ */
+struct diag_l0_device *
+do_l2_open(int L1protocol)
+{
+	session->dl0d = NULL;
+	return diag_l2_open(l0_names[session->interface_idx].longname,
+		session->subinterface, L1protocol);
+}
+
 /*
  * Common start routine used by all protocols
  * - initialises the diagnostic layer
@@ -714,7 +832,7 @@ static struct diag_l2_conn * do_l2_common_start(int L1protocol, int L2protocol,
 	int l2flags;
 
 	/* Clear out all ECU data as we're starting again */
-	clear_data();
+	clear_data(session);
 
 	rv = diag_init();
 	if (rv != 0) {
@@ -722,7 +840,7 @@ static struct diag_l2_conn * do_l2_common_start(int L1protocol, int L2protocol,
 		return NULL;
 	}
 
-	dl0d = diag_l2_open(l0_names[set_interface_idx].longname, set_subinterface, L1protocol);
+	dl0d = do_l2_open(L1protocol);
 	if (dl0d == 0) {
 		rv = diag_geterr();
 		if ((rv != DIAG_ERR_BADIFADAPTER) &&
@@ -762,10 +880,12 @@ static struct diag_l2_conn * do_l2_common_start(int L1protocol, int L2protocol,
 		rv = do_l3_md1pid0_rqst(d_conn);
 		if (rv < 0) {
 			/* Not actually there, close L2 and go */
+			diag_l2_StopCommunications(d_conn);
 			diag_l2_close(dl0d);
 			return NULL;
 		}
 	}
+	session->dl0d = dl0d;	/* Saved for close, and "debug timing" */
 	return d_conn;
 }
 
@@ -788,8 +908,8 @@ int do_l3_md1pid0_rqst( struct diag_l2_conn *d_conn )
 	int errval = DIAG_ERR_GENERAL;
 
 	/* Create mode 1 pid 0 message */
-	msg.src = set_testerid;
-	msg.dest = set_destaddr;
+	msg.src = session->testerid;
+	msg.dest = session->destaddr;
 	msg.len = 2;
 	msg.data = data;
 	data[0] = 1;
@@ -800,6 +920,7 @@ int do_l3_md1pid0_rqst( struct diag_l2_conn *d_conn )
 	if (rmsg != NULL) {
 		/* Check its a Mode1 Pid0 response */	
 		if (rmsg->len < 1) {
+			diag_freemsg(rmsg);
 			return diag_iseterr(DIAG_ERR_BADDATA);	
 		}
 // What is this???
@@ -808,6 +929,7 @@ int do_l3_md1pid0_rqst( struct diag_l2_conn *d_conn )
 /*			return diag_iseterr(DIAG_ERR_BADDATA);	*/
 /*		} */
 
+		diag_freemsg(rmsg);
 		return 0;
 	}
 	return errval;
@@ -822,14 +944,14 @@ do_l2_9141_start(int destaddr)
 	struct diag_l2_conn *d_conn;
 
 	d_conn = do_l2_common_start(DIAG_L1_ISO9141, DIAG_L2_PROT_ISO9141,
-		DIAG_L2_TYPE_SLOWINIT, set_speed, (uint8_t)destaddr,
-		set_testerid);
+		DIAG_L2_TYPE_SLOWINIT, session->speed, (uint8_t)destaddr,
+		session->testerid);
 
 	if (d_conn == NULL)
 		return -1;
 
 	/* Connected ! */
-	global_l2_conn = d_conn;
+	session->l2_conn = d_conn;
 
 	return 0;
 }
@@ -843,7 +965,7 @@ do_l2_14230_start(int init_type)
 	struct diag_l2_conn *d_conn;
 	flag_type flags = 0;
 
-	if (set_addrtype == 1)
+	if (session->addrtype == 1)
 		flags = DIAG_L2_TYPE_FUNCADDR;
 	else
 		flags = 0;
@@ -853,13 +975,13 @@ do_l2_14230_start(int init_type)
 	flags |= (init_type & DIAG_L2_TYPE_INITMASK) ;
 
 	d_conn = do_l2_common_start(DIAG_L1_ISO14230, DIAG_L2_PROT_ISO14230,
-		flags, set_speed, set_destaddr, set_testerid);
+		flags, session->speed, session->destaddr, session->testerid);
 
 	if (d_conn == NULL)
 		return -1;
 
 	/* Connected ! */
-	global_l2_conn = d_conn;
+	session->l2_conn = d_conn;
 
 	return 0;
 }
@@ -874,13 +996,36 @@ do_l2_j1850_start(int l1_type)
 	struct diag_l2_conn *d_conn;
 
 	d_conn = do_l2_common_start(l1_type, DIAG_L2_PROT_SAEJ1850,
-		flags, set_speed, 0x6a, set_testerid);
+		flags, session->speed, 0x6a, session->testerid);
+
+	if (d_conn == NULL)
+		return -1;
+
+	/* Connected ! */
+	session->l2_conn = d_conn;
+
+	return 0;
+}
+
+/*
+ * ISO 15765-4 (CAN) init, flags say 11 or 29 bit identifiers. The ISO
+ * 15765-4 bit rate is 500kbps (250kbps on some trucks), nothing like the
+ * K-line speed in set_speed
+ */
+int
+do_l2_can_start(int flags)
+{
+	struct diag_l2_conn *d_conn;
+
+	d_conn = do_l2_common_start(DIAG_L1_CAN, DIAG_L2_PROT_CAN,
+		(uint32_t)flags | DIAG_L2_TYPE_FUNCADDR, 500000, 0x33,
+		session->testerid);
 
 	if (d_conn == NULL)
 		return -1;
 
 	/* Connected ! */
-	global_l2_conn = d_conn;
+	session->l2_conn = d_conn;
 
 	return 0;
 }
@@ -904,25 +1049,28 @@ do_l2_generic_start(void)
 	}
 
 	/* Open interface using hardware type ISO14230 */
-	dl0d = diag_l2_open(l0_names[set_interface_idx].longname, set_subinterface, set_L1protocol);
+	dl0d = do_l2_open(session->L1protocol);
 	if (dl0d == 0) {
 		//indicating an error
 		rv = diag_geterr();
 		//if ((rv != DIAG_ERR_BADIFADAPTER) && (rv != DIAG_ERR_PROTO_NOTSUPP))
 		fprintf(stderr, "Failed to open hardware interface protocol %d with %s on %s\n",
-			set_L1protocol,l0_names[set_interface_idx].longname,set_subinterface);
+			session->L1protocol,l0_names[session->interface_idx].longname,session->subinterface);
 		return diag_iseterr(rv);
 	}
 
-	if (set_addrtype == 1)
+	if (session->addrtype == 1)
 		flags = DIAG_L2_TYPE_FUNCADDR;
 	else
 		flags = 0;
 
-	flags |= (set_initmode & DIAG_L2_TYPE_INITMASK) ;
+	flags |= (session->initmode & DIAG_L2_TYPE_INITMASK) ;
+
+	if (session->can29bit)
+		flags |= DIAG_L2_TYPE_CAN29BIT;
 
-	d_conn = diag_l2_StartCommunications(dl0d, set_L2protocol,
-		flags, set_speed, set_destaddr, set_testerid);
+	d_conn = diag_l2_StartCommunications(dl0d, session->L2protocol,
+		flags, session->speed, session->destaddr, session->testerid);
 
 	if (d_conn == NULL) {
 	rv=diag_geterr();
@@ -932,8 +1080,8 @@ do_l2_generic_start(void)
 
 	/* Connected ! */
 	
-	global_l2_conn = d_conn;
-	global_l2_dl0d = dl0d;	/* Saved for close */
+	session->l2_conn = d_conn;
+	session->dl0d = dl0d;	/* Saved for close */
 
 	return 0;
 }
@@ -948,22 +1096,108 @@ do_l2_generic_start(void)
  *
  * It is used in "Interuptible" mode when doing "monitor" command
  */
+#define J1979_QDEPTH	3	/* Mode 1 requests queued ahead */
+
+/* Completion of a queued mode 1 request, see j1979_getdata_queued() */
+static void
+j1979_getdata_done(struct diag_l2_areq *req, void *arg)
+{
+	uint8_t *failed = (uint8_t *)arg;
+	uint8_t pid = req->msg->data[1];
+
+	if (req->resp == NULL) {
+		PIDSET_ADD(failed, pid);
+		return;
+	}
+	j1979_data_rcv((void *)0, req->resp);
+	j1979_store(1, pid);
+	if (find_ecu_msg(0, 0x41) == NULL)
+		fprintf(stderr, "Mode 1 Pid 0x%02x request no-data\n", pid);
+}
+
+/*
+ * Mode 1 part of do_j1979_getdata(), pipelined: the next requests are
+ * already queued on L2 while we file each answer. Only used when L2 does
+ * the framing, as the J1979 L3 then just passes messages through.
+ * Requests that fail get the usual retry/resync afterwards.
+ *
+ * Returns 0, or 1 if interrupted
+ */
+static int
+j1979_getdata_queued(struct diag_l3_conn *d_conn, int interruptible)
+{
+	struct diag_l2_conn *d_l2_conn = d_conn->d_l3l2_conn;
+	struct diag_msg msg;
+	uint8_t data[2];
+	uint8_t failed[PIDSET_SIZE];
+	unsigned int i;
+	int rv, interrupted = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(failed, 0, sizeof(failed));
+	msg.src = session->testerid;
+	msg.dest = session->destaddr;
+	msg.len = 2;
+	msg.data = data;
+	data[0] = 1;
+
+	for (i=3; (i<0x100) && !interrupted; i++) {
+		if (!PIDSET_HAS(session->merged_mode1_info, i))
+			continue;
+
+		while (diag_l2_outstanding(d_l2_conn) >= J1979_QDEPTH)
+			(void) diag_l2_reap(d_l2_conn, 1000);
+
+		fprintf(stderr, "Requesting Mode 1 Pid 0x%02x...\n", i);
+		data[1] = (uint8_t) i;
+		if (diag_l2_submit(d_l2_conn, &msg, j1979_getdata_done, failed) < 0)
+			PIDSET_ADD(failed, i);
+
+		if (interruptible) {
+			if (diag_os_ipending(fileno(stdin)))
+				interrupted = 1;
+		}
+	}
+	while (diag_l2_outstanding(d_l2_conn))
+		(void) diag_l2_reap(d_l2_conn, 1000);
+	if (interrupted)
+		return 1;
+
+	for (i=3; i<0x100; i++) {
+		if (!PIDSET_HAS(failed, i))
+			continue;
+		rv = l3_do_j1979_rqst(d_conn, 0x1, (int)i, 0x00,
+			0x00, 0x00, 0x00, 0x00, (void *)0);
+		if (rv < 0) {
+			fprintf(stderr, "Mode 1 Pid 0x%02x request failed (%d)\n",
+				i, rv);
+		} else if (find_ecu_msg(0, 0x41) == NULL) {
+			fprintf(stderr, "Mode 1 Pid 0x%02x request no-data (%d)\n",
+				i, rv);
+		}
+	}
+	return 0;
+}
+
 int
 do_j1979_getdata(int interruptible)
 {
 	unsigned int i,j;
 	int rv;
 	struct diag_l3_conn *d_conn;
-	ecu_data_t *ep;
 	struct diag_msg *msg;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	/*
 	 * Now get all the data supported
 	 */
-	for (i=3; i<0x100; i++) {
-		if (merged_mode1_info[i]) {
+	if ((d_conn->d_l3l2_flags & (DIAG_L2_FLAG_FRAMED|DIAG_L2_FLAG_DATA_ONLY)) ==
+			(DIAG_L2_FLAG_FRAMED|DIAG_L2_FLAG_DATA_ONLY)) {
+		if (j1979_getdata_queued(d_conn, interruptible))
+			return 1;
+	} else for (i=3; i<0x100; i++) {
+		if (PIDSET_HAS(session->merged_mode1_info, i)) {
 			fprintf(stderr, "Requesting Mode 1 Pid 0x%02x...\n", i);
 			rv = l3_do_j1979_rqst(d_conn, 0x1, (int)i, 0x00,
 				0x00, 0x00, 0x00, 0x00, (void *)0);
@@ -1000,12 +1234,15 @@ do_j1979_getdata(int interruptible)
 	}
 
 	/* Now go thru the ECUs that have responded with mode2 info */
-	for (j=0, ep=ecu_info; j<ecu_count; j++, ep++) {
-		if ( (ep->mode1_data[2].type == TYPE_GOOD) &&
-			(ep->mode1_data[2].data[2] |
-				ep->mode1_data[2].data[3]) ) {
-			for (i=3; i<=0x100; i++) {
-				if (ep->mode2_info[i]) {
+	for (j=0; j<session->ecu_count; j++) {
+		const response_t *ffdtc;
+
+		/* (ecu_info may move while requests are made below) */
+		ffdtc = response_get(&session->ecu_info[j].mode1_data, 2);
+		if ( (ffdtc->type == TYPE_GOOD) &&
+			(ffdtc->data[2] | ffdtc->data[3]) ) {
+			for (i=3; i<0x100; i++) {
+				if (PIDSET_HAS(session->ecu_info[j].mode2_info, i)) {
 					fprintf(stderr, "Requesting Mode 0x02 Pid 0x%02x...\n", i);
 					rv = l3_do_j1979_rqst(d_conn, 0x2, (int)i, 0x00,
 						0x00, 0x00, 0x00, 0x00, (void *)0);
@@ -1042,14 +1279,14 @@ do_j1979_basics()
 	unsigned int i;
 	int o2monitoring = 0;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	/*
 	 * Get supported PIDs and Tests etc
 	 */
 	do_j1979_getpids();
 
-	global_state = STATE_SCANDONE ;
+	session->state = STATE_SCANDONE ;
 
 	/*
 	 * Get current DTCs/MIL lamp status/Tests supported for this ECU
@@ -1065,18 +1302,21 @@ do_j1979_basics()
 	/*
 	 * And now do stuff with that data
 	 */
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if ( (ep->mode1_data[2].type == TYPE_GOOD) &&
-			(ep->mode1_data[2].data[2] | ep->mode1_data[2].data[3]) ) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		const response_t *r;
+
+		r = response_get(&ep->mode1_data, 2);
+		if ( (r->type == TYPE_GOOD) && (r->data[2] | r->data[3]) ) {
 			fprintf(stderr, "ECU %d Freezeframe data exists, caused by DTC ",
 				i);
-			print_single_dtc(ep->mode1_data[2].data[2] , ep->mode1_data[2].data[3]);
+			print_single_dtc(r->data[2] , r->data[3]);
 			fprintf(stderr, "\n");
 		}
 
-		if (ep->mode1_data[0x1c].type == TYPE_GOOD) {
+		r = response_get(&ep->mode1_data, 0x1c);
+		if (r->type == TYPE_GOOD) {
 			fprintf(stderr, "ECU %d is ", i);
-			switch(ep->mode1_data[0x1c].data[2]) {
+			switch(r->data[2]) {
 			case 1:
 				fprintf(stderr, "OBD II (California ARB)");
 				break;
@@ -1096,7 +1336,7 @@ do_j1979_basics()
 				fprintf(stderr, "EOBD (Europe)");
 				break;
 			default:
-				fprintf(stderr, "unknown (%d)", ep->mode1_data[0x1c].data[2]);
+				fprintf(stderr, "unknown (%d)", r->data[2]);
 				break;
 			}
 			fprintf(stderr, " compliant\n");
@@ -1106,8 +1346,8 @@ do_j1979_basics()
 		 * If ECU supports Oxygen sensor monitoring, then do O2 sensor
 		 * stuff
 		 */
-		if ( (ep->mode1_data[1].type == TYPE_GOOD) &&
-			(ep->mode1_data[1].data[4] & 0x20) ) {
+		r = response_get(&ep->mode1_data, 1);
+		if ( (r->type == TYPE_GOOD) && (r->data[4] & 0x20) ) {
 			o2monitoring = 1;
 		}
 	}
@@ -1133,19 +1373,20 @@ print_single_dtc(databyte_type d0, databyte_type d1)
 	 * and not a buffer and size
 	 */
 	fprintf(stderr, "%s", 
-		diag_dtc_decode(db, 2, set_vehicle, set_ecu, dtc_proto_j2012, buf,
+		diag_dtc_decode(db, 2, session->vehicle, session->ecu, dtc_proto_j2012, buf,
 		sizeof(buf)));
 
 	return 0;
 }
 
 static void
-print_dtcs(uint8_t *data)
+print_dtcs(const struct diag_msg *msg)
 {
-	/* Print the DTCs just received */
-	int i, j;
+	/* Print the DTCs just received : 3 per message, or more on CAN */
+	const uint8_t *data = msg->data;
+	int j;
 
-	for (i=0, j=1; i<3; i++, j+=2) {
+	for (j=1; j+1 < msg->len; j+=2) {
 		if ((data[j]==0) && (data[j+1]==0))
 			continue;
 		print_single_dtc(data[j], data[j+1]);
@@ -1163,7 +1404,7 @@ do_j1979_cms()
 	struct diag_l3_conn *d_conn;
 	struct diag_msg *msg;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	fprintf(stderr, "Requesting Mode 7 (Current cycle emission DTCs)...\n");
 	rv = l3_do_j1979_rqst(d_conn, 0x07, 0x00, 0x00,
@@ -1180,9 +1421,9 @@ do_j1979_cms()
 
 	fprintf(stderr, "Currently monitored DTCs: ");
 
-	for (i=0; i<ecu_count;i++) {
-		for (msg=ecu_info[i].rxmsg; msg; msg=msg->next) {
-			print_dtcs(msg->data);
+	for (i=0; i<session->ecu_count;i++) {
+		for (msg=session->ecu_info[i].rxmsgs.head; msg; msg=msg->next) {
+			print_dtcs(msg);
 		}
 
 	}
@@ -1204,26 +1445,26 @@ do_j1979_ncms(int printall)
 	int supported;
 	ecu_data_t *ep;
 
-	uint8_t merged_mode6_info[0x100];
+	uint8_t merged_mode6_info[PIDSET_SIZE];
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	/* Merge all ECU mode6 info into one place*/
 	memset(merged_mode6_info, 0, sizeof(merged_mode6_info));
-	for (i=0, ep=ecu_info, supported = 0; i<ecu_count; i++, ep++) {
+	for (i=0, ep=session->ecu_info, supported = 0; i<session->ecu_count; i++, ep++) {
 		for (j=0; j<sizeof(ep->mode6_info);j++) {
 			merged_mode6_info[j] |= ep->mode6_info[j] ;
 		}
-		if (ep->mode6_info[0] != 0)
+		if (PIDSET_HAS(ep->mode6_info, 0))
 			supported = 1;
 	}
 
-	if (merged_mode6_info[0] == 0x00) {
+	if (!PIDSET_HAS(merged_mode6_info, 0)) {
 		/* Either not supported, or tests havent been done */
 		do_j1979_getmodeinfo(6, 3);
 	}
 	
-	if (merged_mode6_info[0] == 0x00) {
+	if (!PIDSET_HAS(merged_mode6_info, 0)) {
 		fprintf(stderr, "ECU doesn't support non-continuously monitored system tests\n");
 		return;
 	}
@@ -1232,7 +1473,7 @@ do_j1979_ncms(int printall)
 	 * Now do the tests
 	 */
 	for (i=0 ; i < 60; i++) {
-		if ((merged_mode6_info[i]) && ((i & 0x1f) != 0)) {
+		if (PIDSET_HAS(merged_mode6_info, i) && ((i & 0x1f) != 0)) {
 			/* Do test */
 			fprintf(stderr, "Requesting Mode 6 TestID 0x%02x...\n", i);
 			rv = l3_do_j1979_rqst(d_conn, 6, (int)i, 0x00,
@@ -1261,7 +1502,7 @@ do_j1979_getmodeinfo(int mode, int response_offset)
 	int not_done;
 	uint8_t *data;
 	
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	/*
 	 * Test 0, 0x20, 0x40, 0x60 (etc) for each mode returns information
@@ -1283,10 +1524,10 @@ do_j1979_getmodeinfo(int mode, int response_offset)
 		}
 
 		/* Process the results */
-		for (j=0, ep=ecu_info, not_done = 0; j<ecu_count; j++, ep++) {
-			if (ep->rxmsg == NULL)
+		for (j=0, ep=session->ecu_info, not_done = 0; j<session->ecu_count; j++, ep++) {
+			if (ep->rxmsgs.head == NULL)
 				continue;
-			if (ep->rxmsg->data[0] != (mode + 0x40))
+			if (ep->rxmsgs.head->data[0] != (mode + 0x40))
 				continue;
 
 			/* Valid response for this request */
@@ -1319,12 +1560,12 @@ do_j1979_getmodeinfo(int mode, int response_offset)
 			if (data == NULL)
 				break;
 
-			data[0] = 1;	/* Pid 0, 0x20, 0x40 always supported */
+			PIDSET_ADD(data, 0);	/* Pid 0, 0x20, 0x40 always supported */
 			for (i=0 ; i<=0x20; i++) {
-				if (l2_check_pid_bits(&ep->rxmsg->data[response_offset], (int)i))
-					data[i + pid] = 1;
+				if (l2_check_pid_bits(&ep->rxmsgs.head->data[response_offset], (int)i))
+					PIDSET_ADD(data, i + pid);
 			}
-			if (data[0x20 + pid] == 1)
+			if (PIDSET_HAS(data, 0x20 + pid))
 				not_done = 1;
 		}
 
@@ -1349,7 +1590,7 @@ do_j1979_getpids()
 	ecu_data_t *ep;
 	unsigned int i, j;
 	
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	do_j1979_getmodeinfo(1, 2);
 	do_j1979_getmodeinfo(2, 2);
@@ -1363,17 +1604,17 @@ do_j1979_getpids()
 	 * from the ECUs into one bitmask, do same
 	 * for Mode5
 	 */
-	memset(merged_mode1_info, 0, sizeof(merged_mode1_info));
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+	memset(session->merged_mode1_info, 0, sizeof(session->merged_mode1_info));
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
 		for (j=0; j<sizeof(ep->pids);j++) {
-			merged_mode1_info[j] |= ep->pids[j] ;
+			session->merged_mode1_info[j] |= ep->pids[j] ;
 		}
 	}
 
-	memset(merged_mode5_info, 0, sizeof(merged_mode5_info));
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+	memset(session->merged_mode5_info, 0, sizeof(session->merged_mode5_info));
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
 		for (j=0; j<sizeof(ep->mode5_info);j++) {
-			merged_mode5_info[j] |= ep->mode5_info[j] ;
+			session->merged_mode5_info[j] |= ep->mode5_info[j] ;
 		}
 	}
 	return;
@@ -1387,13 +1628,13 @@ do_j1979_O2tests()
 {
 	int i;
 
-	if (merged_mode5_info[0] == 0) {
+	if (!PIDSET_HAS(session->merged_mode5_info, 0)) {
 		fprintf(stderr, "Oxygen (O2) sensor tests not supported\n");
 		return;
 	}
 
 	for (i=0; i<=7; i++) {
-		if (global_O2_sensors & (1<<i))
+		if (session->O2_sensors & (1<<i))
 			do_j1979_getO2tests(i);
 	}
 	return;
@@ -1415,11 +1656,11 @@ do_j1979_getO2tests(int O2sensor)
 
 	uint8_t o2s = 1<<O2sensor ;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	for (i=1 ; i<=0x1f; i++) {
 		fprintf(stderr, "O2 Sensor %d Tests: -\n", O2sensor);
-		if ((merged_mode5_info[i]) && ((i & 0x1f) != 0)) {
+		if (PIDSET_HAS(session->merged_mode5_info, i) && ((i & 0x1f) != 0)) {
 			/* Do test for of i + testID */
 			fprintf(stderr, "Requesting Mode 0x05 TestID 0x%02x...\n", i);
 			rv = l3_do_j1979_rqst(d_conn, 5, i, o2s,
@@ -1447,9 +1688,9 @@ do_j1979_getdtcs()
 	unsigned int i;
 	int num_dtcs, readiness, mil;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
-	if (merged_mode1_info[1] == 0) {
+	if (!PIDSET_HAS(session->merged_mode1_info, 1)) {
 		fprintf(stderr, "ECU(s) do not support DTC#/test query - can't do tests\n");
 		return 0;
 	}
@@ -1466,17 +1707,18 @@ do_j1979_getdtcs()
 	/* Go thru the received messages, and see readiness/MIL light */
 	mil = 0; readiness = 0, num_dtcs = 0;
 
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if ((ep->rxmsg) && (ep->rxmsg->data[0] == 0x41)) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		if ((ep->rxmsgs.head) && (ep->rxmsgs.head->data[0] == 0x41)) {
+			const response_t *r = response_get(&ep->mode1_data, 1);
+
 			/* Go thru received msgs looking for DTC responses */
-			if ( (ep->mode1_data[1].data[3] & 0xf0) ||
-				ep->mode1_data[1].data[5] )
+			if ( (r->data[3] & 0xf0) || r->data[5] )
 				readiness = 1;
 
-			if (ep->mode1_data[1].data[2] & 0x80)
+			if (r->data[2] & 0x80)
 				mil = 1;
 
-			num_dtcs += ep->mode1_data[1].data[2] & 0x7f;
+			num_dtcs += r->data[2] & 0x7f;
 		}
 
 	}
@@ -1504,10 +1746,10 @@ do_j1979_getdtcs()
 		}
 
 		/* Go thru received msgs looking for DTC responses */
-		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-			if ((ep->rxmsg) && (ep->rxmsg->data[0] == 0x43)) {
-				for (msg=ep->rxmsg; msg; msg=msg->next) {
-					print_dtcs(ep->rxmsg->data);
+		for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+			if ((ep->rxmsgs.head) && (ep->rxmsgs.head->data[0] == 0x43)) {
+				for (msg=ep->rxmsgs.head; msg; msg=msg->next) {
+					print_dtcs(msg);
 				}
 				fprintf(stderr, "\n");
 			}
@@ -1528,9 +1770,9 @@ do_j1979_getO2sensors()
 	int num_sensors;
 	ecu_data_t *ep;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
-	global_O2_sensors = 0;
+	session->O2_sensors = 0;
 	num_sensors = 0;
 
 	fprintf(stderr, "Requesting Mode 0x01 PID 0x13 (O2 sensors location)...\n");
@@ -1542,13 +1784,13 @@ do_j1979_getO2sensors()
 		return 0;
 	}
 
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		if ((ep->rxmsg) && (ep->rxmsg->data[0] == 0x41)) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		if ((ep->rxmsgs.head) && (ep->rxmsgs.head->data[0] == 0x41)) {
 			/* Maintain bitmap of sensors */
-			global_O2_sensors |= ep->rxmsg->data[2];
+			session->O2_sensors |= ep->rxmsgs.head->data[2];
 			/* And count additional sensors on this ECU */
 			for (j=0; j<=7; j++) {
-				if (ep->rxmsg->data[2] & (1<<j))
+				if (ep->rxmsgs.head->data[2] & (1<<j))
 					num_sensors++;
 			}
 		}
@@ -1567,7 +1809,7 @@ diag_cleardtc(void)
 	int rv;
 	struct diag_msg	*rxmsg;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 	fprintf(stderr, "Requesting Mode 0x04 (Clear DTCs)...\n");
 	rv = l3_do_j1979_rqst(d_conn, 0x04, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00, (void *)0);
@@ -1593,6 +1835,8 @@ struct protocol {
 };
 
 const struct protocol protocols[] = {
+	{"ISO15765_11BIT", do_l2_can_start, 0, PROTOCOL_ISO15765, 0},
+	{"ISO15765_29BIT", do_l2_can_start, DIAG_L2_TYPE_CAN29BIT, PROTOCOL_ISO15765, 0},
 	{"SAEJ1850-VPW", do_l2_j1850_start, DIAG_L1_J1850_VPW, PROTOCOL_SAEJ1850, 0},
 	{"SAEJ1850-PWM", do_l2_j1850_start, DIAG_L1_J1850_PWM, PROTOCOL_SAEJ1850, 0},
 	{"ISO14230_FAST", do_l2_14230_start, DIAG_L2_TYPE_FASTINIT, PROTOCOL_ISO14230, DIAG_L2_TYPE_FASTINIT},
@@ -1617,8 +1861,8 @@ ecu_connect(void)
 		fprintf(stderr,"Trying %s:\n", p->desc);
 		rv = p->start(p->flags);
 		if (rv == 0) {
-			global_conmode = p->conmode;
-			global_protocol = p->protoID;
+			session->conmode = p->conmode;
+			session->protocol = p->protoID;
 			connected = 1;
 			fprintf(stderr, "%s Connected.\n", p->desc);
 		} else {
@@ -1635,21 +1879,21 @@ ecu_connect(void)
 	if (connected) {
 		struct diag_l3_conn *d_l3_conn;
 
-		global_state = STATE_CONNECTED;
+		session->state = STATE_CONNECTED;
 
-		d_l3_conn = diag_l3_start("SAEJ1979", global_l2_conn);
+		d_l3_conn = diag_l3_start("SAEJ1979", session->l2_conn);
 		if (d_l3_conn == NULL) {
 			fprintf(stderr, "Failed to enable SAEJ1979 mode\n");
 			rv = DIAG_ERR_GENERAL;
 		}
-		global_l3_conn = d_l3_conn;
+		session->l3_conn = d_l3_conn;
 
-		global_state = STATE_L3ADDED;
+		session->state = STATE_L3ADDED;
 	}
 
 	if (diag_cmd_debug > 0)
 		fprintf(stderr, "debug: L2 connection ID %p, L3 ID %p\n",
-			global_l2_conn, global_l3_conn);
+			session->l2_conn, session->l3_conn);
 
 	return rv;
 }
@@ -1660,7 +1904,11 @@ ecu_connect(void)
 static int
 do_init(void)
 {
-	clear_data();
+	struct scantool_session *s = scantool_session_new();
+
+	if (s == NULL)
+		return DIAG_ERR_NOMEM;
+	scantool_session_use(s);
 
 	return 0;
 }
@@ -1689,14 +1937,14 @@ static void
 format_o2(char *buf,
 int english,
 const struct pid *p,
-response_t *data,
+const response_store_t *data,
 int n)
 #else
 static void
 format_o2(char *buf,
 int english __attribute__((unused)),
 const struct pid *p,
-response_t *data,
+const response_store_t *data,
 int n)
 #endif
 {
@@ -1714,14 +1962,14 @@ static void
 format_aux(char *buf,
 int english,
 const struct pid *p,
-response_t *data,
+const response_store_t *data,
 int n)
 #else
 static void
 format_aux(char *buf,
 int english __attribute__((unused)),
 const struct pid *p,
-response_t *data,
+const response_store_t *data,
 int n)
 #endif
 {
@@ -1734,14 +1982,14 @@ static void
 format_fuel(char *buf,
 int english,
 const struct pid *p,
-response_t *data,
+const response_store_t *data,
 int n)
 #else
 static void
 format_fuel(char *buf,
 int english __attribute__((unused)),
 const struct pid *p,
-response_t *data,
+const response_store_t *data,
 int n)
 #endif
 {
@@ -1773,7 +2021,8 @@ int n)
 
 
 static void
-format_data(char *buf, int english, const struct pid *p, response_t *data, int n)
+format_data(char *buf, int english, const struct pid *p,
+	const response_store_t *data, int n)
 {
 		double v;
 
@@ -1904,7 +2153,10 @@ main(int argc __attribute__((unused)), char **argv)
 
 	/* Input buffer */
 
-	do_init();
+	if (do_init()) {
+		fprintf(stderr, "%s: initialisation failed\n", argv[0]);
+		exit(1);
+	}
 
 	progname = strrchr(argv[0], '/');
 	progname = (progname)?(progname+1):argv[0];
@@ -61,6 +61,37 @@ typedef struct response
 #define TYPE_FAILED	1	/* Got failure response */
 #define TYPE_GOOD	2	/* Valid info */
 
+/*
+ * Set of PIDs (or test IDs), one bit per PID
+ */
+#define PIDSET_SIZE	(0x100 / 8)
+#define PIDSET_HAS(s, n)	((unsigned int)(n) < 0x100 && \
+				((s)[(unsigned int)(n) >> 3] & (1 << ((n) & 7))))
+#define PIDSET_ADD(s, n)	do { if ((unsigned int)(n) < 0x100) \
+				(s)[(unsigned int)(n) >> 3] |= 1 << ((n) & 7); } while (0)
+
+/*
+ * Responses received for one mode; only PIDs that were actually
+ * requested take up space. "present" says which PIDs are held, and
+ * r[] holds them in ascending PID order.
+ */
+typedef struct response_store
+{
+	uint8_t	present[PIDSET_SIZE];
+	uint16_t	cnt;		/* Entries used in r[] */
+	uint16_t	alloc;		/* Entries allocated in r[] */
+	response_t	*r;
+} response_store_t;
+
+/*
+ * Find the response for a PID; returns an UNTESTED (all zero) response
+ * if nothing was received for it, so the result is always readable
+ */
+const response_t *response_get(const response_store_t *rs, unsigned int pid);
+/* Find or create the response for a PID, NULL on failure */
+response_t *response_put(response_store_t *rs, unsigned int pid);
+void response_store_free(response_store_t *rs);
+
 /*
  * This structure holds all the data/config info for a given ecu
  * - one request can result in more than one ECU responding, and so
@@ -73,21 +104,21 @@ typedef struct ecu_data
 
 	uint8_t	supress;	/* Supress output of data from ECU */
 
-	uint8_t	pids[0x100];	/* Pids supported by ECU */
-	uint8_t	mode2_info[0x100];	/* Freeze frame version */
-	uint8_t	mode5_info[0x100];	/* Mode 5 info */
-	uint8_t	mode6_info[0x100];	/* Mode 6 info */
-	uint8_t	mode8_info[0x100];	/* Mode 8 info */
-	uint8_t	mode9_info[0x100];	/* Mode 9 info */
+	uint8_t	pids[PIDSET_SIZE];	/* Pids supported by ECU */
+	uint8_t	mode2_info[PIDSET_SIZE];	/* Freeze frame version */
+	uint8_t	mode5_info[PIDSET_SIZE];	/* Mode 5 info */
+	uint8_t	mode6_info[PIDSET_SIZE];	/* Mode 6 info */
+	uint8_t	mode8_info[PIDSET_SIZE];	/* Mode 8 info */
+	uint8_t	mode9_info[PIDSET_SIZE];	/* Mode 9 info */
 
 	uint8_t	data_good;		/* Flags for above data */
 
 	uint8_t	O2_sensors;	/* O2 sensors bit mask */
 
-	response_t	mode1_data[256]; /* Response data for all responses */
-	response_t	mode2_data[256]; /* Same, but for freeze frame */
+	response_store_t	mode1_data; /* Response data for all responses */
+	response_store_t	mode2_data; /* Same, but for freeze frame */
 
-	struct diag_msg	*rxmsg;		/* Received message */
+	struct diag_msglist	rxmsgs;		/* Received messages */
 } ecu_data_t;
 
 #define ECU_DATA_PIDS	0x01
@@ -97,26 +128,21 @@ typedef struct ecu_data
 #define ECU_DATA_MODE8	0x10
 #define ECU_DATA_MODE9	0x20
 
-#define MAX_ECU 8			/* Max 8 Ecus responding */
-extern ecu_data_t	ecu_info[MAX_ECU];
-extern unsigned int ecu_count;
-
-extern uint8_t	global_O2_sensors;	/* O2 sensors bit mask */
-
-/* XXX end of stuff to move */
-
-extern int		global_conmode;
-extern int		global_protocol;
-
-extern struct diag_l0_device *global_l2_dl0d;	/* L2 file descriptor */
+/*
+ * Find the ECU with source address addr in this thread's session; if
+ * create is set and it isn't known yet, add it. Returns NULL if not
+ * found (or out of memory)
+ */
+ecu_data_t *ecu_lookup(uint8_t addr, int create);
 
 #define	PROTOCOL_NOTFOUND	0
 #define	PROTOCOL_ISO9141	1
 #define	PROTOCOL_ISO14230	2
 #define	PROTOCOL_SAEJ1850	3
+#define	PROTOCOL_ISO15765	4
 
 //XXX The following defs should probably go in an auto-generated l0_list.h file
-enum l0_nameindex {MET16, SE9141, VAGTOOL, BR1, ELM, CARSIM, DUMB};
+enum l0_nameindex {MET16, SE9141, VAGTOOL, BR1, ELM, CARSIM, DUMB, SOCKETCAN};
 struct l0_name
 {
 	char * longname;
@@ -140,7 +166,9 @@ int l2_do_send( struct diag_l2_conn *d_conn, void *data, size_t len, void *handl
 int l2_check_pid_bits(uint8_t *data, int pid);
 int do_l2_9141_start(int destaddr); // 9141 init
 int do_l2_14230_start(int init_type); //14230 init
+int do_l2_can_start(int flags); //15765 (CAN) init
 int do_l2_generic_start(void);// Generic init, using parameters set by user
+struct diag_l0_device *do_l2_open(int L1protocol); // Open the current interface
 int do_j1979_getdtcs(void);
 int do_j1979_getO2sensors(void);
 int diag_cleardtc(void);
@@ -174,37 +202,92 @@ void	j1979_data_rcv(void *handle, struct diag_msg *msg);
 void	j1979_watch_rcv(void *handle, struct diag_msg *msg);
 void	l2raw_data_rcv(void *handle, struct diag_msg *msg);
 
-extern int		global_state;
-
 #define STATE_IDLE	0	/* Idle */
 #define STATE_WATCH	1	/* Watch mode */
 #define	STATE_CONNECTED	2	/* Connected to ECU */
 #define	STATE_L3ADDED	3	/* Layer 3 protocol added on Layer 2 */
 #define	STATE_SCANDONE	4	/* J1978/9 Scan Done, so got J1979 PID list */
 
+extern const struct l0_name l0_names[];	//filled in scantool_set.c
 
-/* Parameters set by user interface (and their defaults) */
-extern int 	set_speed ;	/* Comms speed */
-extern unsigned char	set_testerid ;	/* Our tester ID */
-extern int	set_addrtype ;	/* Address type, 1 = functional */
-extern unsigned char	set_destaddr ;	/* Dest ECU address */
-extern int	set_L1protocol ;	/* L1 (H/W) Protocol type */
-extern int	set_L2protocol ;	/* L2 (S/W) Protocol type */
-extern int	set_initmode ;
-extern int 	set_display ;	/* English (1) or Metric (0) display */
+#define SUBINTERFACE_MAX 256
 
-extern const char*	set_vehicle;	/* Vehicle name */
-extern const char*	set_ecu;	/* ECU name */
+/*
+ * Everything about one vehicle : the connection, what its ECUs told us
+ * and the parameters set by the user interface. Each thread works on
+ * the session it last passed to scantool_session_use(), so several
+ * vehicles can be handled from one process, one thread and interface
+ * each.
+ */
+struct scantool_session {
+	struct diag_l0_device *dl0d;	/* L2 dl0d, saved for close */
+	struct diag_l2_conn *l2_conn;
+	struct diag_l3_conn *l3_conn;
+	int	state;		/* See STATE_ definitions above */
+	int	conmode;
+	int	protocol;
+
+	/*
+	 * ECUs that have responded, in order of first response. The array
+	 * grows as needed, so pointers into it are only good until the next
+	 * request is made; keep ecu_addr rather than an ecu_data_t * across
+	 * requests.
+	 */
+	ecu_data_t	*ecu_info;
+	unsigned int	ecu_count;	/* How many ecus are active */
+	unsigned int	ecu_alloc;	/* Entries allocated in ecu_info */
+	/* Position in ecu_info + 1 of each source address, 0 if not seen */
+	uint16_t	ecu_index[0x100];
+
+	/* Merge of all the suported mode1 pids by all the ECUs */
+	uint8_t	merged_mode1_info[PIDSET_SIZE];
+	uint8_t	merged_mode5_info[PIDSET_SIZE];
 
-extern enum l0_nameindex set_interface;	/* Physical interface name to use */
-int set_interface_idx;	//index into l0_names
-extern const struct l0_name l0_names[];	//filled in scantool_set.c
+	uint8_t	O2_sensors;	/* O2 sensors bit mask */
 
-#define SUBINTERFACE_MAX 256
-extern char	set_subinterface[SUBINTERFACE_MAX];	/* Sub interface ID */
+	/* Parameters set by user interface (defaults from set_defaults()) */
+	int	speed;		/* Comms speed */
+	unsigned char	testerid;	/* Our tester ID */
+	int	addrtype;	/* Address type, 1 = functional */
+	unsigned char	destaddr;	/* Dest ECU address */
+	int	L1protocol;	/* L1 (H/W) Protocol type */
+	int	L2protocol;	/* L2 (S/W) Protocol type */
+	int	initmode;
+	int	can29bit;	/* CAN : 29 bit identifiers if set, else 11 bit */
+	int	display;	/* English (1) or Metric (0) display */
+
+	const char	*vehicle;	/* Vehicle name */
+	const char	*ecu;		/* ECU name */
+
+	enum l0_nameindex interface;	/* Physical interface name to use */
+	int	interface_idx;		/* index into l0_names */
+	char	subinterface[SUBINTERFACE_MAX];	/* Sub interface ID */
+};
+
+#ifdef __GNUC__
+#define SCANTOOL_TLS	__thread
+#else
+/* No thread local storage: one session per process */
+#define SCANTOOL_TLS
+#endif
+
+/* This thread's session */
+extern SCANTOOL_TLS struct scantool_session *session;
+
+/*
+ * A new session has the default parameters and no connection; it must
+ * be disconnected before it's freed.
+ */
+struct scantool_session *scantool_session_new(void);
+void scantool_session_free(struct scantool_session *s);
+/* Make s the calling thread's session, returns the previous one */
+struct scantool_session *scantool_session_use(struct scantool_session *s);
+
+void set_defaults(struct scantool_session *s);	/* in scantool_set.c */
 
 struct pid ;
-typedef void (formatter)(char *, int, const struct pid *, response_t *, int);
+typedef void (formatter)(char *, int, const struct pid *,
+	const response_store_t *, int);
 
 struct pid
 {
@@ -220,8 +303,8 @@ struct pid
 	double offset2 ;
 };
 
-#define DATA_VALID(p, d)	(d[p->pidID].type == TYPE_GOOD)
-#define DATA_1(p, n, d)	(d[p->pidID].data[n])
+#define DATA_VALID(p, d)	(response_get(d, p->pidID)->type == TYPE_GOOD)
+#define DATA_1(p, n, d)	(response_get(d, p->pidID)->data[n])
 #define DATA_2(p, n, d)	(DATA_1(p, n, d) * 256 + DATA_1(p, n+1, d))
 #define DATA_RAW(p, n, d)	(p->bytes == 1 ? DATA_1(p, n, d) : DATA_2(p, n, d))
 
@@ -71,7 +71,7 @@ static void aif_dyno      ( void *data ) { BadToApp () ; }
 
 static void aif_monitor ( void *data )
 {
-	if ( global_state < STATE_CONNECTED )
+	if ( session->state < STATE_CONNECTED )
 	{
 		fprintf ( stderr, "scantool: Can't monitor - car is not yet connected.\n");
 		BadToApp () ;
@@ -103,20 +103,20 @@ static void aif_monitor ( void *data )
 				ecu_data_t   *ep ;
 				char buf[24] ;
 
-				for ( i = 0, ep = ecu_info ; i < ecu_count ; i++, ep++ )
+				for ( i = 0, ep = session->ecu_info ; i < session->ecu_count ; i++, ep++ )
 				{
-					if ( DATA_VALID(p, ep->mode1_data) ||
-					DATA_VALID(p, ep->mode2_data) )
+					if ( DATA_VALID(p, &ep->mode1_data) ||
+					DATA_VALID(p, &ep->mode2_data) )
 					{
 						const char *name = p->desc ;
 
-						if (DATA_VALID(p, ep->mode1_data))
-							p->sprintf(buf, set_display, p, ep->mode1_data, 2);
+						if (DATA_VALID(p, &ep->mode1_data))
+							p->sprintf(buf, session->display, p, &ep->mode1_data, 2);
 
 						printf("%-15.15s ", buf);
 
-						if (DATA_VALID(p, ep->mode2_data))
-							p->sprintf(buf, set_display, p, ep->mode2_data, 3);
+						if (DATA_VALID(p, &ep->mode2_data))
+							p->sprintf(buf, session->display, p, &ep->mode2_data, 3);
 
 						printf("%-15.15s\n", buf);
 					}
@@ -124,7 +124,7 @@ static void aif_monitor ( void *data )
 			}
 	}
 
-	d_conn = global_l3_conn ;
+	d_conn = session->l3_conn ;
 
 	rv = l3_do_j1979_rqst ( d_conn, 0x07, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00, (void *)0 ) ;
@@ -142,8 +142,8 @@ static void aif_monitor ( void *data )
 	{
 		/* Currently monitored DTCs: */
 
-		for ( i = 0 ; i < ecu_count ; i++ )
-			for ( msg = ecu_info[i].rxmsg ; msg ; msg = msg->next )
+		for ( i = 0 ; i < session->ecu_count ; i++ )
+			for ( msg = session->ecu_info[i].rxmsgs.head ; msg ; msg = msg->next )
 			{
 				int i, j ;
 
@@ -159,7 +159,7 @@ static void aif_monitor ( void *data )
 					db[0] = msg->data[j];
 					db[1] = msg->data[j+1];
 
-					result = diag_dtc_decode ( db, 2, set_vehicle, set_ecu,
+					result = diag_dtc_decode ( db, 2, session->vehicle, session->ecu,
 					dtc_proto_j2012, buf, sizeof(buf)) ;
 				}
 			}
@@ -184,8 +184,8 @@ static void aif_set ( void *data )
 
 			switch ( units )
 			{
-				case FREEDIAG_AIF_SET_UNITS_US     : set_display = 1 ; break ; 
-				case FREEDIAG_AIF_SET_UNITS_METRIC : set_display = 0 ; break ; 
+				case FREEDIAG_AIF_SET_UNITS_US     : session->display = 1 ; break ; 
+				case FREEDIAG_AIF_SET_UNITS_METRIC : session->display = 0 ; break ; 
 				default                            : BadToApp () ; return ;
 			}
 			break ;
@@ -203,7 +203,7 @@ static void aif_set ( void *data )
 				return ;
 			}
 
-			sprintf ( set_subinterface, "%d", port ) ;
+			sprintf ( session->subinterface, "%d", port ) ;
 			break ;
 		}
 		default :
@@ -235,23 +235,24 @@ static void aif_exit ( void *data )
 
 static void aif_disconnect ( void *data )
 {
-	if ( global_state < STATE_CONNECTED )
+	if ( session->state < STATE_CONNECTED )
 	{
 		OkToApp () ;
 		return ;
 	}
 
-	if (global_state >= STATE_L3ADDED)
+	if (session->state >= STATE_L3ADDED)
 	{
 		/* Close L3 protocol */
-		diag_l3_stop(global_l3_conn);
+		diag_l3_stop(session->l3_conn);
 	}
 
-	diag_l2_StopCommunications(global_l2_conn);
-	diag_l2_close(global_l2_dl0d);
+	diag_l2_StopCommunications(session->l2_conn);
+	diag_l2_close(session->dl0d);
 
-	global_l2_conn = NULL;
-	global_state = STATE_IDLE;
+	session->l2_conn = NULL;
+	session->dl0d = NULL;
+	session->state = STATE_IDLE;
 
 	OkToApp () ;
 }
@@ -260,7 +261,7 @@ static void aif_disconnect ( void *data )
 
 static void aif_scan ( void *data )
 {
-	if ( global_state >= STATE_CONNECTED )
+	if ( session->state >= STATE_CONNECTED )
 	{
 		OkToApp () ;
 		return ;
@@ -293,22 +293,16 @@ cmd_rem(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 	return CMD_OK;
 }
 
-struct timeval log_start;
+tstamp_type log_start;
 
 static void
 log_timestamp(const char *prefix)
 {
-	struct timeval tv;
-	long sec, usec;
+	tstamp_type elapsed;
 
-	gettimeofday(&tv, NULL);
-	if (tv.tv_usec < log_start.tv_usec) {
-			tv.tv_usec += 1000*1000;
-		tv.tv_sec--;
-	}
-	sec = tv.tv_sec - log_start.tv_sec;
-	usec = tv.tv_usec - log_start.tv_usec;
-	fprintf(global_logfp, "%s %04ld.%03ld ", prefix, sec, usec / 1000);
+	elapsed = diag_os_getns() - log_start;
+	fprintf(global_logfp, "%s %04ld.%03ld ", prefix,
+		(long)(elapsed / 1000000000), (long)(elapsed % 1000000000) / 1000000);
 }
 
 static void
@@ -364,7 +358,7 @@ cmd_log(int argc, char **argv)
 	}
 
 	now = time(NULL);
-	gettimeofday(&log_start, NULL);
+	log_start = diag_os_getns();
 	fprintf(global_logfp, "%s\n", LOG_FORMAT);
 	log_timestamp("#");
 	fprintf(global_logfp, "logging started at %s",
@@ -469,7 +463,7 @@ cmd_watch(int argc, char **argv)
 		fprintf(stderr, "diag_init failed\n");
 		return -1;
 	}
-	dl0d = diag_l2_open(l0_names[set_interface_idx].longname, set_subinterface, set_L1protocol);
+	dl0d = do_l2_open(session->L1protocol);
 	if (dl0d == 0) {
 		rv = diag_geterr();
 		printf("Failed to open hardware interface ");
@@ -483,12 +477,12 @@ cmd_watch(int argc, char **argv)
 	}
 	if (rawmode)
 		d_l2_conn = diag_l2_StartCommunications(dl0d, DIAG_L2_PROT_RAW,
-			0, set_speed, 
-			set_destaddr, 
-			set_testerid);
+			0, session->speed, 
+			session->destaddr, 
+			session->testerid);
 	else
-		d_l2_conn = diag_l2_StartCommunications(dl0d, set_L2protocol,
-			DIAG_L2_TYPE_MONINIT, set_speed, set_destaddr, set_testerid);
+		d_l2_conn = diag_l2_StartCommunications(dl0d, session->L2protocol,
+			DIAG_L2_TYPE_MONINIT, session->speed, session->destaddr, session->testerid);
 
 	if (d_l2_conn == 0) {
 		printf("Failed to connect to hardware in monitor mode\n");
@@ -509,6 +503,25 @@ cmd_watch(int argc, char **argv)
 		}
 
 		printf("Waiting for data to be received\n");
+		if (d_l3_conn == NULL) {
+			/*
+			 * Let the L2 framer be driven by events when it can,
+			 * rather than by a blocking recv.
+			 */
+			struct diag_os_reactor *r = diag_os_reactor_new();
+
+			if (r && (diag_l2_reactor_add(r, d_l2_conn,
+					j1979_watch_rcv, NULL) == 0)) {
+				while ((rv = diag_os_reactor_run(r, 10000)) >= 0)
+					;
+				printf("recv returns %d\n", rv);
+				diag_l2_reactor_del(r, d_l2_conn);
+				diag_os_reactor_free(r);
+				return CMD_FAILED;
+			}
+			if (r)
+				diag_os_reactor_free(r);
+		}
 		while (1) {
 			if (d_l3_conn)
 				rv = diag_l3_recv(d_l3_conn, 10000,
@@ -562,22 +575,22 @@ print_current_data(int english)
 	for (j = 0 ; get_pid ( j ) != NULL ; j++) {
 		const struct pid *p = get_pid ( j ) ;
 
-		for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-			if (DATA_VALID(p, ep->mode1_data) ||
-				DATA_VALID(p, ep->mode2_data)) {
+		for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+			if (DATA_VALID(p, &ep->mode1_data) ||
+				DATA_VALID(p, &ep->mode2_data)) {
 				printf("%-30.30s ", p->desc);
 
-				if (DATA_VALID(p, ep->mode1_data))
+				if (DATA_VALID(p, &ep->mode1_data))
 					p->sprintf(buf, english, p,
-						ep->mode1_data, 2);
+						&ep->mode1_data, 2);
 				else
 					sprintf(buf, "-----");
 				
 				printf("%-15.15s ", buf);
 
-				if (DATA_VALID(p, ep->mode2_data))
+				if (DATA_VALID(p, &ep->mode2_data))
 					p->sprintf(buf, english, p,
-						ep->mode2_data, 3);
+						&ep->mode2_data, 3);
 				else
 					sprintf(buf, "-----");
 				
@@ -588,7 +601,7 @@ print_current_data(int english)
 }
 
 static void
-log_response(int ecu, response_t *r)
+log_response(int ecu, const response_t *r)
 {
 	int i;
 
@@ -606,7 +619,7 @@ log_response(int ecu, response_t *r)
 static void
 log_current_data(void)
 {
-	response_t *r;
+	const response_t *r;
 	ecu_data_t *ep;
 	unsigned int i;
 
@@ -615,18 +628,18 @@ log_current_data(void)
 
 	log_timestamp("D");
 	fprintf(global_logfp, "MODE 1 DATA\n");
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (r = ep->mode1_data;
-			r < &ep->mode1_data[ARRAY_SIZE(ep->mode1_data)]; r++) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		for (r = ep->mode1_data.r;
+			r < &ep->mode1_data.r[ep->mode1_data.cnt]; r++) {
 				log_response((int)i, r);
 		}
 	}
 
 	log_timestamp("D");
 	fprintf(global_logfp, "MODE 2 DATA\n");
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
-		for (r = ep->mode2_data;
-			r < &ep->mode2_data[ARRAY_SIZE(ep->mode2_data)]; r++) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
+		for (r = ep->mode2_data.r;
+			r < &ep->mode2_data.r[ep->mode2_data.cnt]; r++) {
 			log_response((int)i, r);
 		}
 	}
@@ -639,9 +652,9 @@ cmd_monitor(int argc, char **argv)
 	struct diag_l3_conn *d_conn;
 	int english = 0;
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
-	if (global_state < STATE_SCANDONE) {
+	if (session->state < STATE_SCANDONE) {
 		printf("SCAN has not been done, please do a scan\n");
 		return CMD_FAILED;
 	}
@@ -655,7 +668,7 @@ cmd_monitor(int argc, char **argv)
 		else
 			return CMD_USAGE;
 	} else {
-		english = set_display;
+		english = session->display;
 	}
 
 	printf("Please wait\n");
@@ -696,7 +709,7 @@ cmd_scan(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 {
 	int rv;
 
-	if (global_state >= STATE_CONNECTED) {
+	if (session->state >= STATE_CONNECTED) {
 		printf("Already connected, please disconnect first\n");
 		return CMD_FAILED;
 	}
@@ -738,7 +751,7 @@ char **argv __attribute__((unused)))
 {
 	char *input;
 
-	if (global_state < STATE_CONNECTED) {
+	if (session->state < STATE_CONNECTED) {
 		printf("Not connected to ECU\n");
 		return CMD_OK;
 	}
@@ -773,14 +786,14 @@ cmd_ecus(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 	ecu_data_t *ep;
 	unsigned int i;
 
-	if (global_state < STATE_SCANDONE) {
+	if (session->state < STATE_SCANDONE) {
 		printf("SCAN has not been done, please do a scan\n");
 		return CMD_OK;
 	}
 
-	printf("%d ECUs found\n", ecu_count);
+	printf("%d ECUs found\n", session->ecu_count);
 
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++) {
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++) {
 		printf("ECU %d: Address 0x%02x ", i, ep->ecu_addr & 0xff);
 		if (ep->supress)
 			printf("output supressed for monitor mode\n");
@@ -43,6 +43,9 @@ static int cmd_debug_dumpdata(int argc, char **argv);
 static int cmd_debug_pids(int argc, char **argv);
 static int cmd_debug_help(int argc, char **argv);
 static int cmd_debug_show(int argc, char **argv);
+static int cmd_debug_timing(int argc, char **argv);
+static int cmd_debug_memory(int argc, char **argv);
+static int cmd_debug_errors(int argc, char **argv);
 
 static int cmd_debug_cli(int argc, char **argv);
 static int cmd_debug_l0(int argc, char **argv);
@@ -65,6 +68,15 @@ const struct cmd_tbl_entry debug_cmd_table[] =
 	{ "show", "show", "Shows current debug levels",
 		cmd_debug_show, 0, NULL},
 
+	{ "timing", "timing", "Shows sleep, transmit and receive timing",
+		cmd_debug_timing, 0, NULL},
+
+	{ "memory", "memory", "Shows message allocator counters and per-connection memory",
+		cmd_debug_memory, 0, NULL},
+
+	{ "errors", "errors [clear]", "Shows (or clears) the recent error history",
+		cmd_debug_errors, 0, NULL},
+
 	{ "l0", "l0 [val]", "Show/set Layer0 debug level",
 		cmd_debug_l0, 0, NULL},
 	{ "l1", "l1 [val]", "Show/set Layer1 debug level",
@@ -99,16 +111,18 @@ cmd_debug_help(int argc, char **argv)
 
 #ifdef WIN32
 static void
-print_resp_info(int mode, response_t *data)
+print_resp_info(int mode, const response_store_t *rs)
 #else
 static void
-print_resp_info(int mode __attribute__((unused)), response_t *data)
+print_resp_info(int mode __attribute__((unused)), const response_store_t *rs)
 #endif
 {
 
 	int i;
 	for (i=0; i<256; i++)
 	{
+		const response_t *data = response_get(rs, i);
+
 		if (data->type != TYPE_UNTESTED)
 		{
 			if (data->type == TYPE_GOOD)
@@ -123,7 +137,6 @@ print_resp_info(int mode __attribute__((unused)), response_t *data)
 				printf("0x%02x: Failed 0x%x\n",
 					i, data->data[1]);
 		}
-		data++;
 	}
 }
 
@@ -138,25 +151,25 @@ char **argv __attribute__((unused)))
 #endif
 {
 	ecu_data_t *ep;
-	int i;
+	unsigned int i;
 
 	printf("Current Data\n");
-	for (i=0, ep=ecu_info; i<MAX_ECU; i++,ep++)
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++,ep++)
 	{
 		if (ep->valid)
 		{
 			printf("ECU %d:\n", ep->ecu_addr & 0xff);
-			print_resp_info(1, ep->mode1_data);
+			print_resp_info(1, &ep->mode1_data);
 		}
 	}
 
 	printf("Freezeframe Data\n");
-	for (i=0,ep=ecu_info; i<MAX_ECU; i++,ep++)
+	for (i=0,ep=session->ecu_info; i<session->ecu_count; i++,ep++)
 	{
 		if (ep->valid)
 		{
 			printf("ECU %d:\n", ep->ecu_addr & 0xff);
-			print_resp_info(2, ep->mode2_data);
+			print_resp_info(2, &ep->mode2_data);
 		}
 	}
 
@@ -243,6 +256,53 @@ char **argv __attribute__((unused)))
 	return CMD_OK;
 }
 
+#ifdef WIN32
+static int
+cmd_debug_timing(int argc,
+char **argv)
+#else
+static int
+cmd_debug_timing(int argc __attribute__((unused)),
+char **argv __attribute__((unused)))
+#endif
+{
+	diag_os_sleepstats(stdout);
+	if (session->dl0d) {
+		diag_l1_print_txstats(session->dl0d, stdout);
+		diag_tty_rdstats(session->dl0d, stdout);
+	}
+	return CMD_OK;
+}
+
+#ifdef WIN32
+static int
+cmd_debug_memory(int argc,
+char **argv)
+#else
+static int
+cmd_debug_memory(int argc __attribute__((unused)),
+char **argv __attribute__((unused)))
+#endif
+{
+	diag_msgpool_stats(stdout);
+	diag_l2_memstats(stdout);
+	diag_l3_memstats(stdout);
+	return CMD_OK;
+}
+
+static int
+cmd_debug_errors(int argc, char **argv)
+{
+	if (argc > 1) {
+		if (strcasecmp(argv[1], "clear") != 0)
+			return CMD_USAGE;
+		diag_errhistory_clear();
+		return CMD_OK;
+	}
+	diag_errhistory_print(stdout);
+	return CMD_OK;
+}
+
 static void
 print_pidinfo(int mode, uint8_t *pid_data)
 {
@@ -252,7 +312,7 @@ print_pidinfo(int mode, uint8_t *pid_data)
 	printf(" Mode %d:\n	", mode);
 	for (i=0; i<=0x60; i++)
 	{
-		if (pid_data[i]) {
+		if (PIDSET_HAS(pid_data, i)) {
 			printf("0x%x ", i);
 			j++; p++;
 		}
@@ -275,15 +335,15 @@ char **argv __attribute__((unused)))
 #endif
 {
 	ecu_data_t *ep;
-	int i;
+	unsigned int i;
 
-	if (global_state < STATE_SCANDONE)
+	if (session->state < STATE_SCANDONE)
 	{
 		printf("SCAN has not been done, please do a scan\n");
 		return CMD_OK;
 	}
 
-	for (i=0,ep=ecu_info; i<MAX_ECU; i++,ep++)
+	for (i=0,ep=session->ecu_info; i<session->ecu_count; i++,ep++)
 	{
 		if (ep->valid)
 		{
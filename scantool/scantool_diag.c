@@ -46,6 +46,7 @@ static int cmd_diag_disconnect(int argc, char **argv);
 static int cmd_diag_connect(int argc, char **argv);
 static int cmd_diag_sendreq(int argc, char **argv);
 static int cmd_diag_read(int argc, char **argv);
+static int cmd_diag_timing(int argc, char **argv);
 
 static int cmd_diag_addl3(int argc, char **argv);
 
@@ -72,6 +73,10 @@ const struct cmd_tbl_entry diag_cmd_table[] =
 	{ "rx", "read [waittime]", "Receive some data from the ECU",
 		cmd_diag_read, FLAG_HIDDEN, NULL},
 
+	{ "timing", "timing [fast/default]",
+		"Show, or renegotiate (ISO14230 only), the ECU timing",
+		cmd_diag_timing, 0, NULL},
+
 	{ "addl3", "addl3 protocol", "Add [start] a L3 protocol",
 		cmd_diag_addl3, 0, NULL},
 
@@ -101,12 +106,12 @@ cmd_diag_addl3(int argc, char **argv)
 	const char *proto;
 
 	/* Add a L3 stack above the open L2 */
-	if (global_state < STATE_CONNECTED)
+	if (session->state < STATE_CONNECTED)
 	{
 		printf("Not connected to ECU\n");
 		return CMD_OK;
 	}
-	if (global_state > STATE_CONNECTED)
+	if (session->state > STATE_CONNECTED)
 	{
 		printf("L3 protocol already connected\n");
 		return CMD_OK;
@@ -141,10 +146,10 @@ cmd_diag_addl3(int argc, char **argv)
 	}
 	else
 	{
-		global_l3_conn = diag_l3_start(proto, global_l2_conn);
+		session->l3_conn = diag_l3_start(proto, session->l2_conn);
 
-		if (global_l3_conn) {
-			global_state = STATE_L3ADDED ;
+		if (session->l3_conn) {
+			session->state = STATE_L3ADDED ;
 			printf("Done\n");
 		}
 		else
@@ -204,8 +209,7 @@ cmd_diag_probe_common(int argc, char **argv, int fastflag)
 		return CMD_OK;
 	}
 	/* Open interface using hardware type ISO9141 */
-	dl0d = diag_l2_open(l0_names[set_interface_idx].longname, set_subinterface,
-		DIAG_L1_ISO9141);
+	dl0d = do_l2_open(DIAG_L1_ISO9141);
 	if (dl0d == 0)
 	{
 		rv = diag_geterr();
@@ -230,12 +234,12 @@ cmd_diag_probe_common(int argc, char **argv, int fastflag)
 			d_conn = diag_l2_StartCommunications(dl0d,
 				DIAG_L2_PROT_ISO14230,
 				DIAG_L2_TYPE_FASTINIT | funcmode,
-				set_speed, i, set_testerid);
+				session->speed, i, session->testerid);
 		else
 			d_conn = diag_l2_StartCommunications(dl0d,
 				DIAG_L2_PROT_ISO9141,
 				DIAG_L2_TYPE_SLOWINIT,
-				set_speed, i, set_testerid);
+				session->speed, i, session->testerid);
 
 		if (d_conn != NULL)
 		{
@@ -245,8 +249,9 @@ cmd_diag_probe_common(int argc, char **argv, int fastflag)
 			printf(" connected !!\n");
 			fflush(stdout);
 
-			global_state = STATE_CONNECTED;
-			global_l2_conn = d_conn;
+			session->state = STATE_CONNECTED;
+			session->l2_conn = d_conn;
+			session->dl0d = dl0d;
 
 			/* Get the keybytes */
 			diag_l2_ioctl(d_conn, DIAG_IOCTL_GET_L2_DATA, &d);
@@ -306,7 +311,7 @@ char **argv __attribute__((unused)))
 	if (rv==0)
 	{
 		printf("Connection to ECU established\n");
-		global_state = STATE_CONNECTED;
+		session->state = STATE_CONNECTED;
 	}
 	else
 	{
@@ -329,22 +334,23 @@ cmd_diag_disconnect(int argc __attribute__((unused)),
 char **argv __attribute__((unused)))
 #endif
 {
-	if (global_state < STATE_CONNECTED)
+	if (session->state < STATE_CONNECTED)
 	{
 		printf("Not connected to ECU\n");
 		return CMD_OK;
 	}
 
-	if (global_state >= STATE_L3ADDED)
+	if (session->state >= STATE_L3ADDED)
 	{
 		/* Close L3 protocol */
-		diag_l3_stop(global_l3_conn);
+		diag_l3_stop(session->l3_conn);
 	}
-	diag_l2_StopCommunications(global_l2_conn);
-	diag_l2_close(global_l2_dl0d);
+	diag_l2_StopCommunications(session->l2_conn);
+	diag_l2_close(session->dl0d);
 
-	global_l2_conn = NULL;
-	global_state = STATE_IDLE;
+	session->l2_conn = NULL;
+	session->dl0d = NULL;
+	session->state = STATE_IDLE;
 
 	return CMD_OK;
 }
@@ -355,7 +361,7 @@ cmd_diag_read(int argc, char **argv)
 {
 	int timeout = 0;
 
-	if (global_state < STATE_CONNECTED)
+	if (session->state < STATE_CONNECTED)
 	{
 		printf("Not connected to ECU\n");
 		return CMD_OK;
@@ -364,16 +370,16 @@ cmd_diag_read(int argc, char **argv)
 	if (argc > 1)
 		timeout = atoi(argv[1]) * 1000;
 
-	if (global_state < STATE_L3ADDED)
+	if (session->state < STATE_L3ADDED)
 	{
 		/* No L3 protocol, do L2 stuff */
-		(void)diag_l2_recv(global_l2_conn, timeout, l2raw_data_rcv,
+		(void)diag_l2_recv(session->l2_conn, timeout, l2raw_data_rcv,
 			NULL);
 
 	}
 	else
 	{
-		(void)diag_l3_recv(global_l3_conn, timeout, j1979_data_rcv,
+		(void)diag_l3_recv(session->l3_conn, timeout, j1979_data_rcv,
 			(void *)RQST_HANDLE_WATCH);
 	}
 	return CMD_OK;
@@ -382,6 +388,42 @@ cmd_diag_read(int argc, char **argv)
 /*
  * Send some data, and wait for a response
  */
+static int
+cmd_diag_timing(int argc, char **argv)
+{
+	int rv;
+	struct diag_l2_conn *d_conn = session->l2_conn;
+
+	if (session->state < STATE_CONNECTED)
+	{
+		printf("Not connected to ECU\n");
+		return CMD_OK;
+	}
+
+	if (argc > 1)
+	{
+		if (strcasecmp(argv[1], "fast") == 0)
+			rv = diag_l2_AccessTimingParameters(d_conn,
+				DIAG_L2_ATP_FAST);
+		else if (strcasecmp(argv[1], "default") == 0)
+			rv = diag_l2_AccessTimingParameters(d_conn,
+				DIAG_L2_ATP_DEFAULT);
+		else
+			return CMD_USAGE;
+
+		if (rv < 0)
+			printf("timing: ECU did not accept the change, "
+				"error %d\n", rv);
+	}
+
+	printf("P2 %u-%u ms, P3 %u-%u ms, P4 %u ms\n",
+		d_conn->diag_l2_p2min, d_conn->diag_l2_p2max,
+		d_conn->diag_l2_p3min, d_conn->diag_l2_p3max,
+		d_conn->diag_l2_p4min);
+
+	return CMD_OK;
+}
+
 static int
 cmd_diag_sendreq(int argc, char **argv)
 {
@@ -389,7 +431,7 @@ cmd_diag_sendreq(int argc, char **argv)
 	unsigned int	len;
 	int	i, j, rv;
 
-	if (global_state < STATE_CONNECTED)
+	if (session->state < STATE_CONNECTED)
 	{
 		printf("Not connected to ECU\n");
 		return CMD_OK;
@@ -408,15 +450,15 @@ cmd_diag_sendreq(int argc, char **argv)
 	len = j ;
 
 
-	if (global_state < STATE_L3ADDED)
+	if (session->state < STATE_L3ADDED)
 	{
-		rv = l2_do_send( global_l2_conn, data, len,
+		rv = l2_do_send( session->l2_conn, data, len,
 			(void *)RQST_HANDLE_DECODE);
 	}
 	else
 	{
 		/* Send data with handle to tell callback to print results */
-		rv = l3_do_send( global_l3_conn, data, len,
+		rv = l3_do_send( session->l3_conn, data, len,
 			(void *)RQST_HANDLE_DECODE);
 	}
 
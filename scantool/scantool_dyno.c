@@ -107,7 +107,7 @@ static int cmd_dyno_mass(int argc, char **argv)
  * Functions to measure data                                                  *
  ******************************************************************************/
 
-#define DYNDATA_1(p, n, d)	(d[p].data[n])
+#define DYNDATA_1(p, n, d)	(response_get(d, p)->data[n])
 #define DYNDATA_2(p, n, d)	(DYNDATA_1(p, n, d) * 256 + DYNDATA_1(p, n+1, d))
 #define RPM_PID           (0x0c)
 #define RPM_DATA(d)       (DYNDATA_2(RPM_PID, 2, d)*0.25)
@@ -117,50 +117,54 @@ static int cmd_dyno_mass(int argc, char **argv)
 #define SPEED_ISO_TO_KMH(_speed_) ((_speed_)*36/10000)
 
 /* measure speed */
-static int measure_data(int data_pid, ecu_data_t *ep)
+static int measure_data(int data_pid, uint8_t ecu_addr)
 {
   int rv;
+  ecu_data_t *ep;
   
   /* measure */
-  rv = l3_do_j1979_rqst(global_l3_conn, 0x1, data_pid, 0x00,
+  rv = l3_do_j1979_rqst(session->l3_conn, 0x1, data_pid, 0x00,
       0x00, 0x00, 0x00, 0x00, (void *)0);
   if (rv < 0)
     return 0;
   
-  /* data extraction */
+  /* data extraction (look the ECU up again, ecu_info may have moved) */
+  ep = ecu_lookup(ecu_addr, 0);
+  if (ep == NULL)
+    return 0;
   if (data_pid == RPM_PID)
-    return (int)(RPM_DATA(ep->mode1_data) + .50);
+    return (int)(RPM_DATA(&ep->mode1_data) + .50);
   else if (data_pid == SPEED_PID)
-    return (int)(SPEED_DATA(ep->mode1_data) + .50);
+    return (int)(SPEED_DATA(&ep->mode1_data) + .50);
   else
-    return DYNDATA_1(data_pid, 2, ep->mode1_data);
+    return DYNDATA_1(data_pid, 2, &ep->mode1_data);
   
   return 0;
 }
 
-#define MILLIS(TV)         ((TV).tv_sec *1000L + (TV).tv_usec / 1000L)
+#define MILLIS(T)          ((long)((T) / 1000000))
 
 
 #ifdef DYNO_DEBUG
 int counter;
-struct timeval tv0; /* measuring time */
+tstamp_type tv0; /* measuring time */
   
 /* fake loss measures */
 int fake_loss_measure_data()
 {
-  struct timeval tv; /* measuring time */
+  tstamp_type tv; /* measuring time */
   int elapsed; /* elapsed time */
   int speed;
   
   if (counter == 0)
   {
-    gettimeofday(&tv0, 0);
+    tv0 = diag_os_getns();
   }
   
   diag_os_millisleep(250);
 
   /* get elapsed time */
-  gettimeofday(&tv, 0);
+  tv = diag_os_getns();
   elapsed = MILLIS(tv) - MILLIS(tv0);
   elapsed += 11000;
   
@@ -234,11 +238,11 @@ int fake_run_measure_data(int data_pid)
 
 
 #ifdef DYNO_DEBUG
-#define LOSS_MEASURE_DATA(_pid_, _ep_) fake_loss_measure_data()
-#define RUN_MEASURE_DATA(_pid_, _ep_)  fake_run_measure_data(_pid_)
+#define LOSS_MEASURE_DATA(_pid_, _addr_) fake_loss_measure_data()
+#define RUN_MEASURE_DATA(_pid_, _addr_)  fake_run_measure_data(_pid_)
 #else /* DYNO_DEBUG */
-#define LOSS_MEASURE_DATA(_pid_, _ep_) measure_data(_pid_, _ep_)
-#define RUN_MEASURE_DATA(_pid_, _ep_)  measure_data(_pid_, _ep_)
+#define LOSS_MEASURE_DATA(_pid_, _addr_) measure_data(_pid_, _addr_)
+#define RUN_MEASURE_DATA(_pid_, _addr_)  measure_data(_pid_, _addr_)
 #endif
 
 
@@ -260,12 +264,12 @@ static int cmd_dyno_loss(int argc __attribute__((unused)),
 char **argv __attribute__((unused)))
 #endif
 {
-  ecu_data_t *ep;
+  uint8_t ecu_addr;	/* ECU to measure */
   
   int speed;              /* measured speed */
   int speed_previous = 0; /* previous speed */
   
-  struct timeval tv0, tv;  /* measuring time */
+  tstamp_type tv0, tv;  /* measuring time */
   int elapsed; /* elapsed time */
   
   int i, length; /* length of printed string */
@@ -290,11 +294,11 @@ char **argv __attribute__((unused)))
   /* Reset data */
   dyno_loss_reset(); /* dyno data */
   reset_results();
-  gettimeofday(&tv0, 0); /* initial time */
-  ep = ecu_info; /* ECU data */
+  tv0 = diag_os_getns(); /* initial time */
+  ecu_addr = session->ecu_count ? session->ecu_info[0].ecu_addr : 0; /* ECU data */
   
   /* exclude 1st measure */
-  speed_previous = LOSS_MEASURE_DATA(SPEED_PID, ep); /* m/s * 1000 */
+  speed_previous = LOSS_MEASURE_DATA(SPEED_PID, ecu_addr); /* m/s * 1000 */
 
   printf("Starting loss determination (max speed=%d km/h)\n", SPEED_ISO_TO_KMH(speed_previous));
   printf("Number of measures : 0");
@@ -304,10 +308,10 @@ char **argv __attribute__((unused)))
   while (1)
   {
     /* measure speed */
-    speed = LOSS_MEASURE_DATA(SPEED_PID, ep); /* m/s * 1000 */
+    speed = LOSS_MEASURE_DATA(SPEED_PID, ecu_addr); /* m/s * 1000 */
     
     /* get elapsed time */
-    gettimeofday(&tv, 0);
+    tv = diag_os_getns();
     elapsed = MILLIS(tv) - MILLIS(tv0);
     
     if (speed < speed_previous)
@@ -339,7 +343,7 @@ char **argv __attribute__((unused)))
   }
   
   /* display dyno time */
-  gettimeofday(&tv, 0);
+  tv = diag_os_getns();
   elapsed = MILLIS(tv) - MILLIS(tv0);
   printf("d=%5.5f, f=%4.2f\n", dyno_loss_get_d(), dyno_loss_get_f());
   printf("Loss determination time : %ds.\n", (elapsed/1000));
@@ -406,13 +410,13 @@ static int cmd_dyno_run(int argc __attribute__((unused)),
 char **argv __attribute__((unused)))
 #endif
 {
-  ecu_data_t *ep;
+  uint8_t ecu_addr;	/* ECU to measure */
   
   int speed;            /* measured speed */
   int rpm;              /* measured rpm */
   int rpm_previous = 0; /* previous rpm */
   
-  struct timeval tv0, tv;  /* measuring time */
+  tstamp_type tv0, tv;  /* measuring time */
   int elapsed; /* elapsed time */
   
   int i, length = 0; /* length of printed string */
@@ -444,14 +448,14 @@ char **argv __attribute__((unused)))
   /* Reset data */
   dyno_reset(); /* dyno data */
   reset_results();
-  gettimeofday(&tv0, 0); /* initial time */
-  ep = ecu_info; /* ECU data */
+  tv0 = diag_os_getns(); /* initial time */
+  ecu_addr = session->ecu_count ? session->ecu_info[0].ecu_addr : 0; /* ECU data */
 
   /* Measures */
   while (1)
   {
     /* measure RPM */
-    rpm = RUN_MEASURE_DATA(RPM_PID, ep);
+    rpm = RUN_MEASURE_DATA(RPM_PID, ecu_addr);
     
     if (rpm_previous == 0)
     {
@@ -468,7 +472,7 @@ char **argv __attribute__((unused)))
     }
     
     /* get elapsed time */
-    gettimeofday(&tv, 0);
+    tv = diag_os_getns();
     elapsed = MILLIS(tv) - MILLIS(tv0);
     
     /* Add measure */
@@ -486,12 +490,12 @@ char **argv __attribute__((unused)))
 
   /* measure gear ratio */
   rpm_previous = rpm;
-  speed = RUN_MEASURE_DATA(SPEED_PID, ep); /* m/s * 1000 */
-  rpm   = RUN_MEASURE_DATA(RPM_PID,   ep);
+  speed = RUN_MEASURE_DATA(SPEED_PID, ecu_addr); /* m/s * 1000 */
+  rpm   = RUN_MEASURE_DATA(RPM_PID, ecu_addr);
   dyno_set_gear(speed, (rpm_previous + rpm) / 2);
   
   /* display dyno time */
-  gettimeofday(&tv, 0);
+  tv = diag_os_getns();
   elapsed = MILLIS(tv) - MILLIS(tv0);
   printf("Dyno time : %ds.\n", (elapsed/1000));
 
@@ -31,6 +31,8 @@
 #include "diag.h"
 #include "diag_l1.h"
 #include "diag_l2.h"
+#include "diag_l2_can.h"
+#include "diag_tty.h"
 
 #include "scantool.h"
 #include "scantool_cli.h"
@@ -39,56 +41,48 @@ CVSID("$Id: scantool_set.c,v 1.11 2011/06/09 01:11:25 fenugrec Exp $");
 
 #define PROTO_NONE	"<not_used>"
 
-int 	set_speed;	/* Comms speed */
-unsigned char	set_testerid;	/* Our tester ID */
-int	set_addrtype;	/* Use virtual addressing */
-unsigned char	set_destaddr;	/* Dest ECU address */
-int	set_L1protocol;	/* L1 protocol type */
-int	set_L2protocol;	/* Protocol type */
-int	set_initmode;
-
-int set_display;		/* English (1), or Metric (0) */
-
-const char *	set_vehicle;	/* Vehicle */
-const char *	set_ecu;	/* ECU name */
-
 //const char  *	set_interface;	/* H/w interface to use */
 #define DEFAULT_INTERFACE 5	//index into l0_names below
 const struct l0_name l0_names[] = { {"MET16", MET16}, {"SE9141", SE9141}, {"VAGTOOL", VAGTOOL},
-			{"BR1", BR1}, {"ELM", ELM}, {"CARSIM", CARSIM}, {"DUMB", DUMB}, NULL};
-
-enum l0_nameindex set_interface;	//hw interface to use
-
-char set_subinterface[SUBINTERFACE_MAX];		/* and sub-interface ID */
+			{"BR1", BR1}, {"ELM", ELM}, {"CARSIM", CARSIM}, {"DUMB", DUMB},
+			{"SOCKETCAN", SOCKETCAN}, NULL};
 
 char *set_simfile;	//source for simulation data
 extern void diag_l0_sim_setfile(char * fname);
 
 /*
- * XXX All commands should probably have optional "init" hooks.
+ * Reset a session's parameters to defaults.
  */
-int set_init(void)
+void set_defaults(struct scantool_session *s)
 {
-	/* Reset parameters to defaults. */
+	s->speed = 10400;	/* Comms speed; ECUs will probably send at 10416 bps (96us per bit) */
+	s->testerid = 0xf1;	/* Our tester ID */
+	s->addrtype = 1;	/* Use virtual addressing */
+	s->destaddr = 0x33;	/* Dest ECU address */
+	s->L1protocol = DIAG_L1_ISO9141;	/* L1 protocol type */
+	s->L2protocol = DIAG_L2_PROT_ISO9141;	/* Protocol type */
+	s->initmode = DIAG_L2_TYPE_FASTINIT ;
+	s->can29bit = 0;	/* 11 bit CAN identifiers */
 
-	set_speed = 10400;	/* Comms speed; ECUs will probably send at 10416 bps (96us per bit) */
-	set_testerid = 0xf1;	/* Our tester ID */
-	set_addrtype = 1;	/* Use virtual addressing */
-	set_destaddr = 0x33;	/* Dest ECU address */
-	set_L1protocol = DIAG_L1_ISO9141;	/* L1 protocol type */
-	set_L2protocol = DIAG_L2_PROT_ISO9141;	/* Protocol type */
-	set_initmode = DIAG_L2_TYPE_FASTINIT ;
+	s->display = 0;		/* English (1), or Metric (0) */
 
-	set_display = 0;		/* English (1), or Metric (0) */
+	s->vehicle = "ODBII";	/* Vehicle */
+	s->ecu = "ODBII";	/* ECU name */
 
-	set_vehicle = "ODBII";	/* Vehicle */
-	set_ecu = "ODBII";	/* ECU name */
+	s->interface_idx= DEFAULT_INTERFACE;
+	s->interface = l0_names[DEFAULT_INTERFACE].code;	/* Default H/w interface to use */
 
-	set_interface_idx= DEFAULT_INTERFACE;
-	set_interface = l0_names[DEFAULT_INTERFACE].code;	/* Default H/w interface to use */
+	strncpy(s->subinterface,"/dev/null",sizeof(s->subinterface));
+}
 
-	strncpy(set_subinterface,"/dev/null",sizeof(set_subinterface));
-	printf( "%s: Interface set to default: %s on %s\n", progname, l0_names[set_interface_idx].longname, set_subinterface);
+/*
+ * XXX All commands should probably have optional "init" hooks.
+ */
+int set_init(void)
+{
+	/* Reset parameters to defaults. */
+	set_defaults(session);
+	printf( "%s: Interface set to default: %s on %s\n", progname, l0_names[session->interface_idx].longname, session->subinterface);
 
 	if (diag_calloc(&set_simfile, strlen(DB_FILE)+1))
 		return diag_iseterr(DIAG_ERR_GENERAL);	
@@ -124,9 +118,64 @@ static int cmd_set_testerid(int argc, char **argv);
 static int cmd_set_destaddr(int argc, char **argv);
 static int cmd_set_addrtype(int argc, char **argv);
 static int cmd_set_l1protocol(int argc, char **argv);
+static int
+cmd_set_canid(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "29") == 0)
+			session->can29bit = 1;
+		else if (strcmp(argv[1], "11") == 0)
+			session->can29bit = 0;
+		else
+			return(CMD_USAGE);
+	}
+	else
+	{
+		printf("canid: %d bit CAN identifiers\n", session->can29bit ? 29 : 11);
+	}
+
+	return (CMD_OK);
+}
+
+/*
+ * STmin is in ms up to 0x7F, 0xF1-0xF9 are 100-900us (ISO 15765-2);
+ * both take effect on the next message received
+ */
+static int
+cmd_set_isotp(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		int bs, stmin;
+
+		bs = htoi(argv[1]);
+		stmin = (argc > 2) ? htoi(argv[2]) : diag_l2_can_stmin;
+		if ((bs < 0) || (bs > 0xff)) {
+			printf("isotp: blocksize must be between 0 and 0xff\n");
+			return (CMD_OK);
+		}
+		if ((stmin < 0) || ((stmin > 0x7f) && (stmin < 0xf1))
+				|| (stmin > 0xf9)) {
+			printf("isotp: stmin must be 0-0x7f (ms) or 0xf1-0xf9 (100-900us)\n");
+			return (CMD_OK);
+		}
+		diag_l2_can_bs = (uint8_t) bs;
+		diag_l2_can_stmin = (uint8_t) stmin;
+	}
+	else
+		printf("isotp: BlockSize %d, STmin 0x%x\n",
+			diag_l2_can_bs, diag_l2_can_stmin);
+
+	return (CMD_OK);
+}
+
 static int cmd_set_l2protocol(int argc, char **argv);
 static int cmd_set_initmode(int argc, char **argv);
+static int cmd_set_canid(int argc, char **argv);
+static int cmd_set_isotp(int argc, char **argv);
 static int cmd_set_display(int argc, char **argv);
+static int cmd_set_lowlatency(int argc, char **argv);
 static int cmd_set_interface(int argc, char **argv);
 static int cmd_set_simfile(int argc, char **argv);
 
@@ -144,6 +193,10 @@ const struct cmd_tbl_entry set_cmd_table[] =
 	{ "display", "display [english/metric]", "Sets english or metric display",
 		cmd_set_display, 0, NULL},
 
+	{ "lowlatency", "lowlatency [on/off]",
+		"Shows/Sets the low latency serial profile (VMIN/VTIME, USB-serial latency timer)",
+		cmd_set_lowlatency, 0, NULL},
+
 	{ "speed", "speed [speed]", "Shows/Sets the speed to connect",
 		cmd_set_speed, 0, NULL},
 	{ "testerid", "testerid [testerid]",
@@ -166,6 +219,12 @@ const struct cmd_tbl_entry set_cmd_table[] =
 	{ "initmode", "initmode [modename]", "Shows/Sets the initialisation mode to use. Use set initmode ? to get a list of protocols",
 		cmd_set_initmode, 0, NULL},
 
+	{ "canid", "canid [11/29]", "Shows/Sets the CAN identifier length (bits) to use with the CAN L2 protocol",
+		cmd_set_canid, 0, NULL},
+
+	{ "isotp", "isotp [blocksize [stmin]]", "Shows/Sets the ISO 15765-2 flow control asked of ECUs sending long messages on CAN",
+		cmd_set_isotp, 0, NULL},
+
 	{ "show", "show", "Shows all set'able values",
 		cmd_set_show, 0, NULL},
 
@@ -210,26 +269,31 @@ char **argv __attribute__((unused)))
 	int offset;
 	for (offset=0; offset < 8; offset++)
 	{
-		if (set_L1protocol == (1 << offset))
+		if (session->L1protocol == (1 << offset))
 			break;
 	}
 
-	printf("interface: %s on %s\n", l0_names[set_interface_idx].longname, set_subinterface);
-	if (set_interface==CARSIM)
+	printf("interface: %s on %s\n", l0_names[session->interface_idx].longname, session->subinterface);
+	if (session->interface==CARSIM)
 		printf("simfile: %s\n", set_simfile);
-	printf("speed:    Connect speed: %d\n", set_speed);
-	printf("display:  %s units\n", set_display?"english":"metric");
-	printf("testerid: Source ID to use: 0x%x\n", set_testerid);
+	printf("speed:    Connect speed: %d\n", session->speed);
+	printf("lowlatency: Low latency serial profile %s\n",
+		diag_tty_lowlatency ? "on" : "off");
+	printf("display:  %s units\n", session->display?"english":"metric");
+	printf("testerid: Source ID to use: 0x%x\n", session->testerid);
 	printf("addrtype: %s addressing\n",
-		set_addrtype ? "functional" : "physical");
+		session->addrtype ? "functional" : "physical");
 	printf("destaddr: Destination address to connect to: 0x%x\n",
-		set_destaddr);
+		session->destaddr);
 	printf("l1protocol: Layer 1 (H/W) protocol to use %s\n",
 		l1_names[offset]);
 	printf("l2protocol: Layer 2 (S/W) protocol to use %s\n",
-		l2_names[set_L2protocol]);
+		l2_names[session->L2protocol]);
 	printf("initmode: Initmode to use with above L2 protocol is %s\n",
-		l2_initmodes[set_initmode]);
+		l2_initmodes[session->initmode]);
+	printf("canid: %d bit CAN identifiers\n", session->can29bit ? 29 : 11);
+	printf("isotp: BlockSize %d, STmin 0x%x\n",
+		diag_l2_can_bs, diag_l2_can_stmin);
 
 	return (CMD_OK);
 }
@@ -244,6 +308,7 @@ static int cmd_set_interface(int argc, char **argv)
 			printf("hardware interface: use \"set interface NAME [id]\" .\n"
 			"[id] is either an integer to be appended as /dev/obdII[id] or\n"
 			"a complete device name such as \"/dev/ttyS0\".\n"
+			"For SOCKETCAN, [id] is the network interface, e.g. \"can0\".\n"
 			"Valid interface names are: \n");
 		}
 		for (i=0; l0_names[i].longname != NULL; i++) {
@@ -252,8 +317,8 @@ static int cmd_set_interface(int argc, char **argv)
 				printf("%s ", l0_names[i]);
 			else
 				if (strcasecmp(argv[1], l0_names[i].longname) == 0) {
-					set_interface = l0_names[i].code;
-					set_interface_idx=i;
+					session->interface = l0_names[i].code;
+					session->interface_idx=i;
 					found = 1;
 				}
 		}
@@ -265,17 +330,17 @@ static int cmd_set_interface(int argc, char **argv)
 			printf("interface: use \"set interface ?\" to see list of names\n");
 		} else {
 			if (argc > 2)
-				strncpy(set_subinterface, argv[2], sizeof(set_subinterface));
+				strncpy(session->subinterface, argv[2], sizeof(session->subinterface));
 			printf("interface is now %s on %s\n",
-					l0_names[set_interface_idx].longname, set_subinterface);
-			if (set_interface==VAGTOOL)
+					l0_names[session->interface_idx].longname, session->subinterface);
+			if (session->interface==VAGTOOL)
 				diag_l0_dumb_setflags(1);
 			else
 				diag_l0_dumb_setflags(0);	//not strictly correct usage, but will do for hack.
 		}
 	} else {
 		printf("interface: using %s on %s\n",
-			l0_names[set_interface_idx].longname, set_subinterface);
+			l0_names[session->interface_idx].longname, session->subinterface);
 	}
 	return (CMD_OK);
 }
@@ -301,7 +366,7 @@ static int cmd_set_simfile(int argc, char **argv)
 		diag_l0_sim_setfile(set_simfile);
 		printf("Simulation file: now using %s\n", set_simfile);
 
-		if (set_interface!=CARSIM) {
+		if (session->interface!=CARSIM) {
 			printf("Note: simfile only needed with CARSIM interface.\n");
 		}
 	} else {
@@ -317,14 +382,44 @@ cmd_set_display(int argc, char **argv)
 	if (argc > 1)
 	{
 		if (strcasecmp(argv[1], "english") == 0)
-			set_display = 1;
+			session->display = 1;
 		else if (strcasecmp(argv[1], "metric") == 0)
-			set_display = 0;
+			session->display = 0;
 		else
 			return (CMD_USAGE);
 	}
 	else
-		printf("display: %s units\n", set_display?"english":"metric");
+		printf("display: %s units\n", session->display?"english":"metric");
+
+	return (CMD_OK);
+}
+
+/*
+ * The profile applies to interfaces opened from now on, and also right
+ * away to the current one if we're connected, so the turnaround latency
+ * can be compared (see "debug timing").
+ */
+static int
+cmd_set_lowlatency(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		if (strcasecmp(argv[1], "on") == 0)
+			diag_tty_lowlatency = 1;
+		else if (strcasecmp(argv[1], "off") == 0)
+			diag_tty_lowlatency = 0;
+		else
+			return (CMD_USAGE);
+
+		/* session->dl0d is only set while the link is open */
+		if (session->dl0d && diag_tty_istty(session->dl0d)) {
+			if (diag_tty_set_lowlatency(session->dl0d, diag_tty_lowlatency))
+				printf("lowlatency: could not change the current interface\n");
+		}
+	}
+	else
+		printf("lowlatency: Low latency serial profile %s\n",
+			diag_tty_lowlatency ? "on" : "off");
 
 	return (CMD_OK);
 }
@@ -334,10 +429,10 @@ cmd_set_speed(int argc, char **argv)
 {
 	if (argc > 1)
 	{
-		set_speed = htoi(argv[1]);
+		session->speed = htoi(argv[1]);
 	}
 	else
-		printf("speed: Connect speed: %d\n", set_speed);
+		printf("speed: Connect speed: %d\n", session->speed);
 
 	return (CMD_OK);
 }
@@ -352,10 +447,10 @@ cmd_set_testerid(int argc, char **argv)
 		if ( (tmp < 0) || (tmp > 0xff))
 			printf("testerid: must be between 0 and 0xff\n");
 		else
-			set_testerid = tmp;
+			session->testerid = tmp;
 	}
 	else
-		printf("testerid: Source ID to use: 0x%x\n", set_testerid);
+		printf("testerid: Source ID to use: 0x%x\n", session->testerid);
 
 	return (CMD_OK);
 }
@@ -369,12 +464,12 @@ cmd_set_destaddr(int argc, char **argv)
 		if ( (tmp < 0) || (tmp > 0xff))
 			printf("destaddr: must be between 0 and 0xff\n");
 		else
-			set_destaddr = tmp;
+			session->destaddr = tmp;
 	}
 	else
 	{
 		printf("destaddr: Destination address to connect to: 0x%x\n",
-			set_destaddr);
+			session->destaddr);
 	}
 
 	return (CMD_OK);
@@ -385,16 +480,16 @@ cmd_set_addrtype(int argc, char **argv)
 	if (argc > 1)
 	{
 		if (strncmp(argv[1], "func", 4) == 0)
-			set_addrtype = 1;
+			session->addrtype = 1;
 		else if (strncmp(argv[1], "phys", 4) == 0)
-			set_addrtype = 0;
+			session->addrtype = 0;
 		else
 			return(CMD_USAGE);
 	}
 	else
 	{
 		printf("addrtype: %s addressing\n",
-			set_addrtype ? "functional" : "physical");
+			session->addrtype ? "functional" : "physical");
 	}
 
 	return (CMD_OK);
@@ -423,7 +518,7 @@ static int cmd_set_l2protocol(int argc, char **argv)
 				if (strcasecmp(argv[1], l2_names[i]) == 0)
 				{
 					found = 1;
-					set_L2protocol = i;
+					session->L2protocol = i;
 				}
 		}
 		if (prflag)
@@ -437,7 +532,7 @@ static int cmd_set_l2protocol(int argc, char **argv)
 	else
 	{
 		printf("l2protocol: Layer 2 protocol to use %s\n",
-			l2_names[set_L2protocol]);
+			l2_names[session->L2protocol]);
 	}
 	return (CMD_OK);
 }
@@ -459,7 +554,7 @@ static int cmd_set_l1protocol(int argc, char **argv)
 			else
 				if (strcasecmp(argv[1], l1_names[i]) == 0)
 				{
-					set_L1protocol = 1 << i;
+					session->L1protocol = 1 << i;
 					found = 1;
 				}
 		}
@@ -477,7 +572,7 @@ static int cmd_set_l1protocol(int argc, char **argv)
 
 		for (offset=0; offset < 8; offset++)
 		{
-			if (set_L1protocol == (1 << offset))
+			if (session->L1protocol == (1 << offset))
 				break;
 		}
 		printf("l1protocol: Layer 1 (H/W) protocol to use %s\n",
@@ -503,7 +598,7 @@ static int cmd_set_initmode(int argc, char **argv)
 				if (strcasecmp(argv[1], l2_initmodes[i]) == 0)
 				{
 					found = 1;
-					set_initmode = i;
+					session->initmode = i;
 				}
 			}
 		}
@@ -518,7 +613,7 @@ static int cmd_set_initmode(int argc, char **argv)
 	else
 	{
 		printf("initmode: Initmode to use with above protocol is %s\n",
-			l2_initmodes[set_initmode]);
+			l2_initmodes[session->initmode]);
 	}
 	return(CMD_OK);
 }
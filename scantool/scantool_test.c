@@ -128,13 +128,13 @@ char **argv __attribute__((unused)))
 
 	uint8_t vit_bits[4];
 
-	if (global_state < STATE_SCANDONE)
+	if (session->state < STATE_SCANDONE)
 	{
 		printf("SCAN has not been done, please do a scan\n");
 		return(CMD_OK);
 	}
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
 	/* 1st ask for the supported types */
 	rv = l3_do_j1979_rqst(d_conn, 9, 0, 0, 0, 0, 0, 0, (void *)0);
@@ -186,7 +186,7 @@ cmd_test_cms(int argc __attribute__((unused)),
 char **argv __attribute__((unused)))
 #endif
 {
-	if (global_state < STATE_SCANDONE)
+	if (session->state < STATE_SCANDONE)
 	{
 		printf("SCAN has not been done, please do a scan\n");
 		return(CMD_OK);
@@ -205,7 +205,7 @@ cmd_test_ncms(int argc __attribute__((unused)),
 char **argv __attribute__((unused)))
 #endif
 {
-	if (global_state < STATE_SCANDONE)
+	if (session->state < STATE_SCANDONE)
 	{
 		printf("SCAN has not been done, please do a scan\n");
 		return(CMD_OK);
@@ -245,9 +245,9 @@ char **argv __attribute__((unused)))
 		"EGR System Monitoring"
 	};
 
-	d_conn = global_l3_conn;
+	d_conn = session->l3_conn;
 
-	if (global_state < STATE_CONNECTED)
+	if (session->state < STATE_CONNECTED)
 	{
 		printf("Not connected to ECU\n");
 		return(CMD_OK);
@@ -265,9 +265,11 @@ char **argv __attribute__((unused)))
 	}
 
 	/* And process results */
-	for (i=0, ep=ecu_info; i<ecu_count; i++, ep++)
+	for (i=0, ep=session->ecu_info; i<session->ecu_count; i++, ep++)
 	{
-		if (ep->mode1_data[1].type == TYPE_GOOD)
+		const response_t *r = response_get(&ep->mode1_data, 1);
+
+		if (r->type == TYPE_GOOD)
 		{
 			int supported, value;
 
@@ -278,16 +280,16 @@ char **argv __attribute__((unused)))
 					continue;
 				if (i<4)
 				{
-					supported = (ep->mode1_data[1].data[3]>>i)&1;
-					value = (ep->mode1_data[1].data[3]>>(i+4))&1;
+					supported = (r->data[3]>>i)&1;
+					value = (r->data[3]>>(i+4))&1;
 					
 				}
 				else
 				{
-					supported = (ep->mode1_data[1].data[4]>>(i-4))&1;
-					value = (ep->mode1_data[1].data[5]>>(i-4))&1;
+					supported = (r->data[4]>>(i-4))&1;
+					value = (r->data[5]>>(i-4))&1;
 				}
-				if (ecu_count > 1)
+				if (session->ecu_count > 1)
 					printf("ECU %d: ", i);
 				printf("%s: ", text);
 				if (supported)